@@ -35,14 +35,21 @@
 #include <netinet/tcp.h>
 #include <netinet/ip.h>
 #include <string.h>
+#include <ctype.h>
 #include <strings.h>
 #include <signal.h>
 #include <netdb.h>
 #include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <pcap.h>
 
 char *match_string = NULL;
-int num_instructions = 999999999;
+#define ALL_INSTRUCTIONS 999999999
+int num_instructions = ALL_INSTRUCTIONS;
 
 int wait_for_break = 0;
 
@@ -120,20 +127,23 @@ char *oplist[] = { "00   BRK\n", "01   ORA ($nn,X)\n", "02   CLE\n", "03   SEE\n
   "F9   SBC $nnnn,Y\n", "FA   PLX\n", "FB   PLZ\n", "FC   PHW $nnnn\n", "FD   SBC $nnnn,X\n", "FE   INC $nnnn,X\n",
   "FF   BBS7 $nn,$rr\n", NULL };
 
-struct annotation {
-  char *text;
-  struct annotation *next;
-};
-
-struct annotation *annotations[0x10000] = { NULL };
+// Source annotations, indexed by address: see index_annotations().
+// The annotations for addr are annotation_order[annotation_start[addr]] to annotation_order[annotation_start[addr+1]-1]
+char *annotation_text = NULL;
+unsigned int annotation_start[0x10001];
+uint32_t *annotation_order = NULL;
 
 char *opnames[256] = { NULL };
 char *modes[256] = { NULL };
 
-int instruction_address = 0xFFFF;
+// Decoding state carried from one instruction record to the next
+struct trace_state {
+  int instruction_address;
+  unsigned int instruction_count;
+  int last_d031_toggle;
+};
 
-int last_d031_toggle = 0;
-unsigned int instruction_count = 0;
+struct trace_state trace = { 0xFFFF, 0, 0 };
 
 int one_frame = 0;
 int one_frame_active = 0;
@@ -141,90 +151,118 @@ int one_frame_active = 0;
 int logged_instruction_count = 0;
 char *logged_instructions[16] = { NULL };
 
-int decode_instruction(const unsigned char *b)
+int is_raster_marker(const unsigned char *b)
 {
-  char out[8192] = "";
-  int out_len = 0;
-
-  // Limit number of instructions shown
-  // (unless we have a match string, in which case we display 16 instructions before and after each match)
-  if (num_instructions)
-    num_instructions--;
-  else {
-    if (!match_string)
-      exit(-1);
-  }
-  if (0)
-    out_len += snprintf(&out[out_len], 8192 - out_len, "INSTRUCTION: %02x %02x %02x %02x %02x %02x %02x %02x\n", b[0], b[1],
-        b[2], b[3], b[4], b[5], b[6], b[7]);
-
-  if ((b[0] & b[1] & b[2]) == 0xff) {
-    // Raster / badline marker
-    int viciv_raster = b[3] | ((b[4] & 0xf) << 4);
-    int vicii_raster = (b[4] >> 4) + (b[5] << 4);
-    int raster = b[7] & 0x80;
-    int badline = b[7] & 0x40;
-
-    if (one_frame && (one_frame_active)) {
-      if (raster && (!viciv_raster)) {
-        // Start of next frame after single raster display, so stop
-        exit(0);
-      }
-    }
-
-    if (one_frame && (!one_frame_active)) {
-      if (raster && (!viciv_raster)) {
-        // Start of single frame to display
-        one_frame_active = 1;
-      }
-    }
+  return (b[0] & b[1] & b[2]) == 0xff;
+}
 
-    // Don't display anything if we are not yet in the active frame to be displayed
-    if (one_frame && (!one_frame_active))
-      return 0;
+// The VIC-IV raster line in a raster marker, which ethernet.vhdl puts in bits 24 to 35 of the record
+int raster_marker_line(const unsigned char *b)
+{
+  return b[3] | ((b[4] & 0xf) << 8);
+}
 
-    out_len += snprintf(&out[out_len], 8192 - out_len, "VIC-II raster $%03x (VIC-IV raster $%03x)%s%s\n", vicii_raster,
-        viciv_raster, raster ? " [NEW RASTER]" : "", badline ? " [BADLINE TRIGGERED]" : "");
-    return 0;
+// Work out the address of the instruction after the one in record b, which was at load_address
+int next_instruction_address(int load_address, const unsigned char *b)
+{
+  int instruction_address = (b[1] << 8) + b[0];
+  // JSR passes PC+1 instead of PC of next instruction, so adjust
+  switch (b[2]) {
+  case 0x6c:
+  case 0x4c:
+    // jump leaves correct address
+    break;
+  case 0xf0:
+  case 0xd0:
+    // Branches taken leave correct address, but
+    // untaken branches do not.
+    if (instruction_address != (load_address + 2))
+      break;
+    /* fall through */
+  default:
+    instruction_address--;
   }
+  // Keep within the annotation table, even when PC wraps
+  return instruction_address & 0xffff;
+}
 
-  // Don't display anything if we are not yet in the active frame to be displayed
-  if (one_frame && (!one_frame_active))
-    return 0;
+// Write v in hex with at least the given number of digits, as printf's %0*X would
+char *put_hex(char *p, unsigned int v, int digits, const char *hex)
+{
+  int n = 1;
+  while (n < 8 && (v >> (n * 4)))
+    n++;
+  if (n < digits)
+    n = digits;
+  for (int i = n - 1; i >= 0; i--)
+    *p++ = hex[(v >> (i * 4)) & 0xf];
+  return p;
+}
 
-  int d031_toggle = b[7] & 0x80;
+const char hex_upper[] = "0123456789ABCDEF";
+const char hex_lower[] = "0123456789abcdef";
 
-  out_len += snprintf(&out[out_len], 8192 - out_len, "%08x ", instruction_count++);
-  //    if (d031_toggle!=last_d031_toggle) {
-  //      out_len+=snprintf(&out[out_len],8192-out_len,"[$D031 written to!] ");
-  //    }
-  last_d031_toggle = d031_toggle;
+// Branch targets are shown as their first 4 hex digits, even when they fall outside $0000-$FFFF
+char *put_branch_target(char *p, int value)
+{
+  char digits[8];
+  put_hex(digits, value, 4, hex_upper);
+  memcpy(p, digits, 4);
+  return p + 4;
+}
 
-  out_len += snprintf(&out[out_len], 8192 - out_len, "%c %c%c%c%c%c%c%c%c($%02X) SP=$xx%02X, A=$%02X : $%04X : %02X",
-      d031_toggle ? 'Y' : 'N', b[5] & 0x80 ? 'N' : '-', b[5] & 0x40 ? 'V' : '-', b[5] & 0x20 ? 'E' : '-',
-      b[5] & 0x10 ? 'B' : '-', b[5] & 0x08 ? 'D' : '-', b[5] & 0x04 ? 'I' : '-', b[5] & 0x02 ? 'Z' : '-',
-      b[5] & 0x01 ? 'C' : '-', b[5], b[6], b[7], instruction_address, b[2]);
+// Format the instruction record b into out, and advance s past it. Returns the length of the text.
+// A record that is not whole (the last of a frame) is shown with SP and A unknown.
+// This runs for every record of a live trace, so it builds the line by hand rather than with snprintf().
+int format_instruction(struct trace_state *s, const unsigned char *b, int whole, char *out, int out_size)
+{
+  char line[256];
+  char *p = line;
+  int d031_toggle = whole ? b[7] & 0x80 : s->last_d031_toggle;
+
+  p = put_hex(p, s->instruction_count++, 8, hex_lower);
+  *p++ = ' ';
+  s->last_d031_toggle = d031_toggle;
+
+  *p++ = d031_toggle ? 'Y' : 'N';
+  *p++ = ' ';
+  *p++ = b[5] & 0x80 ? 'N' : '-';
+  *p++ = b[5] & 0x40 ? 'V' : '-';
+  *p++ = b[5] & 0x20 ? 'E' : '-';
+  *p++ = b[5] & 0x10 ? 'B' : '-';
+  *p++ = b[5] & 0x08 ? 'D' : '-';
+  *p++ = b[5] & 0x04 ? 'I' : '-';
+  *p++ = b[5] & 0x02 ? 'Z' : '-';
+  *p++ = b[5] & 0x01 ? 'C' : '-';
+  memcpy(p, "($", 2);
+  p = put_hex(p + 2, b[5], 2, hex_upper);
+  if (whole) {
+    memcpy(p, ") SP=$xx", 8);
+    p = put_hex(p + 8, b[6], 2, hex_upper);
+    memcpy(p, ", A=$", 5);
+    p = put_hex(p + 5, b[7], 2, hex_upper);
+  }
+  else {
+    memcpy(p, ") SP=$xx??, A=$??", 17);
+    p += 17;
+  }
+  memcpy(p, " : $", 4);
+  p = put_hex(p + 4, s->instruction_address, 4, hex_upper);
+  memcpy(p, " : ", 3);
+  p = put_hex(p + 3, b[2], 2, hex_upper);
 
   int opcode = b[2];
   int mem[3] = { b[2], b[3], b[4] };
   char args[1024];
-  int o = 0;
+  char *a = args;
   int i = 1;
   int c = 0;
   int value;
   int digits;
 
-  int load_address = instruction_address;
-
-  // Display until 32 instructions after BRK instruction if requested
-  // XXX -- We should also just cache instructions before the BRK, so we just display the period when things
-  // go wrong.
-  if ((!b[2]) && wait_for_break)
-    num_instructions = 32;
+  int load_address = s->instruction_address;
 
   for (int j = 0; modes[opcode][j];) {
-    args[o] = 0;
-    // out_len+=snprintf(&out[out_len],8192-out_len,"j=%d, args=[%s], template=[%s]\n",j,args,modes[opcode]);
     switch (modes[opcode][j]) {
     case 'n': // normal argument
       digits = 0;
@@ -234,17 +272,18 @@ int decode_instruction(const unsigned char *b)
       j--;
       if (digits == 2) {
         value = mem[i];
-        out_len += snprintf(&out[out_len], 8192 - out_len, " %02X", mem[i++]);
-        sprintf(&args[o], "%02X", value);
-        o += 2;
+        *p++ = ' ';
+        p = put_hex(p, mem[i++], 2, hex_upper);
+        a = put_hex(a, value, 2, hex_upper);
         c += 3;
       }
       if (digits == 4) {
         value = mem[i] + (mem[i + 1] << 8);
-        out_len += snprintf(&out[out_len], 8192 - out_len, " %02X", mem[i++]);
-        out_len += snprintf(&out[out_len], 8192 - out_len, " %02X", mem[i++]);
-        sprintf(&args[o], "%04X", value);
-        o += 4;
+        *p++ = ' ';
+        p = put_hex(p, mem[i++], 2, hex_upper);
+        *p++ = ' ';
+        p = put_hex(p, mem[i++], 2, hex_upper);
+        a = put_hex(a, value, 4, hex_upper);
         c += 6;
       }
       break;
@@ -258,73 +297,133 @@ int decode_instruction(const unsigned char *b)
         value = mem[i];
         if (value & 0x80)
           value -= 0x100;
-        out_len += snprintf(&out[out_len], 8192 - out_len, " %02X", mem[i++]);
+        *p++ = ' ';
+        p = put_hex(p, mem[i++], 2, hex_upper);
         value += load_address + i;
-        sprintf(&args[o], "%04X", value);
-        o += 4;
+        a = put_branch_target(a, value);
         c += 3;
       }
       if (digits == 4) {
         value = mem[i] + (mem[i + 1] << 8);
         if (value & 0x8000)
           value -= 0x10000;
-        out_len += snprintf(&out[out_len], 8192 - out_len, " %02X", mem[i++]);
+        *p++ = ' ';
+        p = put_hex(p, mem[i++], 2, hex_upper);
         // 16 bit branches are still relative to the same point as 8-bit ones,
         // i.e., after the 2nd of the 3 bytes
         value += load_address + i;
-        out_len += snprintf(&out[out_len], 8192 - out_len, " %02X", mem[i++]);
-        sprintf(&args[o], "%04X", value);
-        o += 4;
+        *p++ = ' ';
+        p = put_hex(p, mem[i++], 2, hex_upper);
+        a = put_branch_target(a, value);
         c += 6;
       }
       break;
     default:
-      args[o++] = modes[opcode][j++];
+      *a++ = modes[opcode][j++];
       break;
     }
-    args[o] = 0;
-    // out_len+=snprintf(&out[out_len],8192-out_len,"[%s]\n",args);
   }
-  args[o] = 0;
+  *a = 0;
 
   while (c < 9) {
-    out_len += snprintf(&out[out_len], 8192 - out_len, " ");
+    *p++ = ' ';
     c++;
   }
-  out_len += snprintf(&out[out_len], 8192 - out_len, "%s %s", opnames[opcode], args);
-  c += strlen(opnames[opcode]) + 1 + strlen(args);
+  int len = strlen(opnames[opcode]);
+  memcpy(p, opnames[opcode], len);
+  p += len;
+  *p++ = ' ';
+  memcpy(p, args, a - args);
+  p += a - args;
+  c += len + 1 + (a - args);
   while (c < 20) {
-    out_len += snprintf(&out[out_len], 8192 - out_len, " ");
+    *p++ = ' ';
     c++;
   }
-  struct annotation *a = annotations[load_address];
-  while (a) {
-    out_len += snprintf(&out[out_len], 8192 - out_len, "%s\n", a->text);
-    if (a->next)
-      out_len += snprintf(&out[out_len], 8192 - out_len, "                                       ");
-    a = a->next;
+
+  // Copy the line to out, followed by the annotations for this address, stopping if out fills up
+  int out_len = p - line;
+  if (out_len > out_size - 2)
+    out_len = out_size - 2;
+  memcpy(out, line, out_len);
+  for (unsigned int an = annotation_start[load_address]; an < annotation_start[load_address + 1]; an++) {
+    for (const char *t = &annotation_text[annotation_order[an]]; *t && out_len < out_size - 2;)
+      out[out_len++] = *t++;
+    if (out_len < out_size - 2)
+      out[out_len++] = '\n';
+    if (an + 1 < annotation_start[load_address + 1])
+      for (int k = 0; k < 39 && out_len < out_size - 2; k++)
+        out[out_len++] = ' ';
   }
-  out_len += snprintf(&out[out_len], 8192 - out_len, "\n");
+  out[out_len++] = '\n';
+  out[out_len] = 0;
 
   // Remember instruction address for next display
-  instruction_address = (b[1] << 8) + b[0];
-  // JSR passes PC+1 instead of PC of next instruction, so adjust
-  switch (opcode) {
-  case 0x6c:
-  case 0x4c:
-    // jump leaves correct address
-    break;
-  case 0xf0:
-  case 0xd0:
-    // Branches taken leave correct address, but
-    // untaken branches do not.
-    if (instruction_address != (load_address + 2))
-      break;
-    /* fall through */
-  default:
-    instruction_address--;
+  s->instruction_address = next_instruction_address(load_address, b);
+
+  return out_len;
+}
+
+int decode_instruction(const unsigned char *b, int whole)
+{
+  char out[8192];
+  int out_len = 0;
+
+  // Limit number of instructions shown
+  // (unless we have a match string, in which case we display 16 instructions before and after each match)
+  if (num_instructions)
+    num_instructions--;
+  else {
+    if (!match_string)
+      exit(-1);
+  }
+  out[0] = 0;
+  if (0)
+    out_len += snprintf(&out[out_len], 8192 - out_len, "INSTRUCTION: %02x %02x %02x %02x %02x %02x %02x %02x\n", b[0], b[1],
+        b[2], b[3], b[4], b[5], b[6], b[7]);
+
+  if (is_raster_marker(b)) {
+    // Raster / badline marker (whose flags a short record doesn't have)
+    int viciv_raster = raster_marker_line(b);
+    int vicii_raster = (b[4] >> 4) + (b[5] << 4);
+    int raster = whole && (b[7] & 0x80);
+    int badline = whole && (b[7] & 0x40);
+
+    if (one_frame && (one_frame_active)) {
+      if (raster && (!viciv_raster)) {
+        // Start of next frame after single raster display, so stop
+        exit(0);
+      }
+    }
+
+    if (one_frame && (!one_frame_active)) {
+      if (raster && (!viciv_raster)) {
+        // Start of single frame to display
+        one_frame_active = 1;
+      }
+    }
+
+    // Don't display anything if we are not yet in the active frame to be displayed
+    if (one_frame && (!one_frame_active))
+      return 0;
+
+    out_len += snprintf(&out[out_len], 8192 - out_len, "VIC-II raster $%03x (VIC-IV raster $%03x)%s%s\n", vicii_raster,
+        viciv_raster, raster ? " [NEW RASTER]" : "", badline ? " [BADLINE TRIGGERED]" : "");
+    return 0;
   }
 
+  // Don't display anything if we are not yet in the active frame to be displayed
+  if (one_frame && (!one_frame_active))
+    return 0;
+
+  // Display until 32 instructions after BRK instruction if requested
+  // XXX -- We should also just cache instructions before the BRK, so we just display the period when things
+  // go wrong.
+  if ((!b[2]) && wait_for_break)
+    num_instructions = 32;
+
+  format_instruction(&trace, b, whole, out, 8192);
+
   if (match_string) {
     if (strstr(out, match_string)) {
       // Output contains a string we are watching for, so begin
@@ -373,9 +472,9 @@ int decode_busaccess(const unsigned char *b)
 
   printf("BUS ACCESS: %02x %02x %02x %02x %02x %02x %02x %02x\n", b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]);
 
-  if (last_d031_toggle != d031_toggle)
+  if (trace.last_d031_toggle != d031_toggle)
     printf("[$D031 written!] ");
-  last_d031_toggle = d031_toggle;
+  trace.last_d031_toggle = d031_toggle;
 
   // Don't say anything when the bus is idle
   //  if (!(fastio_write|fastio_read|instruction_strobe)) return 0;
@@ -397,178 +496,1653 @@ int decode_busaccess(const unsigned char *b)
   return 0;
 }
 
-#define MAX_LINES 65536
+/*
+  Source files named by annotations are mapped into memory rather than
+  read, and found through a hash of their names.  Each has a table of
+  where its lines start, so finding a line is a single lookup.
+*/
 struct source_file {
   char *name;
+  const char *text; // NULL if the file could not be read, or is empty
+  size_t size;
   int line_count;
-  char *lines[MAX_LINES];
+  uint32_t *lines; // offset of the start of each line
 };
 
-#define MAX_SOURCES 256
-struct source_file source_files[MAX_SOURCES];
+struct source_file *source_files = NULL;
 int source_file_count = 0;
+int *source_hash = NULL; // index into source_files[], or -1
+int source_hash_size = 0;
 
-char *find_source_line(char *file, int line)
+unsigned int hash_name(const char *name)
 {
-  int num;
-  line--;
-  for (num = 0; num < source_file_count; num++) {
-    if (!strcmp(source_files[num].name, file))
-      break;
+  // FNV-1a
+  unsigned int h = 2166136261u;
+  while (*name)
+    h = (h ^ (unsigned char)*name++) * 16777619u;
+  return h;
+}
+
+void hash_source_file(int num)
+{
+  int slot = hash_name(source_files[num].name) & (source_hash_size - 1);
+  while (source_hash[slot] != -1)
+    slot = (slot + 1) & (source_hash_size - 1);
+  source_hash[slot] = num;
+}
+
+struct source_file *load_source_file(char *file)
+{
+  if (source_file_count * 2 >= source_hash_size) {
+    // Keep the hash table no more than half full
+    source_hash_size = source_hash_size ? source_hash_size * 2 : 256;
+    source_hash = realloc(source_hash, source_hash_size * sizeof(int));
+    memset(source_hash, 0xff, source_hash_size * sizeof(int));
+    for (int i = 0; i < source_file_count; i++)
+      hash_source_file(i);
   }
-  if (num == source_file_count) {
-    FILE *f = fopen(file, "r");
-    if (!f)
-      return NULL;
-    char l[1024];
-    int line_count = 0;
-    l[0] = 0;
-    fgets(l, 1024, f);
-    while (l[0]) {
-      if (line_count == MAX_LINES)
+  if (!(source_file_count & 255))
+    source_files = realloc(source_files, (source_file_count + 256) * sizeof(struct source_file));
+
+  struct source_file *s = &source_files[source_file_count];
+  memset(s, 0, sizeof(struct source_file));
+  s->name = strdup(file);
+  hash_source_file(source_file_count++);
+
+  int fd = open(file, O_RDONLY);
+  if (fd == -1)
+    return s;
+  struct stat st;
+  if (!fstat(fd, &st) && st.st_size > 0) {
+    s->text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (s->text == MAP_FAILED)
+      s->text = NULL;
+    else
+      s->size = st.st_size;
+  }
+  close(fd);
+  if (!s->text)
+    return s;
+
+  // Find where each line starts (a last line without a newline counts too)
+  int count = 0;
+  for (const char *p = s->text; p < s->text + s->size; count++) {
+    p = memchr(p, '\n', s->text + s->size - p);
+    p = p ? p + 1 : s->text + s->size;
+  }
+  s->lines = malloc(count * sizeof(uint32_t));
+  const char *p = s->text;
+  for (int i = 0; i < count; i++) {
+    s->lines[i] = p - s->text;
+    p = memchr(p, '\n', s->text + s->size - p);
+    if (p)
+      p++;
+  }
+  s->line_count = count;
+  return s;
+}
+
+// Find the given line (from 1) of a source file, without the line ending. Returns NULL if there is no such line.
+const char *find_source_line(char *file, int line, int *length)
+{
+  struct source_file *s = NULL;
+  if (source_hash_size) {
+    int slot = hash_name(file) & (source_hash_size - 1);
+    while (source_hash[slot] != -1) {
+      if (!strcmp(source_files[source_hash[slot]].name, file)) {
+        s = &source_files[source_hash[slot]];
         break;
-      // Trim CRLF etc
-      while (l[0] && (l[strlen(l) - 1] < ' '))
-        l[strlen(l) - 1] = 0;
-      // Store line
-      source_files[num].lines[line_count++] = strdup(l);
-      source_files[num].line_count = line_count;
-      l[0] = 0;
-      fgets(l, 1024, f);
-    }
-    source_files[num].name = strdup(file);
-    source_file_count++;
-  }
-  if (num == source_file_count)
-    return NULL;
-  if (source_files[num].line_count < line)
+      }
+      slot = (slot + 1) & (source_hash_size - 1);
+    }
+  }
+  if (!s)
+    s = load_source_file(file);
+
+  line--;
+  if (line < 0 || line >= s->line_count)
     return NULL;
-  return source_files[num].lines[line];
+  const char *start = s->text + s->lines[line];
+  const char *end = line + 1 < s->line_count ? s->text + s->lines[line + 1] : s->text + s->size;
+  // Trim CRLF etc
+  while (end > start && end[-1] < ' ')
+    end--;
+  *length = end - start;
+  return start;
 }
 
+/*
+  Annotations are gathered in one block of text as they are read, and then
+  indexed by address, so that those for an address are together.
+*/
+size_t annotation_text_len = 0;
+size_t annotation_text_size = 0;
+
+struct pending_annotation {
+  uint16_t addr;
+  uint32_t text;
+};
+struct pending_annotation *pending_annotations = NULL;
+int annotation_count = 0;
+
 int record_address_annotation(int addr, char *source, int line)
 {
   if (addr < 0 || addr > 0xffff)
     return -1;
 
-  char *source_line = find_source_line(source, line);
+  int source_length = 0;
+  const char *source_line = find_source_line(source, line, &source_length);
   char annotation[8192];
   int source_offset = 0;
   for (int i = 0; source[i]; i++)
     if (source[i] == '/')
       source_offset = i + 1;
+  int len;
   if (source_line) {
-    while (source_line[0] == '\t' || source_line[0] == ' ')
+    while (source_length && (source_line[0] == '\t' || source_line[0] == ' ')) {
       source_line++;
-    snprintf(annotation, 8192, "%s:%d: %s", &source[source_offset], line, source_line);
+      source_length--;
+    }
+    len = snprintf(annotation, 8192, "%s:%d: %.*s", &source[source_offset], line, source_length, source_line);
   }
   else
-    snprintf(annotation, 8192, "%s:%d", &source[source_offset], line);
+    len = snprintf(annotation, 8192, "%s:%d", &source[source_offset], line);
+  if (len > 8191)
+    len = 8191;
 
   //  printf("  %s\n",annotation);
 
-  struct annotation *a = calloc(sizeof(struct annotation), 1);
-  a->text = strdup(annotation);
-  a->next = annotations[addr];
-  annotations[addr] = a;
+  if (annotation_text_len + len + 1 > annotation_text_size) {
+    annotation_text_size = annotation_text_size * 2 + 65536;
+    annotation_text = realloc(annotation_text, annotation_text_size);
+  }
+  if (!(annotation_count & 4095))
+    pending_annotations = realloc(pending_annotations, (annotation_count + 4096) * sizeof(struct pending_annotation));
+  pending_annotations[annotation_count].addr = addr;
+  pending_annotations[annotation_count].text = annotation_text_len;
+  annotation_count++;
+  memcpy(&annotation_text[annotation_text_len], annotation, len + 1);
+  annotation_text_len += len + 1;
   return 0;
 }
 
+// Index the annotations read so far by address. The most recently read comes first for each address.
+void index_annotations(void)
+{
+  memset(annotation_start, 0, sizeof(annotation_start));
+  for (int i = 0; i < annotation_count; i++)
+    annotation_start[pending_annotations[i].addr + 1]++;
+  for (int addr = 0; addr < 0x10000; addr++)
+    annotation_start[addr + 1] += annotation_start[addr];
+  annotation_order = realloc(annotation_order, (annotation_count + 1) * sizeof(uint32_t));
+  static unsigned int next[0x10000];
+  memcpy(next, annotation_start, sizeof(next));
+  for (int i = annotation_count - 1; i >= 0; i--)
+    annotation_order[next[pending_annotations[i].addr]++] = pending_annotations[i].text;
+}
+
+// Parse an annotation line, as sscanf(line, "%x %*[^|]| %[^:]:%d", ...) would, but much faster.
+// Returns the number of fields read, like sscanf().
+int parse_annotation_line(const char *line, int *addr, char *source_file, int *source_line)
+{
+  const char *p = line;
+  while (isspace((unsigned char)*p))
+    p++;
+  if (!isxdigit((unsigned char)*p) || (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')))
+    return sscanf(line, "%x %*[^|]| %[^:]:%d", addr, source_file, source_line);
+  unsigned int value = 0;
+  int digits = 0;
+  for (; isxdigit((unsigned char)*p); p++, digits++)
+    value = (value << 4) | (isdigit((unsigned char)*p) ? *p - '0' : (tolower((unsigned char)*p) - 'a' + 10));
+  if (digits > 8)
+    return sscanf(line, "%x %*[^|]| %[^:]:%d", addr, source_file, source_line);
+  *addr = value;
+
+  while (isspace((unsigned char)*p))
+    p++;
+  if (!*p || *p == '|')
+    return 1;
+  p = strchr(p, '|');
+  if (!p)
+    return 1;
+  p++;
+  while (isspace((unsigned char)*p))
+    p++;
+  const char *colon = strchr(p, ':');
+  if (!*p || colon == p)
+    return 1;
+  if (!colon) {
+    strcpy(source_file, p);
+    return 2;
+  }
+  memcpy(source_file, p, colon - p);
+  source_file[colon - p] = 0;
+  p = colon + 1;
+  while (isspace((unsigned char)*p))
+    p++;
+  const char *number = p;
+  if (*p == '-' || *p == '+')
+    p++;
+  if (!isdigit((unsigned char)*p))
+    return 2;
+  *source_line = atoi(number);
+  return 3;
+}
+
 int read_annotation_file(char *an)
 {
-  FILE *f = fopen(an, "r");
-  if (!f) {
+  int fd = open(an, O_RDONLY);
+  if (fd == -1) {
     fprintf(stderr, "Could not open '%s' for reading.\n", an);
     exit(-3);
   }
-  char line[1024];
-  line[0] = 0;
-  fgets(line, 1024, f);
-  while (line[0]) {
-    // Trim CR/LF etc from end
-    while (line[0] && line[strlen(line) - 1] < ' ')
-      line[strlen(line) - 1] = 0;
-
-    int addr;
-    int source_line;
-    char source_file[1024];
-
-    if (sscanf(line, "%x %*[^|]| %[^:]:%d", &addr, source_file, &source_line) == 3) {
-      //	printf("Addr $%X = %s:%d\n",addr,source_file,source_line);
-      record_address_annotation(addr, source_file, source_line);
+  struct stat st;
+  fstat(fd, &st);
+  const char *text = NULL;
+  if (st.st_size > 0) {
+    text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text == MAP_FAILED) {
+      fprintf(stderr, "Could not map '%s': %s\n", an, strerror(errno));
+      exit(-3);
     }
-
-    line[0] = 0;
-    fgets(line, 1024, f);
+  }
+  close(fd);
+
+  const char *end = text + st.st_size;
+  for (const char *p = text; p && p < end;) {
+    const char *eol = memchr(p, '\n', end - p);
+    const char *next = eol ? eol + 1 : end;
+    if (!eol)
+      eol = end;
+    // Only lines with a | can be annotations
+    if (memchr(p, '|', eol - p)) {
+      char line[1024];
+      int len = eol - p;
+      if (len > 1023)
+        len = 1023;
+      memcpy(line, p, len);
+      // Trim CR/LF etc from end
+      while (len && line[len - 1] < ' ')
+        len--;
+      line[len] = 0;
+
+      int addr;
+      int source_line;
+      char source_file[1024];
+
+      if (parse_annotation_line(line, &addr, source_file, &source_line) == 3) {
+        //	printf("Addr $%X = %s:%d\n",addr,source_file,source_line);
+        record_address_annotation(addr, source_file, source_line);
+      }
+    }
+    p = next;
   }
 
-  fclose(f);
+  if (text)
+    munmap((void *)text, st.st_size);
+  index_annotations();
   return 0;
 }
 
-int usage(void)
+// Instruction trace frames, including the ethernet header, are always this size
+#define FRAME_SIZE 2132
+// The 8 byte records start after the packet header.  The last one is cut 2 bytes short: it has the PC,
+// opcode, arguments and flags, but not SP and A, nor whether $D031 was written (or a raster marker's flags).
+#define FIRST_RECORD (0x48 + 14)
+#define RECORD_KNOWN_BYTES 6
+
+/*
+  Profiling (-p): instead of decoding each instruction, count how many
+  times each address was executed, and how many instructions ran on each
+  raster line.  Symbols from ACME symbol lists, VICE/cc65 label files,
+  cc65 map files and Ophis map files are used to name the routines.
+  Note that the counts are of instructions, not cycles.
+*/
+#define MAX_RASTERS 4096
+#define RASTER_GROUP 8
+#define RASTER_GROUPS (MAX_RASTERS / RASTER_GROUP)
+// Routines tracked for each group of raster lines, the rest are counted as "other"
+#define HEAT_SLOTS 64
+
+struct symbol {
+  char *name;
+  int addr;
+};
+
+struct symbol *symbols = NULL;
+int symbol_count = 0;
+// Index of the symbol at or before each address, or -1
+int symbol_at[0x10000];
+
+int profile = 0;
+unsigned long long pc_samples[0x10000];
+unsigned long long profile_instructions = 0;
+unsigned long long profile_frames = 0;
+
+int current_raster = -1;
+int highest_raster = 0;
+unsigned long long raster_instructions[MAX_RASTERS];
+unsigned long long raster_badlines[MAX_RASTERS];
+
+struct heat_slot {
+  int symbol;
+  unsigned long long count;
+};
+struct heat_slot raster_heat[RASTER_GROUPS][HEAT_SLOTS];
+unsigned long long raster_heat_other[RASTER_GROUPS];
+
+void add_symbol(char *name, int addr)
 {
-  fprintf(stderr, "usage: ethermon [-F] [-n num instructions] [-m match string] <network interface> [.list, .map or other "
-                  "supported memory annotation files]\n");
-  fprintf(stderr, "If -m is specified, then no instructions are displayed until <match string> appears in the output.\n");
-  fprintf(stderr, "If -F is specified, the instruction stream is collected for a single frame of video display.\n");
-  exit(-3);
+  if (addr < 0 || addr > 0xffff)
+    return;
+  if (!(symbol_count & 1023))
+    symbols = realloc(symbols, (symbol_count + 1024) * sizeof(struct symbol));
+  symbols[symbol_count].name = strdup(name);
+  symbols[symbol_count].addr = addr;
+  symbol_count++;
 }
 
-int main(int argc, char **argv)
+int read_symbol_file(char *filename)
 {
-  char *dev;
-  char errbuf[PCAP_ERRBUF_SIZE];
-  pcap_t *descr;
-  //    struct bpf_program fp;        /* to hold compiled program */
-  bpf_u_int32 pMask; /* subnet mask */
-  bpf_u_int32 pNet;  /* ip address*/
-  pcap_if_t *alldevs;
-
-  for (int i = 0; i < 0x10000; i++)
-    annotations[i] = NULL;
+  FILE *f = fopen(filename, "r");
+  if (!f) {
+    fprintf(stderr, "Could not open '%s' for reading.\n", filename);
+    exit(-3);
+  }
+  char line[1024];
+  int in_exports = 0;
+  int before = symbol_count;
+  while (fgets(line, sizeof(line), f)) {
+    char sym[1024];
+    char sym2[1024];
+    char kind[16];
+    char kind2[16];
+    int addr;
+    int addr2;
 
-  int opt;
-  while ((opt = getopt(argc, argv, "bfFm:n:")) != -1) {
-    switch (opt) {
-    case 'f':
-      instruction_frequency = 1;
-      num_instructions = 0;
-      break;
-    case 'b':
-      wait_for_break = 1;
-      break;
-    case 'F':
-      one_frame = 1;
-      break;
-    case 'm':
-      match_string = optarg;
-      num_instructions = 0;
-      break;
-    case 'n':
-      num_instructions = atoi(optarg);
-      if (match_string) {
-        fprintf(stderr, "ERROR: -n and -m cannot be combined.\n");
-        exit(-1);
-      }
-      break;
-    default:
-      usage();
+    if (!strncmp(line, "Exports list", 12)) {
+      // cc65 map file: two exports per line, until the next list
+      in_exports = 1;
+      continue;
     }
+    if (in_exports) {
+      if (!strncmp(line, "Imports list", 12))
+        in_exports = 0;
+      int n = sscanf(line, "%s %x %15s %s %x %15s", sym, &addr, kind, sym2, &addr2, kind2);
+      if (n >= 3)
+        add_symbol(sym, addr);
+      if (n == 6)
+        add_symbol(sym2, addr2);
+      continue;
+    }
+    if (sscanf(line, " %s = $%x", sym, &addr) == 2)
+      // ACME symbol list
+      add_symbol(sym, addr);
+    else if (sscanf(line, "al %x %s", &addr, sym) == 2)
+      // VICE label file (eg from cc65 -Ln)
+      add_symbol(sym[0] == '.' ? &sym[1] : sym, addr);
+    else if (sscanf(line, " $%x | %[^| \t]", &addr, sym) == 2 || sscanf(line, "%x | %[^| \t]", &addr, sym) == 2)
+      // Ophis map file
+      add_symbol(sym, addr);
   }
+  fclose(f);
+  fprintf(stderr, "Read %d symbols from '%s'.\n", symbol_count - before, filename);
+  return 0;
+}
 
-  if (optind >= argc)
-    usage();
+int compare_symbols(const void *a, const void *b)
+{
+  const struct symbol *sa = a, *sb = b;
+  if (sa->addr != sb->addr)
+    return sa->addr - sb->addr;
+  return strcmp(sa->name, sb->name);
+}
 
-  if (argv[optind])
-    dev = argv[optind];
-  else {
-    fprintf(stderr, "You must specify the interface to listen on.\n");
-    exit(-1);
+// Sort the symbols, and note which one each address belongs to
+void index_symbols(void)
+{
+  qsort(symbols, symbol_count, sizeof(struct symbol), compare_symbols);
+  int s = -1;
+  for (int addr = 0; addr < 0x10000; addr++) {
+    while (s + 1 < symbol_count && symbols[s + 1].addr <= addr)
+      s++;
+    symbol_at[addr] = s;
   }
+  // Prefer the first symbol at an address, which sorts first
+  for (int addr = 0; addr < 0x10000; addr++) {
+    int i = symbol_at[addr];
+    while (i > 0 && symbols[i - 1].addr == symbols[i].addr)
+      i--;
+    symbol_at[addr] = i;
+  }
+}
 
-  for (int i = optind + 1; i < argc; i++)
-    read_annotation_file(argv[i]);
+void count_raster_heat(int raster, int pc)
+{
+  int group = raster / RASTER_GROUP;
+  int symbol = symbol_at[pc];
+  // With no symbol, the 256 byte page stands in for the routine
+  int key = symbol >= 0 ? symbol : -1 - (pc >> 8);
+  struct heat_slot *slots = raster_heat[group];
+  for (int i = 0; i < HEAT_SLOTS; i++) {
+    if (slots[i].count && slots[i].symbol == key) {
+      slots[i].count++;
+      return;
+    }
+    if (!slots[i].count) {
+      slots[i].symbol = key;
+      slots[i].count = 1;
+      return;
+    }
+  }
+  raster_heat_other[group]++;
+}
+
+int profile_frame(const unsigned char *packet, int caplen)
+{
+  for (int offset = FIRST_RECORD; offset + RECORD_KNOWN_BYTES <= caplen; offset += 8) {
+    const unsigned char *b = &packet[offset];
+    int whole = offset + 8 <= caplen;
+    if (is_raster_marker(b)) {
+      if (!whole)
+        continue;
+      int raster = raster_marker_line(b);
+      if (b[7] & 0x80) {
+        current_raster = raster;
+        if (raster > highest_raster)
+          highest_raster = raster;
+        if (!raster)
+          profile_frames++;
+      }
+      if (b[7] & 0x40)
+        raster_badlines[raster]++;
+      continue;
+    }
+    int pc = trace.instruction_address;
+    pc_samples[pc]++;
+    profile_instructions++;
+    if (current_raster >= 0) {
+      raster_instructions[current_raster]++;
+      count_raster_heat(current_raster, pc);
+    }
+    trace.instruction_address = next_instruction_address(pc, b);
+    trace.instruction_count++;
+  }
+  return 0;
+}
+
+// Describe a routine found by count_raster_heat(), or an entry of the flat profile
+char *routine_name(int key, char *buf, int size)
+{
+  if (key >= 0)
+    snprintf(buf, size, "%s", symbols[key].name);
+  else
+    snprintf(buf, size, "$%02X00-$%02XFF", -1 - key, -1 - key);
+  return buf;
+}
+
+struct profile_entry {
+  int key;
+  int addr;
+  unsigned long long count;
+};
+
+int compare_profile_entries(const void *a, const void *b)
+{
+  const struct profile_entry *pa = a, *pb = b;
+  if (pa->count != pb->count)
+    return pa->count < pb->count ? 1 : -1;
+  return pa->addr - pb->addr;
+}
+
+void report_profile(void)
+{
+  char name[1024];
+  char routine[256];
+  if (!profile_instructions) {
+    fprintf(stderr, "No instructions were seen.\n");
+    return;
+  }
+  unsigned long long frames = profile_frames ? profile_frames : 1;
+
+  // Flat profile: by symbol, or by 256 byte page where there is no symbol
+  struct profile_entry *entries = calloc(symbol_count + 256, sizeof(struct profile_entry));
+  for (int i = 0; i < symbol_count; i++) {
+    entries[i].key = i;
+    entries[i].addr = symbols[i].addr;
+  }
+  for (int page = 0; page < 256; page++) {
+    entries[symbol_count + page].key = -1 - page;
+    entries[symbol_count + page].addr = page << 8;
+  }
+  for (int addr = 0; addr < 0x10000; addr++) {
+    if (!pc_samples[addr])
+      continue;
+    int s = symbol_at[addr];
+    entries[s >= 0 ? s : symbol_count + (addr >> 8)].count += pc_samples[addr];
+  }
+  qsort(entries, symbol_count + 256, sizeof(struct profile_entry), compare_profile_entries);
+
+  printf("Flat profile of %llu instructions over %llu frames (%.1f instructions per frame):\n\n", profile_instructions,
+      profile_frames, (double)profile_instructions / frames);
+  printf("      %%  cumulative   instructions  per frame  address  routine\n");
+  double cumulative = 0;
+  for (int i = 0; i < symbol_count + 256 && entries[i].count; i++) {
+    double percent = 100.0 * entries[i].count / profile_instructions;
+    cumulative += percent;
+    printf("%6.2f%%     %6.2f%%  %13llu  %9.1f    $%04X  %s\n", percent, cumulative, entries[i].count,
+        (double)entries[i].count / frames, entries[i].addr, routine_name(entries[i].key, name, sizeof(name)));
+  }
+  free(entries);
+
+  // The busiest individual instructions
+  printf("\nBusiest instructions:\n\n");
+  printf("      %%   instructions  address  routine\n");
+  for (int n = 0; n < 20; n++) {
+    int best = -1;
+    for (int addr = 0; addr < 0x10000; addr++)
+      if (pc_samples[addr] && (best == -1 || pc_samples[addr] > pc_samples[best]))
+        best = addr;
+    if (best == -1)
+      break;
+    int s = symbol_at[best];
+    if (s >= 0)
+      snprintf(name, sizeof(name), "%s+%d", symbols[s].name, best - symbols[s].addr);
+    else
+      name[0] = 0;
+    printf("%6.2f%%  %13llu    $%04X  %s\n", 100.0 * pc_samples[best] / profile_instructions, pc_samples[best], best,
+        name);
+    // Take it out of the running, now it has been reported
+    pc_samples[best] = 0;
+  }
+
+  // Timeline: instructions on each group of raster lines in an average frame
+  unsigned long long busiest_group = 1;
+  for (int g = 0; g <= highest_raster / RASTER_GROUP; g++) {
+    unsigned long long total = 0;
+    for (int r = g * RASTER_GROUP; r < (g + 1) * RASTER_GROUP; r++)
+      total += raster_instructions[r];
+    if (total > busiest_group)
+      busiest_group = total;
+  }
+  printf("\nInstructions per raster line (VIC-IV raster, average of %llu frames):\n\n", profile_frames);
+  printf(" raster lines  per line  badlines  %-40s  busiest routine\n", "");
+  for (int g = 0; g <= highest_raster / RASTER_GROUP; g++) {
+    unsigned long long total = 0, badlines = 0;
+    for (int r = g * RASTER_GROUP; r < (g + 1) * RASTER_GROUP; r++) {
+      total += raster_instructions[r];
+      badlines += raster_badlines[r];
+    }
+    char bar[41];
+    int len = total * 40 / busiest_group;
+    memset(bar, '#', len);
+    memset(&bar[len], ' ', 40 - len);
+    bar[40] = 0;
+
+    struct heat_slot *busiest = NULL;
+    for (int i = 0; i < HEAT_SLOTS && raster_heat[g][i].count; i++)
+      if (!busiest || raster_heat[g][i].count > busiest->count)
+        busiest = &raster_heat[g][i];
+    name[0] = 0;
+    if (busiest)
+      snprintf(name, sizeof(name), "%s (%d%%)", routine_name(busiest->symbol, routine, sizeof(routine)),
+          (int)(100 * busiest->count / total));
+    printf("  $%03X-$%03X  %8.1f  %8.1f  %s  %s\n", g * RASTER_GROUP, g * RASTER_GROUP + RASTER_GROUP - 1,
+        (double)total / frames / RASTER_GROUP, (double)badlines / frames, bar, name);
+  }
+}
+
+/*
+  Triggers (-t): an expression over the raw trace records, such as
+
+    pc=$1000-$10ff && op=jsr,rts
+    io=$d020,$d021 || (raster=$100-$110 && d031)
+    pc=$2000{3}
+
+  Terms are:
+    pc=RANGES      address of the instruction
+    op=OPCODES     opcode, as a number or a mnemonic (all its modes)
+    io=RANGES      the address operand of an absolute mode instruction
+    raster=RANGES  the current VIC-IV raster line
+    d031           the instruction wrote to $D031
+
+  RANGES is a list like $d000-$d0ff,$d400.  Numbers are decimal unless
+  they start with $ or 0x.  Terms can be combined with
+  &&, || and ! (or and, or and not), and brackets.  X{N} is true each
+  time X is true, from the Nth time on, so pc=$2000{3} fires at the 3rd
+  visit to $2000 and every one after it (up to the -c limit).
+
+  The expression is compiled to a little postfix program, which is run
+  on every record without decoding it.  Instructions are kept in a ring
+  of raw records, along with the decoder state for each, so that when
+  the trigger fires the instructions before it can be decoded.  Only
+  those and the ones after it are ever formatted.
+*/
+#define MAX_TRIGGER_OPS 256
+#define MAX_TRIGGER_RANGES 16
+
+enum trigger_op_type {
+  TRIGGER_PC,
+  TRIGGER_OPCODE,
+  TRIGGER_IO,
+  TRIGGER_RASTER,
+  TRIGGER_D031,
+  TRIGGER_AND,
+  TRIGGER_OR,
+  TRIGGER_NOT,
+  TRIGGER_COUNT
+};
+
+struct trigger_op {
+  enum trigger_op_type type;
+  int range_count;
+  int low[MAX_TRIGGER_RANGES];
+  int high[MAX_TRIGGER_RANGES];
+  unsigned char opcodes[256];
+  unsigned long long count; // for TRIGGER_COUNT: times true so far, and how many are needed
+  unsigned long long target;
+};
+
+struct trigger_op trigger_program[MAX_TRIGGER_OPS];
+int trigger_op_count = 0;
+char *trigger_expression = NULL;
+const char *trigger_parse_position;
+
+int trigger_before = 16;
+int trigger_after = 16;
+int trigger_limit = 0;
+int triggers_fired = 0;
+
+// Whether each opcode takes a 16 bit address, for io=
+unsigned char absolute_mode[256];
+
+struct trigger_record {
+  unsigned char b[8];
+  int whole;
+  struct trace_state state;
+};
+struct trigger_record *trigger_ring = NULL;
+int trigger_ring_first = 0;
+int trigger_ring_count = 0;
+int trigger_remaining = 0;
+int trigger_raster = -1;
+int trigger_started = 0;
+
+void trigger_syntax_error(const char *message)
+{
+  fprintf(stderr, "ERROR: %s in trigger expression at '%s'\n", message, trigger_parse_position);
+  exit(-3);
+}
+
+void trigger_skip_space(void)
+{
+  while (isspace((unsigned char)*trigger_parse_position))
+    trigger_parse_position++;
+}
+
+int trigger_accept(const char *token)
+{
+  trigger_skip_space();
+  int len = strlen(token);
+  if (strncasecmp(trigger_parse_position, token, len))
+    return 0;
+  // Words must not run into the next one
+  if (isalpha((unsigned char)token[0]) && isalnum((unsigned char)trigger_parse_position[len]))
+    return 0;
+  trigger_parse_position += len;
+  return 1;
+}
+
+struct trigger_op *trigger_emit(enum trigger_op_type type)
+{
+  if (trigger_op_count == MAX_TRIGGER_OPS)
+    trigger_syntax_error("Too many terms");
+  struct trigger_op *op = &trigger_program[trigger_op_count++];
+  memset(op, 0, sizeof(struct trigger_op));
+  op->type = type;
+  return op;
+}
+
+// A decimal number, or hex starting with $ or 0x
+int trigger_number(void)
+{
+  trigger_skip_space();
+  const char *start = trigger_parse_position;
+  int base = 10;
+  char *end;
+  if (*start == '$') {
+    start++;
+    base = 16;
+  }
+  else if (start[0] == '0' && (start[1] == 'x' || start[1] == 'X')) {
+    start += 2;
+    base = 16;
+  }
+  if (!isxdigit((unsigned char)*start))
+    trigger_syntax_error("Expected a number");
+  long value = strtol(start, &end, base);
+  // Catch hex without a $, such as d020 or 10ff, rather than stopping at its first letter
+  if (isalnum((unsigned char)*end))
+    trigger_syntax_error("Expected a decimal number, or hex starting with $ (e.g. $d020)");
+  trigger_parse_position = end;
+  return value;
+}
+
+void trigger_ranges(struct trigger_op *op)
+{
+  do {
+    if (op->range_count == MAX_TRIGGER_RANGES)
+      trigger_syntax_error("Too many ranges");
+    op->low[op->range_count] = trigger_number();
+    op->high[op->range_count] = op->low[op->range_count];
+    if (trigger_accept("-"))
+      op->high[op->range_count] = trigger_number();
+    op->range_count++;
+  } while (trigger_accept(","));
+}
+
+void trigger_opcodes(struct trigger_op *op)
+{
+  do {
+    trigger_skip_space();
+    if (isalpha((unsigned char)*trigger_parse_position)) {
+      char name[16];
+      int len = 0;
+      while (isalnum((unsigned char)trigger_parse_position[len]) && len < 15) {
+        name[len] = toupper((unsigned char)trigger_parse_position[len]);
+        len++;
+      }
+      name[len] = 0;
+      int found = 0;
+      for (int i = 0; i < 256; i++)
+        if (opnames[i] && !strcmp(opnames[i], name)) {
+          op->opcodes[i] = 1;
+          found = 1;
+        }
+      if (!found)
+        trigger_syntax_error("Unknown instruction (opcodes in hex start with $, e.g. $60)");
+      trigger_parse_position += len;
+    }
+    else {
+      int opcode = trigger_number();
+      if (opcode < 0 || opcode > 0xff)
+        trigger_syntax_error("Opcode out of range");
+      op->opcodes[opcode] = 1;
+    }
+  } while (trigger_accept(","));
+}
+
+void trigger_parse_or(void);
+
+void trigger_parse_term(void)
+{
+  if (trigger_accept("(")) {
+    trigger_parse_or();
+    if (!trigger_accept(")"))
+      trigger_syntax_error("Expected )");
+  }
+  else if (trigger_accept("!") || trigger_accept("not")) {
+    trigger_parse_term();
+    trigger_emit(TRIGGER_NOT);
+    return;
+  }
+  else if (trigger_accept("pc")) {
+    if (!trigger_accept("="))
+      trigger_syntax_error("Expected =");
+    trigger_ranges(trigger_emit(TRIGGER_PC));
+  }
+  else if (trigger_accept("op")) {
+    if (!trigger_accept("="))
+      trigger_syntax_error("Expected =");
+    trigger_opcodes(trigger_emit(TRIGGER_OPCODE));
+  }
+  else if (trigger_accept("io")) {
+    if (!trigger_accept("="))
+      trigger_syntax_error("Expected =");
+    trigger_ranges(trigger_emit(TRIGGER_IO));
+  }
+  else if (trigger_accept("raster")) {
+    if (!trigger_accept("="))
+      trigger_syntax_error("Expected =");
+    trigger_ranges(trigger_emit(TRIGGER_RASTER));
+  }
+  else if (trigger_accept("d031"))
+    trigger_emit(TRIGGER_D031);
+  else
+    trigger_syntax_error("Expected pc=, op=, io=, raster=, d031, ! or (");
+
+  while (trigger_accept("{")) {
+    struct trigger_op *op = trigger_emit(TRIGGER_COUNT);
+    op->target = trigger_number();
+    if (!trigger_accept("}"))
+      trigger_syntax_error("Expected }");
+  }
+}
+
+void trigger_parse_and(void)
+{
+  trigger_parse_term();
+  while (trigger_accept("&&") || trigger_accept("and")) {
+    trigger_parse_term();
+    trigger_emit(TRIGGER_AND);
+  }
+}
+
+void trigger_parse_or(void)
+{
+  trigger_parse_and();
+  while (trigger_accept("||") || trigger_accept("or")) {
+    trigger_parse_and();
+    trigger_emit(TRIGGER_OR);
+  }
+}
+
+void compile_trigger(char *expression)
+{
+  trigger_parse_position = expression;
+  trigger_parse_or();
+  trigger_skip_space();
+  if (*trigger_parse_position)
+    trigger_syntax_error("Unexpected text");
+
+  for (int i = 0; i < 256; i++)
+    absolute_mode[i] = modes[i] && strstr(modes[i], "nnnn") != NULL;
+
+  trigger_ring = calloc(trigger_before + 1, sizeof(struct trigger_record));
+}
+
+int in_ranges(struct trigger_op *op, int value)
+{
+  for (int i = 0; i < op->range_count; i++)
+    if (value >= op->low[i] && value <= op->high[i])
+      return 1;
+  return 0;
+}
+
+int run_trigger(const unsigned char *b, int pc, int d031_written)
+{
+  int stack[MAX_TRIGGER_OPS];
+  int sp = 0;
+  for (int i = 0; i < trigger_op_count; i++) {
+    struct trigger_op *op = &trigger_program[i];
+    switch (op->type) {
+    case TRIGGER_PC:
+      stack[sp++] = in_ranges(op, pc);
+      break;
+    case TRIGGER_OPCODE:
+      stack[sp++] = op->opcodes[b[2]];
+      break;
+    case TRIGGER_IO:
+      stack[sp++] = absolute_mode[b[2]] && in_ranges(op, b[3] | (b[4] << 8));
+      break;
+    case TRIGGER_RASTER:
+      stack[sp++] = trigger_raster >= 0 && in_ranges(op, trigger_raster);
+      break;
+    case TRIGGER_D031:
+      stack[sp++] = d031_written;
+      break;
+    case TRIGGER_AND:
+      sp--;
+      stack[sp - 1] = stack[sp - 1] && stack[sp];
+      break;
+    case TRIGGER_OR:
+      sp--;
+      stack[sp - 1] = stack[sp - 1] || stack[sp];
+      break;
+    case TRIGGER_NOT:
+      stack[sp - 1] = !stack[sp - 1];
+      break;
+    case TRIGGER_COUNT:
+      // True each time X is true, from the Nth time on
+      if (stack[sp - 1])
+        op->count++;
+      stack[sp - 1] = stack[sp - 1] && op->count >= op->target;
+      break;
+    }
+  }
+  return stack[0];
+}
+
+void print_trigger_record(const char *prefix, const unsigned char *b, int whole, struct trace_state state)
+{
+  char out[8192];
+  format_instruction(&state, b, whole, out, sizeof(out));
+  printf("%s %s", prefix, out);
+}
+
+int trigger_frame(const unsigned char *packet, int caplen)
+{
+  for (int offset = FIRST_RECORD; offset + RECORD_KNOWN_BYTES <= caplen; offset += 8) {
+    const unsigned char *b = &packet[offset];
+    int whole = offset + 8 <= caplen;
+    if (is_raster_marker(b)) {
+      if (whole && (b[7] & 0x80))
+        trigger_raster = raster_marker_line(b);
+      continue;
+    }
+
+    int d031_toggle = whole ? b[7] & 0x80 : trace.last_d031_toggle;
+    int fired = run_trigger(b, trace.instruction_address, trigger_started && d031_toggle != trace.last_d031_toggle)
+             && (!trigger_limit || triggers_fired < trigger_limit);
+    trigger_started = 1;
+    if (fired) {
+      if (!trigger_remaining) {
+        // Show what led up to it
+        printf("...\n");
+        for (int i = 0; i < trigger_ring_count; i++) {
+          struct trigger_record *r = &trigger_ring[(trigger_ring_first + i) % (trigger_before + 1)];
+          print_trigger_record("   ", r->b, r->whole, r->state);
+        }
+        trigger_ring_count = 0;
+      }
+      print_trigger_record(">>>", b, whole, trace);
+      triggers_fired++;
+      trigger_remaining = trigger_after;
+    }
+    else if (trigger_remaining) {
+      print_trigger_record("   ", b, whole, trace);
+      trigger_remaining--;
+    }
+    else if (trigger_before) {
+      // Keep it in case the trigger fires soon
+      if (trigger_ring_count == trigger_before) {
+        trigger_ring_first = (trigger_ring_first + 1) % (trigger_before + 1);
+        trigger_ring_count--;
+      }
+      struct trigger_record *r = &trigger_ring[(trigger_ring_first + trigger_ring_count++) % (trigger_before + 1)];
+      memcpy(r->b, b, whole ? 8 : RECORD_KNOWN_BYTES);
+      r->whole = whole;
+      r->state = trace;
+    }
+    if (trigger_limit && triggers_fired >= trigger_limit && !trigger_remaining)
+      exit(0);
+
+    trace.instruction_address = next_instruction_address(trace.instruction_address, b);
+    trace.instruction_count++;
+    trace.last_d031_toggle = d031_toggle;
+  }
+  return 0;
+}
+
+int process_packet(const unsigned char *packet, int caplen)
+{
+  if (caplen != FRAME_SIZE)
+    return 0;
+  if (profile)
+    return profile_frame(packet, caplen);
+  if (trigger_expression)
+    return trigger_frame(packet, caplen);
+
+  int bit52set = 0;
+  for (int offset = FIRST_RECORD; (offset + 6) < caplen; offset += 8) {
+    if (packet[offset + 6] & 0x10) {
+#if 0
+	      printf(">>> Bit52 set at offset $%X+6\n",offset-14);
+	      for(int j=0;j<8;j++) printf(" %02X",packet[offset+j]);
+	      printf("\n");
+#endif
+      bit52set = 1;
+      break;
+    }
+  }
+  // For now only support instruction decode
+  if (1 || bit52set) {
+    for (int offset = FIRST_RECORD; offset + RECORD_KNOWN_BYTES <= caplen; offset += 8) {
+      if (instruction_frequency) {
+        if (!is_raster_marker(&packet[offset])) {
+          instruction_counts[packet[offset + 2]]++;
+          num_instructions++;
+          if (!(num_instructions & 0xffff)) {
+            report_instruction_frequencies();
+          }
+        }
+      }
+      else
+        decode_instruction(&packet[offset], offset + 8 <= caplen);
+    }
+  }
+  else {
+    for (int offset = FIRST_RECORD; offset + 8 <= caplen; offset += 8) {
+      decode_busaccess(&packet[offset]);
+    }
+  }
+  return 0;
+}
+
+/*
+  Capture files (-w) are a ring of raw trace frames in a preallocated file,
+  written through mmap() so that capture does nothing but copy each frame.
+  When the ring is full, the oldest frames are overwritten.  The header
+  keeps the counts needed to say afterwards what was lost.  They are
+  updated as capture goes, so a capture file is still good if ethermon
+  is killed.
+
+  The frames themselves carry no sequence number, so lost frames are
+  detected from the raster markers: each new raster line should be one
+  more than the last, or 0 at the start of a frame.
+*/
+#define CAPTURE_MAGIC "ETHMON01"
+#define CAPTURE_HEADER_SIZE 4096
+
+struct capture_header {
+  char magic[8];
+  uint32_t frame_size;
+  uint32_t slot_size;
+  uint64_t capacity;            // frames the ring holds
+  uint64_t frames_written;      // including those since overwritten
+  uint64_t kernel_drops;        // frames libpcap says were dropped before we saw them
+  uint64_t raster_gaps;         // places where raster lines went missing
+  uint64_t raster_lines_missed; // total raster lines missing
+};
+
+struct capture_slot {
+  uint64_t sequence; // frame number since capture began
+  uint32_t tv_sec;
+  uint32_t tv_usec;
+  uint32_t caplen;
+  uint32_t lines_missed; // raster lines missing before or within this frame
+  unsigned char data[(FRAME_SIZE + 7) & ~7];
+};
+
+struct capture_header *capture = NULL;
+struct capture_slot *capture_slots = NULL;
+size_t capture_size = 0;
+unsigned long long capture_first = 0;
+unsigned long long capture_count = 0;
+
+int last_raster = -1;
+volatile sig_atomic_t stop_capture = 0;
+pcap_t *capture_descr = NULL;
+
+// Check the raster markers in a frame follow on from the last ones seen, and return how many lines are missing
+int raster_lines_missing(const unsigned char *packet, int caplen)
+{
+  int missing = 0;
+  for (int offset = FIRST_RECORD; offset + 8 <= caplen; offset += 8) {
+    const unsigned char *b = &packet[offset];
+    if (!is_raster_marker(b) || !(b[7] & 0x80))
+      continue;
+    int raster = raster_marker_line(b);
+    if (last_raster != -1 && raster && raster != last_raster + 1) {
+      missing += raster > last_raster ? raster - last_raster - 1 : 1;
+      capture->raster_gaps++;
+    }
+    last_raster = raster;
+  }
+  return missing;
+}
+
+void capture_frame(u_char *user, const struct pcap_pkthdr *hdr, const u_char *packet)
+{
+  if (hdr->caplen != FRAME_SIZE)
+    return;
+  struct capture_slot *s = &capture_slots[capture->frames_written % capture->capacity];
+  s->sequence = capture->frames_written;
+  s->tv_sec = hdr->ts.tv_sec;
+  s->tv_usec = hdr->ts.tv_usec;
+  s->caplen = hdr->caplen;
+  memcpy(s->data, packet, hdr->caplen);
+  s->lines_missed = raster_lines_missing(packet, hdr->caplen);
+  capture->raster_lines_missed += s->lines_missed;
+  capture->frames_written++;
+}
+
+void stop_capture_signal(int sig)
+{
+  stop_capture = 1;
+  if (capture_descr)
+    pcap_breakloop(capture_descr);
+}
+
+void update_kernel_drops(pcap_t *descr)
+{
+  struct pcap_stat ps;
+  if (pcap_stats(descr, &ps) == 0)
+    capture->kernel_drops = ps.ps_drop + ps.ps_ifdrop;
+}
+
+// Open the device for capture, with a big kernel buffer, only passing on trace frames
+pcap_t *open_trace_device(char *dev)
+{
+  char errbuf[PCAP_ERRBUF_SIZE];
+  pcap_t *descr = pcap_create(dev, errbuf);
+  if (descr == NULL) {
+    printf("pcap_create() failed due to [%s]\n", errbuf);
+    return NULL;
+  }
+  pcap_set_snaplen(descr, 8192);
+  pcap_set_promisc(descr, 1);
+  pcap_set_timeout(descr, 10);
+  pcap_set_buffer_size(descr, 64 * 1024 * 1024);
+  if (pcap_activate(descr) < 0) {
+    printf("pcap_activate() failed due to [%s]\n", pcap_geterr(descr));
+    return NULL;
+  }
+  struct bpf_program fp;
+  if (pcap_compile(descr, &fp, "len == 2132", 1, PCAP_NETMASK_UNKNOWN) == -1 || pcap_setfilter(descr, &fp) == -1) {
+    printf("Could not set packet filter due to [%s]\n", pcap_geterr(descr));
+    return NULL;
+  }
+  pcap_freecode(&fp);
+  return descr;
+}
+
+int capture_to_file(char *dev, char *filename, int size_mb)
+{
+  unsigned long long capacity = ((unsigned long long)size_mb << 20) / sizeof(struct capture_slot);
+  if (capacity < 1) {
+    fprintf(stderr, "Capture file size of %dMB is too small.\n", size_mb);
+    exit(-3);
+  }
+  capture_size = CAPTURE_HEADER_SIZE + capacity * sizeof(struct capture_slot);
+
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "Could not open '%s' for writing: %s\n", filename, strerror(errno));
+    exit(-3);
+  }
+  // Allocate the whole file now, so capture never waits for the file system to find space
+  int r = posix_fallocate(fd, 0, capture_size);
+  if (r) {
+    fprintf(stderr, "Could not allocate %lluMB for '%s': %s\n", (unsigned long long)capture_size >> 20, filename, strerror(r));
+    exit(-3);
+  }
+  capture = mmap(NULL, capture_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (capture == MAP_FAILED) {
+    fprintf(stderr, "Could not map '%s': %s\n", filename, strerror(errno));
+    exit(-3);
+  }
+  close(fd);
+  capture_slots = (struct capture_slot *)((char *)capture + CAPTURE_HEADER_SIZE);
+  memcpy(capture->magic, CAPTURE_MAGIC, 8);
+  capture->frame_size = FRAME_SIZE;
+  capture->slot_size = sizeof(struct capture_slot);
+  capture->capacity = capacity;
+
+  // Open the device with a big kernel buffer, so that a slow disk doesn't cost us frames
+  pcap_t *descr = open_trace_device(dev);
+  if (!descr)
+    return -1;
+
+  capture_descr = descr;
+  signal(SIGINT, stop_capture_signal);
+  signal(SIGTERM, stop_capture_signal);
+
+  fprintf(stderr, "Capturing up to %llu frames to '%s'. Press CTRL-C to stop.\n", capacity, filename);
+  printf("Started.\n");
+  fflush(stdout);
+
+  time_t last_report = time(0);
+  while (!stop_capture) {
+    if (pcap_dispatch(descr, -1, capture_frame, NULL) == -1) {
+      printf("pcap_dispatch() failed due to [%s]\n", pcap_geterr(descr));
+      break;
+    }
+    if (time(0) != last_report) {
+      last_report = time(0);
+      update_kernel_drops(descr);
+      fprintf(stderr, "\rCaptured %llu frames, %llu dropped, %llu raster gaps.", (unsigned long long)capture->frames_written,
+          (unsigned long long)capture->kernel_drops, (unsigned long long)capture->raster_gaps);
+    }
+  }
+  update_kernel_drops(descr);
+  pcap_close(descr);
+
+  fprintf(stderr, "\nCaptured %llu frames, %llu dropped by the kernel, %llu raster gaps (%llu lines).\n",
+      (unsigned long long)capture->frames_written, (unsigned long long)capture->kernel_drops,
+      (unsigned long long)capture->raster_gaps, (unsigned long long)capture->raster_lines_missed);
+  if (capture->frames_written > capacity)
+    fprintf(stderr, "The oldest %llu frames were overwritten, as the capture file was full.\n",
+        (unsigned long long)(capture->frames_written - capacity));
+  munmap(capture, capture_size);
+  return 0;
+}
+
+int open_capture_file(char *filename)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Could not open '%s' for reading: %s\n", filename, strerror(errno));
+    exit(-3);
+  }
+  struct stat st;
+  fstat(fd, &st);
+  capture_size = st.st_size;
+  if (capture_size < CAPTURE_HEADER_SIZE) {
+    fprintf(stderr, "'%s' is not an ethermon capture file.\n", filename);
+    exit(-3);
+  }
+  capture = mmap(NULL, capture_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (capture == MAP_FAILED) {
+    fprintf(stderr, "Could not map '%s': %s\n", filename, strerror(errno));
+    exit(-3);
+  }
+  close(fd);
+  if (memcmp(capture->magic, CAPTURE_MAGIC, 8) || capture->frame_size != FRAME_SIZE
+      || capture->slot_size != sizeof(struct capture_slot)
+      || CAPTURE_HEADER_SIZE + capture->capacity * sizeof(struct capture_slot) > capture_size) {
+    fprintf(stderr, "'%s' is not an ethermon capture file.\n", filename);
+    exit(-3);
+  }
+  capture_slots = (struct capture_slot *)((char *)capture + CAPTURE_HEADER_SIZE);
+  madvise(capture, capture_size, MADV_SEQUENTIAL);
+
+  capture_count = capture->frames_written;
+  if (capture_count > capture->capacity) {
+    capture_first = capture_count - capture->capacity;
+    capture_count = capture->capacity;
+  }
+  return 0;
+}
+
+struct capture_slot *capture_frame_slot(unsigned long long frame)
+{
+  return &capture_slots[(capture_first + frame) % capture->capacity];
+}
+
+void report_capture_drops(void)
+{
+  fflush(stdout);
+  fprintf(stderr, "Capture had %llu frames dropped by the kernel, %llu raster gaps (%llu lines)",
+      (unsigned long long)capture->kernel_drops, (unsigned long long)capture->raster_gaps,
+      (unsigned long long)capture->raster_lines_missed);
+  if (capture_first)
+    fprintf(stderr, ", and the oldest %llu frames were overwritten", capture_first);
+  fprintf(stderr, ".\n");
+}
+
+/*
+  Decoding in parallel, for both live capture and capture files: a
+  producer thread gathers frames into batches and hands them to the decode
+  workers in turn, and the main thread writes out the text of each batch
+  in the same order.  The threads are connected by single producer,
+  single consumer queues, so no locks are needed.  As batches are
+  formed, the producer keeps track of the instruction number and address
+  reached, so that each batch can be decoded without looking at any
+  other.
+*/
+#define BATCH_FRAMES 16
+#define QUEUE_SIZE 256 // must be a power of two
+#define MAX_WORKERS 32
+#define BATCHES_PER_WORKER 4
+
+struct trace_batch {
+  int frames;
+  struct trace_state state; // state at the start of the batch
+  char *out;
+  size_t out_len;
+  size_t out_size;
+  unsigned char data[BATCH_FRAMES][(FRAME_SIZE + 7) & ~7];
+};
+
+struct batch_queue {
+  unsigned int head; // next to take, only written by the consumer
+  char pad1[60];
+  unsigned int tail; // next free, only written by the producer
+  char pad2[60];
+  struct trace_batch *batches[QUEUE_SIZE];
+};
+
+// Passed down the pipeline to say that the trace has ended
+struct trace_batch end_of_trace = { -1 };
+
+struct batch_queue free_batches;
+struct batch_queue work_queues[MAX_WORKERS];
+struct batch_queue done_queues[MAX_WORKERS];
+int workers = 0;
+
+// Producer side
+struct trace_batch *filling = NULL;
+struct trace_state produced = { 0xFFFF, 0, 0 };
+int next_worker = 0;
+
+void wait_a_moment(int *spins)
+{
+  if (++(*spins) < 100)
+    sched_yield();
+  else
+    usleep(1000);
+}
+
+void queue_push(struct batch_queue *q, struct trace_batch *b)
+{
+  int spins = 0;
+  unsigned int tail = q->tail;
+  while (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == QUEUE_SIZE)
+    wait_a_moment(&spins);
+  q->batches[tail & (QUEUE_SIZE - 1)] = b;
+  __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+int queue_empty(struct batch_queue *q)
+{
+  return __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == q->head;
+}
+
+struct trace_batch *queue_pop(struct batch_queue *q)
+{
+  int spins = 0;
+  unsigned int head = q->head;
+  while (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == head)
+    wait_a_moment(&spins);
+  struct trace_batch *b = q->batches[head & (QUEUE_SIZE - 1)];
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+  return b;
+}
+
+// Step the trace state over a frame without formatting anything
+void skip_frame(struct trace_state *s, const unsigned char *frame)
+{
+  for (int offset = FIRST_RECORD; offset + RECORD_KNOWN_BYTES <= FRAME_SIZE; offset += 8) {
+    const unsigned char *b = &frame[offset];
+    if (is_raster_marker(b))
+      continue;
+    s->instruction_address = next_instruction_address(s->instruction_address, b);
+    s->instruction_count++;
+    if (offset + 8 <= FRAME_SIZE)
+      s->last_d031_toggle = b[7] & 0x80;
+  }
+}
+
+// Hand the batch being filled to the next worker
+void pipeline_submit(void)
+{
+  if (!filling)
+    return;
+  queue_push(&work_queues[next_worker], filling);
+  next_worker = (next_worker + 1) % workers;
+  filling = NULL;
+}
+
+void pipeline_frame(const unsigned char *packet, int caplen)
+{
+  if (caplen != FRAME_SIZE)
+    return;
+  if (!filling) {
+    filling = queue_pop(&free_batches);
+    filling->frames = 0;
+    filling->state = produced;
+  }
+  unsigned char *frame = filling->data[filling->frames++];
+  memcpy(frame, packet, FRAME_SIZE);
+  memset(&frame[FRAME_SIZE], 0, sizeof(filling->data[0]) - FRAME_SIZE);
+  skip_frame(&produced, frame);
+  if (filling->frames == BATCH_FRAMES)
+    pipeline_submit();
+}
+
+void pipeline_end(void)
+{
+  pipeline_submit();
+  // The writer stops at the first end it sees, which is from the worker that would have had the next batch
+  for (int i = 0; i < workers; i++)
+    queue_push(&work_queues[(next_worker + i) % workers], &end_of_trace);
+}
+
+void pipeline_packet(u_char *user, const struct pcap_pkthdr *hdr, const u_char *packet)
+{
+  pipeline_frame(packet, hdr->caplen);
+}
+
+void *live_producer(void *arg)
+{
+  pcap_t *descr = arg;
+  while (!stop_capture) {
+    if (pcap_dispatch(descr, -1, pipeline_packet, NULL) < 0)
+      break;
+    // Don't sit on a part-filled batch when the wire goes quiet
+    pipeline_submit();
+  }
+  pipeline_end();
+  return NULL;
+}
+
+void *capture_file_producer(void *arg)
+{
+  for (unsigned long long frame = 0; frame < capture_count; frame++) {
+    struct capture_slot *s = capture_frame_slot(frame);
+    pipeline_frame(s->data, s->caplen);
+  }
+  pipeline_end();
+  return NULL;
+}
+
+void *decode_worker(void *arg)
+{
+  int worker = (int)(long)arg;
+  while (1) {
+    struct trace_batch *b = queue_pop(&work_queues[worker]);
+    if (b != &end_of_trace) {
+      struct trace_state state = b->state;
+      b->out_len = 0;
+      for (int f = 0; f < b->frames; f++) {
+        for (int offset = FIRST_RECORD; offset + RECORD_KNOWN_BYTES <= FRAME_SIZE; offset += 8) {
+          const unsigned char *r = &b->data[f][offset];
+          if (is_raster_marker(r))
+            continue;
+          if (b->out_len + 4 + 8192 > b->out_size) {
+            b->out_size = b->out_size * 2 + 65536;
+            b->out = realloc(b->out, b->out_size);
+            if (!b->out) {
+              perror("realloc");
+              exit(-1);
+            }
+          }
+          memcpy(&b->out[b->out_len], "    ", 4);
+          b->out_len += 4;
+          b->out_len += format_instruction(&state, r, offset + 8 <= FRAME_SIZE, &b->out[b->out_len], 8192);
+        }
+      }
+    }
+    queue_push(&done_queues[worker], b);
+    if (b == &end_of_trace)
+      return NULL;
+  }
+}
+
+// Decode everything the producer supplies, using the given number of worker threads, writing it out in order
+int run_pipeline(void *(*producer)(void *), void *arg, int threads)
+{
+  workers = threads;
+  if (workers > MAX_WORKERS)
+    workers = MAX_WORKERS;
+
+  for (int i = 0; i < workers * BATCHES_PER_WORKER; i++)
+    queue_push(&free_batches, calloc(1, sizeof(struct trace_batch)));
+
+  pthread_t thread;
+  for (long i = 0; i < workers; i++) {
+    if (pthread_create(&thread, NULL, decode_worker, (void *)i)) {
+      perror("pthread_create");
+      exit(-1);
+    }
+    pthread_detach(thread);
+  }
+  pthread_t producer_thread;
+  if (pthread_create(&producer_thread, NULL, producer, arg)) {
+    perror("pthread_create");
+    exit(-1);
+  }
+
+  // Write the output in big pieces (main() gave stdout a big buffer), and only flush it when there is
+  // nothing more to write just now
+  for (int worker = 0;; worker = (worker + 1) % workers) {
+    struct trace_batch *b = queue_pop(&done_queues[worker]);
+    if (b == &end_of_trace)
+      break;
+    fwrite(b->out, b->out_len, 1, stdout);
+    queue_push(&free_batches, b);
+    if (queue_empty(&done_queues[(worker + 1) % workers]))
+      fflush(stdout);
+  }
+  fflush(stdout);
+  pthread_join(producer_thread, NULL);
+  return 0;
+}
+
+// Matching, break and single frame display depend on everything before them, so need one record at a time.
+// Profiling does too, but is quick.
+int can_decode_in_parallel(int threads)
+{
+  return threads > 1 && !match_string && !wait_for_break && !one_frame && !instruction_frequency && !profile
+      && !trigger_expression && num_instructions == ALL_INSTRUCTIONS;
+}
+
+int decode_capture_file(char *filename, int threads)
+{
+  open_capture_file(filename);
+  atexit(report_capture_drops);
+
+  if (can_decode_in_parallel(threads))
+    return run_pipeline(capture_file_producer, NULL, threads);
+
+  for (unsigned long long frame = 0; frame < capture_count; frame++) {
+    struct capture_slot *s = capture_frame_slot(frame);
+    process_packet(s->data, s->caplen);
+  }
+  return 0;
+}
+
+int usage(void)
+{
+  fprintf(stderr, "usage: ethermon [-F] [-j threads] [-n num instructions] [-m match string] <network interface> [.list, "
+                  ".map or other supported memory annotation files]\n");
+  fprintf(stderr, "       ethermon -p [-r <capture file> | <network interface>] [symbol or map files]\n");
+  fprintf(stderr, "       ethermon -t <trigger> [-B before] [-A after] [-c count] [-r <capture file> | <network interface>] "
+                  "[annotation files]\n");
+  fprintf(stderr, "       ethermon -w <capture file> [-s size in MB] <network interface>\n");
+  fprintf(stderr, "       ethermon -r <capture file> [-j threads] [-F] [-n num instructions] [-m match string] [annotation "
+                  "files]\n");
+  fprintf(stderr, "If -m is specified, then no instructions are displayed until <match string> appears in the output.\n");
+  fprintf(stderr, "If -F is specified, the instruction stream is collected for a single frame of video display.\n");
+  fprintf(stderr, "Without -m, -n, -F, -b or -f, instructions are decoded by -j threads (default: one per CPU).\n");
+  fprintf(stderr, "If -p is specified, instructions are counted by routine and raster line, and the profile shown at the "
+                  "end.\n");
+  fprintf(stderr, "If -t is specified, only the instructions around those matching <trigger> are shown: -B before (default "
+                  "16) and -A after (default 16),\n"
+                  "for the first -c matches. A trigger is made of pc=, op=, io= and raster= terms, and d031, combined with\n"
+                  "&&, || and !, e.g. \"pc=$1000-$10ff && op=jsr,$60\" or \"io=$d020 || raster=$100{3}\", where X{N} is true "
+                  "each time X is true, from the Nth time on.\nNumbers are decimal unless they start with $ or 0x. -t cannot be "
+                  "combined with -m, -n, -p, -f, -F or -b.\n");
+  fprintf(stderr, "If -w is specified, raw frames are written to a ring in <capture file> (1024MB unless -s is given), to be "
+                  "decoded later with -r.\n");
+  exit(-3);
+}
+
+int main(int argc, char **argv)
+{
+  char *dev = NULL;
+  char errbuf[PCAP_ERRBUF_SIZE];
+  pcap_t *descr;
+  //    struct bpf_program fp;        /* to hold compiled program */
+  bpf_u_int32 pMask; /* subnet mask */
+  bpf_u_int32 pNet;  /* ip address*/
+  pcap_if_t *alldevs;
+
+  char *capture_file = NULL;
+  char *replay_file = NULL;
+  int capture_size_mb = 1024;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int instruction_limit = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "A:B:bc:fFj:m:n:pr:s:t:w:")) != -1) {
+    switch (opt) {
+    case 'f':
+      instruction_frequency = 1;
+      num_instructions = 0;
+      break;
+    case 'b':
+      wait_for_break = 1;
+      break;
+    case 'F':
+      one_frame = 1;
+      break;
+    case 'm':
+      match_string = optarg;
+      num_instructions = 0;
+      break;
+    case 'n':
+      num_instructions = atoi(optarg);
+      instruction_limit = 1;
+      if (match_string) {
+        fprintf(stderr, "ERROR: -n and -m cannot be combined.\n");
+        exit(-1);
+      }
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'p':
+      profile = 1;
+      break;
+    case 't':
+      trigger_expression = optarg;
+      break;
+    case 'A':
+      trigger_after = atoi(optarg);
+      break;
+    case 'B':
+      trigger_before = atoi(optarg);
+      break;
+    case 'c':
+      trigger_limit = atoi(optarg);
+      break;
+    case 'r':
+      replay_file = optarg;
+      break;
+    case 's':
+      capture_size_mb = atoi(optarg);
+      break;
+    case 'w':
+      capture_file = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if (replay_file && capture_file)
+    usage();
+  if (trigger_expression && (match_string || profile || instruction_frequency || instruction_limit || one_frame
+                                || wait_for_break)) {
+    fprintf(stderr, "ERROR: -t cannot be combined with -m, -n, -p, -f, -F or -b.\n");
+    exit(-1);
+  }
+
+  if (replay_file) {
+    // No interface when decoding a capture file, just annotation files
+    optind--;
+  }
+  else {
+    if (optind >= argc)
+      usage();
+
+    if (argv[optind])
+      dev = argv[optind];
+    else {
+      fprintf(stderr, "You must specify the interface to listen on.\n");
+      exit(-1);
+    }
+  }
+
+  if (capture_file)
+    return capture_to_file(dev, capture_file, capture_size_mb);
+
+  // The decode pipeline writes its output in big pieces.  stdout can only be given a buffer for them
+  // before anything is written to it.
+  static char output_buffer[1 << 20];
+  if (can_decode_in_parallel(threads))
+    setvbuf(stdout, output_buffer, _IOFBF, sizeof(output_buffer));
+
+  for (int i = optind + 1; i < argc; i++) {
+    if (profile)
+      read_symbol_file(argv[i]);
+    else
+      read_annotation_file(argv[i]);
+  }
+  if (profile)
+    index_symbols();
 
   int i;
   for (i = 0; oplist[i]; i++) {
@@ -589,6 +2163,18 @@ int main(int argc, char **argv)
     }
   }
 
+  if (trigger_expression)
+    compile_trigger(trigger_expression);
+
+  if (replay_file) {
+    decode_capture_file(replay_file, threads);
+    if (instruction_frequency)
+      report_instruction_frequencies();
+    if (profile)
+      report_profile();
+    return 0;
+  }
+
   // Prepare a list of all the devices
   if (pcap_findalldevs(&alldevs, errbuf) == -1) {
     fprintf(stderr, "Error in pcap_findalldevs: %s\n", errbuf);
@@ -607,60 +2193,43 @@ int main(int argc, char **argv)
 
   // Now, open device for sniffing with big snaplen and
   // promiscuous mode enabled.
-  descr = pcap_open_live(dev, 8192, 1, 10, errbuf);
-  if (descr == NULL) {
-    printf("pcap_open_live() failed due to [%s]\n", errbuf);
+  descr = open_trace_device(dev);
+  if (descr == NULL)
     return -1;
-  }
 
   printf("Started.\n");
   fflush(stdout);
 
-  int bit52set = 0;
+  if (can_decode_in_parallel(threads)) {
+    // Stop cleanly on CTRL-C, so that everything captured gets written out
+    capture_descr = descr;
+    signal(SIGINT, stop_capture_signal);
+    signal(SIGTERM, stop_capture_signal);
+    run_pipeline(live_producer, descr, threads);
+    struct pcap_stat ps;
+    if (pcap_stats(descr, &ps) == 0)
+      fprintf(stderr, "%u frames were dropped by the kernel.\n", ps.ps_drop + ps.ps_ifdrop);
+    return 0;
+  }
 
-  while (1) {
+  if (profile) {
+    // Profile until CTRL-C
+    signal(SIGINT, stop_capture_signal);
+    signal(SIGTERM, stop_capture_signal);
+    fprintf(stderr, "Profiling. Press CTRL-C to stop and show the profile.\n");
+  }
 
+  while (!stop_capture) {
     struct pcap_pkthdr hdr;
     hdr.caplen = 0;
     const unsigned char *packet = pcap_next(descr, &hdr);
     if (packet) {
-      if (hdr.caplen == 2132) {
-        bit52set = 0;
-        for (int offset = 0x48 + 14; (offset + 6) < hdr.caplen; offset += 8) {
-          if (packet[offset + 6] & 0x10) {
-#if 0
-	      printf(">>> Bit52 set at offset $%X+6\n",offset-14);
-	      for(int j=0;j<8;j++) printf(" %02X",packet[offset+j]);
-	      printf("\n");
-#endif
-            bit52set = 1;
-            break;
-          }
-        }
-        // For now only support instruction decode
-        if (1 || bit52set) {
-          for (int offset = 0x48 + 14; offset < hdr.caplen; offset += 8) {
-            if (instruction_frequency) {
-              if ((packet[offset + 0] & packet[offset + 1] & packet[offset + 2]) != 0xff) {
-                instruction_counts[packet[offset + 2]]++;
-                num_instructions++;
-                if (!(num_instructions & 0xffff)) {
-                  report_instruction_frequencies();
-                }
-              }
-            }
-            else
-              decode_instruction(&packet[offset]);
-          }
-        }
-        else {
-          for (int offset = 0x48 + 14; offset < hdr.caplen; offset += 8) {
-            decode_busaccess(&packet[offset]);
-          }
-        }
-      }
+      // probably a MEGA65 instruction trace frame.
+      process_packet(packet, hdr.caplen);
     }
   }
+  if (profile)
+    report_profile();
   printf("Exiting.\n");
 
   return 0;
@@ -1,16 +1,32 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+
+#include "hyppotrace.h"
 
 int do_screen_shot_ascii(FILE *f);
 int do_screen_shot(char *filename);
 void get_video_state(void);
+extern int frame_cells, frame_cells_drawn;
+bool expect_screen_matches(char *filename);
+bool expect_screen_text(char *text, int row, int column);
 
 #define MEM_WRITE16(CPU, ADDR, VALUE)                                                                                       \
   if (write_mem28(CPU, addr_to_28bit(CPU, ADDR, 1), VALUE)) {                                                               \
@@ -75,12 +91,35 @@ struct termination_conditions {
 
 struct cpu {
   unsigned int instruction_count;
+  unsigned long long cycles;
   struct regs regs;
   struct termination_conditions term;
   bool stack_overflow;
   bool stack_underflow;
+
+  // Set by a write to a hypervisor register, to 1 + the trap number or HYPERVISOR_RETURN.
+  // The trap or return happens once the instruction completes.
+  int hypervisor_request;
+
+  // 16-bit to 28-bit address translation for each 4KB page, as computed by
+  // addr_to_28bit_uncached().  Valid while map_generation matches memory_map_generation.
+  unsigned int map_generation;
+  unsigned int read_map[16];
+  unsigned int write_map[16];
 };
 
+#define HYPERVISOR_RETURN -1
+
+// Bumped whenever something that affects address translation changes ($00/$01, $D030),
+// or by cpu_map_changed() when the MAP registers of a CPU change.  Starts at 1, so that
+// a zeroed struct cpu always rebuilds its translation table on first use.
+unsigned int memory_map_generation = 1;
+
+void cpu_map_changed(struct cpu *cpu)
+{
+  cpu->map_generation = 0;
+}
+
 #define FLAG_N 0x80
 #define FLAG_V 0x40
 #define FLAG_E 0x20
@@ -93,11 +132,13 @@ struct cpu {
 // By default we log to stderr
 FILE *logfile = NULL;
 char logfilename[8192] = "";
-#define TESTLOGFILE "/tmp/hyppotest.tmp"
+// Per-process, so that parallel test workers don't clobber one another's logs
+char testlogfile[1024] = "/tmp/hyppotest.tmp";
 
 bool fail_on_stack_overflow = true;
 bool fail_on_stack_underflow = true;
 bool log_on_failure = false;
+bool expect_test_failure = false; // "expect failure": the test passes only if something in it fails
 int test_passes = 0;
 int test_fails = 0;
 char test_name[1024] = "unnamed test";
@@ -127,6 +168,31 @@ unsigned int hypporam_blame[HYPPORAM_SIZE];
 unsigned int colourram_blame[COLOURRAM_SIZE];
 unsigned int ffdram_blame[65536];
 
+// Pages (256 bytes) whose current contents may differ from the expected contents.
+// A clean page is known to match, so comparing and stashing RAM only has to look at
+// dirty pages.  Anything that changes either copy of a page must mark it dirty.
+#define PAGE_SHIFT 8
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+unsigned char chipram_dirty[CHIPRAM_SIZE >> PAGE_SHIFT];
+unsigned char hypporam_dirty[HYPPORAM_SIZE >> PAGE_SHIFT];
+unsigned char colourram_dirty[COLOURRAM_SIZE >> PAGE_SHIFT];
+unsigned char ffdram_dirty[65536 >> PAGE_SHIFT];
+
+void mark_all_pages_dirty(void)
+{
+  memset(chipram_dirty, 1, sizeof(chipram_dirty));
+  memset(hypporam_dirty, 1, sizeof(hypporam_dirty));
+  memset(colourram_dirty, 1, sizeof(colourram_dirty));
+  memset(ffdram_dirty, 1, sizeof(ffdram_dirty));
+}
+
+// Pages that may have changed since the machine was last saved to or restored from a snapshot
+// (see snapshot_base), beyond those that are still dirty: a dirty page that is cleaned again has
+// been changed all the same.  Only these pages need copying to save or restore it again.
+unsigned char chipram_touched[CHIPRAM_SIZE >> PAGE_SHIFT];
+unsigned char hypporam_touched[HYPPORAM_SIZE >> PAGE_SHIFT];
+unsigned char colourram_touched[COLOURRAM_SIZE >> PAGE_SHIFT];
+
 #define MAX_HYPPO_SYMBOLS HYPPORAM_SIZE
 typedef struct hyppo_symbol {
   char *name;
@@ -161,13 +227,98 @@ typedef struct instruction_log {
   unsigned char pops;
   unsigned int pop_blame[MAX_POPS];
 } instruction_log;
+
+// The log lives in one contiguous arena instead of one malloc() per instruction.
+// By default it is a ring that keeps only the most recent CPULOG_RING_LENGTH
+// instructions, which is plenty for the "instructions leading up to ..." reports.
+// "log history full" keeps every instruction (up to MAX_LOG_LENGTH) for tests
+// that want complete blame information.  Both sizes must be powers of two.
+// Instruction numbers (as used in the blame arrays) are absolute, so use
+// cpulog_entry() to look one up: it returns NULL once it has been overwritten.
 #define MAX_LOG_LENGTH (32 * 1024 * 1024)
-instruction_log *cpulog[MAX_LOG_LENGTH];
+#define CPULOG_RING_LENGTH (1024 * 1024)
+instruction_log *cpulog_arena = NULL;
+unsigned int cpulog_capacity = 0;  // entries retained (ring size, or MAX_LOG_LENGTH)
+unsigned int cpulog_allocated = 0; // entries currently allocated in the arena
+int cpulog_first = 0; // lowest instruction number recorded since the last reset
 int cpulog_len = 0;
 
+// Instruction throughput accounting
+unsigned long long instructions_executed = 0;
+unsigned long long test_instructions_start = 0;
+struct timespec test_time_start;
+double total_execution_seconds = 0;
+
 #define INFINITE_LOOP_THRESHOLD 65536
+unsigned int infinite_loop_threshold = INFINITE_LOOP_THRESHOLD;
+
+// Most recent distinct CPU state seen at each PC, used for infinite loop detection.
+// The state is copied out of the log, so that loop detection keeps working once
+// the logged instruction has been overwritten in the ring.
+// Entries are only valid for the epoch in which they were recorded, so that clearing
+// the log doesn't have to touch the whole table.
+// The hash of the registers and instruction lets most changes of state be seen without
+// comparing whole log entries.
+typedef struct loop_state {
+  unsigned int epoch;
+  unsigned int hash;
+  int instruction; // log entry whose repeat count is shown in the instruction log
+  instruction_log log;
+} loop_state;
+loop_state lastataddr[65536];
+unsigned int lastataddr_epoch = 1;
+
+// Opcode handlers
+// Each implemented opcode has its own handler, named after the opcode byte.  They
+// return false if the instruction could not be executed.  opcode_handlers[] is
+// built from IMPLEMENTED_OPCODES at compile time.
+typedef bool (*opcode_handler)(struct cpu *cpu, struct instruction_log *log);
+extern const opcode_handler opcode_handlers[256];
+
+// Decoded instruction cache
+// Saves translating and reading each of the 6 bytes fetched for every instruction,
+// and looking up the opcode's handler.  The operand bytes are kept as they are, as
+// every addressing mode combines them with registers or memory as it executes.
+// Entries are keyed by the 28-bit address of the opcode (direct mapped), and are
+// invalidated by writes to any of the 6 bytes they cover.  Only chip RAM and
+// hypervisor RAM are cached, since all writes there go through write_mem28(), or
+// invalidate the cache themselves.
+#define DECODE_CACHE_SIZE 65536
+#define DECODE_CACHE_INVALID 0xffffffff
+typedef struct decoded_instruction {
+  unsigned int addr;
+  unsigned char bytes[6];
+  opcode_handler handler;
+} decoded_instruction;
+decoded_instruction decode_cache[DECODE_CACHE_SIZE];
+
+void decode_cache_flush(void)
+{
+  memset(decode_cache, 0xff, sizeof(decode_cache));
+}
+
+void decode_cache_invalidate(unsigned int addr)
+{
+  for (unsigned int i = 0; i < 6; i++) {
+    decoded_instruction *d = &decode_cache[(addr - i) & (DECODE_CACHE_SIZE - 1)];
+    if (d->addr == addr - i)
+      d->addr = DECODE_CACHE_INVALID;
+  }
+}
 
-instruction_log *lastataddr[65536] = { NULL };
+// Invalidate any cached instruction overlapping addr .. addr + count - 1
+void decode_cache_invalidate_range(unsigned int addr, unsigned int count)
+{
+  if (count + 5 >= DECODE_CACHE_SIZE) {
+    decode_cache_flush();
+    return;
+  }
+  for (unsigned int a = addr - 5; a != addr + count; a++) {
+    decoded_instruction *d = &decode_cache[a & (DECODE_CACHE_SIZE - 1)];
+    if (d->addr != DECODE_CACHE_INVALID && d->addr + 5 >= addr && d->addr < addr + count)
+      d->addr = DECODE_CACHE_INVALID;
+  }
+}
 
 char *describe_address(unsigned int addr);
 char *describe_address_label(struct cpu *cpu, unsigned int addr);
@@ -176,6 +327,608 @@ unsigned int addr_to_28bit(struct cpu *cpu, unsigned int addr, int writeP);
 void disassemble_instruction(FILE *f, struct instruction_log *log);
 int write_mem28(struct cpu *cpu, unsigned int addr, unsigned char value);
 unsigned int memory_blame(struct cpu *cpu, unsigned int addr16);
+void symbol_tables_reset(void);
+extern double emulated_seconds;
+
+// Binary instruction trace (see hyppotrace.h), streamed through a buffer as the CPU runs
+#define TRACE_BUFFER_SIZE 65536
+typedef struct trace_code {
+  unsigned int pc28;
+  unsigned char len;
+  unsigned char bytes[6];
+} trace_code;
+
+typedef struct trace_writer {
+  FILE *f;
+  char *filename;
+  unsigned char buffer[TRACE_BUFFER_SIZE];
+  unsigned int len;
+  unsigned long long bytes;
+  unsigned long long instructions;
+  unsigned long long writes;
+  // State that the next records are encoded relative to
+  struct regs regs;
+  unsigned int pc_next;
+  int bank;
+  unsigned int write_addr;
+  int instruction;
+  trace_code code[65536]; // instruction last recorded at each PC
+} trace_writer;
+trace_writer *trace = NULL;
+
+void trace_flush(void)
+{
+  if (trace->len && fwrite(trace->buffer, trace->len, 1, trace->f) != 1)
+    fprintf(logfile, "ERROR: Could not write to trace file '%s'\n", trace->filename);
+  trace->bytes += trace->len;
+  trace->len = 0;
+}
+
+// Make room for a record of up to n bytes
+static inline void trace_reserve(unsigned int n)
+{
+  if (trace->len + n > TRACE_BUFFER_SIZE)
+    trace_flush();
+}
+
+static inline void trace_byte(unsigned char b)
+{
+  trace->buffer[trace->len++] = b;
+}
+
+static inline void trace_varint(unsigned int v)
+{
+  while (v >= 0x80) {
+    trace_byte(v | 0x80);
+    v >>= 7;
+  }
+  trace_byte(v);
+}
+
+static inline void trace_svarint(int v)
+{
+  trace_varint(((unsigned int)v << 1) ^ (unsigned int)(v >> 31));
+}
+
+void trace_reset(int first)
+{
+  trace_reserve(8);
+  trace_byte(TRACE_RESET);
+  trace_varint(first);
+  bzero(&trace->regs, sizeof(trace->regs));
+  trace->pc_next = 0;
+  trace->bank = 0;
+  trace->write_addr = 0;
+  trace->instruction = first;
+  bzero(trace->code, sizeof(trace->code));
+}
+
+void trace_note(const char *text)
+{
+  unsigned int len = strlen(text);
+  trace_reserve(8);
+  trace_byte(TRACE_NOTE);
+  trace_varint(len);
+  trace_flush();
+  if (len && fwrite(text, len, 1, trace->f) != 1)
+    fprintf(logfile, "ERROR: Could not write to trace file '%s'\n", trace->filename);
+  trace->bytes += len;
+}
+
+// Record an instruction from the log, whose PC was at pc28 in the 28-bit address space
+void trace_instruction(instruction_log *log, unsigned int pc28)
+{
+  const struct regs *r = &log->regs, *last = &trace->regs;
+  unsigned char mask = 0, ext = 0;
+  int bank = pc28 - log->pc;
+
+  if (log->pc != trace->pc_next)
+    mask |= TRACE_PC;
+  if (r->a != last->a)
+    mask |= TRACE_A;
+  if (r->x != last->x)
+    mask |= TRACE_X;
+  if (r->y != last->y)
+    mask |= TRACE_Y;
+  if (r->flags != last->flags)
+    mask |= TRACE_FLAGS;
+  if (r->sp != last->sp)
+    mask |= TRACE_SP;
+  if (r->z != last->z)
+    ext |= TRACE_EXT_Z;
+  if (r->b != last->b)
+    ext |= TRACE_EXT_B;
+  if (r->maplo != last->maplo || r->maphi != last->maphi || r->maplomb != last->maplomb || r->maphimb != last->maphimb)
+    ext |= TRACE_EXT_MAP;
+  if (r->in_hyper != last->in_hyper || r->map_irq_inhibit != last->map_irq_inhibit)
+    ext |= TRACE_EXT_MODE;
+  if (bank != trace->bank)
+    ext |= TRACE_EXT_BANK;
+  if (ext)
+    mask |= TRACE_EXT;
+
+  trace_reserve(32);
+  trace_byte(mask);
+  if (mask & TRACE_PC) {
+    trace_byte(log->pc);
+    trace_byte(log->pc >> 8);
+  }
+  if (mask & TRACE_A)
+    trace_byte(r->a);
+  if (mask & TRACE_X)
+    trace_byte(r->x);
+  if (mask & TRACE_Y)
+    trace_byte(r->y);
+  if (mask & TRACE_FLAGS)
+    trace_byte(r->flags);
+  if (mask & TRACE_SP) {
+    trace_byte(r->spl);
+    trace_byte(r->sph);
+  }
+  if (ext) {
+    trace_byte(ext);
+    if (ext & TRACE_EXT_Z)
+      trace_byte(r->z);
+    if (ext & TRACE_EXT_B)
+      trace_byte(r->b);
+    if (ext & TRACE_EXT_MAP) {
+      trace_byte(r->maplo);
+      trace_byte(r->maplo >> 8);
+      trace_byte(r->maphi);
+      trace_byte(r->maphi >> 8);
+      trace_byte(r->maplomb);
+      trace_byte(r->maphimb);
+    }
+    if (ext & TRACE_EXT_MODE)
+      trace_byte((r->in_hyper ? 1 : 0) | (r->map_irq_inhibit ? 2 : 0));
+    if (ext & TRACE_EXT_BANK)
+      trace_svarint(bank);
+  }
+  trace_code *code = &trace->code[log->pc & 0xffff];
+  if (!log->len || (code->len && code->pc28 == pc28 && code->len == log->len && !memcmp(code->bytes, log->bytes, log->len)))
+    trace_byte(0);
+  else {
+    trace_byte(log->len);
+    for (int i = 0; i < log->len; i++)
+      trace_byte(log->bytes[i]);
+    code->pc28 = pc28;
+    code->len = log->len;
+    memcpy(code->bytes, log->bytes, sizeof(code->bytes));
+  }
+
+  trace->regs = *r;
+  trace->pc_next = (log->pc + log->len) & 0xffff;
+  trace->bank = bank;
+  trace->instruction++;
+  trace->instructions++;
+}
+
+// Record a write to memory, made by instruction number blame
+void trace_write(unsigned int addr, unsigned char value, int blame)
+{
+  trace_reserve(16);
+  trace_byte(TRACE_WRITE);
+  trace_svarint(addr - trace->write_addr);
+  trace_byte(value);
+  trace_varint(blame < trace->instruction ? trace->instruction - blame : 0);
+  trace->write_addr = addr;
+  trace->writes++;
+}
+
+void trace_symbol(unsigned int addr, const char *name)
+{
+  unsigned int len = strlen(name);
+  if (len > 255)
+    len = 255;
+  trace_reserve(8 + len);
+  trace_byte(TRACE_SYMBOL);
+  trace_varint(addr);
+  trace_byte(len);
+  memcpy(&trace->buffer[trace->len], name, len);
+  trace->len += len;
+}
+
+void trace_close(void);
+
+bool trace_open(const char *filename)
+{
+  if (trace)
+    trace_close();
+  FILE *f = fopen(filename, "wb");
+  if (!f) {
+    fprintf(logfile, "ERROR: Could not write trace to '%s'\n", filename);
+    return false;
+  }
+  trace = calloc(1, sizeof(trace_writer));
+  trace->f = f;
+  trace->filename = strdup(filename);
+  memcpy(trace->buffer, HYPPOTRACE_MAGIC, 8);
+  trace->len = 8;
+  trace_reset(cpulog_len);
+  trace_note(test_name);
+  return true;
+}
+
+void trace_close(void)
+{
+  // The symbols are written last, so that those defined while tracing are included.
+  // Hypervisor symbols are for $8000-$BFFF, which is $FFF8000-$FFFBFFF when in the hypervisor.
+  for (int i = 0; i < hyppo_symbol_count; i++)
+    trace_symbol(hyppo_symbols[i].addr + 0xfff0000, hyppo_symbols[i].name);
+  for (int i = 0; i < symbol_count; i++)
+    trace_symbol(symbols[i].addr, symbols[i].name);
+  trace_reserve(1);
+  trace_byte(TRACE_END);
+  trace_flush();
+  fclose(trace->f);
+  fprintf(logfile, "INFO: Traced %llu instructions and %llu memory writes to '%s' (%llu bytes)\n", trace->instructions,
+      trace->writes, trace->filename, trace->bytes);
+  free(trace->filename);
+  free(trace);
+  trace = NULL;
+}
+
+// Emulated SD card controller at $D680, backed by a disk image ("sdcard <image>")
+typedef struct sdcard_state {
+  unsigned char *image; // NULL when no card is attached, and $D680-$D68F are plain registers
+  size_t sectors;
+  char *filename;
+  bool writable; // writes reach the image file, rather than a private copy of it
+
+  bool mapped; // sector buffer visible at $DE00-$DFFF
+  bool reset;
+  bool sdhc;
+  bool error;
+  bool fsm_error;
+  bool card1;
+  bool write_gate;
+  bool write_sector0_gate;
+  bool fill_mode;
+  double busy_until; // emulated seconds
+  unsigned int last_sector;
+
+  // Latency model, in seconds: a command takes its read or write latency, plus the seek latency
+  // when it isn't for the sector after the previous one
+  double read_latency;
+  double write_latency;
+  double seek_latency;
+
+  unsigned long long reads;
+  unsigned long long writes;
+  unsigned long long seeks;
+  double busy_seconds;
+} sdcard_state;
+
+sdcard_state sdcard;
+
+unsigned char sdcard_status(void)
+{
+  bool busy = emulated_seconds < sdcard.busy_until;
+  return (sdcard.card1 << 7) | (sdcard.error << 6) | (sdcard.fsm_error << 5) | (sdcard.sdhc << 4) | (sdcard.mapped << 3)
+       | (sdcard.reset << 2) | (busy << 1) | busy;
+}
+
+void sdcard_detach(void)
+{
+  if (sdcard.image) {
+    if (sdcard.writable)
+      msync(sdcard.image, sdcard.sectors * 512, MS_SYNC);
+    munmap(sdcard.image, sdcard.sectors * 512);
+    free(sdcard.filename);
+  }
+  bzero(&sdcard, sizeof(sdcard));
+}
+
+bool sdcard_attach(const char *filename, bool writable)
+{
+  struct stat st;
+  double latency[3] = { sdcard.read_latency, sdcard.write_latency, sdcard.seek_latency };
+
+  // A new card starts out as one just inserted, but keeps the latencies the test asked for
+  sdcard_detach();
+  sdcard.read_latency = latency[0];
+  sdcard.write_latency = latency[1];
+  sdcard.seek_latency = latency[2];
+  int fd = open(filename, writable ? O_RDWR : O_RDONLY);
+  if (fd < 0 || fstat(fd, &st)) {
+    fprintf(logfile, "ERROR: Could not open SD card image '%s'\n", filename);
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  if (st.st_size < 512) {
+    fprintf(logfile, "ERROR: SD card image '%s' is smaller than a sector\n", filename);
+    close(fd);
+    return false;
+  }
+  // Unless asked to, never change the image: writes go to a private copy of the pages they touch
+  size_t sectors = st.st_size / 512;
+  void *image = mmap(NULL, sectors * 512, PROT_READ | PROT_WRITE, writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    fprintf(logfile, "ERROR: Could not map SD card image '%s'\n", filename);
+    return false;
+  }
+  sdcard.image = image;
+  sdcard.sectors = sectors;
+  sdcard.filename = strdup(filename);
+  sdcard.writable = writable;
+  sdcard.sdhc = true;
+  sdcard.last_sector = -1;
+  return true;
+}
+
+// Start a sector transfer, and say how long it keeps the controller busy
+void sdcard_transfer(unsigned int sector, double latency, unsigned long long *count)
+{
+  if (sector != sdcard.last_sector + 1) {
+    latency += sdcard.seek_latency;
+    sdcard.seeks++;
+  }
+  (*count)++;
+  sdcard.last_sector = sector;
+  sdcard.busy_until = emulated_seconds + latency;
+  sdcard.busy_seconds += latency;
+}
+
+// The address in $D681-$D684, which is a sector number for SDHC cards, and a byte offset for older ones
+unsigned int sdcard_address(void)
+{
+  return ffdram[0x3681] | (ffdram[0x3682] << 8) | (ffdram[0x3683] << 16) | (ffdram[0x3684] << 24);
+}
+
+// The sector at an address, or false if it isn't the start of one
+bool sdcard_sector(unsigned int address, unsigned int *sector)
+{
+  if (sdcard.sdhc) {
+    *sector = address;
+    return true;
+  }
+  if (address & 511) {
+    fprintf(logfile, "NOTE: SD card byte address $%08x is not the start of a sector\n", address);
+    sdcard.error = true;
+    return false;
+  }
+  *sector = address / 512;
+  return true;
+}
+
+void sdcard_read_sector(struct cpu *cpu)
+{
+  unsigned int sector;
+
+  if (!sdcard_sector(sdcard_address(), &sector))
+    return;
+  if (sector >= sdcard.sectors) {
+    fprintf(logfile, "NOTE: SD card read of sector $%08x, beyond the end of the %zu sector image\n", sector,
+        sdcard.sectors);
+    sdcard.error = true;
+    return;
+  }
+  // The data lands in the SD card sector buffer at $FFD6E00, as if written by the controller.
+  memcpy(&ffdram[0x6e00], &sdcard.image[sector * 512ULL], 512);
+  for (int i = 0; i < 512; i++) {
+    ffdram_blame[0x6e00 + i] = cpu->instruction_count;
+    if (trace)
+      trace_write(0xffd6e00 + i, ffdram[0x6e00 + i], cpu->instruction_count);
+  }
+  ffdram_dirty[0x6e00 >> PAGE_SHIFT] = 1;
+  ffdram_dirty[0x6fff >> PAGE_SHIFT] = 1;
+  sdcard_transfer(sector, sdcard.read_latency, &sdcard.reads);
+}
+
+void sdcard_write_sector(struct cpu *cpu)
+{
+  unsigned int address = sdcard_address();
+  unsigned int sector;
+
+  // Address 0 is sector 0 in either addressing mode
+  if (!(address ? sdcard.write_gate : sdcard.write_sector0_gate)) {
+    fprintf(logfile, "NOTE: SD card write to address $%08x without opening the write gate\n", address);
+    sdcard.error = sdcard.fsm_error = true;
+    return;
+  }
+  sdcard.write_gate = sdcard.write_sector0_gate = false;
+  if (!sdcard_sector(address, &sector))
+    return;
+  if (sector >= sdcard.sectors) {
+    fprintf(logfile, "NOTE: SD card write to sector $%08x, beyond the end of the %zu sector image\n", sector,
+        sdcard.sectors);
+    sdcard.error = true;
+    return;
+  }
+  if (sdcard.fill_mode)
+    memset(&sdcard.image[sector * 512ULL], ffdram[0x3686], 512);
+  else
+    memcpy(&sdcard.image[sector * 512ULL], &ffdram[0x6e00], 512);
+  sdcard_transfer(sector, sdcard.write_latency, &sdcard.writes);
+}
+
+// A command written to $D680
+void sdcard_command(struct cpu *cpu, unsigned char command)
+{
+  bool busy = emulated_seconds < sdcard.busy_until;
+
+  switch (command) {
+  case 0x00: // Reset
+  case 0x10:
+    sdcard.reset = true;
+    sdcard.error = sdcard.fsm_error = false;
+    sdcard.busy_until = 0;
+    break;
+  case 0x01: // End reset
+  case 0x11:
+    sdcard.reset = false;
+    sdcard.error = sdcard.fsm_error = false;
+    break;
+  case 0x02: // Read sector
+    if (busy)
+      sdcard.error = sdcard.fsm_error = true;
+    else {
+      sdcard.error = sdcard.fsm_error = false;
+      sdcard_read_sector(cpu);
+    }
+    break;
+  case 0x03: // Write sector, and the first, middle and last sectors of a multi-sector write
+  case 0x04:
+  case 0x05:
+  case 0x06:
+    if (busy)
+      sdcard.error = sdcard.fsm_error = true;
+    else {
+      sdcard.error = sdcard.fsm_error = false;
+      sdcard_write_sector(cpu);
+    }
+    break;
+  case 0x0c: // Flush the card's write cache, and handshake debugging
+  case 0x0e:
+  case 0x0f:
+    break;
+  case 0x40: // Standard capacity (byte addressed) or SDHC (sector addressed) card
+  case 0x41:
+    sdcard.sdhc = command & 1;
+    break;
+  case 0x4d:
+    sdcard.write_sector0_gate = true;
+    break;
+  case 0x57:
+    sdcard.write_gate = true;
+    break;
+  case 0x81:
+  case 0x82:
+    sdcard.mapped = command == 0x81;
+    sdcard.error = sdcard.fsm_error = false;
+    break;
+  case 0x83:
+  case 0x84:
+    sdcard.fill_mode = command == 0x83;
+    break;
+  case 0xc0:
+  case 0xc1:
+    sdcard.card1 = command & 1;
+    break;
+  default:
+    sdcard.error = true;
+    break;
+  }
+  ffdram[0x3680] = sdcard_status();
+}
+
+// Where an access to $FFD3E00-$FFD3FFF ($DE00-$DFFF) goes while the sector buffer is mapped there:
+// the SD card buffer at $FFD6E00, or the F011 one at $FFD6C00, as selected by $D689 bit 7.
+// Colour RAM at $DC00 hides the sector buffer.
+static inline unsigned int sdcard_buffer_address(unsigned int addr)
+{
+  if (sdcard.mapped && addr >= 0xffd3e00 && addr < 0xffd4000 && !(ffdram[0x3030] & 1))
+    return ((ffdram[0x3689] & 0x80) ? 0xffd6e00 : 0xffd6c00) + (addr & 0x1ff);
+  return addr;
+}
+
+void report_sdcard(FILE *f)
+{
+  fprintf(f, "INFO: SD card '%s': %llu sectors read, %llu written, %llu not after the previous one\n", sdcard.filename,
+      sdcard.reads, sdcard.writes, sdcard.seeks);
+  if (emulated_seconds > 0)
+    fprintf(f, "INFO: SD card was busy for %.6f of %.6f emulated seconds (%.0f sectors/second)\n", sdcard.busy_seconds,
+        emulated_seconds, (sdcard.reads + sdcard.writes) / emulated_seconds);
+}
+
+instruction_log *cpulog_entry(int instruction)
+{
+  if (instruction < cpulog_first || instruction >= cpulog_len)
+    return NULL;
+  if ((unsigned int)(cpulog_len - instruction) > cpulog_capacity)
+    return NULL;
+  return &cpulog_arena[instruction & (cpulog_capacity - 1)];
+}
+
+// Oldest instruction number still present in the log
+int cpulog_oldest(void)
+{
+  if ((unsigned int)(cpulog_len - cpulog_first) > cpulog_capacity)
+    return cpulog_len - cpulog_capacity;
+  return cpulog_first;
+}
+
+void cpulog_set_capacity(unsigned int capacity);
+
+instruction_log *cpulog_append(void)
+{
+  if (!cpulog_capacity)
+    cpulog_set_capacity(CPULOG_RING_LENGTH);
+  if ((unsigned int)cpulog_len >= cpulog_allocated && cpulog_allocated < cpulog_capacity) {
+    // Full history mode: grow the arena geometrically
+    unsigned int new_size = cpulog_allocated ? cpulog_allocated * 2 : CPULOG_RING_LENGTH;
+    if (new_size > cpulog_capacity)
+      new_size = cpulog_capacity;
+    instruction_log *n = realloc(cpulog_arena, new_size * sizeof(instruction_log));
+    if (!n) {
+      fprintf(stderr, "ERROR: Could not grow instruction log to %u entries\n", new_size);
+      exit(-2);
+    }
+    cpulog_arena = n;
+    cpulog_allocated = new_size;
+  }
+  instruction_log *log = &cpulog_arena[cpulog_len & (cpulog_capacity - 1)];
+  bzero(log, sizeof(instruction_log));
+  cpulog_len++;
+  return log;
+}
+
+// Change how many instructions are retained, keeping those already in the log.
+// MAX_LOG_LENGTH means full history.
+void cpulog_set_capacity(unsigned int capacity)
+{
+  unsigned int size = capacity;
+
+  if (capacity == cpulog_capacity)
+    return;
+  if (capacity == MAX_LOG_LENGTH) {
+    // In full history mode instruction i lives at index i, so the arena must cover the whole log
+    size = CPULOG_RING_LENGTH;
+    while (size < (unsigned int)cpulog_len)
+      size *= 2;
+  }
+  instruction_log *arena = malloc(size * sizeof(instruction_log));
+  if (!arena) {
+    fprintf(stderr, "ERROR: Could not allocate instruction log of %u entries\n", size);
+    exit(-2);
+  }
+  if (cpulog_capacity) {
+    int first = cpulog_oldest();
+    if ((unsigned int)(cpulog_len - first) > capacity)
+      first = cpulog_len - capacity;
+    for (int i = first; i < cpulog_len; i++)
+      arena[i & (capacity - 1)] = cpulog_arena[i & (cpulog_capacity - 1)];
+    cpulog_first = first;
+  }
+  free(cpulog_arena);
+  cpulog_arena = arena;
+  cpulog_allocated = size;
+  cpulog_capacity = capacity;
+}
+
+void cpulog_clear(int first)
+{
+  if (!cpulog_capacity)
+    cpulog_set_capacity(CPULOG_RING_LENGTH);
+  cpulog_first = first;
+  cpulog_len = first;
+  lastataddr_epoch++;
+  if (trace)
+    trace_reset(first);
+}
+
+void disassemble_pusher(FILE *f, unsigned int instruction)
+{
+  instruction_log *pusher = cpulog_entry(instruction);
+  if (pusher) {
+    fprintf(f, "$%04X ", pusher->pc);
+    disassemble_instruction(f, pusher);
+  }
+  else
+    fprintf(f, "I%d <no longer in instruction log>", instruction);
+}
 
 int rel8_delta(unsigned char c)
 {
@@ -230,14 +983,14 @@ void disassemble_iabs(FILE *f, struct instruction_log *log)
   // historical memory mappings.
   if (memory_blame(&fakecpu, log->zp_pointer + 0)) {
     fprintf(f, "I%d: ", memory_blame(&fakecpu, log->zp_pointer + 0));
-    disassemble_instruction(f, cpulog[memory_blame(&fakecpu, log->zp_pointer + 0)]);
+    disassemble_instruction(f, cpulog_entry(memory_blame(&fakecpu, log->zp_pointer + 0)));
   }
   else
     fprintf(f, "<uninitialised memory>");
   fprintf(f, " and ");
   if (memory_blame(&fakecpu, log->zp_pointer + 1)) {
     fprintf(f, "I%d: ", memory_blame(&fakecpu, log->zp_pointer + 1));
-    disassemble_instruction(f, cpulog[memory_blame(&fakecpu, log->zp_pointer + 1)]);
+    disassemble_instruction(f, cpulog_entry(memory_blame(&fakecpu, log->zp_pointer + 1)));
   }
   else
     fprintf(f, "<uninitialised memory>");
@@ -303,8 +1056,7 @@ void disassemble_stack_source(FILE *f, struct instruction_log *log)
 {
   fprintf(f, "  {Pushed by ");
   if (log->pop_blame[0]) {
-    fprintf(f, "$%04X ", cpulog[log->pop_blame[0]]->pc);
-    disassemble_instruction(f, cpulog[log->pop_blame[0]]);
+    disassemble_pusher(f, log->pop_blame[0]);
   }
   else
     fprintf(f, "<unitialised stack location>");
@@ -314,6 +1066,10 @@ void disassemble_stack_source(FILE *f, struct instruction_log *log)
 void disassemble_instruction(FILE *f, struct instruction_log *log)
 {
 
+  if (!log) {
+    fprintf(f, "<no longer in instruction log>");
+    return;
+  }
   if (!log->len)
     return;
   switch (log->bytes[0]) {
@@ -652,22 +1408,19 @@ void disassemble_instruction(FILE *f, struct instruction_log *log)
     if (log->pop_blame[0] != log->pop_blame[1]) {
       fprintf(f, " two different instructions: ");
       if (log->pop_blame[0]) {
-        fprintf(f, "$%04X ", cpulog[log->pop_blame[0]]->pc);
-        disassemble_instruction(f, cpulog[log->pop_blame[0]]);
+        disassemble_pusher(f, log->pop_blame[0]);
       }
       else
         fprintf(f, "<unitialised stack location>");
       fprintf(f, " and ");
       if (log->pop_blame[1]) {
-        fprintf(f, "$%04X ", cpulog[log->pop_blame[1]]->pc);
-        disassemble_instruction(f, cpulog[log->pop_blame[1]]);
+        disassemble_pusher(f, log->pop_blame[1]);
       }
       else
         fprintf(f, "<unitialised stack location>");
     }
     else if (log->pop_blame[0]) {
-      fprintf(f, "$%04X ", cpulog[log->pop_blame[0]]->pc);
-      disassemble_instruction(f, cpulog[log->pop_blame[0]]);
+      disassemble_pusher(f, log->pop_blame[0]);
     }
     else
       fprintf(f, "<unitialised stack location>");
@@ -1233,7 +1986,18 @@ int show_recent_instructions(
       fprintf(f, "I0        -- Machine reset --\n");
       continue;
     }
-    if (cpulog[i]->dup && (i > first_instruction)) {
+    instruction_log *l = cpulog_entry(i);
+    if (!l) {
+      // Overwritten in the ring buffer: skip ahead to the oldest retained instruction
+      int oldest = cpulog_oldest();
+      if (oldest <= i)
+        break;
+      fprintf(f, " --- %d older instructions no longer in instruction log (use 'log history full') ---\n", oldest - i);
+      count -= oldest - i - 1;
+      i = oldest - 1;
+      continue;
+    }
+    if (l->dup && (i > first_instruction)) {
       if (!last_was_dup)
         fprintf(f, "                 ... duplicated instructions omitted ...\n");
       last_was_dup = 1;
@@ -1244,35 +2008,35 @@ int show_recent_instructions(
         fprintf(f, "I%-7d ", i);
       else
         fprintf(f, "     >>> ");
-      if (cpulog[i]->count > 1)
-        fprintf(f, "$%04X x%-6d : ", cpulog[i]->pc, cpulog[i]->count);
+      if (l->count > 1)
+        fprintf(f, "$%04X x%-6d : ", l->pc, l->count);
       else
-        fprintf(f, "$%04X         : ", cpulog[i]->pc);
-      fprintf(f, "A:%02X ", cpulog[i]->regs.a);
-      fprintf(f, "X:%02X ", cpulog[i]->regs.x);
-      fprintf(f, "Y:%02X ", cpulog[i]->regs.y);
-      fprintf(f, "Z:%02X ", cpulog[i]->regs.z);
-      fprintf(f, "SP:%02X%02X ", cpulog[i]->regs.sph, cpulog[i]->regs.spl);
-      fprintf(f, "B:%02X ", cpulog[i]->regs.b);
-      fprintf(f, "M:%04x+%02x/%04x+%02x ", cpulog[i]->regs.maplo, cpulog[i]->regs.maplomb, cpulog[i]->regs.maphi,
-          cpulog[i]->regs.maphimb);
-      fprintf(f, "%c%c%c%c%c%c%c%c ", cpulog[i]->regs.flags & FLAG_N ? 'N' : '.', cpulog[i]->regs.flags & FLAG_V ? 'V' : '.',
-          cpulog[i]->regs.flags & FLAG_E ? 'E' : '.', cpulog[i]->regs.flags & 0x10 ? 'B' : '.',
-          cpulog[i]->regs.flags & FLAG_D ? 'D' : '.', cpulog[i]->regs.flags & FLAG_I ? 'I' : '.',
-          cpulog[i]->regs.flags & FLAG_Z ? 'Z' : '.', cpulog[i]->regs.flags & FLAG_C ? 'C' : '.');
+        fprintf(f, "$%04X         : ", l->pc);
+      fprintf(f, "A:%02X ", l->regs.a);
+      fprintf(f, "X:%02X ", l->regs.x);
+      fprintf(f, "Y:%02X ", l->regs.y);
+      fprintf(f, "Z:%02X ", l->regs.z);
+      fprintf(f, "SP:%02X%02X ", l->regs.sph, l->regs.spl);
+      fprintf(f, "B:%02X ", l->regs.b);
+      fprintf(f, "M:%04x+%02x/%04x+%02x ", l->regs.maplo, l->regs.maplomb, l->regs.maphi,
+          l->regs.maphimb);
+      fprintf(f, "%c%c%c%c%c%c%c%c ", l->regs.flags & FLAG_N ? 'N' : '.', l->regs.flags & FLAG_V ? 'V' : '.',
+          l->regs.flags & FLAG_E ? 'E' : '.', l->regs.flags & 0x10 ? 'B' : '.',
+          l->regs.flags & FLAG_D ? 'D' : '.', l->regs.flags & FLAG_I ? 'I' : '.',
+          l->regs.flags & FLAG_Z ? 'Z' : '.', l->regs.flags & FLAG_C ? 'C' : '.');
       fprintf(f, " : ");
 
-      fprintf(f, "%32s : ", describe_address_label28(cpu, addr_to_28bit(cpu, cpulog[i]->regs.pc, 0)));
+      fprintf(f, "%32s : ", describe_address_label28(cpu, addr_to_28bit(cpu, l->regs.pc, 0)));
 
       for (int j = 0; j < 3; j++) {
-        if (j < cpulog[i]->len)
-          fprintf(f, "%02X ", cpulog[i]->bytes[j]);
+        if (j < l->len)
+          fprintf(f, "%02X ", l->bytes[j]);
         else
           fprintf(f, "   ");
       }
       fprintf(f, " : ");
       // XXX - Show instruction disassembly
-      disassemble_instruction(f, cpulog[i]);
+      disassemble_instruction(f, l);
       fprintf(f, "\n");
     }
   }
@@ -1280,17 +2044,33 @@ int show_recent_instructions(
   return 0;
 }
 
+// Compare everything except the repeat counts
 int identical_cpustates(struct instruction_log *a, struct instruction_log *b)
 {
-  unsigned int count = a->count;
-  a->count = b->count;
-  int r = memcmp(a, b, sizeof(struct instruction_log));
-  a->count = count;
+  const size_t count_start = offsetof(struct instruction_log, count);
+  const size_t count_end = count_start + sizeof(a->count);
 
-  if (r)
+  if (memcmp(a, b, count_start))
     return 0;
-  else
-    return 1;
+  if (memcmp((char *)a + count_end, (char *)b + count_end, sizeof(struct instruction_log) - count_end))
+    return 0;
+  return 1;
+}
+
+// Hash the registers (including MAP and flags) and instruction bytes of a log entry.
+// Identical states always have the same hash.  The PC is left out, as it is the same
+// for all of the states that are compared.
+unsigned int cpustate_hash(struct instruction_log *log)
+{
+  uint32_t w[5];
+
+  _Static_assert(sizeof(struct regs) - offsetof(struct regs, a) == 16, "cpustate_hash() needs updating");
+  memcpy(w, &log->regs.a, 16);
+  memcpy(&w[4], log->bytes, sizeof(w[4]));
+  // (The multiplies are independent, so this costs little more than one of them)
+  uint64_t h = (w[0] ^ ((uint64_t)w[1] << 32)) * 0x9e3779b97f4a7c15ULL
+             + (w[2] ^ ((uint64_t)w[3] << 32)) * 0xc2b2ae3d27d4eb4fULL + (w[4] ^ log->len) * 0x165667b19e3779f9ULL;
+  return h >> 32;
 }
 
 char addr_description[8192];
@@ -1372,20 +2152,31 @@ char *describe_address_label(struct cpu *cpu, unsigned int addr)
 
 void cpu_log_reset(void)
 {
-  for (int i = 0; i < cpulog_len; i++)
-    free(cpulog[i]);
-  cpulog_len = 1;
-  cpulog[0] = NULL;
+  // Instruction #0 is reserved to mean "machine reset" in the blame arrays
+  cpulog_clear(1);
 }
 
 void cpu_stash_ram(void)
 {
-  // Remember the RAM contents before calling a routine
-  bcopy(chipram, chipram_expected, CHIPRAM_SIZE);
-  bcopy(hypporam, hypporam_expected, HYPPORAM_SIZE);
+  // Remember the RAM contents before calling a routine.
+  // Only dirty pages can differ from what we already have.
+  for (int page = 0; page < (CHIPRAM_SIZE >> PAGE_SHIFT); page++) {
+    if (chipram_dirty[page]) {
+      bcopy(&chipram[page << PAGE_SHIFT], &chipram_expected[page << PAGE_SHIFT], PAGE_SIZE);
+      chipram_touched[page] = 1;
+      chipram_dirty[page] = 0;
+    }
+  }
+  for (int page = 0; page < (HYPPORAM_SIZE >> PAGE_SHIFT); page++) {
+    if (hypporam_dirty[page]) {
+      bcopy(&hypporam[page << PAGE_SHIFT], &hypporam_expected[page << PAGE_SHIFT], PAGE_SIZE);
+      hypporam_touched[page] = 1;
+      hypporam_dirty[page] = 0;
+    }
+  }
 }
 
-unsigned int addr_to_28bit(struct cpu *cpu, unsigned int addr, int writeP)
+unsigned int addr_to_28bit_uncached(struct cpu *cpu, unsigned int addr, int writeP)
 {
   // XXX -- Royally stupid banking emulation for now
   unsigned int addr_in = addr;
@@ -1476,6 +2267,43 @@ unsigned int addr_to_28bit(struct cpu *cpu, unsigned int addr, int writeP)
   return addr;
 }
 
+void cpu_rebuild_map(struct cpu *cpu)
+{
+  // Every mapping above is linear within a 4KB page, so the base address of each page is enough
+  for (unsigned int page = 0; page < 16; page++) {
+    cpu->read_map[page] = addr_to_28bit_uncached(cpu, page << 12, 0);
+    cpu->write_map[page] = addr_to_28bit_uncached(cpu, page << 12, 1);
+  }
+  cpu->map_generation = memory_map_generation;
+}
+
+unsigned int addr_to_28bit(struct cpu *cpu, unsigned int addr, int writeP)
+{
+  if (addr > 0xffff)
+    return addr_to_28bit_uncached(cpu, addr, writeP);
+  if (cpu->map_generation != memory_map_generation)
+    cpu_rebuild_map(cpu);
+  if (writeP)
+    return cpu->write_map[addr >> 12] + (addr & 0xfff);
+  return cpu->read_map[addr >> 12] + (addr & 0xfff);
+}
+
+// IO registers with side effects are implemented by the handlers in io_handlers[] (see "IO registers"
+// below).  Registers without a handler, and all debug reads (with no CPU), are plain ffdram[].
+typedef struct io_handler {
+  unsigned int first;
+  unsigned int last;
+  const char *name;
+  unsigned char (*read)(struct cpu *cpu, unsigned int addr);
+  // Must store the value itself, normally with io_store(), if the register keeps it
+  void (*write)(struct cpu *cpu, unsigned int addr, unsigned char value);
+} io_handler;
+
+extern const io_handler io_handlers[];
+// Which 4KB pages of $FFDxxxx have any handlers, and 1 + the io_handlers[] index for each register (or 0)
+unsigned char io_page_has_handlers[16];
+unsigned char io_register_handler[65536];
+
 unsigned char read_memory28(struct cpu *cpu, unsigned int addr)
 {
   if (addr >= 0xfff8000 && addr < 0xfffc000) {
@@ -1492,7 +2320,13 @@ unsigned char read_memory28(struct cpu *cpu, unsigned int addr)
   }
   else if ((addr & 0xfff0000) == 0xffd0000) {
     // $FFDxxxx IO space
-    return ffdram[addr - 0xffd0000];
+    unsigned int offset = addr - 0xffd0000;
+    if (io_page_has_handlers[offset >> 12] && io_register_handler[offset] && cpu) {
+      const io_handler *h = &io_handlers[io_register_handler[offset] - 1];
+      if (h->read)
+        return h->read(cpu, addr);
+    }
+    return ffdram[offset];
   }
   // Otherwise unmapped RAM
   return 0xbd;
@@ -1528,6 +2362,87 @@ unsigned int memory_blame(struct cpu *cpu, unsigned int addr16)
   return 0;
 }
 
+// DMA throughput, for copy and fill jobs
+typedef struct dma_stats {
+  unsigned long long jobs;
+  unsigned long long fast_jobs;
+  unsigned long long bytes;
+  double seconds;
+} dma_stats;
+
+dma_stats dma_copy_stats, dma_fill_stats;
+
+// A range of addresses that lies within one RAM without side effects on writes
+typedef struct dma_region {
+  unsigned char *ram;
+  unsigned int *blame;
+  unsigned char *dirty;
+  unsigned int offset; // of addr within ram
+  bool cached;         // may hold instructions in the decode cache
+} dma_region;
+
+bool dma_plain_region(unsigned long long addr, unsigned int count, dma_region *r)
+{
+  if (addr >= 0xfff8000 && addr + count <= 0xfffc000) {
+    r->ram = hypporam;
+    r->blame = hypporam_blame;
+    r->dirty = hypporam_dirty;
+    r->offset = addr - 0xfff8000;
+    r->cached = true;
+  }
+  else if (addr >= 2 && addr + count <= CHIPRAM_SIZE) {
+    // (Writes to $0 and $1 change the memory map)
+    r->ram = chipram;
+    r->blame = chipram_blame;
+    r->dirty = chipram_dirty;
+    r->offset = addr;
+    r->cached = true;
+  }
+  else if (addr >= 0xff80000 && addr + count <= 0xff80000 + COLOURRAM_SIZE) {
+    r->ram = colourram;
+    r->blame = colourram_blame;
+    r->dirty = colourram_dirty;
+    r->offset = addr - 0xff80000;
+    r->cached = false;
+  }
+  else
+    return false;
+  return true;
+}
+
+// Do a plain copy or fill job, that steps forward one byte at a time through RAM, all at once.
+// Returns false if the job needs doing byte by byte instead.
+bool dma_fast_path(struct cpu *cpu, int op, unsigned long long src, unsigned long long dest, unsigned int count)
+{
+  dma_region s, d;
+
+  if (!dma_plain_region(dest, count, &d))
+    return false;
+  if (op == 0) {
+    // Copying forwards onto a later part of the source repeats the start of the source, so is left
+    // to the byte by byte path
+    if (!dma_plain_region(src, count, &s))
+      return false;
+    if (d.ram == s.ram && d.offset > s.offset && d.offset < s.offset + count)
+      return false;
+    memmove(&d.ram[d.offset], &s.ram[s.offset], count);
+  }
+  else
+    memset(&d.ram[d.offset], src & 0xff, count);
+  if (trace) {
+    for (unsigned int i = 0; i < count; i++)
+      trace_write(dest + i, d.ram[d.offset + i], cpu->instruction_count);
+  }
+
+  for (unsigned int i = 0; i < count; i++)
+    d.blame[d.offset + i] = cpu->instruction_count;
+  for (unsigned int page = d.offset >> PAGE_SHIFT; page <= (d.offset + count - 1) >> PAGE_SHIFT; page++)
+    d.dirty[page] = 1;
+  if (d.cached)
+    decode_cache_invalidate_range(dest, count);
+  return true;
+}
+
 int do_dma(struct cpu *cpu, int eDMA, unsigned int addr)
 {
   int f011b = 0;
@@ -1813,13 +2728,39 @@ int do_dma(struct cpu *cpu, int eDMA, unsigned int addr)
             symbol_count--;
           }
         }
-        if (symbols_erased)
+        if (symbols_erased) {
+          symbol_tables_reset();
           fprintf(logfile, "NOTE: Erased %d symbols due to DMA fill from $%07llX to $%07llX.\n", symbols_erased,
               dest_addr >> 8, (dest_addr >> 8) + dma_count - 1);
+        }
       }
       break;
     }
 
+    // The fill value is the low byte of the source address, however the source address steps
+    int fill_value = (src_addr >> 8) & 0xff;
+
+    // Plain forward copies and fills within RAM don't need stepping through a byte at a time
+    dma_stats *stats = NULL;
+    struct timespec t0, t1;
+    if ((dma_cmd & 3) == 0 || (dma_cmd & 3) == 3) {
+      stats = (dma_cmd & 3) ? &dma_fill_stats : &dma_copy_stats;
+      bool plain = !line_mode && !s_line_mode && !spiral_mode && !with_transparency && !floppy_mode
+                && src_skip == 0x100 && dst_skip == 0x100 && !src_direction && !dest_direction && !dest_hold
+                && !src_modulo && !dest_modulo && ((dma_cmd & 3) == 3 || !src_hold);
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      bool fast = plain && dma_fast_path(cpu, dma_cmd & 3, src_addr >> 8, dest_addr >> 8, dma_count);
+      stats->jobs++;
+      stats->bytes += dma_count;
+      if (cpu->term.log_dma)
+        fprintf(logfile, "INFO: DMA %s of %d bytes done %s\n", (dma_cmd & 3) ? "fill" : "copy", dma_count,
+            fast ? "in one go" : "byte by byte");
+      if (fast) {
+        stats->fast_jobs++;
+        dma_count = 0;
+      }
+    }
+
     while (dma_count--) {
 
       // Do operation before updating addresses
@@ -1832,7 +2773,7 @@ int do_dma(struct cpu *cpu, int eDMA, unsigned int addr)
         //      fprintf(stderr,"DEBUG: Copying $%02X from $%07X to $%07X\n",value,src_addr>>8,dest_addr>>8);
       } break;
       case 3: // fill
-        MEM_WRITE28(cpu, dest_addr >> 8, (src_addr >> 8) & 0xff);
+        MEM_WRITE28(cpu, dest_addr >> 8, fill_value);
         break;
       default:
         fprintf(logfile, "ERROR: Unsupported DMA operation %d requested.\n", dma_cmd & 3);
@@ -2190,18 +3131,454 @@ int do_dma(struct cpu *cpu, int eDMA, unsigned int addr)
         }
       }
     }
-  }
+
+    if (stats) {
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      stats->seconds += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    }
+  }
   return 0;
 }
 
-int write_mem28(struct cpu *cpu, unsigned int addr, unsigned char value)
+// Report DMA throughput for the current test
+void report_dma_speed(FILE *f)
+{
+  dma_stats *all[2] = { &dma_copy_stats, &dma_fill_stats };
+  const char *names[2] = { "copy", "fill" };
+
+  for (int i = 0; i < 2; i++) {
+    dma_stats *stats = all[i];
+    if (!stats->jobs)
+      continue;
+    fprintf(f, "INFO: DMA %s: %llu jobs (%llu in one go), %llu bytes in %.6f seconds (%.1f MB/second)\n", names[i],
+        stats->jobs, stats->fast_jobs, stats->bytes, stats->seconds,
+        stats->seconds > 0 ? stats->bytes / stats->seconds / 1e6 : 0);
+  }
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   IO registers
+
+   Each entry of io_handlers[] implements a range of $FFDxxxx registers.  read_memory28() and write_mem28()
+   look the handler up with a 4KB page check and then a per-register table, so plain memory, and IO
+   pages without handlers, cost nothing extra.  Time, for the raster and CIA timers, is emulated time.
+   ----------------------------------------------------------------------------------------------------------
+*/
+
+// The CPU's own write to an IO register
+void io_store(struct cpu *cpu, unsigned int addr, unsigned char value)
+{
+  ffdram[addr - 0xffd0000] = value;
+  ffdram_blame[addr - 0xffd0000] = cpu->instruction_count;
+  ffdram_dirty[(addr - 0xffd0000) >> PAGE_SHIFT] = 1;
+}
+
+// A register that changes as a side effect of the CPU's write to another
+void io_update(struct cpu *cpu, unsigned int addr, unsigned char value)
+{
+  if (trace)
+    trace_write(addr, value, cpu->instruction_count);
+  io_store(cpu, addr, value);
+}
+
+// VIC-IV raster position: 312 lines at 50Hz (PAL), or 263 at 60Hz when $D06F bit 7 selects NTSC
+unsigned int vic_raster_line(void)
+{
+  bool ntsc = ffdram[0x306f] & 0x80;
+  unsigned int lines = ntsc ? 263 : 312;
+  return (unsigned long long)(emulated_seconds * (ntsc ? 60 : 50) * lines) % lines;
+}
+
+unsigned char vic_raster_read(struct cpu *cpu, unsigned int addr)
+{
+  unsigned int line = vic_raster_line();
+  if (addr == 0xffd3012)
+    return line & 0xff;
+  return (ffdram[0x3011] & 0x7f) | ((line >> 1) & 0x80);
+}
+
+void vic_rom_banking_write(struct cpu *cpu, unsigned int addr, unsigned char value)
+{
+  io_store(cpu, addr, value);
+  memory_map_generation++;
+}
+
+// C65 UART: transmitted bytes go to the log, a line at a time, and nothing is ever received
+char uart_line[256];
+int uart_line_len = 0;
+char serial_monitor_line[256];
+int serial_monitor_line_len = 0;
+
+void serial_output(const char *what, char *line, int *len, unsigned char c)
+{
+  if (c == '\r' || c == '\n' || *len == 255) {
+    if (*len) {
+      line[*len] = 0;
+      fprintf(logfile, "INFO: %s: %s\n", what, line);
+    }
+    *len = 0;
+    if (c == '\r' || c == '\n')
+      return;
+  }
+  line[(*len)++] = isprint(c) ? c : '.';
+}
+
+unsigned char uart_read(struct cpu *cpu, unsigned int addr)
+{
+  if (addr == 0xffd3601)
+    return 0x60; // Transmit buffer empty, end of transmission
+  return ffdram[addr - 0xffd0000];
+}
+
+void uart_write(struct cpu *cpu, unsigned int addr, unsigned char value)
+{
+  if (addr == 0xffd3600)
+    serial_output("UART", uart_line, &uart_line_len, value);
+  else
+    io_store(cpu, addr, value);
+}
+
+// Hypervisor registers $D640-$D67F: in user mode, writing to any of them traps to the hypervisor, and
+// in the hypervisor, writing to $D67F returns from it.  Both happen once the instruction completes.
+unsigned char hypervisor_register_read(struct cpu *cpu, unsigned int addr)
+{
+  if (addr == 0xffd367c)
+    return 0; // The serial monitor is never busy
+  return ffdram[addr - 0xffd0000];
+}
+
+void hypervisor_register_write(struct cpu *cpu, unsigned int addr, unsigned char value)
+{
+  if (!cpu->regs.in_hyper) {
+    fprintf(logfile, "NOTE: CPU Entered Hypervisor via write to $%07x at instruction #%d\n", addr, cpulog_len);
+    cpu->hypervisor_request = 1 + (addr & 0x3f);
+    return;
+  }
+  if (addr == 0xffd367c) {
+    serial_output("Serial monitor", serial_monitor_line, &serial_monitor_line_len, value);
+    return;
+  }
+  io_store(cpu, addr, value);
+  if (addr == 0xffd367f) {
+    fprintf(logfile, "NOTE: CPU Exited Hypervisor via write to $%07x at instruction #%d\n", addr, cpulog_len);
+    cpu->hypervisor_request = HYPERVISOR_RETURN;
+  }
+}
+
+// Save the CPU state in $D640-$D657, and enter the hypervisor at $8000 + 4 * trap number
+void hypervisor_trap(struct cpu *cpu, int trap)
+{
+  unsigned char state[0x18] = { cpu->regs.a, cpu->regs.x, cpu->regs.y, cpu->regs.z, cpu->regs.b, cpu->regs.spl,
+    cpu->regs.sph, cpu->regs.flags, cpu->regs.pc & 0xff, cpu->regs.pc >> 8, cpu->regs.maplo >> 8,
+    cpu->regs.maplo & 0xff, cpu->regs.maphi >> 8, cpu->regs.maphi & 0xff, cpu->regs.maplomb, cpu->regs.maphimb,
+    chipram[0], chipram[1], 3 /* VIC-IV IO mode */, 0, 0, ffdram[0x3700], ffdram[0x3701], ffdram[0x3702] };
+  for (int i = 0; i < sizeof(state); i++)
+    io_update(cpu, 0xffd3640 + i, state[i]);
+
+  cpu->regs.in_hyper = 1;
+  cpu->regs.flags = (cpu->regs.flags & ~FLAG_D) | FLAG_E | FLAG_I;
+  cpu->regs.spl = 0xff;
+  cpu->regs.sph = 0xbe;
+  cpu->regs.b = 0xbf;
+  cpu->regs.pc = 0x8000 + trap * 4;
+  cpu->regs.maphi = 0x3f00;
+  cpu->regs.maphimb = 0xff;
+  if (cpu->regs.maplomb == 0xff)
+    cpu->regs.maplomb = 0;
+  cpu_map_changed(cpu);
+  write_mem28(cpu, 0, 0x3f);
+  write_mem28(cpu, 1, 0x35);
+}
+
+// Restore the CPU state from $D640-$D651
+void hypervisor_return(struct cpu *cpu)
+{
+  unsigned char *state = &ffdram[0x3640];
+
+  cpu->regs.a = state[0];
+  cpu->regs.x = state[1];
+  cpu->regs.y = state[2];
+  cpu->regs.z = state[3];
+  cpu->regs.b = state[4];
+  cpu->regs.spl = state[5];
+  cpu->regs.sph = state[6];
+  cpu->regs.flags = state[7];
+  cpu->regs.pc = state[8] | (state[9] << 8);
+  cpu->regs.maplo = (state[10] << 8) | state[11];
+  cpu->regs.maphi = (state[12] << 8) | state[13];
+  cpu->regs.maplomb = state[14];
+  cpu->regs.maphimb = state[15];
+  cpu->regs.in_hyper = 0;
+  cpu_map_changed(cpu);
+  write_mem28(cpu, 0, state[16]);
+  write_mem28(cpu, 1, state[17]);
+}
+
+// Called after each instruction that asked to enter or leave the hypervisor
+void hypervisor_transition(struct cpu *cpu)
+{
+  int request = cpu->hypervisor_request;
+  cpu->hypervisor_request = 0;
+  if (request == HYPERVISOR_RETURN)
+    hypervisor_return(cpu);
+  else
+    hypervisor_trap(cpu, request - 1);
+}
+
+unsigned char sdcard_register_read(struct cpu *cpu, unsigned int addr)
+{
+  return sdcard.image ? sdcard_status() : ffdram[0x3680];
+}
+
+void sdcard_register_write(struct cpu *cpu, unsigned int addr, unsigned char value)
+{
+  io_store(cpu, addr, value);
+  if (sdcard.image)
+    sdcard_command(cpu, value);
+}
+
+unsigned char sdcard_buffer_read(struct cpu *cpu, unsigned int addr)
+{
+  return ffdram[sdcard_buffer_address(addr) - 0xffd0000];
+}
+
+void sdcard_buffer_write(struct cpu *cpu, unsigned int addr, unsigned char value)
+{
+  io_store(cpu, sdcard_buffer_address(addr), value);
+}
+
+void dmagic_register_write(struct cpu *cpu, unsigned int addr, unsigned char value)
 {
   unsigned int dma_addr;
 
+  io_store(cpu, addr, value);
+  switch (addr) {
+  case 0xffd3700: // Trigger DMA
+    if (cpu->term.log_dma)
+      fprintf(logfile, "NOTE: DMA triggered via write to $%07x at instruction #%d\n", addr, cpulog_len);
+    ffdram[0x3705] = value;
+    ffdram_blame[0x3705] = cpu->instruction_count;
+    dma_addr = (ffdram[0x3700] + (ffdram[0x3701] << 8) + ((ffdram[0x3702] & 0x7f) << 16)) | (ffdram[0x3704] << 20);
+    do_dma(cpu, 0, dma_addr);
+    break;
+  case 0xffd3702: // Set bits 22 to 16 of DMA address
+    ffdram[0x3704] &= 0xf1;
+    ffdram[0x3704] |= (value >> 4) & 7;
+    ffdram_blame[0x3704] = cpu->instruction_count;
+    break;
+  case 0xffd3705: // Trigger EDMA
+    if (cpu->term.log_dma)
+      fprintf(logfile, "NOTE: DMA triggered via write to $%07x at instruction #%d\n", addr, cpulog_len);
+    ffdram[0x3700] = value;
+    ffdram_blame[0x3700] = cpu->instruction_count;
+    dma_addr = (ffdram[0x3700] + (ffdram[0x3701] << 8) + ((ffdram[0x3702] & 0x7f) << 16)) | (ffdram[0x3704] << 20);
+    do_dma(cpu, 1, dma_addr);
+    break;
+  }
+}
+
+// Hardware multiplier and divider: writing MULTINA ($D770-3) or MULTINB ($D774-7) updates MULTOUT
+// ($D778-F) with A * B, and DIVOUT ($D768-F) with A / B as a 32.32 fixed point number (unless B is 0).
+// The results are ready at once, so DIVBUSY ($D70F bit 7) never reads as set.
+void math_register_write(struct cpu *cpu, unsigned int addr, unsigned char value)
+{
+  io_store(cpu, addr, value);
+
+  unsigned long long a = ffdram[0x3770] | (ffdram[0x3771] << 8) | (ffdram[0x3772] << 16) | ((unsigned)ffdram[0x3773] << 24);
+  unsigned long long b = ffdram[0x3774] | (ffdram[0x3775] << 8) | (ffdram[0x3776] << 16) | ((unsigned)ffdram[0x3777] << 24);
+  unsigned long long product = a * b;
+  for (int i = 0; i < 8; i++)
+    io_update(cpu, 0xffd3778 + i, product >> (i * 8));
+  if (b) {
+    unsigned long long quotient = (a << 32) / b;
+    for (int i = 0; i < 8; i++)
+      io_update(cpu, 0xffd3768 + i, quotient >> (i * 8));
+  }
+}
+
+// CIA timers A and B count down at the PAL phi2 rate, and set their interrupt flag ($DC0D/$DD0D bits 0
+// and 1) on underflow.  The other CIA registers, and counting anything but phi2, are not emulated.
+#define CIA_HZ 985248.0
+
+typedef struct cia_timer {
+  unsigned short latch;
+  unsigned short counter; // as of start_tick, when the timer was last brought up to date
+  bool running;
+  bool one_shot;
+  unsigned long long start_tick;
+} cia_timer;
+
+typedef struct cia_state {
+  cia_timer timer[2];
+  unsigned char icr_flags;
+  unsigned char icr_mask;
+} cia_state;
+
+cia_state cias[2];
+
+unsigned long long cia_tick(void)
+{
+  return (unsigned long long)(emulated_seconds * CIA_HZ);
+}
+
+// Bring a timer up to date, so that its counter is the count now, and return it.  This must be done
+// before stopping, starting or loading it.
+unsigned short cia_timer_update(cia_state *cia, int t)
+{
+  cia_timer *timer = &cia->timer[t];
+  unsigned long long now = cia_tick(), elapsed = now - timer->start_tick;
+  timer->start_tick = now;
+  if (!timer->running)
+    return timer->counter;
+
+  if (elapsed <= timer->counter) {
+    timer->counter -= elapsed;
+    return timer->counter;
+  }
+
+  // Underflowed at least once: the counter reloads from the latch each time
+  cia->icr_flags |= 1 << t;
+  elapsed -= timer->counter + 1;
+  if (timer->one_shot) {
+    timer->running = false;
+    timer->counter = timer->latch;
+  }
+  else
+    timer->counter = timer->latch - elapsed % ((unsigned long long)timer->latch + 1);
+  return timer->counter;
+}
+
+cia_state *cia_for(unsigned int addr)
+{
+  return &cias[(addr >> 8) & 1];
+}
+
+unsigned char cia_read(struct cpu *cpu, unsigned int addr)
+{
+  cia_state *cia = cia_for(addr);
+  unsigned int reg = addr & 0xf;
+  unsigned char value;
+
+  switch (reg) {
+  case 0x4:
+  case 0x5:
+  case 0x6:
+  case 0x7: {
+    unsigned short counter = cia_timer_update(cia, (reg - 4) >> 1);
+    return reg & 1 ? counter >> 8 : counter & 0xff;
+  }
+  case 0xd:
+    // Reading the interrupt control register acknowledges the interrupts
+    cia_timer_update(cia, 0);
+    cia_timer_update(cia, 1);
+    value = cia->icr_flags;
+    if (value & cia->icr_mask)
+      value |= 0x80;
+    cia->icr_flags = 0;
+    return value;
+  case 0xe:
+  case 0xf:
+    cia_timer_update(cia, reg - 0xe);
+    return (ffdram[(addr - 0xffd0000) & ~0xf0] & 0xee) | cia->timer[reg - 0xe].running
+         | (cia->timer[reg - 0xe].one_shot << 3);
+  }
+  return ffdram[(addr - 0xffd0000) & ~0xf0];
+}
+
+void cia_write(struct cpu *cpu, unsigned int addr, unsigned char value)
+{
+  cia_state *cia = cia_for(addr);
+  unsigned int reg = addr & 0xf;
+
+  // The 16 registers repeat through the page
+  addr &= ~0xf0;
+  io_store(cpu, addr, value);
+  switch (reg) {
+  case 0x4:
+  case 0x5:
+  case 0x6:
+  case 0x7: {
+    int t = (reg - 4) >> 1;
+    cia_timer *timer = &cia->timer[t];
+    cia_timer_update(cia, t);
+    if (reg & 1)
+      timer->latch = (timer->latch & 0xff) | (value << 8);
+    else
+      timer->latch = (timer->latch & 0xff00) | value;
+    // Writing the high byte of a stopped timer loads it
+    if ((reg & 1) && !timer->running)
+      timer->counter = timer->latch;
+    break;
+  }
+  case 0xd:
+    if (value & 0x80)
+      cia->icr_mask |= value & 0x1f;
+    else
+      cia->icr_mask &= ~value;
+    break;
+  case 0xe:
+  case 0xf: {
+    int t = reg - 0xe;
+    cia_timer *timer = &cia->timer[t];
+    cia_timer_update(cia, t);
+    if (value & 0x10)
+      timer->counter = timer->latch;
+    timer->one_shot = value & 0x08;
+    timer->running = value & 1;
+    break;
+  }
+  }
+}
+
+const io_handler io_handlers[] = {
+  { 0xffd3011, 0xffd3012, "VIC-IV raster", vic_raster_read, NULL },
+  { 0xffd3030, 0xffd3030, "VIC-III ROM banking", NULL, vic_rom_banking_write },
+  { 0xffd3600, 0xffd3601, "UART", uart_read, uart_write },
+  { 0xffd3640, 0xffd367f, "hypervisor registers", hypervisor_register_read, hypervisor_register_write },
+  { 0xffd3680, 0xffd3680, "SD card controller", sdcard_register_read, sdcard_register_write },
+  { 0xffd3700, 0xffd3705, "DMAgic", NULL, dmagic_register_write },
+  { 0xffd3770, 0xffd3777, "multiplier and divider", NULL, math_register_write },
+  { 0xffd3c00, 0xffd3cff, "CIA 1", cia_read, cia_write },
+  { 0xffd3d00, 0xffd3dff, "CIA 2", cia_read, cia_write },
+  { 0xffd3e00, 0xffd3fff, "SD card sector buffer", sdcard_buffer_read, sdcard_buffer_write },
+  { 0 }
+};
+
+void io_handlers_init(void)
+{
+  static bool done = false;
+
+  if (done)
+    return;
+  done = true;
+  for (int i = 0; io_handlers[i].name; i++) {
+    for (unsigned int addr = io_handlers[i].first; addr <= io_handlers[i].last; addr++) {
+      unsigned int offset = addr - 0xffd0000;
+      assert(!io_register_handler[offset]);
+      io_register_handler[offset] = i + 1;
+      io_page_has_handlers[offset >> 12] = 1;
+    }
+  }
+}
+
+void io_reset(void)
+{
+  bzero(cias, sizeof(cias));
+  uart_line_len = 0;
+  serial_monitor_line_len = 0;
+}
+
+int write_mem28(struct cpu *cpu, unsigned int addr, unsigned char value)
+{
+  if (trace)
+    trace_write(addr, value, cpu->instruction_count);
+
   if (addr >= 0xfff8000 && addr < 0xfffc000) {
     // Hypervisor sits at $FFF8000-$FFFBFFF
     hypporam_blame[addr - 0xfff8000] = cpu->instruction_count;
     hypporam[addr - 0xfff8000] = value;
+    hypporam_dirty[(addr - 0xfff8000) >> PAGE_SHIFT] = 1;
+    decode_cache_invalidate(addr);
   }
   else if (addr < CHIPRAM_SIZE) {
     // Chipram at base of address space
@@ -2214,53 +3591,31 @@ int write_mem28(struct cpu *cpu, unsigned int addr, unsigned char value)
     else {
       chipram_blame[addr] = cpu->instruction_count;
       chipram[addr] = value;
+      chipram_dirty[addr >> PAGE_SHIFT] = 1;
+      decode_cache_invalidate(addr);
+      if (addr < 2) {
+        // CPU port changes C64 ROM/IO banking
+        memory_map_generation++;
+      }
     }
   }
   else if (addr >= 0xff80000 && addr < (0xff80000 + COLOURRAM_SIZE)) {
     colourram_blame[addr - 0xff80000] = cpu->instruction_count;
     colourram[addr - 0xff80000] = value;
+    colourram_dirty[(addr - 0xff80000) >> PAGE_SHIFT] = 1;
   }
   else if ((addr & 0xfff0000) == 0xffd0000) {
     // $FFDxxxx IO space
-    ffdram[addr - 0xffd0000] = value;
-    ffdram_blame[addr - 0xffd0000] = cpu->instruction_count;
-
-    // Now check for special address actions
-    switch (addr) {
-    case 0xffd3700: // Trigger DMA
-      if (cpu->term.log_dma)
-        fprintf(logfile, "NOTE: DMA triggered via write to $%07x at instruction #%d\n", addr, cpulog_len);
-      ffdram[0x3705] = value;
-      ffdram_blame[0x3705] = cpu->instruction_count;
-      dma_addr = (ffdram[0x3700] + (ffdram[0x3701] << 8) + ((ffdram[0x3702] & 0x7f) << 16)) | (ffdram[0x3704] << 20);
-      do_dma(cpu, 0, dma_addr);
-      break;
-    case 0xffd3702: // Set bits 22 to 16 of DMA address
-      ffdram[0x3704] &= 0xf1;
-      ffdram[0x3704] |= (value >> 4) & 7;
-      ffdram_blame[0x3704] = cpu->instruction_count;
-      break;
-    case 0xffd3705: // Trigger EDMA
-      if (cpu->term.log_dma)
-        fprintf(logfile, "NOTE: DMA triggered via write to $%07x at instruction #%d\n", addr, cpulog_len);
-      ffdram[0x3700] = value;
-      ffdram_blame[0x3700] = cpu->instruction_count;
-      dma_addr = (ffdram[0x3700] + (ffdram[0x3701] << 8) + ((ffdram[0x3702] & 0x7f) << 16)) | (ffdram[0x3704] << 20);
-      do_dma(cpu, 1, dma_addr);
-      break;
-    }
-    if (!cpu->regs.in_hyper) {
-      if (addr >= 0xffd3640 && addr <= 0xffd367f) {
-        // Enter hypervisor
-        fprintf(logfile, "NOTE: CPU Entered Hypervisor via write to $%07x at instruction #%d\n", addr, cpulog_len);
-      }
-    }
-    else {
-      if (addr == 0xffd367f) {
-        // Exit hypervisor
-        fprintf(logfile, "NOTE: CPU Exited Hypervisor via write to $%07x at instruction #%d\n", addr, cpulog_len);
-      }
+    unsigned int offset = addr - 0xffd0000;
+    if (io_page_has_handlers[offset >> 12] && io_register_handler[offset]) {
+      const io_handler *h = &io_handlers[io_register_handler[offset] - 1];
+      if (h->write)
+        h->write(cpu, addr, value);
+      else
+        io_store(cpu, addr, value);
     }
+    else
+      io_store(cpu, addr, value);
   }
   else {
     // Otherwise unmapped RAM
@@ -2283,18 +3638,22 @@ int write_mem_expected28(unsigned int addr, unsigned char value)
   if (addr >= 0xfff8000 && addr < 0xfffc000) {
     // Hypervisor sits at $FFF8000-$FFFBFFF
     hypporam_expected[addr - 0xfff8000] = value;
+    hypporam_dirty[(addr - 0xfff8000) >> PAGE_SHIFT] = 1;
     fprintf(logfile, "NOTE: Writing to hypervisor RAM @ $%07x\n", addr);
   }
   else if (addr < CHIPRAM_SIZE) {
     // Chipram at base of address space
     chipram_expected[addr] = value;
+    chipram_dirty[addr >> PAGE_SHIFT] = 1;
   }
   else if (addr >= 0xff80000 && addr < (0xff80000 + COLOURRAM_SIZE)) {
     colourram_expected[addr - 0xff80000] = value;
+    colourram_dirty[(addr - 0xff80000) >> PAGE_SHIFT] = 1;
   }
   else if ((addr & 0xfff0000) == 0xffd0000) {
     // $FFDxxxx IO space
     ffdram_expected[addr - 0xffd0000] = value;
+    ffdram_dirty[(addr - 0xffd0000) >> PAGE_SHIFT] = 1;
   }
   else {
     // Otherwise unmapped RAM
@@ -2466,1543 +3825,3343 @@ bool stack_push(struct cpu *cpu, unsigned char v)
   return true;
 }
 
-bool execute_instruction(struct cpu *cpu, struct instruction_log *log)
+// BRK
+bool op_00(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->term.error = true;
+  cpu->term.brk = true;
+  cpu->term.done = true;
+  return true;
+}
+
+// ORA ($xx,X)
+bool op_01(struct cpu *cpu, struct instruction_log *log)
 {
   int v;
-  for (int i = 0; i < 6; i++) {
-    log->bytes[i] = read_memory(cpu, cpu->regs.pc + i);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  v = read_memory(cpu, addr_izpx(cpu, log));
+  v |= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  return true;
+}
+
+// SEE
+bool op_03(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.flags |= FLAG_E;
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// TSB $xx
+bool op_04(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  cpu->regs.flag_z = (v & cpu->regs.a) == 0;
+  v |= cpu->regs.a;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  return true;
+}
+
+// ORA $xx
+bool op_05(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  v |= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  return true;
+}
+
+// ASL $nn
+bool op_06(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  cpu->regs.flag_c = cpu->regs.a >= 0x80;
+  v = read_memory(cpu, addr_zp(cpu, log)) << 1;
+  update_nz(v);
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// RMB0 $nn
+bool op_07(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log)) & ~1;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// PHP
+bool op_08(struct cpu *cpu, struct instruction_log *log)
+{
+  // B flag always pushes as set
+  stack_push(cpu, cpu->regs.flags | FLAG_B);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// ORA #$nn
+bool op_09(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.a |= log->bytes[1];
+  update_nz(cpu->regs.a);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// ASL A
+bool op_0A(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  cpu->regs.flag_c = cpu->regs.a >= 0x80;
+  v = cpu->regs.a << 1;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 1;
+  cpu->regs.pc += 1;
+  return true;
+}
+
+// TSB $xxxx
+bool op_0C(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 3;
+  cpu->regs.pc += 3;
+  v = read_memory(cpu, addr_abs(log));
+  cpu->regs.flag_z = (v & cpu->regs.a) == 0;
+  v |= cpu->regs.a;
+  MEM_WRITE16(cpu, addr_abs(log), v);
+  return true;
+}
+
+// ORA $xxxx
+bool op_0D(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 3;
+  cpu->regs.pc += 3;
+  v = read_memory(cpu, addr_abs(log));
+  v |= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  return true;
+}
+
+// ASL $nnnn
+bool op_0E(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  cpu->regs.flag_c = cpu->regs.a >= 0x80;
+  v = read_memory(cpu, addr_abs(log)) << 1;
+  update_nz(v);
+  MEM_WRITE16(cpu, addr_abs(log), v);
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// BBR0 $nn,$rr
+bool op_0F(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  if ((v & 1) == 0) {
+    cpu->regs.pc += rel8_delta(log->bytes[2]);
   }
-  switch (log->bytes[0]) {
-  case 0x00: // BRK
-    log->len = 2;
-    cpu->term.error = true;
-    cpu->term.brk = true;
-    cpu->term.done = true;
-    break;
-  case 0x01: // ORA ($xx,X)
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_izpx(cpu, log));
-    v |= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    break;
-  case 0x03: // SEE
-    cpu->regs.flags |= FLAG_E;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x04: // TSB $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_zp(cpu, log));
-    cpu->regs.flag_z = (v & cpu->regs.a) == 0;
-    v |= cpu->regs.a;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    break;
-  case 0x05: // ORA $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_zp(cpu, log));
-    v |= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    break;
-  case 0x06: // ASL $nn
-    cpu->regs.flag_c = cpu->regs.a >= 0x80;
-    v = read_memory(cpu, addr_zp(cpu, log)) << 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x07: // RMB0 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) & ~1;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x08: // PHP
-    // B flag always pushes as set
-    stack_push(cpu, cpu->regs.flags | FLAG_B);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x09: // ORA #$nn
-    cpu->regs.a |= log->bytes[1];
-    update_nz(cpu->regs.a);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x0A: // ASL A
-    cpu->regs.flag_c = cpu->regs.a >= 0x80;
-    v = cpu->regs.a << 1;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 1;
-    cpu->regs.pc += 1;
-    break;
-  case 0x0c: // TSB $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    v = read_memory(cpu, addr_abs(log));
-    cpu->regs.flag_z = (v & cpu->regs.a) == 0;
-    v |= cpu->regs.a;
-    MEM_WRITE16(cpu, addr_abs(log), v);
-    break;
-  case 0x0d: // ORA $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    v = read_memory(cpu, addr_abs(log));
-    v |= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    break;
-  case 0x0e: // ASL $nnnn
-    cpu->regs.flag_c = cpu->regs.a >= 0x80;
-    v = read_memory(cpu, addr_abs(log)) << 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_abs(log), v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x0F: // BBR0 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 1) == 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0x10: // BPL $rr
-    log->len = 2;
-    if (cpu->regs.flags & FLAG_N)
-      cpu->regs.pc += 2;
-    else
-      cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
-    break;
-  case 0x11: // ORA ($xx),Y
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_izpy(cpu, log));
-    v |= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    break;
-  case 0x12: // ORA ($xx),Z
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_izpz(cpu, log));
-    v |= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    break;
-  case 0x13: // BPL $rrrr
-    log->len = 3;
-    if (cpu->regs.flags & FLAG_N)
-      cpu->regs.pc += 3;
-    else
-      cpu->regs.pc += 2 + rel16_delta(log->bytes[1]);
-    break;
-  case 0x14: // TRB $xx
-    log->len = 2;
+  cpu->regs.pc += 3;
+  log->len = 3;
+  return true;
+}
+
+// BPL $rr
+bool op_10(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  if (cpu->regs.flags & FLAG_N)
     cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_zp(cpu, log));
-    cpu->regs.flag_z = (v & cpu->regs.a) == 0;
-    v &= ~cpu->regs.a;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    break;
-  case 0x15: // ORA $xx,X
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_zpx(cpu, log));
-    v |= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    break;
-  case 0x16: // ASL $nn,X
-    cpu->regs.flag_c = cpu->regs.a >= 0x80;
-    v = read_memory(cpu, addr_zpx(cpu, log)) << 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_zpx(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x17: // RMB1 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) & ~2;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x18: // CLC
-    cpu->regs.flags &= ~FLAG_C;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x19: // ORA $xxxx,Y
-    log->len = 3;
-    cpu->regs.pc += 3;
-    v = read_memory(cpu, addr_absy(cpu, log));
-    v |= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    break;
-  case 0x1A: // INC A
-    cpu->regs.a++;
-    update_nz(cpu->regs.a);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x1B: // INZ
-    cpu->regs.z++;
-    update_nz(cpu->regs.z);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x1d: // ORA $xxxx,X
-    log->len = 3;
-    cpu->regs.pc += 3;
-    v = read_memory(cpu, addr_absx(cpu, log));
-    v |= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    break;
-  case 0x1e: // ASL $nnnn,X
-    cpu->regs.flag_c = cpu->regs.a >= 0x80;
-    v = read_memory(cpu, addr_absx(cpu, log)) << 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_absx(cpu, log), v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x1c: // TRB $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    v = read_memory(cpu, addr_abs(log));
-    cpu->regs.flag_z = (v & cpu->regs.a) == 0;
-    v &= ~cpu->regs.a;
-    MEM_WRITE16(cpu, addr_abs(log), v);
-    break;
-  case 0x1F: // BBR1 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 2) == 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0x20: // JSR $nnnn
-    if (cpu->term.rts)
-      cpu->term.rts++;
-    stack_push(cpu, (cpu->regs.pc + 2) >> 8);
-    stack_push(cpu, cpu->regs.pc + 2);
-    cpu->regs.pc = addr_abs(log);
-    log->len = 3;
-    break;
-  case 0x21: // AND ($nn,X)
-    v = read_memory(cpu, addr_izpx(cpu, log));
-    v &= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x22: // JSR ($nnnn)
-    if (cpu->term.rts)
-      cpu->term.rts++;
-    stack_push(cpu, (cpu->regs.pc + 2) >> 8);
-    stack_push(cpu, cpu->regs.pc + 2);
-    cpu->regs.pc = addr_deref16(cpu, log);
-    log->len = 3;
-    break;
-  case 0x24: // BIT $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    update_bit_flags(read_memory(cpu, addr_zp(cpu, log)));
-    break;
-  case 0x25: // AND $nn
-    v = read_memory(cpu, addr_zp(cpu, log));
-    v &= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x26: // ROL $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) << 1;
-    if (cpu->regs.flag_c)
-      v |= 0x1;
-    cpu->regs.flag_c = v >= 0x100;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x27: // RMB2 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) & ~4;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x28: // PLP
-    // E & B flags cannot be set via PLP
-    cpu->regs.flags &= FLAG_E | FLAG_B;
-    cpu->regs.flags |= stack_pop(cpu, log) & ~(FLAG_E | FLAG_B);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x29: // AND #$nn
-    cpu->regs.a &= log->bytes[1];
-    update_nz(cpu->regs.a);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x2A: // ROL A
-    v = cpu->regs.a << 1;
-    if (cpu->regs.flag_c)
-      v |= 0x1;
-    cpu->regs.flag_c = v >= 0x100;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 1;
-    cpu->regs.pc += 1;
-    break;
-  case 0x2b: // TYS
-    cpu->regs.sph = cpu->regs.y;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x2C: // BIT $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    update_bit_flags(read_memory(cpu, addr_abs(log)));
-    break;
-  case 0x2D: // AND $nnnn
-    v = read_memory(cpu, addr_abs(log));
-    v &= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x2e: // ROL $nnnn
-    v = read_memory(cpu, addr_abs(log)) << 1;
-    if (cpu->regs.flag_c)
-      v |= 0x1;
-    cpu->regs.flag_c = v >= 0x100;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_abs(log), v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x2F: // BBR2 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 4) == 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0x30: // BMI $rr
-    log->len = 2;
-    if (!(cpu->regs.flags & FLAG_N))
-      cpu->regs.pc += 2;
-    else
-      cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
-    break;
-  case 0x31: // AND ($nn),Y
-    v = read_memory(cpu, addr_izpy(cpu, log));
-    v &= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x32: // AND ($nn),Z
-    v = read_memory(cpu, addr_izpz(cpu, log));
-    v &= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x33: // BMI $rrrr
-    log->len = 3;
-    if (!(cpu->regs.flags & FLAG_N))
-      cpu->regs.pc += 3;
-    else
-      cpu->regs.pc += 2 + rel16_delta(log->bytes[1]);
-    break;
-  case 0x34: // BIT $xx,X
-    log->len = 2;
-    cpu->regs.pc += 2;
-    update_bit_flags(read_memory(cpu, addr_zpx(cpu, log)));
-    break;
-  case 0x35: // AND $nn,X
-    v = read_memory(cpu, addr_zpx(cpu, log));
-    v &= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x36: // ROL $nn,X
-    v = read_memory(cpu, addr_zpx(cpu, log)) << 1;
-    if (cpu->regs.flag_c)
-      v |= 0x1;
-    cpu->regs.flag_c = v >= 0x100;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_zpx(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x37: // RMB3 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) & ~8;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x38: // SEC
-    cpu->regs.flags |= FLAG_C;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x39: // AND $nnnn,Y
-    v = read_memory(cpu, addr_absy(cpu, log));
-    v &= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x3A: // DEC A
-    cpu->regs.a--;
-    update_nz(cpu->regs.a);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x3C: // BIT $xxxx,X
-    log->len = 3;
-    cpu->regs.pc += 3;
-    update_bit_flags(read_memory(cpu, addr_absx(cpu, log)));
-    break;
-  case 0x3D: // AND $nnnn,X
-    v = read_memory(cpu, addr_absx(cpu, log));
-    v &= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x3e: // ROL $nnnn,X
-    v = read_memory(cpu, addr_absx(cpu, log)) << 1;
-    if (cpu->regs.flag_c)
-      v |= 0x1;
-    cpu->regs.flag_c = v >= 0x100;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_absx(cpu, log), v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x3F: // BBR3 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 8) == 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
+  else
+    cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
+  return true;
+}
+
+// ORA ($xx),Y
+bool op_11(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  v = read_memory(cpu, addr_izpy(cpu, log));
+  v |= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  return true;
+}
+
+// ORA ($xx),Z
+bool op_12(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  v = read_memory(cpu, addr_izpz(cpu, log));
+  v |= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  return true;
+}
+
+// BPL $rrrr
+bool op_13(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  if (cpu->regs.flags & FLAG_N)
     cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0x40: // RTI
-    log->len = 1;
-    // E & B flags cannot be set via RTI
-    cpu->regs.flags &= FLAG_E | FLAG_B;
-    cpu->regs.flags |= stack_pop(cpu, log) & ~(FLAG_E | FLAG_B);
-    cpu->regs.pc = stack_pop(cpu, log);
-    cpu->regs.pc |= stack_pop(cpu, log) << 8;
-    break;
-  case 0x41: // EOR ($nn,X)
-    v = read_memory(cpu, addr_izpx(cpu, log));
-    v ^= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x45: // EOR $nn
-    v = read_memory(cpu, addr_zp(cpu, log));
-    v ^= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x46: // LSR $nn
-    v = read_memory(cpu, addr_zp(cpu, log));
-    cpu->regs.flag_c = v & 1;
-    v >>= 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x47: // RMB4 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) & ~16;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x48: // PHA
-    stack_push(cpu, cpu->regs.a);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x49: // EOR #$nn
-    cpu->regs.a ^= log->bytes[1];
-    update_nz(cpu->regs.a);
-    log->len = 2;
+  else
+    cpu->regs.pc += 2 + rel16_delta(log->bytes[1]);
+  return true;
+}
+
+// TRB $xx
+bool op_14(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  cpu->regs.flag_z = (v & cpu->regs.a) == 0;
+  v &= ~cpu->regs.a;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  return true;
+}
+
+// ORA $xx,X
+bool op_15(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  v = read_memory(cpu, addr_zpx(cpu, log));
+  v |= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  return true;
+}
+
+// ASL $nn,X
+bool op_16(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  cpu->regs.flag_c = cpu->regs.a >= 0x80;
+  v = read_memory(cpu, addr_zpx(cpu, log)) << 1;
+  update_nz(v);
+  MEM_WRITE16(cpu, addr_zpx(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// RMB1 $nn
+bool op_17(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log)) & ~2;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// CLC
+bool op_18(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.flags &= ~FLAG_C;
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// ORA $xxxx,Y
+bool op_19(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 3;
+  cpu->regs.pc += 3;
+  v = read_memory(cpu, addr_absy(cpu, log));
+  v |= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  return true;
+}
+
+// INC A
+bool op_1A(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.a++;
+  update_nz(cpu->regs.a);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// INZ
+bool op_1B(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.z++;
+  update_nz(cpu->regs.z);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// ORA $xxxx,X
+bool op_1D(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 3;
+  cpu->regs.pc += 3;
+  v = read_memory(cpu, addr_absx(cpu, log));
+  v |= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  return true;
+}
+
+// ASL $nnnn,X
+bool op_1E(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  cpu->regs.flag_c = cpu->regs.a >= 0x80;
+  v = read_memory(cpu, addr_absx(cpu, log)) << 1;
+  update_nz(v);
+  MEM_WRITE16(cpu, addr_absx(cpu, log), v);
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// TRB $xxxx
+bool op_1C(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 3;
+  cpu->regs.pc += 3;
+  v = read_memory(cpu, addr_abs(log));
+  cpu->regs.flag_z = (v & cpu->regs.a) == 0;
+  v &= ~cpu->regs.a;
+  MEM_WRITE16(cpu, addr_abs(log), v);
+  return true;
+}
+
+// BBR1 $nn,$rr
+bool op_1F(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  if ((v & 2) == 0) {
+    cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+  cpu->regs.pc += 3;
+  log->len = 3;
+  return true;
+}
+
+// JSR $nnnn
+bool op_20(struct cpu *cpu, struct instruction_log *log)
+{
+  if (cpu->term.rts)
+    cpu->term.rts++;
+  stack_push(cpu, (cpu->regs.pc + 2) >> 8);
+  stack_push(cpu, cpu->regs.pc + 2);
+  cpu->regs.pc = addr_abs(log);
+  log->len = 3;
+  return true;
+}
+
+// AND ($nn,X)
+bool op_21(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_izpx(cpu, log));
+  v &= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// JSR ($nnnn)
+bool op_22(struct cpu *cpu, struct instruction_log *log)
+{
+  if (cpu->term.rts)
+    cpu->term.rts++;
+  stack_push(cpu, (cpu->regs.pc + 2) >> 8);
+  stack_push(cpu, cpu->regs.pc + 2);
+  cpu->regs.pc = addr_deref16(cpu, log);
+  log->len = 3;
+  return true;
+}
+
+// BIT $xx
+bool op_24(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  update_bit_flags(read_memory(cpu, addr_zp(cpu, log)));
+  return true;
+}
+
+// AND $nn
+bool op_25(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  v &= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// ROL $nn
+bool op_26(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log)) << 1;
+  if (cpu->regs.flag_c)
+    v |= 0x1;
+  cpu->regs.flag_c = v >= 0x100;
+  update_nz(v);
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// RMB2 $nn
+bool op_27(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log)) & ~4;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// PLP
+bool op_28(struct cpu *cpu, struct instruction_log *log)
+{
+  // E & B flags cannot be set via PLP
+  cpu->regs.flags &= FLAG_E | FLAG_B;
+  cpu->regs.flags |= stack_pop(cpu, log) & ~(FLAG_E | FLAG_B);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// AND #$nn
+bool op_29(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.a &= log->bytes[1];
+  update_nz(cpu->regs.a);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// ROL A
+bool op_2A(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = cpu->regs.a << 1;
+  if (cpu->regs.flag_c)
+    v |= 0x1;
+  cpu->regs.flag_c = v >= 0x100;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 1;
+  cpu->regs.pc += 1;
+  return true;
+}
+
+// TYS
+bool op_2B(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.sph = cpu->regs.y;
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// BIT $xxxx
+bool op_2C(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  cpu->regs.pc += 3;
+  update_bit_flags(read_memory(cpu, addr_abs(log)));
+  return true;
+}
+
+// AND $nnnn
+bool op_2D(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_abs(log));
+  v &= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// ROL $nnnn
+bool op_2E(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_abs(log)) << 1;
+  if (cpu->regs.flag_c)
+    v |= 0x1;
+  cpu->regs.flag_c = v >= 0x100;
+  update_nz(v);
+  MEM_WRITE16(cpu, addr_abs(log), v);
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// BBR2 $nn,$rr
+bool op_2F(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  if ((v & 4) == 0) {
+    cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+  cpu->regs.pc += 3;
+  log->len = 3;
+  return true;
+}
+
+// BMI $rr
+bool op_30(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  if (!(cpu->regs.flags & FLAG_N))
     cpu->regs.pc += 2;
-    break;
-  case 0x4A: // LSR A
-    v = cpu->regs.a;
-    cpu->regs.flag_c = v & 1;
-    v >>= 1;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 1;
-    cpu->regs.pc++;
-    break;
-  case 0x4B: // TAZ
-    cpu->regs.z = cpu->regs.a;
-    update_nz(cpu->regs.z);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x4c: // JMP $nnnn
-    cpu->regs.pc = addr_abs(log);
-    log->len = 3;
-    break;
-  case 0x4d: // EOR $nnnn
-    v = read_memory(cpu, addr_abs(log));
-    v ^= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x4e: // LSR $nnnn
-    v = read_memory(cpu, addr_abs(log));
-    cpu->regs.flag_c = v & 1;
-    v >>= 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_abs(log), v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x4F: // BBR4 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 16) == 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
+  else
+    cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
+  return true;
+}
+
+// AND ($nn),Y
+bool op_31(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_izpy(cpu, log));
+  v &= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// AND ($nn),Z
+bool op_32(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_izpz(cpu, log));
+  v &= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// BMI $rrrr
+bool op_33(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  if (!(cpu->regs.flags & FLAG_N))
     cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0x50: // BVC $rr
-    log->len = 2;
-    if (cpu->regs.flag_v)
-      cpu->regs.pc += 2;
-    else
-      cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
-    break;
-  case 0x51: // EOR ($nn),Y
-    v = read_memory(cpu, addr_izpy(cpu, log));
-    v ^= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
+  else
+    cpu->regs.pc += 2 + rel16_delta(log->bytes[1]);
+  return true;
+}
+
+// BIT $xx,X
+bool op_34(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  update_bit_flags(read_memory(cpu, addr_zpx(cpu, log)));
+  return true;
+}
+
+// AND $nn,X
+bool op_35(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zpx(cpu, log));
+  v &= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// ROL $nn,X
+bool op_36(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zpx(cpu, log)) << 1;
+  if (cpu->regs.flag_c)
+    v |= 0x1;
+  cpu->regs.flag_c = v >= 0x100;
+  update_nz(v);
+  MEM_WRITE16(cpu, addr_zpx(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// RMB3 $nn
+bool op_37(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log)) & ~8;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// SEC
+bool op_38(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.flags |= FLAG_C;
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// AND $nnnn,Y
+bool op_39(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_absy(cpu, log));
+  v &= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// DEC A
+bool op_3A(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.a--;
+  update_nz(cpu->regs.a);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// BIT $xxxx,X
+bool op_3C(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  cpu->regs.pc += 3;
+  update_bit_flags(read_memory(cpu, addr_absx(cpu, log)));
+  return true;
+}
+
+// AND $nnnn,X
+bool op_3D(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_absx(cpu, log));
+  v &= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// ROL $nnnn,X
+bool op_3E(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_absx(cpu, log)) << 1;
+  if (cpu->regs.flag_c)
+    v |= 0x1;
+  cpu->regs.flag_c = v >= 0x100;
+  update_nz(v);
+  MEM_WRITE16(cpu, addr_absx(cpu, log), v);
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// BBR3 $nn,$rr
+bool op_3F(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  if ((v & 8) == 0) {
+    cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+  cpu->regs.pc += 3;
+  log->len = 3;
+  return true;
+}
+
+// RTI
+bool op_40(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 1;
+  // E & B flags cannot be set via RTI
+  cpu->regs.flags &= FLAG_E | FLAG_B;
+  cpu->regs.flags |= stack_pop(cpu, log) & ~(FLAG_E | FLAG_B);
+  cpu->regs.pc = stack_pop(cpu, log);
+  cpu->regs.pc |= stack_pop(cpu, log) << 8;
+  return true;
+}
+
+// EOR ($nn,X)
+bool op_41(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_izpx(cpu, log));
+  v ^= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// EOR $nn
+bool op_45(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  v ^= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// LSR $nn
+bool op_46(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  cpu->regs.flag_c = v & 1;
+  v >>= 1;
+  update_nz(v);
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// RMB4 $nn
+bool op_47(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log)) & ~16;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// PHA
+bool op_48(struct cpu *cpu, struct instruction_log *log)
+{
+  stack_push(cpu, cpu->regs.a);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// EOR #$nn
+bool op_49(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.a ^= log->bytes[1];
+  update_nz(cpu->regs.a);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// LSR A
+bool op_4A(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = cpu->regs.a;
+  cpu->regs.flag_c = v & 1;
+  v >>= 1;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 1;
+  cpu->regs.pc++;
+  return true;
+}
+
+// TAZ
+bool op_4B(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.z = cpu->regs.a;
+  update_nz(cpu->regs.z);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// JMP $nnnn
+bool op_4C(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.pc = addr_abs(log);
+  log->len = 3;
+  return true;
+}
+
+// EOR $nnnn
+bool op_4D(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_abs(log));
+  v ^= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// LSR $nnnn
+bool op_4E(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_abs(log));
+  cpu->regs.flag_c = v & 1;
+  v >>= 1;
+  update_nz(v);
+  MEM_WRITE16(cpu, addr_abs(log), v);
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// BBR4 $nn,$rr
+bool op_4F(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  if ((v & 16) == 0) {
+    cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+  cpu->regs.pc += 3;
+  log->len = 3;
+  return true;
+}
+
+// BVC $rr
+bool op_50(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  if (cpu->regs.flag_v)
     cpu->regs.pc += 2;
-    break;
-  case 0x52: // EOR ($nn),Z
-    v = read_memory(cpu, addr_izpz(cpu, log));
-    v ^= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
+  else
+    cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
+  return true;
+}
+
+// EOR ($nn),Y
+bool op_51(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_izpy(cpu, log));
+  v ^= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// EOR ($nn),Z
+bool op_52(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_izpz(cpu, log));
+  v ^= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// EOR $nn,X
+bool op_55(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zpx(cpu, log));
+  v ^= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// LSR $nn,X
+bool op_56(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zpx(cpu, log));
+  cpu->regs.flag_c = v & 1;
+  v >>= 1;
+  update_nz(v);
+  MEM_WRITE16(cpu, addr_zpx(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// RMB5 $nn
+bool op_57(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log)) & ~32;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// CLI
+bool op_58(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.flags &= ~FLAG_I;
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// EOR $nnnn,Y
+bool op_59(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_absy(cpu, log));
+  v ^= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// PHY
+bool op_5A(struct cpu *cpu, struct instruction_log *log)
+{
+  stack_push(cpu, cpu->regs.y);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// TAB
+bool op_5B(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.b = cpu->regs.a;
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// MAP
+bool op_5C(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.pc++;
+
+  if (cpu->regs.x == 0x0f)
+    cpu->regs.maplomb = cpu->regs.a;
+  else
+    cpu->regs.maplo = cpu->regs.a + (cpu->regs.x << 8);
+  if (!cpu->regs.in_hyper) {
+    if (cpu->regs.z == 0x0f)
+      cpu->regs.maphimb = cpu->regs.y;
+    else
+      cpu->regs.maphi = cpu->regs.y + (cpu->regs.z << 8);
+  }
+  cpu_map_changed(cpu);
+  cpu->regs.map_irq_inhibit = 1;
+  log->len = 1;
+  return true;
+}
+
+// EOR $nnnn,X
+bool op_5D(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_absx(cpu, log));
+  v ^= cpu->regs.a;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// LSR $nnnn,X
+bool op_5E(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_absx(cpu, log));
+  cpu->regs.flag_c = v & 1;
+  v >>= 1;
+  update_nz(v);
+  MEM_WRITE16(cpu, addr_absx(cpu, log), v);
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// BBR5 $nn,$rr
+bool op_5F(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  if ((v & 32) == 0) {
+    cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+  cpu->regs.pc += 3;
+  log->len = 3;
+  return true;
+}
+
+// RTS
+bool op_60(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 1;
+  if (cpu->term.rts) {
+    cpu->term.rts--;
+    if (!cpu->term.rts) {
+      fprintf(logfile, "INFO: Terminating via RTS\n");
+      cpu->term.done = true;
+    }
+  }
+  cpu->regs.pc = stack_pop(cpu, log);
+  cpu->regs.pc |= stack_pop(cpu, log) << 8;
+  cpu->regs.pc++;
+  return true;
+}
+
+// ADC ($nn,X)
+bool op_61(struct cpu *cpu, struct instruction_log *log)
+{
+  adc(cpu, read_memory(cpu, addr_izpx(cpu, log)));
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// STZ $xx
+bool op_64(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), cpu->regs.z);
+  return true;
+}
+
+// ADC $nn
+bool op_65(struct cpu *cpu, struct instruction_log *log)
+{
+  adc(cpu, read_memory(cpu, addr_zp(cpu, log)));
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// ROR $nn
+bool op_66(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  if (cpu->regs.flag_c)
+    v |= 0x100;
+  cpu->regs.flag_c = v & 1;
+  v = v >> 1;
+  update_nz(v);
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// RMB6 $nn
+bool op_67(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log)) & ~64;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// PLA
+bool op_68(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.a = stack_pop(cpu, log);
+  update_nz(cpu->regs.a);
+  log->len = 1;
+  cpu->regs.pc++;
+  return true;
+}
+
+// ADC #$nn
+bool op_69(struct cpu *cpu, struct instruction_log *log)
+{
+  adc(cpu, log->bytes[1]);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// ROR A
+bool op_6A(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = cpu->regs.a;
+  if (cpu->regs.flag_c)
+    v |= 0x100;
+  cpu->regs.flag_c = v & 1;
+  v = v >> 1;
+  update_nz(v);
+  cpu->regs.a = v;
+  log->len = 1;
+  cpu->regs.pc += 1;
+  return true;
+}
+
+// TZA
+bool op_6B(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.a = cpu->regs.z;
+  update_nz(cpu->regs.a);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// JMP ($nnnn)
+bool op_6C(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.pc = addr_deref16(cpu, log);
+  log->len = 3;
+  return true;
+}
+
+// ADC $nnnn
+bool op_6D(struct cpu *cpu, struct instruction_log *log)
+{
+  adc(cpu, read_memory(cpu, addr_abs(log)));
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// ROR $nnnn
+bool op_6E(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_abs(log));
+  if (cpu->regs.flag_c)
+    v |= 0x100;
+  cpu->regs.flag_c = v & 1;
+  v = v >> 1;
+  update_nz(v);
+  MEM_WRITE16(cpu, addr_abs(log), v);
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// BBR6 $nn,$rr
+bool op_6F(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  if ((v & 64) == 0) {
+    cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+  cpu->regs.pc += 3;
+  log->len = 3;
+  return true;
+}
+
+// BVS $rr-
+bool op_70(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  if (!cpu->regs.flag_v)
     cpu->regs.pc += 2;
-    break;
-  case 0x55: // EOR $nn,X
-    v = read_memory(cpu, addr_zpx(cpu, log));
-    v ^= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 2;
+  else
+    cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
+  return true;
+}
+
+// ADC ($nn),Y
+bool op_71(struct cpu *cpu, struct instruction_log *log)
+{
+  adc(cpu, read_memory(cpu, addr_izpy(cpu, log)));
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// ADC ($nn),Z
+bool op_72(struct cpu *cpu, struct instruction_log *log)
+{
+  adc(cpu, read_memory(cpu, addr_izpz(cpu, log)));
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// STZ $xx,X
+bool op_74(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  MEM_WRITE16(cpu, addr_zpx(cpu, log), cpu->regs.z);
+  return true;
+}
+
+// ADC $nn,X
+bool op_75(struct cpu *cpu, struct instruction_log *log)
+{
+  adc(cpu, read_memory(cpu, addr_zpx(cpu, log)));
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// ROR $nn,X
+bool op_76(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zpx(cpu, log));
+  if (cpu->regs.flag_c)
+    v |= 0x100;
+  cpu->regs.flag_c = v & 1;
+  v = v >> 1;
+  update_nz(v);
+  MEM_WRITE16(cpu, addr_zpx(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// RMB7 $nn
+bool op_77(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log)) & ~128;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// SEI
+bool op_78(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.flags |= FLAG_I;
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// ADC $nnnn,Y
+bool op_79(struct cpu *cpu, struct instruction_log *log)
+{
+  adc(cpu, read_memory(cpu, addr_absy(cpu, log)));
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// PLY
+bool op_7A(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.pc++;
+  log->len = 1;
+  cpu->regs.y = stack_pop(cpu, log);
+  update_nz(cpu->regs.y);
+  return true;
+}
+
+// TBA
+bool op_7B(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.a = cpu->regs.b;
+  update_nz(cpu->regs.a);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// JMP ($nnnn,X)
+bool op_7C(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.pc = addr_iabsx(cpu, log);
+  log->len = 3;
+  return true;
+}
+
+// ADC $nnnn,X
+bool op_7D(struct cpu *cpu, struct instruction_log *log)
+{
+  adc(cpu, read_memory(cpu, addr_absx(cpu, log)));
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// ROR $nnnn,X
+bool op_7E(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_absx(cpu, log));
+  if (cpu->regs.flag_c)
+    v |= 0x100;
+  cpu->regs.flag_c = v & 1;
+  v = v >> 1;
+  update_nz(v);
+  MEM_WRITE16(cpu, addr_absx(cpu, log), v);
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// BBR7 $nn,$rr
+bool op_7F(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  if ((v & 128) == 0) {
+    cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+  cpu->regs.pc += 3;
+  log->len = 3;
+  return true;
+}
+
+// BRA $rr
+bool op_80(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
+  return true;
+}
+
+// STA ($xx,X)
+bool op_81(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  MEM_WRITE16(cpu, addr_izpx(cpu, log), cpu->regs.a);
+  return true;
+}
+
+// BRA $rrrr
+bool op_83(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  cpu->regs.pc += 2 + rel16_delta(log->bytes[1]);
+  return true;
+}
+
+// STY $xx
+bool op_84(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), cpu->regs.y);
+  return true;
+}
+
+// STA $xx
+bool op_85(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), cpu->regs.a);
+  return true;
+}
+
+// STX $xx
+bool op_86(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), cpu->regs.x);
+  return true;
+}
+
+// SMB0 $nn
+bool op_87(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log)) | 1;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// DEY
+bool op_88(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.y--;
+  update_nz(cpu->regs.y);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// BIT #$xx
+bool op_89(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  // NOTE: Bit # does NOT alter the N and V flags, unlike BIT's other addressing modes.
+  //       http://forum.6502.org/viewtopic.php?f=2&t=2241&p=27243#p27239
+  log->len = 2;
+  cpu->regs.pc += 2;
+  v = log->bytes[1] & cpu->regs.a;
+  cpu->regs.flag_z = (v == 0);
+  return true;
+}
+
+// TXA
+bool op_8A(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.a = cpu->regs.x;
+  update_nz(cpu->regs.a);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// STY $xxxx
+bool op_8C(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  cpu->regs.pc += 3;
+  MEM_WRITE16(cpu, addr_abs(log), cpu->regs.y);
+  return true;
+}
+
+// STA $xxxx
+bool op_8D(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  cpu->regs.pc += 3;
+  MEM_WRITE16(cpu, addr_abs(log), cpu->regs.a);
+  return true;
+}
+
+// STX $xxxx
+bool op_8E(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  cpu->regs.pc += 3;
+  MEM_WRITE16(cpu, addr_abs(log), cpu->regs.x);
+  return true;
+}
+
+// BBS0 $nn,$rr
+bool op_8F(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  if ((v & 1) != 0) {
+    cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+  cpu->regs.pc += 3;
+  log->len = 3;
+  return true;
+}
+
+// BCC $rr
+bool op_90(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  if (cpu->regs.flags & FLAG_C)
     cpu->regs.pc += 2;
-    break;
-  case 0x56: // LSR $nn,X
-    v = read_memory(cpu, addr_zpx(cpu, log));
-    cpu->regs.flag_c = v & 1;
-    v >>= 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_zpx(cpu, log), v);
-    log->len = 2;
+  else
+    cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
+  return true;
+}
+
+// STA ($xx),Y
+bool op_91(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  log->zp16 = 1;
+  MEM_WRITE16(cpu, addr_izpy(cpu, log), cpu->regs.a);
+  return true;
+}
+
+// STA ($xx),Z
+bool op_92(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  if (cpulog_entry(cpulog_len - 2) && cpulog_entry(cpulog_len - 2)->bytes[0] == 0xEA) {
+    // NOP prefix means 32-bit ZP pointer
+    fprintf(logfile, "ZP32 address = $%07x\n", addr_izpz32(cpu, log));
+    log->zp32 = 1;
+    MEM_WRITE28(cpu, addr_izpz32(cpu, log), cpu->regs.a);
+  }
+  else {
+    // Normal 16-bit ZP pointer
+    log->zp16 = 1;
+    MEM_WRITE16(cpu, addr_izpz(cpu, log), cpu->regs.a);
+  }
+  return true;
+}
+
+// BCC $rrrr
+bool op_93(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  if (cpu->regs.flags & FLAG_C)
+    cpu->regs.pc += 3;
+  else
+    cpu->regs.pc += 3 + rel16_delta(log->bytes[1] + (log->bytes[2] << 8));
+  return true;
+}
+
+// STA $xx,X
+bool op_94(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  MEM_WRITE16(cpu, addr_zpx(cpu, log), cpu->regs.y);
+  return true;
+}
+
+// STA $xx,X
+bool op_95(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  MEM_WRITE16(cpu, addr_zpx(cpu, log), cpu->regs.a);
+  return true;
+}
+
+// STX $xx,Y
+bool op_96(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  MEM_WRITE16(cpu, addr_zpy(cpu, log), cpu->regs.x);
+  return true;
+}
+
+// SMB1 $nn
+bool op_97(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log)) | 2;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// TYA
+bool op_98(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.a = cpu->regs.y;
+  update_nz(cpu->regs.a);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// STA $xxxx,Y
+bool op_99(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  cpu->regs.pc += 3;
+  MEM_WRITE16(cpu, addr_absy(cpu, log), cpu->regs.a);
+  return true;
+}
+
+// TXS
+bool op_9A(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.spl = cpu->regs.x;
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// STZ $xxxx
+bool op_9C(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  cpu->regs.pc += 3;
+  MEM_WRITE16(cpu, addr_abs(log), cpu->regs.z);
+  return true;
+}
+
+// STA $xxxx,X
+bool op_9D(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  cpu->regs.pc += 3;
+  MEM_WRITE16(cpu, addr_absx(cpu, log), cpu->regs.a);
+  return true;
+}
+
+// STZ $xxxx,X
+bool op_9E(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  cpu->regs.pc += 3;
+  MEM_WRITE16(cpu, addr_absx(cpu, log), cpu->regs.z);
+  return true;
+}
+
+// BBS1 $nn,$rr
+bool op_9F(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  if ((v & 2) != 0) {
+    cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+  cpu->regs.pc += 3;
+  log->len = 3;
+  return true;
+}
+
+// LDY #$nn
+bool op_A0(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.y = log->bytes[1];
+  update_nz(cpu->regs.y);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// LDA ($xx,X)
+bool op_A1(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  log->zp16 = 1;
+  cpu->regs.a = read_memory(cpu, addr_izpx(cpu, log));
+  update_nz(cpu->regs.a);
+  return true;
+}
+
+// LDX #$nn
+bool op_A2(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.x = log->bytes[1];
+  update_nz(cpu->regs.x);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// LDZ #$nn
+bool op_A3(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.z = log->bytes[1];
+  update_nz(cpu->regs.z);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// LDY $xx
+bool op_A4(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  cpu->regs.y = read_memory(cpu, addr_zp(cpu, log));
+  update_nz(cpu->regs.y);
+  return true;
+}
+
+// LDA $xx
+bool op_A5(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  cpu->regs.a = read_memory(cpu, addr_zp(cpu, log));
+  update_nz(cpu->regs.a);
+  return true;
+}
+
+// LDX $xx
+bool op_A6(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  cpu->regs.x = read_memory(cpu, addr_zp(cpu, log));
+  update_nz(cpu->regs.x);
+  return true;
+}
+
+// SMB2 $nn
+bool op_A7(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log)) | 4;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// TAY
+bool op_A8(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.y = cpu->regs.a;
+  update_nz(cpu->regs.a);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// LDA #$nn
+bool op_A9(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.a = log->bytes[1];
+  update_nz(cpu->regs.a);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// TAX
+bool op_AA(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.x = cpu->regs.a;
+  update_nz(cpu->regs.a);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// LDY $xxxx
+bool op_AC(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  cpu->regs.pc += 3;
+  cpu->regs.y = read_memory(cpu, addr_abs(log));
+  update_nz(cpu->regs.y);
+  return true;
+}
+
+// LDA $xxxx
+bool op_AD(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  cpu->regs.pc += 3;
+  cpu->regs.a = read_memory(cpu, addr_abs(log));
+  update_nz(cpu->regs.a);
+  return true;
+}
+
+// LDX $xxxx
+bool op_AE(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  cpu->regs.pc += 3;
+  cpu->regs.x = read_memory(cpu, addr_abs(log));
+  update_nz(cpu->regs.x);
+  return true;
+}
+
+// BBS2 $nn,$rr
+bool op_AF(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  if ((v & 4) != 0) {
+    cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+  cpu->regs.pc += 3;
+  log->len = 3;
+  return true;
+}
+
+// BCS $rr
+bool op_B0(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  if (cpu->regs.flags & FLAG_C)
+    cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
+  else
     cpu->regs.pc += 2;
-    break;
-  case 0x57: // RMB5 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) & ~32;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
+  return true;
+}
+
+// LDA ($xx),Y
+bool op_B1(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  log->zp16 = 1;
+  cpu->regs.a = read_memory(cpu, addr_izpy(cpu, log));
+  update_nz(cpu->regs.a);
+  return true;
+}
+
+// LDA ($xx),Z
+bool op_B2(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  log->zp16 = 1;
+  cpu->regs.a = read_memory(cpu, addr_izpz(cpu, log));
+  update_nz(cpu->regs.a);
+  return true;
+}
+
+// LDY $xx,X
+bool op_B4(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  cpu->regs.y = read_memory(cpu, addr_zpx(cpu, log));
+  update_nz(cpu->regs.y);
+  return true;
+}
+
+// LDA $xx,X
+bool op_B5(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  cpu->regs.a = read_memory(cpu, addr_zpx(cpu, log));
+  update_nz(cpu->regs.a);
+  return true;
+}
+
+// LDX $xx,Y
+bool op_B6(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  cpu->regs.pc += 2;
+  cpu->regs.x = read_memory(cpu, addr_zpy(cpu, log));
+  update_nz(cpu->regs.x);
+  return true;
+}
+
+// SMB3 $nn
+bool op_B7(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log)) | 8;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// CLV
+bool op_B8(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.flags &= ~FLAG_V;
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// LDA $xxxx,Y
+bool op_B9(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  cpu->regs.pc += 3;
+  cpu->regs.a = read_memory(cpu, addr_absy(cpu, log));
+  update_nz(cpu->regs.a);
+  return true;
+}
+
+// TSX
+bool op_BA(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 1;
+  cpu->regs.pc += 1;
+  cpu->regs.x = cpu->regs.spl;
+  update_nz(cpu->regs.x);
+  return true;
+}
+
+// LDY $xxxx,X
+bool op_BC(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  cpu->regs.pc += 3;
+  cpu->regs.y = read_memory(cpu, addr_absx(cpu, log));
+  update_nz(cpu->regs.y);
+  return true;
+}
+
+// LDA $xxxx,X
+bool op_BD(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  cpu->regs.pc += 3;
+  cpu->regs.a = read_memory(cpu, addr_absx(cpu, log));
+  update_nz(cpu->regs.a);
+  return true;
+}
+
+// LDX $xxxx,Y
+bool op_BE(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  cpu->regs.pc += 3;
+  cpu->regs.x = read_memory(cpu, addr_absy(cpu, log));
+  update_nz(cpu->regs.x);
+  return true;
+}
+
+// BBS3 $nn,$rr
+bool op_BF(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  if ((v & 8) != 0) {
+    cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+  cpu->regs.pc += 3;
+  log->len = 3;
+  return true;
+}
+
+// CPY #$nn
+bool op_C0(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = cpu->regs.y - log->bytes[1];
+  update_cmp_flags(v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// CMP ($nn,X)
+bool op_C1(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = cpu->regs.a - read_memory(cpu, addr_izpx(cpu, log));
+  update_cmp_flags(v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// CPY $nn
+bool op_C4(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = cpu->regs.y - read_memory(cpu, addr_zp(cpu, log));
+  update_cmp_flags(v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// CMP $nn
+bool op_C5(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = cpu->regs.a - read_memory(cpu, addr_zp(cpu, log));
+  update_cmp_flags(v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// DEC $xx
+bool op_C6(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  v--;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  update_nz(v);
+  return true;
+}
+
+// SMB4 $nn
+bool op_C7(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log)) | 16;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// INY
+bool op_C8(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.y++;
+  update_nz(cpu->regs.y);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// CMP #$nn
+bool op_C9(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = cpu->regs.a - log->bytes[1];
+  update_cmp_flags(v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// DEX
+bool op_CA(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.x--;
+  update_nz(cpu->regs.x);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// CPY $nnnn
+bool op_CC(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = cpu->regs.y - read_memory(cpu, addr_abs(log));
+  update_cmp_flags(v);
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// CMP $nnnn
+bool op_CD(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = cpu->regs.a - read_memory(cpu, addr_abs(log));
+  update_cmp_flags(v);
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// DEC $xxxx
+bool op_CE(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 3;
+  cpu->regs.pc += 3;
+  v = read_memory(cpu, addr_abs(log));
+  v--;
+  MEM_WRITE16(cpu, addr_abs(log), v);
+  update_nz(v);
+  return true;
+}
+
+// BBS4 $nn,$rr
+bool op_CF(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  if ((v & 16) != 0) {
+    cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+  cpu->regs.pc += 3;
+  log->len = 3;
+  return true;
+}
+
+// BNE $rr
+bool op_D0(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  if (cpu->regs.flags & FLAG_Z)
     cpu->regs.pc += 2;
-    break;
-  case 0x58: // CLI
-    cpu->regs.flags &= ~FLAG_I;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x59: // EOR $nnnn,Y
-    v = read_memory(cpu, addr_absy(cpu, log));
-    v ^= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x5A: // PHY
-    stack_push(cpu, cpu->regs.y);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x5b: // TAB
-    cpu->regs.b = cpu->regs.a;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x5c: // MAP
-    cpu->regs.pc++;
+  else
+    cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
+  return true;
+}
+
+// CMP ($nn),Y
+bool op_D1(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = cpu->regs.a - read_memory(cpu, addr_izpy(cpu, log));
+  update_cmp_flags(v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// CMP ($nn),Z
+bool op_D2(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = cpu->regs.a - read_memory(cpu, addr_izpz(cpu, log));
+  update_cmp_flags(v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// CMP $nn,X
+bool op_D5(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = cpu->regs.a - read_memory(cpu, addr_zpx(cpu, log));
+  update_cmp_flags(v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// DEC $xx,X
+bool op_D6(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  v = read_memory(cpu, addr_zpx(cpu, log));
+  v--;
+  MEM_WRITE16(cpu, addr_zpx(cpu, log), v);
+  update_nz(v);
+  return true;
+}
+
+// SMB5 $nn
+bool op_D7(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log)) | 32;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// CLD
+bool op_D8(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.flags &= ~FLAG_D;
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// CMP $nnnn,Y
+bool op_D9(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = cpu->regs.a - read_memory(cpu, addr_absy(cpu, log));
+  update_cmp_flags(v);
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// PHX
+bool op_DA(struct cpu *cpu, struct instruction_log *log)
+{
+  stack_push(cpu, cpu->regs.x);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// PHZ
+bool op_DB(struct cpu *cpu, struct instruction_log *log)
+{
+  stack_push(cpu, cpu->regs.z);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// CMP $nnnn,X
+bool op_DD(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = cpu->regs.a - read_memory(cpu, addr_absx(cpu, log));
+  update_cmp_flags(v);
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// DEC $xxxx,X
+bool op_DE(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 3;
+  cpu->regs.pc += 3;
+  v = read_memory(cpu, addr_absx(cpu, log));
+  v--;
+  MEM_WRITE16(cpu, addr_absx(cpu, log), v);
+  update_nz(v);
+  return true;
+}
+
+// BBS5 $nn,$rr
+bool op_DF(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  if ((v & 32) != 0) {
+    cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+  cpu->regs.pc += 3;
+  log->len = 3;
+  return true;
+}
 
-    if (cpu->regs.x == 0x0f)
-      cpu->regs.maplomb = cpu->regs.a;
-    else
-      cpu->regs.maplo = cpu->regs.a + (cpu->regs.x << 8);
-    if (!cpu->regs.in_hyper) {
-      if (cpu->regs.z == 0x0f)
-        cpu->regs.maphimb = cpu->regs.y;
-      else
-        cpu->regs.maplo = cpu->regs.y + (cpu->regs.z << 8);
-    }
-    cpu->regs.map_irq_inhibit = 1;
-    log->len = 1;
-    break;
-  case 0x5d: // EOR $nnnn,X
-    v = read_memory(cpu, addr_absx(cpu, log));
-    v ^= cpu->regs.a;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x5e: // LSR $nnnn,X
-    v = read_memory(cpu, addr_absx(cpu, log));
-    cpu->regs.flag_c = v & 1;
-    v >>= 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_absx(cpu, log), v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x5F: // BBR5 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 32) == 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0x60: // RTS
-    log->len = 1;
-    if (cpu->term.rts) {
-      cpu->term.rts--;
-      if (!cpu->term.rts) {
-        fprintf(logfile, "INFO: Terminating via RTS\n");
-        cpu->term.done = true;
-      }
-    }
-    cpu->regs.pc = stack_pop(cpu, log);
-    cpu->regs.pc |= stack_pop(cpu, log) << 8;
-    cpu->regs.pc++;
-    break;
-  case 0x61: // ADC ($nn,X)
-    adc(cpu, read_memory(cpu, addr_izpx(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x64: // STZ $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), cpu->regs.z);
-    break;
-  case 0x65: // ADC $nn
-    adc(cpu, read_memory(cpu, addr_zp(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x66: // ROR $nn
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if (cpu->regs.flag_c)
-      v |= 0x100;
-    cpu->regs.flag_c = v & 1;
-    v = v >> 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x67: // RMB6 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) & ~64;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x68: // PLA
-    cpu->regs.a = stack_pop(cpu, log);
-    update_nz(cpu->regs.a);
-    log->len = 1;
-    cpu->regs.pc++;
-    break;
-  case 0x69: // ADC #$nn
-    adc(cpu, log->bytes[1]);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x6A: // ROR A
-    v = cpu->regs.a;
-    if (cpu->regs.flag_c)
-      v |= 0x100;
-    cpu->regs.flag_c = v & 1;
-    v = v >> 1;
-    update_nz(v);
-    cpu->regs.a = v;
-    log->len = 1;
-    cpu->regs.pc += 1;
-    break;
-  case 0x6B: // TZA
-    cpu->regs.a = cpu->regs.z;
-    update_nz(cpu->regs.a);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x6C: // JMP ($nnnn)
-    cpu->regs.pc = addr_deref16(cpu, log);
-    log->len = 3;
-    break;
-  case 0x6D: // ADC $nnnn
-    adc(cpu, read_memory(cpu, addr_abs(log)));
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x6E: // ROR $nnnn
-    v = read_memory(cpu, addr_abs(log));
-    if (cpu->regs.flag_c)
-      v |= 0x100;
-    cpu->regs.flag_c = v & 1;
-    v = v >> 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_abs(log), v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x6F: // BBR6 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 64) == 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0x70: // BVS $rr-
-    log->len = 2;
-    if (!cpu->regs.flag_v)
-      cpu->regs.pc += 2;
-    else
-      cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
-    break;
-  case 0x71: // ADC ($nn),Y
-    adc(cpu, read_memory(cpu, addr_izpy(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x72: // ADC ($nn),Z
-    adc(cpu, read_memory(cpu, addr_izpz(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x74: // STZ $xx,X
-    log->len = 2;
-    cpu->regs.pc += 2;
-    MEM_WRITE16(cpu, addr_zpx(cpu, log), cpu->regs.z);
-    break;
-  case 0x75: // ADC $nn,X
-    adc(cpu, read_memory(cpu, addr_zpx(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x76: // ROR $nn,X
-    v = read_memory(cpu, addr_zpx(cpu, log));
-    if (cpu->regs.flag_c)
-      v |= 0x100;
-    cpu->regs.flag_c = v & 1;
-    v = v >> 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_zpx(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x77: // RMB7 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) & ~128;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x78: // SEI
-    cpu->regs.flags |= FLAG_I;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x79: // ADC $nnnn,Y
-    adc(cpu, read_memory(cpu, addr_absy(cpu, log)));
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x7a: // PLY
-    cpu->regs.pc++;
-    log->len = 1;
-    cpu->regs.y = stack_pop(cpu, log);
-    update_nz(cpu->regs.y);
-    break;
-  case 0x7b: // TBA
-    cpu->regs.a = cpu->regs.b;
-    update_nz(cpu->regs.a);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x7C: // JMP ($nnnn,X)
-    cpu->regs.pc = addr_iabsx(cpu, log);
-    log->len = 3;
-    break;
-  case 0x7D: // ADC $nnnn,X
-    adc(cpu, read_memory(cpu, addr_absx(cpu, log)));
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x7e: // ROR $nnnn,X
-    v = read_memory(cpu, addr_absx(cpu, log));
-    if (cpu->regs.flag_c)
-      v |= 0x100;
-    cpu->regs.flag_c = v & 1;
-    v = v >> 1;
-    update_nz(v);
-    MEM_WRITE16(cpu, addr_absx(cpu, log), v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0x7F: // BBR7 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 128) == 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0x80: // BRA $rr
-    log->len = 2;
+// CPX #$nn
+bool op_E0(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = cpu->regs.x - log->bytes[1];
+  update_cmp_flags(v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// SBC ($nn,X)
+bool op_E1(struct cpu *cpu, struct instruction_log *log)
+{
+  sbc(cpu, read_memory(cpu, addr_izpx(cpu, log)));
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// CPX $nn
+bool op_E4(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = cpu->regs.x - read_memory(cpu, addr_zp(cpu, log));
+  update_cmp_flags(v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// SBC $nn
+bool op_E5(struct cpu *cpu, struct instruction_log *log)
+{
+  sbc(cpu, read_memory(cpu, addr_zp(cpu, log)));
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// INC $xx
+bool op_E6(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  v++;
+  v &= 0xff;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  update_nz(v);
+  return true;
+}
+
+// SMB6 $nn
+bool op_E7(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log)) | 64;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// INX
+bool op_E8(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.x++;
+  update_nz(cpu->regs.x);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// SBC #$nn
+bool op_E9(struct cpu *cpu, struct instruction_log *log)
+{
+  sbc(cpu, log->bytes[1]);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// EOM / NOP
+bool op_EA(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.pc++;
+  cpu->regs.map_irq_inhibit = 0;
+  log->len = 1;
+  return true;
+}
+
+// CPX $nnnn
+bool op_EC(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = cpu->regs.x - read_memory(cpu, addr_abs(log));
+  update_cmp_flags(v);
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// SBC $nnnn
+bool op_ED(struct cpu *cpu, struct instruction_log *log)
+{
+  sbc(cpu, read_memory(cpu, addr_abs(log)));
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// INC $xxxx
+bool op_EE(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 3;
+  cpu->regs.pc += 3;
+  v = read_memory(cpu, addr_abs(log));
+  v++;
+  MEM_WRITE16(cpu, addr_abs(log), v);
+  update_nz(v);
+  return true;
+}
+
+// BBS6 $nn,$rr
+bool op_EF(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  if ((v & 64) != 0) {
+    cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+  cpu->regs.pc += 3;
+  log->len = 3;
+  return true;
+}
+
+// BEQ $rr
+bool op_F0(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 2;
+  if (cpu->regs.flags & FLAG_Z)
     cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
-    break;
-  case 0x81: // STA ($xx,X)
-    log->len = 2;
-    cpu->regs.pc += 2;
-    MEM_WRITE16(cpu, addr_izpx(cpu, log), cpu->regs.a);
-    break;
-  case 0x83: // BRA $rrrr
-    log->len = 3;
-    cpu->regs.pc += 2 + rel16_delta(log->bytes[1]);
-    break;
-  case 0x84: // STY $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), cpu->regs.y);
-    break;
-  case 0x85: // STA $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), cpu->regs.a);
-    break;
-  case 0x86: // STX $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), cpu->regs.x);
-    break;
-  case 0x87: // SMB0 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) | 1;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x88: // DEY
-    cpu->regs.y--;
-    update_nz(cpu->regs.y);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x89: // BIT #$xx
-    // NOTE: Bit # does NOT alter the N and V flags, unlike BIT's other addressing modes.
-    //       http://forum.6502.org/viewtopic.php?f=2&t=2241&p=27243#p27239
-    log->len = 2;
+  else
     cpu->regs.pc += 2;
-    v = log->bytes[1] & cpu->regs.a;
-    cpu->regs.flag_z = (v == 0);
-    break;
-  case 0x8a: // TXA
-    cpu->regs.a = cpu->regs.x;
-    update_nz(cpu->regs.a);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x8c: // STY $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    MEM_WRITE16(cpu, addr_abs(log), cpu->regs.y);
-    break;
-  case 0x8d: // STA $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    MEM_WRITE16(cpu, addr_abs(log), cpu->regs.a);
-    break;
-  case 0x8e: // STX $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    MEM_WRITE16(cpu, addr_abs(log), cpu->regs.x);
-    break;
-  case 0x8F: // BBS0 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 1) != 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
-    }
+  return true;
+}
+
+// SBC ($nn),Y
+bool op_F1(struct cpu *cpu, struct instruction_log *log)
+{
+  sbc(cpu, read_memory(cpu, addr_izpy(cpu, log)));
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// SBC ($nn),Z
+bool op_F2(struct cpu *cpu, struct instruction_log *log)
+{
+  sbc(cpu, read_memory(cpu, addr_izpz(cpu, log)));
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// BEQ $rrrr
+bool op_F3(struct cpu *cpu, struct instruction_log *log)
+{
+  log->len = 3;
+  if (cpu->regs.flags & FLAG_Z)
+    cpu->regs.pc += 3 + rel16_delta(log->bytes[1]);
+  else
     cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0x90: // BCC $rr
-    log->len = 2;
-    if (cpu->regs.flags & FLAG_C)
-      cpu->regs.pc += 2;
-    else
-      cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
-    break;
-  case 0x91: // STA ($xx),Y
-    log->len = 2;
-    cpu->regs.pc += 2;
-    log->zp16 = 1;
-    MEM_WRITE16(cpu, addr_izpy(cpu, log), cpu->regs.a);
-    break;
-  case 0x92: // STA ($xx),Z
-    log->len = 2;
-    cpu->regs.pc += 2;
-    if ((cpulog_len > 1) && cpulog[cpulog_len - 2]->bytes[0] == 0xEA) {
-      // NOP prefix means 32-bit ZP pointer
-      fprintf(logfile, "ZP32 address = $%07x\n", addr_izpz32(cpu, log));
-      log->zp32 = 1;
-      MEM_WRITE28(cpu, addr_izpz32(cpu, log), cpu->regs.a);
+  return true;
+}
+
+// SBC $nn,X
+bool op_F5(struct cpu *cpu, struct instruction_log *log)
+{
+  sbc(cpu, read_memory(cpu, addr_zpx(cpu, log)));
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// INC $xx,X
+bool op_F6(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 2;
+  cpu->regs.pc += 2;
+  v = read_memory(cpu, addr_zpx(cpu, log));
+  v++;
+  v &= 0xff;
+  MEM_WRITE16(cpu, addr_zpx(cpu, log), v);
+  update_nz(v);
+  return true;
+}
+
+// SMB7 $nn
+bool op_F7(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log)) | 128;
+  MEM_WRITE16(cpu, addr_zp(cpu, log), v);
+  log->len = 2;
+  cpu->regs.pc += 2;
+  return true;
+}
+
+// SED
+bool op_F8(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.flags |= FLAG_D;
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// SBC $nnnn,Y
+bool op_F9(struct cpu *cpu, struct instruction_log *log)
+{
+  sbc(cpu, read_memory(cpu, addr_absy(cpu, log)));
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// PLX
+bool op_FA(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.x = stack_pop(cpu, log);
+  update_nz(cpu->regs.x);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// PLZ
+bool op_FB(struct cpu *cpu, struct instruction_log *log)
+{
+  cpu->regs.z = stack_pop(cpu, log);
+  update_nz(cpu->regs.z);
+  cpu->regs.pc++;
+  log->len = 1;
+  return true;
+}
+
+// SBC $nnnn,X
+bool op_FD(struct cpu *cpu, struct instruction_log *log)
+{
+  sbc(cpu, read_memory(cpu, addr_absx(cpu, log)));
+  log->len = 3;
+  cpu->regs.pc += 3;
+  return true;
+}
+
+// INC $xxxx,X
+bool op_FE(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  log->len = 3;
+  cpu->regs.pc += 3;
+  v = read_memory(cpu, addr_absx(cpu, log));
+  v++;
+  MEM_WRITE16(cpu, addr_absx(cpu, log), v);
+  update_nz(v);
+  return true;
+}
+
+// BBS7 $nn,$rr
+bool op_FF(struct cpu *cpu, struct instruction_log *log)
+{
+  int v;
+  v = read_memory(cpu, addr_zp(cpu, log));
+  if ((v & 128) != 0) {
+    cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+  cpu->regs.pc += 3;
+  log->len = 3;
+  return true;
+}
+
+#define IMPLEMENTED_OPCODES(_op_)                                                                                      \
+  _op_(00) _op_(01) _op_(03) _op_(04) _op_(05) _op_(06) _op_(07) _op_(08) _op_(09) _op_(0A) _op_(0C) _op_(0D)          \
+  _op_(0E) _op_(0F) _op_(10) _op_(11) _op_(12) _op_(13) _op_(14) _op_(15) _op_(16) _op_(17) _op_(18) _op_(19)          \
+  _op_(1A) _op_(1B) _op_(1D) _op_(1E) _op_(1C) _op_(1F) _op_(20) _op_(21) _op_(22) _op_(24) _op_(25) _op_(26)          \
+  _op_(27) _op_(28) _op_(29) _op_(2A) _op_(2B) _op_(2C) _op_(2D) _op_(2E) _op_(2F) _op_(30) _op_(31) _op_(32)          \
+  _op_(33) _op_(34) _op_(35) _op_(36) _op_(37) _op_(38) _op_(39) _op_(3A) _op_(3C) _op_(3D) _op_(3E) _op_(3F)          \
+  _op_(40) _op_(41) _op_(45) _op_(46) _op_(47) _op_(48) _op_(49) _op_(4A) _op_(4B) _op_(4C) _op_(4D) _op_(4E)          \
+  _op_(4F) _op_(50) _op_(51) _op_(52) _op_(55) _op_(56) _op_(57) _op_(58) _op_(59) _op_(5A) _op_(5B) _op_(5C)          \
+  _op_(5D) _op_(5E) _op_(5F) _op_(60) _op_(61) _op_(64) _op_(65) _op_(66) _op_(67) _op_(68) _op_(69) _op_(6A)          \
+  _op_(6B) _op_(6C) _op_(6D) _op_(6E) _op_(6F) _op_(70) _op_(71) _op_(72) _op_(74) _op_(75) _op_(76) _op_(77)          \
+  _op_(78) _op_(79) _op_(7A) _op_(7B) _op_(7C) _op_(7D) _op_(7E) _op_(7F) _op_(80) _op_(81) _op_(83) _op_(84)          \
+  _op_(85) _op_(86) _op_(87) _op_(88) _op_(89) _op_(8A) _op_(8C) _op_(8D) _op_(8E) _op_(8F) _op_(90) _op_(91)          \
+  _op_(92) _op_(93) _op_(94) _op_(95) _op_(96) _op_(97) _op_(98) _op_(99) _op_(9A) _op_(9C) _op_(9D) _op_(9E)          \
+  _op_(9F) _op_(A0) _op_(A1) _op_(A2) _op_(A3) _op_(A4) _op_(A5) _op_(A6) _op_(A7) _op_(A8) _op_(A9) _op_(AA)          \
+  _op_(AC) _op_(AD) _op_(AE) _op_(AF) _op_(B0) _op_(B1) _op_(B2) _op_(B4) _op_(B5) _op_(B6) _op_(B7) _op_(B8)          \
+  _op_(B9) _op_(BA) _op_(BC) _op_(BD) _op_(BE) _op_(BF) _op_(C0) _op_(C1) _op_(C4) _op_(C5) _op_(C6) _op_(C7)          \
+  _op_(C8) _op_(C9) _op_(CA) _op_(CC) _op_(CD) _op_(CE) _op_(CF) _op_(D0) _op_(D1) _op_(D2) _op_(D5) _op_(D6)          \
+  _op_(D7) _op_(D8) _op_(D9) _op_(DA) _op_(DB) _op_(DD) _op_(DE) _op_(DF) _op_(E0) _op_(E1) _op_(E4) _op_(E5)          \
+  _op_(E6) _op_(E7) _op_(E8) _op_(E9) _op_(EA) _op_(EC) _op_(ED) _op_(EE) _op_(EF) _op_(F0) _op_(F1) _op_(F2)          \
+  _op_(F3) _op_(F5) _op_(F6) _op_(F7) _op_(F8) _op_(F9) _op_(FA) _op_(FB) _op_(FD) _op_(FE) _op_(FF)
+
+#define DEFINE_OPCODE_HANDLER(opcode) [0x##opcode] = op_##opcode,
+
+const opcode_handler opcode_handlers[256] = { IMPLEMENTED_OPCODES(DEFINE_OPCODE_HANDLER) };
+
+// Fetch the (up to) 6 bytes of the instruction at PC via the decoded instruction cache,
+// and return its handler (NULL if the opcode is not implemented)
+opcode_handler fetch_instruction(struct cpu *cpu, struct instruction_log *log)
+{
+  unsigned int pc = cpu->regs.pc;
+
+  // Only instructions entirely within one 4KB page are contiguous in the 28-bit
+  // address space, whatever the current memory mapping.
+  if ((pc & 0xfff) <= 0xffa) {
+    unsigned int addr = addr_to_28bit(cpu, pc, 0);
+    decoded_instruction *d = &decode_cache[addr & (DECODE_CACHE_SIZE - 1)];
+    if (d->addr == addr) {
+      memcpy(log->bytes, d->bytes, 6);
+      return d->handler;
     }
-    else {
-      // Normal 16-bit ZP pointer
-      log->zp16 = 1;
-      MEM_WRITE16(cpu, addr_izpz(cpu, log), cpu->regs.a);
+    if ((addr < CHIPRAM_SIZE - 5) || (addr >= 0xfff8000 && addr < 0xfffc000 - 5)) {
+      for (int i = 0; i < 6; i++)
+        log->bytes[i] = read_memory28(cpu, addr + i);
+      d->addr = addr;
+      memcpy(d->bytes, log->bytes, 6);
+      d->handler = opcode_handlers[log->bytes[0]];
+      return d->handler;
     }
-    break;
-  case 0x93: // BCC $rrrr
-    log->len = 3;
-    if (cpu->regs.flags & FLAG_C)
-      cpu->regs.pc += 3;
-    else
-      cpu->regs.pc += 3 + rel16_delta(log->bytes[1] + (log->bytes[2] << 8));
-    break;
-  case 0x94: // STA $xx,X
-    log->len = 2;
-    cpu->regs.pc += 2;
-    MEM_WRITE16(cpu, addr_zpx(cpu, log), cpu->regs.y);
-    break;
-  case 0x95: // STA $xx,X
-    log->len = 2;
-    cpu->regs.pc += 2;
-    MEM_WRITE16(cpu, addr_zpx(cpu, log), cpu->regs.a);
-    break;
-  case 0x96: // STX $xx,Y
-    log->len = 2;
-    cpu->regs.pc += 2;
-    MEM_WRITE16(cpu, addr_zpy(cpu, log), cpu->regs.x);
-    break;
-  case 0x97: // SMB1 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) | 2;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0x98: // TYA
-    cpu->regs.a = cpu->regs.y;
-    update_nz(cpu->regs.a);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x99: // STA $xxxx,Y
-    log->len = 3;
-    cpu->regs.pc += 3;
-    MEM_WRITE16(cpu, addr_absy(cpu, log), cpu->regs.a);
-    break;
-  case 0x9a: // TXS
-    cpu->regs.spl = cpu->regs.x;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0x9c: // STZ $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    MEM_WRITE16(cpu, addr_abs(log), cpu->regs.z);
-    break;
-  case 0x9d: // STA $xxxx,X
-    log->len = 3;
-    cpu->regs.pc += 3;
-    MEM_WRITE16(cpu, addr_absx(cpu, log), cpu->regs.a);
-    break;
-  case 0x9E: // STZ $xxxx,X
-    log->len = 3;
-    cpu->regs.pc += 3;
-    MEM_WRITE16(cpu, addr_absx(cpu, log), cpu->regs.z);
-    break;
-  case 0x9F: // BBS1 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 2) != 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+  for (int i = 0; i < 6; i++) {
+    log->bytes[i] = read_memory(cpu, pc + i);
+  }
+  return opcode_handlers[log->bytes[0]];
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Instruction timing
+
+   Cycle counts are those that the CPU charges when it is not running at full speed, from
+   cycle_count_lut in gs4510.vhdl: 65CE02 timing, or at 1MHz and 2MHz, 6502 timing (which matches
+   expected_cycles_6502 in src/tests/instructiontiming.c).  At 1MHz and 2MHz, taken branches cost a
+   cycle more, and, as on the 6502, so do taken branches to another page, and indexed reads that cross
+   a page.  There is no exact model of the 40MHz CPU, so the 65CE02 counts serve for it, too.
+   The hypervisor always runs at 40MHz.
+   ----------------------------------------------------------------------------------------------------------
+*/
+
+const unsigned char cycles_4502[256] = {
+  7, 5, 2, 2, 4, 3, 4, 4, 3, 2, 1, 1, 5, 4, 5, 4,
+  2, 5, 5, 3, 4, 3, 4, 4, 1, 4, 1, 1, 5, 4, 5, 4,
+  5, 5, 7, 7, 3, 3, 4, 4, 3, 2, 1, 1, 4, 4, 5, 4,
+  2, 5, 5, 3, 3, 3, 4, 4, 1, 4, 1, 1, 4, 4, 5, 4,
+  5, 5, 2, 2, 4, 3, 4, 4, 3, 2, 1, 1, 3, 4, 5, 4,
+  2, 5, 5, 3, 4, 3, 4, 4, 1, 4, 3, 3, 4, 4, 5, 4,
+  4, 5, 7, 5, 3, 3, 4, 4, 3, 2, 1, 1, 5, 4, 5, 4,
+  2, 5, 5, 3, 3, 3, 4, 4, 2, 4, 3, 1, 5, 4, 5, 4,
+  2, 5, 6, 3, 3, 3, 3, 4, 1, 2, 1, 4, 4, 4, 4, 4,
+  2, 5, 5, 3, 3, 3, 3, 4, 1, 4, 1, 4, 4, 4, 4, 4,
+  2, 5, 2, 2, 3, 3, 3, 4, 1, 2, 1, 4, 4, 4, 4, 4,
+  2, 5, 5, 3, 3, 3, 3, 4, 1, 4, 1, 4, 4, 4, 4, 4,
+  2, 5, 2, 6, 3, 3, 4, 4, 1, 2, 1, 7, 4, 4, 5, 4,
+  2, 5, 5, 3, 3, 3, 4, 4, 1, 4, 3, 3, 4, 4, 5, 4,
+  2, 5, 6, 6, 3, 3, 4, 4, 1, 2, 1, 6, 4, 4, 5, 4,
+  2, 5, 5, 3, 5, 3, 4, 4, 1, 4, 3, 3, 7, 4, 5, 4
+};
+
+const unsigned char cycles_6502[256] = {
+  7, 6, 0, 8, 3, 3, 5, 5, 3, 2, 2, 2, 4, 4, 6, 6,
+  2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+  6, 6, 0, 8, 3, 3, 5, 5, 4, 2, 2, 2, 4, 4, 6, 6,
+  2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+  6, 6, 0, 8, 3, 3, 5, 5, 3, 2, 2, 2, 3, 4, 6, 6,
+  2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+  6, 6, 0, 8, 3, 3, 5, 5, 4, 2, 2, 2, 5, 4, 6, 6,
+  2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+  2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,
+  2, 6, 0, 6, 4, 4, 4, 4, 2, 5, 2, 5, 5, 5, 5, 5,
+  2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,
+  2, 5, 0, 5, 4, 4, 4, 4, 2, 4, 2, 4, 4, 4, 4, 4,
+  2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,
+  2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+  2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,
+  2, 5, 0, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7
+};
+
+typedef struct cpu_speed {
+  const char *name;
+  double hz;
+  bool timing_6502;
+  bool charge_for_branches;
+} cpu_speed;
+
+#define CPU_SPEED_FULL 3
+const cpu_speed cpu_speeds[] = {
+  { "1mhz", 1e6, true, true },
+  { "2mhz", 2e6, true, true },
+  { "3.5mhz", 3.5e6, false, false },
+  { "40mhz", 40.5e6, false, false },
+};
+#define CPU_SPEED_COUNT (sizeof(cpu_speeds) / sizeof(cpu_speeds[0]))
+
+// Speed of the CPU outside the hypervisor
+const cpu_speed *user_cpu_speed = &cpu_speeds[CPU_SPEED_FULL];
+
+// Emulated time, in seconds, for the current test
+double emulated_seconds = 0;
+
+// Cycles at the start of the most recent jsr, jmp, step or run directive
+unsigned long long run_start_cycles = 0;
+
+bool is_branch(unsigned char opcode)
+{
+  return (opcode & 0x1f) == 0x10 || (opcode & 0x1f) == 0x13 || opcode == 0x80 || opcode == 0x83
+      || (opcode & 0x0f) == 0x0f;
+}
+
+// Is the instruction a read, using abs,X, abs,Y or (zp),Y addressing, that costs a cycle more
+// on the 6502 when indexing crosses a page?
+bool has_page_penalty(unsigned char opcode)
+{
+  switch (opcode) {
+  case 0x1d: case 0x3d: case 0x5d: case 0x7d: case 0xbd: case 0xbc: case 0xdd: case 0xfd:
+  case 0x19: case 0x39: case 0x59: case 0x79: case 0xb9: case 0xbe: case 0xd9: case 0xf9:
+  case 0x11: case 0x31: case 0x51: case 0x71: case 0xb1: case 0xd1: case 0xf1:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Number of cycles the instruction just executed took
+unsigned int instruction_cycles(struct cpu *cpu, struct instruction_log *log, const cpu_speed *speed)
+{
+  unsigned char opcode = log->bytes[0];
+
+  if (!speed->timing_6502)
+    return cycles_4502[opcode];
+
+  unsigned int cycles = cycles_6502[opcode];
+  if (has_page_penalty(opcode)) {
+    unsigned int base = addr_abs(log);
+    unsigned int index = ((opcode & 0x1f) == 0x19 || opcode == 0xbe) ? log->regs.y : log->regs.x;
+    if ((opcode & 0x1f) == 0x11) {
+      index = log->regs.y;
+      base = log->zp_pointer_addr - index;
     }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0xa0: // LDY #$nn
-    cpu->regs.y = log->bytes[1];
-    update_nz(cpu->regs.y);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xA1: // LDA ($xx,X)
-    log->len = 2;
-    cpu->regs.pc += 2;
-    log->zp16 = 1;
-    cpu->regs.a = read_memory(cpu, addr_izpx(cpu, log));
-    update_nz(cpu->regs.a);
-    break;
-  case 0xa2: // LDX #$nn
-    cpu->regs.x = log->bytes[1];
-    update_nz(cpu->regs.x);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xa3: // LDZ #$nn
-    cpu->regs.z = log->bytes[1];
-    update_nz(cpu->regs.z);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xa4: // LDY $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    cpu->regs.y = read_memory(cpu, addr_zp(cpu, log));
-    update_nz(cpu->regs.y);
-    break;
-  case 0xa5: // LDA $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    cpu->regs.a = read_memory(cpu, addr_zp(cpu, log));
-    update_nz(cpu->regs.a);
-    break;
-  case 0xa6: // LDX $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    cpu->regs.x = read_memory(cpu, addr_zp(cpu, log));
-    update_nz(cpu->regs.x);
-    break;
-  case 0xa7: // SMB2 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) | 4;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xa8: // TAY
-    cpu->regs.y = cpu->regs.a;
-    update_nz(cpu->regs.a);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xa9: // LDA #$nn
-    cpu->regs.a = log->bytes[1];
-    update_nz(cpu->regs.a);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xaa: // TAX
-    cpu->regs.x = cpu->regs.a;
-    update_nz(cpu->regs.a);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xac: // LDY $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    cpu->regs.y = read_memory(cpu, addr_abs(log));
-    update_nz(cpu->regs.y);
-    break;
-  case 0xad: // LDA $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    cpu->regs.a = read_memory(cpu, addr_abs(log));
-    update_nz(cpu->regs.a);
+    if ((base & 0xff) + index > 0xff)
+      cycles++;
+  }
+  if (is_branch(opcode)) {
+    unsigned int next = (log->pc + log->len) & 0xffff;
+    if (cpu->regs.pc != next) {
+      if (speed->charge_for_branches)
+        cycles++;
+      if ((cpu->regs.pc ^ next) & 0xff00)
+        cycles++;
+    }
+  }
+  return cycles;
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Cycle profiler
+
+   "profile cycles" makes the current test keep a shadow call stack, and report at its end how many
+   cycles each routine (identified by the address a JSR or BSR called) and each call from one routine
+   to another took, both on its own (self) and including the routines it called (inclusive).
+   A hypervisor trap is a call to its entry point, which only the hypervisor return ends: RTS and
+   RTI inside the trap do not leave it.  With profiling on, each JSR or JMP directive and the test
+   also log how many cycles they took.
+   ----------------------------------------------------------------------------------------------------------
+*/
+
+#define PROFILE_TABLE_SIZE 65536
+#define PROFILE_NO_CALLER 0xffffffff
+#define PROFILE_MAX_DEPTH 1024
+
+typedef struct profile_entry {
+  bool used;
+  unsigned int caller; // PROFILE_NO_CALLER for the totals of a routine
+  unsigned int routine;
+  unsigned long long calls;
+  unsigned long long self_cycles;
+  unsigned long long inclusive_cycles;
+} profile_entry;
+
+typedef struct profile_frame {
+  profile_entry *routine;
+  profile_entry *call; // NULL for the routine called by a test directive
+  unsigned long long entry_cycles;
+  bool recursive;
+  bool trap; // entered by a hypervisor trap
+} profile_frame;
+
+bool profiling = false;
+profile_entry *profile_table = NULL;
+int profile_entries = 0;
+profile_frame profile_stack[PROFILE_MAX_DEPTH];
+int profile_depth = 0;
+int profile_dropped = 0; // calls that were too deep, or did not fit in the table
+
+void profile_reset(void)
+{
+  if (profile_table)
+    bzero(profile_table, PROFILE_TABLE_SIZE * sizeof(profile_entry));
+  profile_entries = 0;
+  profile_depth = 0;
+  profile_dropped = 0;
+}
+
+void profile_start(void)
+{
+  if (!profile_table)
+    profile_table = calloc(PROFILE_TABLE_SIZE, sizeof(profile_entry));
+  profile_reset();
+  profiling = true;
+}
+
+profile_entry *profile_lookup(unsigned int caller, unsigned int routine)
+{
+  unsigned int slot = ((caller * 2654435761u) ^ (routine * 40503u)) & (PROFILE_TABLE_SIZE - 1);
+  while (profile_table[slot].used) {
+    if (profile_table[slot].caller == caller && profile_table[slot].routine == routine)
+      return &profile_table[slot];
+    slot = (slot + 1) & (PROFILE_TABLE_SIZE - 1);
+  }
+  // Leave room for the probes to end
+  if (profile_entries >= PROFILE_TABLE_SIZE * 3 / 4)
+    return NULL;
+  profile_entries++;
+  profile_table[slot].used = true;
+  profile_table[slot].caller = caller;
+  profile_table[slot].routine = routine;
+  return &profile_table[slot];
+}
+
+void profile_push(unsigned int caller, unsigned int routine, bool trap)
+{
+  profile_entry *r = profile_lookup(PROFILE_NO_CALLER, routine);
+  profile_entry *call = caller == PROFILE_NO_CALLER ? NULL : profile_lookup(caller, routine);
+  if (!r || (caller != PROFILE_NO_CALLER && !call) || profile_depth >= PROFILE_MAX_DEPTH) {
+    profile_dropped++;
+    return;
+  }
+  profile_frame *frame = &profile_stack[profile_depth];
+  frame->routine = r;
+  frame->call = call;
+  frame->entry_cycles = cpu.cycles;
+  frame->recursive = false;
+  frame->trap = trap;
+  for (int i = 0; i < profile_depth; i++)
+    if (profile_stack[i].routine == r)
+      frame->recursive = true;
+  r->calls++;
+  if (call)
+    call->calls++;
+  profile_depth++;
+}
+
+void profile_pop(void)
+{
+  if (!profile_depth)
+    return;
+  profile_frame *frame = &profile_stack[--profile_depth];
+  unsigned long long cycles = cpu.cycles - frame->entry_cycles;
+  // Count the time spent in a recursive routine only once
+  if (!frame->recursive)
+    frame->routine->inclusive_cycles += cycles;
+  if (frame->call) {
+    bool recursive_call = false;
+    for (int i = 0; i < profile_depth; i++)
+      if (profile_stack[i].call == frame->call)
+        recursive_call = true;
+    if (!recursive_call)
+      frame->call->inclusive_cycles += cycles;
+  }
+}
+
+// Start of a routine called by a test directive
+void profile_routine_start(unsigned int addr16)
+{
+  while (profile_depth)
+    profile_pop();
+  profile_push(PROFILE_NO_CALLER, addr_to_28bit(&cpu, addr16, 0), false);
+}
+
+void profile_routine_end(void)
+{
+  while (profile_depth)
+    profile_pop();
+}
+
+// Leave the innermost hypervisor trap, and anything it didn't return from
+void profile_trap_return(void)
+{
+  int trap = profile_depth - 1;
+  while (trap >= 0 && !profile_stack[trap].trap)
+    trap--;
+  if (trap < 0)
+    return;
+  while (profile_depth > trap)
+    profile_pop();
+}
+
+// Account for an instruction, after any hypervisor trap or return it asked for
+void profile_instruction(struct instruction_log *log, unsigned int cycles, int hypervisor_request)
+{
+  unsigned int caller = profile_depth ? profile_stack[profile_depth - 1].routine->routine : PROFILE_NO_CALLER;
+
+  if (profile_depth)
+    profile_stack[profile_depth - 1].routine->self_cycles += cycles;
+
+  if (hypervisor_request == HYPERVISOR_RETURN) {
+    profile_trap_return();
+    return;
+  }
+  if (hypervisor_request) {
+    profile_push(caller, addr_to_28bit(&cpu, cpu.regs.pc, 0), true);
+    return;
+  }
+
+  switch (log->bytes[0]) {
+  case 0x20: // JSR $nnnn
+  case 0x22: // JSR ($nnnn)
+  case 0x23: // JSR ($nnnn,X)
+  case 0x63: // BSR $rrrr
+    profile_push(caller, addr_to_28bit(&cpu, cpu.regs.pc, 0), false);
     break;
-  case 0xae: // LDX $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    cpu->regs.x = read_memory(cpu, addr_abs(log));
-    update_nz(cpu->regs.x);
+  case 0x40: // RTI
+  case 0x60: // RTS
+  case 0x62: // RTS #$nn
+    if (profile_depth && !profile_stack[profile_depth - 1].trap)
+      profile_pop();
     break;
-  case 0xAF: // BBS2 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 4) != 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+}
+
+int compare_profile_entries(const void *a, const void *b)
+{
+  const profile_entry *pa = *(const profile_entry **)a, *pb = *(const profile_entry **)b;
+  if (pa->inclusive_cycles != pb->inclusive_cycles)
+    return pa->inclusive_cycles < pb->inclusive_cycles ? 1 : -1;
+  if (pa->self_cycles != pb->self_cycles)
+    return pa->self_cycles < pb->self_cycles ? 1 : -1;
+  return pa->routine < pb->routine ? -1 : pa->routine > pb->routine;
+}
+
+void profile_report(FILE *f)
+{
+  profile_entry **entries = malloc(profile_entries * sizeof(profile_entry *));
+  int count = 0;
+  char name[8192];
+
+  profile_routine_end();
+  for (int i = 0; i < PROFILE_TABLE_SIZE; i++)
+    if (profile_table[i].used)
+      entries[count++] = &profile_table[i];
+  qsort(entries, count, sizeof(profile_entry *), compare_profile_entries);
+
+  fprintf(f, "INFO: Flat cycle profile, by inclusive cycles:\n");
+  fprintf(f, "         inclusive            self      calls  routine\n");
+  for (int i = 0; i < count; i++) {
+    profile_entry *e = entries[i];
+    if (e->caller != PROFILE_NO_CALLER)
+      continue;
+    fprintf(f, "      %12llu    %12llu %10llu  %s ($%07X)\n", e->inclusive_cycles, e->self_cycles, e->calls,
+        describe_address_label28(&cpu, e->routine), e->routine);
+  }
+
+  fprintf(f, "INFO: Call graph cycle profile, by inclusive cycles:\n");
+  for (int i = 0; i < count; i++) {
+    profile_entry *e = entries[i];
+    if (e->caller != PROFILE_NO_CALLER)
+      continue;
+    bool any = false;
+    for (int j = 0; j < count; j++) {
+      profile_entry *call = entries[j];
+      if (call->caller != e->routine)
+        continue;
+      if (!any)
+        fprintf(f, "      %s ($%07X) %llu cycles\n", describe_address_label28(&cpu, e->routine), e->routine,
+            e->inclusive_cycles);
+      any = true;
+      snprintf(name, sizeof(name), "%s", describe_address_label28(&cpu, call->routine));
+      fprintf(f, "        -> %-32s %12llu cycles in %llu calls\n", name, call->inclusive_cycles, call->calls);
     }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0xB0: // BCS $rr
-    log->len = 2;
-    if (cpu->regs.flags & FLAG_C)
-      cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
+  }
+  if (profile_dropped)
+    fprintf(f, "WARNING: %d calls were too deep or too many to profile\n", profile_dropped);
+  free(entries);
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Code coverage
+
+   "hyppotest -c <file>" keeps a bitmap of the 28-bit addresses of chip and hypervisor RAM at which an
+   instruction started, and of which branches were taken and which fell through.  Coverage accumulates
+   over all tests of a script, and is ORed into the coverage file at the end of the run (and by each -j
+   worker), so that separate runs merge too.
+
+   "hyppotest -l <lcov file>" exports the merged coverage for an ACME report ("acme -r", by default the
+   HICKUP.rep next to the symbol file the script loads), as lcov line, branch and function (label) records
+   for the sources it lists, and prints how much of each source file and label was executed.
+   ----------------------------------------------------------------------------------------------------------
+*/
+
+#define COVERAGE_MAGIC "HYPCOV01"
+#define COVERAGE_BITS (CHIPRAM_SIZE + HYPPORAM_SIZE)
+#define MAX_COVERAGE_REPORTS 16
+
+bool coverage = false;
+char *coverage_file = NULL;
+bool coverage_file_is_temporary = false;
+char *lcov_file = NULL;
+char *coverage_reports[MAX_COVERAGE_REPORTS];
+int coverage_report_count = 0;
+
+unsigned char coverage_executed[COVERAGE_BITS / 8];
+unsigned char coverage_taken[COVERAGE_BITS / 8];
+unsigned char coverage_not_taken[COVERAGE_BITS / 8];
+
+// Bit number of a 28-bit address, or -1 if it isn't in chip or hypervisor RAM
+static inline int coverage_bit(unsigned int addr28)
+{
+  if (addr28 < CHIPRAM_SIZE)
+    return addr28;
+  if (addr28 >= 0xfff8000 && addr28 < 0xfff8000 + HYPPORAM_SIZE)
+    return CHIPRAM_SIZE + addr28 - 0xfff8000;
+  return -1;
+}
+
+#define COVERAGE_SET(MAP, BIT) ((MAP)[(BIT) >> 3] |= 1 << ((BIT)&7))
+#define COVERAGE_GET(MAP, BIT) (((MAP)[(BIT) >> 3] >> ((BIT)&7)) & 1)
+
+// Record the instruction that has just executed from pc28
+static inline void coverage_instruction(struct cpu *cpu, struct instruction_log *log, unsigned int pc28)
+{
+  int bit = coverage_bit(pc28);
+  if (bit < 0)
+    return;
+  COVERAGE_SET(coverage_executed, bit);
+  if (is_branch(log->bytes[0])) {
+    if (cpu->regs.pc != ((log->pc + log->len) & 0xffff))
+      COVERAGE_SET(coverage_taken, bit);
     else
-      cpu->regs.pc += 2;
-    break;
-  case 0xb1: // LDA ($xx),Y
-    log->len = 2;
-    cpu->regs.pc += 2;
-    log->zp16 = 1;
-    cpu->regs.a = read_memory(cpu, addr_izpy(cpu, log));
-    update_nz(cpu->regs.a);
-    break;
-  case 0xb2: // LDA ($xx),Z
-    log->len = 2;
-    cpu->regs.pc += 2;
-    log->zp16 = 1;
-    cpu->regs.a = read_memory(cpu, addr_izpz(cpu, log));
-    update_nz(cpu->regs.a);
-    break;
-  case 0xb4: // LDY $xx,X
-    log->len = 2;
-    cpu->regs.pc += 2;
-    cpu->regs.y = read_memory(cpu, addr_zpx(cpu, log));
-    update_nz(cpu->regs.y);
-    break;
-  case 0xb5: // LDA $xx,X
-    log->len = 2;
-    cpu->regs.pc += 2;
-    cpu->regs.a = read_memory(cpu, addr_zpx(cpu, log));
-    update_nz(cpu->regs.a);
-    break;
-  case 0xb6: // LDX $xx,Y
-    log->len = 2;
-    cpu->regs.pc += 2;
-    cpu->regs.x = read_memory(cpu, addr_zpy(cpu, log));
-    update_nz(cpu->regs.x);
-    break;
-  case 0xb7: // SMB3 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) | 8;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xb8: // CLV
-    cpu->regs.flags &= ~FLAG_V;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xb9: // LDA $xxxx,Y
-    log->len = 3;
-    cpu->regs.pc += 3;
-    cpu->regs.a = read_memory(cpu, addr_absy(cpu, log));
-    update_nz(cpu->regs.a);
-    break;
-  case 0xba: // TSX
-    log->len = 1;
-    cpu->regs.pc += 1;
-    cpu->regs.x = cpu->regs.spl;
-    update_nz(cpu->regs.x);
-    break;
-  case 0xbc: // LDY $xxxx,X
-    log->len = 3;
-    cpu->regs.pc += 3;
-    cpu->regs.y = read_memory(cpu, addr_absx(cpu, log));
-    update_nz(cpu->regs.y);
-    break;
-  case 0xbd: // LDA $xxxx,X
-    log->len = 3;
-    cpu->regs.pc += 3;
-    cpu->regs.a = read_memory(cpu, addr_absx(cpu, log));
-    update_nz(cpu->regs.a);
-    break;
-  case 0xbe: // LDX $xxxx,Y
-    log->len = 3;
-    cpu->regs.pc += 3;
-    cpu->regs.x = read_memory(cpu, addr_absy(cpu, log));
-    update_nz(cpu->regs.x);
-    break;
-  case 0xBF: // BBS3 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 8) != 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
+      COVERAGE_SET(coverage_not_taken, bit);
+  }
+}
+
+// Merge our coverage with that in the coverage file, and write the result back.
+// Our bitmaps are left holding the merged coverage.
+int coverage_save(void)
+{
+  unsigned char *maps[3] = { coverage_executed, coverage_taken, coverage_not_taken };
+  unsigned char header[8];
+  unsigned char buffer[COVERAGE_BITS / 8];
+
+  if (!coverage_file)
+    return 0;
+  int fd = open(coverage_file, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: Could not open coverage file '%s': %s\n", coverage_file, strerror(errno));
+    return -1;
+  }
+  // Workers save as they finish, so take turns
+  if (flock(fd, LOCK_EX)) {
+    perror("flock");
+    close(fd);
+    return -1;
+  }
+
+  ssize_t n = pread(fd, header, sizeof(header), 0);
+  if (n == sizeof(header) && !memcmp(header, COVERAGE_MAGIC, 8)) {
+    for (int m = 0; m < 3; m++) {
+      if (pread(fd, buffer, sizeof(buffer), 8 + m * sizeof(buffer)) != sizeof(buffer))
+        break;
+      for (int i = 0; i < sizeof(buffer); i++)
+        maps[m][i] |= buffer[i];
     }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0xC0: // CPY #$nn
-    v = cpu->regs.y - log->bytes[1];
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xC1: // CMP ($nn,X)
-    v = cpu->regs.a - read_memory(cpu, addr_izpx(cpu, log));
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xC4: // CPY $nn
-    v = cpu->regs.y - read_memory(cpu, addr_zp(cpu, log));
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xC5: // CMP $nn
-    v = cpu->regs.a - read_memory(cpu, addr_zp(cpu, log));
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xC6: // DEC $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_zp(cpu, log));
-    v--;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    update_nz(v);
-    break;
-  case 0xC7: // SMB4 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) | 16;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xC8: // INY
-    cpu->regs.y++;
-    update_nz(cpu->regs.y);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xC9: // CMP #$nn
-    v = cpu->regs.a - log->bytes[1];
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xCA: // DEX
-    cpu->regs.x--;
-    update_nz(cpu->regs.x);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xCC: // CPY $nnnn
-    v = cpu->regs.y - read_memory(cpu, addr_abs(log));
-    update_cmp_flags(v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0xCD: // CMP $nnnn
-    v = cpu->regs.a - read_memory(cpu, addr_abs(log));
-    update_cmp_flags(v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0xCE: // DEC $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    v = read_memory(cpu, addr_abs(log));
-    v--;
-    MEM_WRITE16(cpu, addr_abs(log), v);
-    update_nz(v);
-    break;
-  case 0xCF: // BBS4 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 16) != 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+  else if (n > 0) {
+    fprintf(stderr, "ERROR: '%s' is not a hyppotest coverage file\n", coverage_file);
+    close(fd);
+    return -1;
+  }
+
+  int errors = pwrite(fd, COVERAGE_MAGIC, 8, 0) != 8;
+  for (int m = 0; m < 3; m++)
+    errors += pwrite(fd, maps[m], COVERAGE_BITS / 8, 8 + m * (COVERAGE_BITS / 8)) != COVERAGE_BITS / 8;
+  close(fd);
+  if (errors) {
+    fprintf(stderr, "ERROR: Could not write coverage file '%s'\n", coverage_file);
+    return -1;
+  }
+  return 0;
+}
+
+// One instruction in an ACME report
+typedef struct coverage_line {
+  int file; // index into the file names
+  int line;
+  int bit;
+  unsigned char opcode;
+} coverage_line;
+
+typedef struct coverage_label {
+  char *name;
+  int bit;
+  int line; // first line whose instruction is at the label, or -1
+  int file;
+} coverage_label;
+
+int compare_coverage_lines_by_line(const void *a, const void *b)
+{
+  const coverage_line *la = a, *lb = b;
+  if (la->file != lb->file)
+    return la->file - lb->file;
+  if (la->line != lb->line)
+    return la->line - lb->line;
+  return la->bit - lb->bit;
+}
+
+int compare_coverage_lines_by_bit(const void *a, const void *b)
+{
+  const coverage_line *la = a, *lb = b;
+  return la->bit != lb->bit ? la->bit - lb->bit : la->line - lb->line;
+}
+
+int compare_coverage_labels(const void *a, const void *b)
+{
+  const coverage_label *la = a, *lb = b;
+  return la->bit != lb->bit ? la->bit - lb->bit : strcmp(la->name, lb->name);
+}
+
+// Does the source part of an ACME report line, after any label, start with a pseudo opcode such as !byte?
+bool is_pseudo_op(const char *s)
+{
+  while (isspace(*s))
+    s++;
+  if (isalpha(*s) || *s == '_' || *s == '.') {
+    while (isalnum(*s) || *s == '_' || *s == '.')
+      s++;
+    if (*s == ':')
+      s++;
+    while (isspace(*s))
+      s++;
+  }
+  return *s == '!' || *s == '*';
+}
+
+// Read the instructions listed in an ACME report.  Lines look like
+//   "   123  8a4c a90f      	lda #$0f"
+// and each source file starts with a "; ******** Source: <file>" line.
+int read_acme_report(char *filename, char ***files, int *file_count, coverage_line **lines, int *line_count)
+{
+  FILE *f = fopen(filename, "r");
+  if (!f) {
+    fprintf(stderr, "ERROR: Could not read ACME report '%s'\n", filename);
+    return -1;
+  }
+
+  char line[8192];
+  int file = -1;
+  int allocated = *line_count;
+  while (fgets(line, sizeof(line), f)) {
+    char *source = strstr(line, "; ******** Source: ");
+    if (source == line) {
+      source += strlen("; ******** Source: ");
+      source[strcspn(source, "\r\n")] = 0;
+      for (file = 0; file < *file_count; file++)
+        if (!strcmp((*files)[file], source))
+          break;
+      if (file == *file_count) {
+        *files = realloc(*files, (*file_count + 1) * sizeof(char *));
+        (*files)[(*file_count)++] = strdup(source);
+      }
+      continue;
     }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0xd0: // BNE $rr
-    log->len = 2;
-    if (cpu->regs.flags & FLAG_Z)
-      cpu->regs.pc += 2;
-    else
-      cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
-    break;
-  case 0xD1: // CMP ($nn),Y
-    v = cpu->regs.a - read_memory(cpu, addr_izpy(cpu, log));
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xD2: // CMP ($nn),Z
-    v = cpu->regs.a - read_memory(cpu, addr_izpz(cpu, log));
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xD5: // CMP $nn,X
-    v = cpu->regs.a - read_memory(cpu, addr_zpx(cpu, log));
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xD6: // DEC $xx,X
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_zpx(cpu, log));
-    v--;
-    MEM_WRITE16(cpu, addr_zpx(cpu, log), v);
-    update_nz(v);
-    break;
-  case 0xD7: // SMB5 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) | 32;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xD8: // CLD
-    cpu->regs.flags &= ~FLAG_D;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xD9: // CMP $nnnn,Y
-    v = cpu->regs.a - read_memory(cpu, addr_absy(cpu, log));
-    update_cmp_flags(v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0xDA: // PHX
-    stack_push(cpu, cpu->regs.x);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xDB: // PHZ
-    stack_push(cpu, cpu->regs.z);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xDD: // CMP $nnnn,X
-    v = cpu->regs.a - read_memory(cpu, addr_absx(cpu, log));
-    update_cmp_flags(v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0xDE: // DEC $xxxx,X
-    log->len = 3;
-    cpu->regs.pc += 3;
-    v = read_memory(cpu, addr_absx(cpu, log));
-    v--;
-    MEM_WRITE16(cpu, addr_absx(cpu, log), v);
-    update_nz(v);
-    break;
-  case 0xDF: // BBS5 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 32) != 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
+
+    char *s = line, *end;
+    long number = strtol(s, &end, 10);
+    if (end == s || file < 0)
+      continue;
+    s = end;
+    while (*s == ' ')
+      s++;
+    unsigned int addr = strtoul(s, &end, 16);
+    if (end - s < 4 || *end != ' ')
+      continue;
+    s = end;
+    while (*s == ' ')
+      s++;
+    unsigned int opcode;
+    if (!isxdigit(s[0]) || !isxdigit(s[1]) || sscanf(s, "%2x", &opcode) != 1)
+      continue;
+    while (isxdigit(*s) || *s == '.')
+      s++;
+    if (is_pseudo_op(s))
+      continue;
+
+    // HYPPO is assembled to run at $8000-$BFFF in hypervisor mode
+    unsigned int addr28 = (addr >= 0x8000 && addr < 0xc000) ? 0xfff0000 + addr : addr;
+    int bit = coverage_bit(addr28);
+    if (bit < 0)
+      continue;
+    if (*line_count >= allocated) {
+      allocated = allocated ? allocated * 2 : 4096;
+      *lines = realloc(*lines, allocated * sizeof(coverage_line));
+    }
+    coverage_line *l = &(*lines)[(*line_count)++];
+    l->file = file;
+    l->line = number;
+    l->bit = bit;
+    l->opcode = opcode;
+  }
+  fclose(f);
+  return 0;
+}
+
+// Read the labels of the ACME symbol file that goes with a report
+int read_coverage_labels(char *report, coverage_label **labels, int *label_count)
+{
+  char filename[8192];
+  snprintf(filename, sizeof(filename), "%s", report);
+  char *dot = strrchr(filename, '.');
+  if (!dot || strcmp(dot, ".rep"))
+    return 0;
+  strcpy(dot, ".sym");
+
+  FILE *f = fopen(filename, "r");
+  if (!f)
+    return 0;
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    char sym[1024];
+    unsigned int addr;
+    if (sscanf(line, " %s = $%x", sym, &addr) != 2)
+      continue;
+    unsigned int addr28 = (addr >= 0x8000 && addr < 0xc000) ? 0xfff0000 + addr : addr;
+    int bit = coverage_bit(addr28);
+    if (bit < 0)
+      continue;
+    *labels = realloc(*labels, (*label_count + 1) * sizeof(coverage_label));
+    coverage_label *l = &(*labels)[(*label_count)++];
+    l->name = strdup(sym);
+    l->bit = bit;
+    l->line = -1;
+    l->file = -1;
+  }
+  fclose(f);
+  return 0;
+}
+
+// Write the lcov file, and report how much of each source file and label was executed
+int coverage_report(void)
+{
+  char **files = NULL;
+  int file_count = 0;
+  coverage_line *lines = NULL;
+  int line_count = 0;
+  coverage_label *labels = NULL;
+  int label_count = 0;
+
+  for (int i = 0; i < coverage_report_count; i++) {
+    if (read_acme_report(coverage_reports[i], &files, &file_count, &lines, &line_count))
+      return -1;
+    read_coverage_labels(coverage_reports[i], &labels, &label_count);
+  }
+  if (!line_count) {
+    fprintf(stderr, "ERROR: No instructions found in the ACME report, so there is no coverage to report\n");
+    return -1;
+  }
+
+  // Find each label's first line, and count the instructions from one label to the next
+  int *label_total = calloc(label_count + 1, sizeof(int));
+  int *label_hit = calloc(label_count + 1, sizeof(int));
+  if (label_count)
+    qsort(labels, label_count, sizeof(coverage_label), compare_coverage_labels);
+  qsort(lines, line_count, sizeof(coverage_line), compare_coverage_lines_by_bit);
+  for (int i = 0, j = 0; i < line_count; i++) {
+    while (j < label_count && labels[j].bit <= lines[i].bit) {
+      if (labels[j].bit == lines[i].bit && labels[j].line < 0) {
+        labels[j].line = lines[i].line;
+        labels[j].file = lines[i].file;
+      }
+      j++;
     }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0xE0: // CPX #$nn
-    v = cpu->regs.x - log->bytes[1];
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xe1: // SBC ($nn,X)
-    sbc(cpu, read_memory(cpu, addr_izpx(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xE4: // CPX $nn
-    v = cpu->regs.x - read_memory(cpu, addr_zp(cpu, log));
-    update_cmp_flags(v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xe5: // SBC $nn
-    sbc(cpu, read_memory(cpu, addr_zp(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xE6: // INC $xx
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_zp(cpu, log));
-    v++;
-    v &= 0xff;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    update_nz(v);
-    break;
-  case 0xE7: // SMB6 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) | 64;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xE8: // INX
-    cpu->regs.x++;
-    update_nz(cpu->regs.x);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xe9: // SBC #$nn
-    sbc(cpu, log->bytes[1]);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xea: // EOM / NOP
-    cpu->regs.pc++;
-    cpu->regs.map_irq_inhibit = 0;
-    log->len = 1;
-    break;
-  case 0xEC: // CPX $nnnn
-    v = cpu->regs.x - read_memory(cpu, addr_abs(log));
-    update_cmp_flags(v);
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0xed: // SBC $nnnn
-    sbc(cpu, read_memory(cpu, addr_abs(log)));
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0xEE: // INC $xxxx
-    log->len = 3;
-    cpu->regs.pc += 3;
-    v = read_memory(cpu, addr_abs(log));
-    v++;
-    MEM_WRITE16(cpu, addr_abs(log), v);
-    update_nz(v);
-    break;
-  case 0xEF: // BBS6 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 64) != 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
+    // Skip back over aliases, to the first label at the address of the label we are in
+    int k = j - 1;
+    while (k > 0 && labels[k - 1].bit == labels[k].bit)
+      k--;
+    if (k >= 0 && labels[k].line >= 0) {
+      label_total[k]++;
+      label_hit[k] += COVERAGE_GET(coverage_executed, lines[i].bit);
     }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  case 0xf0: // BEQ $rr
-    log->len = 2;
-    if (cpu->regs.flags & FLAG_Z)
-      cpu->regs.pc += 2 + rel8_delta(log->bytes[1]);
-    else
-      cpu->regs.pc += 2;
-    break;
-  case 0xf1: // SBC ($nn),Y
-    sbc(cpu, read_memory(cpu, addr_izpy(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xf2: // SBC ($nn),Z
-    sbc(cpu, read_memory(cpu, addr_izpz(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xf3: // BEQ $rrrr
-    log->len = 3;
-    if (cpu->regs.flags & FLAG_Z)
-      cpu->regs.pc += 3 + rel16_delta(log->bytes[1]);
-    else
-      cpu->regs.pc += 3;
-    break;
-  case 0xf5: // SBC $nn,X
-    sbc(cpu, read_memory(cpu, addr_zpx(cpu, log)));
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xf6: // INC $xx,X
-    log->len = 2;
-    cpu->regs.pc += 2;
-    v = read_memory(cpu, addr_zpx(cpu, log));
-    v++;
-    v &= 0xff;
-    MEM_WRITE16(cpu, addr_zpx(cpu, log), v);
-    update_nz(v);
-    break;
-  case 0xF7: // SMB7 $nn
-    v = read_memory(cpu, addr_zp(cpu, log)) | 128;
-    MEM_WRITE16(cpu, addr_zp(cpu, log), v);
-    log->len = 2;
-    cpu->regs.pc += 2;
-    break;
-  case 0xf8: // SED
-    cpu->regs.flags |= FLAG_D;
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xF9: // SBC $nnnn,Y
-    sbc(cpu, read_memory(cpu, addr_absy(cpu, log)));
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0xFA: // PLX
-    cpu->regs.x = stack_pop(cpu, log);
-    update_nz(cpu->regs.x);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xFB: // PLZ
-    cpu->regs.z = stack_pop(cpu, log);
-    update_nz(cpu->regs.z);
-    cpu->regs.pc++;
-    log->len = 1;
-    break;
-  case 0xFD: // SBC $nnnn,X
-    sbc(cpu, read_memory(cpu, addr_absx(cpu, log)));
-    log->len = 3;
-    cpu->regs.pc += 3;
-    break;
-  case 0xFE: // INC $xxxx,X
-    log->len = 3;
-    cpu->regs.pc += 3;
-    v = read_memory(cpu, addr_absx(cpu, log));
-    v++;
-    MEM_WRITE16(cpu, addr_absx(cpu, log), v);
-    update_nz(v);
-    break;
-  case 0xFF: // BBS7 $nn,$rr
-    v = read_memory(cpu, addr_zp(cpu, log));
-    if ((v & 128) != 0) {
-      cpu->regs.pc += rel8_delta(log->bytes[2]);
+  }
+
+  FILE *out = fopen(lcov_file, "w");
+  if (!out) {
+    fprintf(stderr, "ERROR: Could not write lcov file '%s'\n", lcov_file);
+    return -1;
+  }
+  fprintf(out, "TN:\n");
+  qsort(lines, line_count, sizeof(coverage_line), compare_coverage_lines_by_line);
+  for (int i = 0; i < line_count;) {
+    int file = lines[i].file;
+    int lines_found = 0, lines_hit = 0, branches_found = 0, branches_hit = 0, labels_found = 0, labels_hit = 0;
+    int instructions = 0, executed = 0;
+
+    fprintf(out, "SF:%s\n", files[file]);
+    for (int k = 0; k < label_count; k++) {
+      if (labels[k].file != file)
+        continue;
+      fprintf(out, "FN:%d,%s\n", labels[k].line, labels[k].name);
+      fprintf(out, "FNDA:%d,%s\n", COVERAGE_GET(coverage_executed, labels[k].bit), labels[k].name);
+      labels_found++;
+      labels_hit += COVERAGE_GET(coverage_executed, labels[k].bit);
     }
-    cpu->regs.pc += 3;
-    log->len = 3;
-    break;
-  default:
+    for (; i < line_count && lines[i].file == file;) {
+      // A line can hold more than one instruction (eg macros)
+      int line = lines[i].line, hits = 0;
+      for (; i < line_count && lines[i].file == file && lines[i].line == line; i++) {
+        int bit = lines[i].bit;
+        int hit = COVERAGE_GET(coverage_executed, bit);
+        hits += hit;
+        instructions++;
+        executed += hit;
+        if (is_branch(lines[i].opcode)) {
+          if (hit) {
+            fprintf(out, "BRDA:%d,%d,0,%d\n", line, bit, COVERAGE_GET(coverage_taken, bit));
+            fprintf(out, "BRDA:%d,%d,1,%d\n", line, bit, COVERAGE_GET(coverage_not_taken, bit));
+          }
+          else {
+            fprintf(out, "BRDA:%d,%d,0,-\n", line, bit);
+            fprintf(out, "BRDA:%d,%d,1,-\n", line, bit);
+          }
+          branches_found += 2;
+          branches_hit += COVERAGE_GET(coverage_taken, bit) + COVERAGE_GET(coverage_not_taken, bit);
+        }
+      }
+      fprintf(out, "DA:%d,%d\n", line, hits);
+      lines_found++;
+      lines_hit += hits > 0;
+    }
+    fprintf(out, "FNF:%d\nFNH:%d\n", labels_found, labels_hit);
+    fprintf(out, "BRF:%d\nBRH:%d\n", branches_found, branches_hit);
+    fprintf(out, "LF:%d\nLH:%d\n", lines_found, lines_hit);
+    fprintf(out, "end_of_record\n");
+
+    printf("INFO: Coverage of %s: %d of %d instructions (%.1f%%), %d of %d branch directions\n", files[file],
+        executed, instructions, instructions ? executed * 100.0 / instructions : 0.0, branches_hit, branches_found);
+    for (int k = 0; k < label_count; k++)
+      if (labels[k].file == file && label_total[k] && label_hit[k] < label_total[k])
+        printf("      %-40s %5d of %5d instructions executed (line %d)\n", labels[k].name, label_hit[k],
+            label_total[k], labels[k].line);
+  }
+  fclose(out);
+  printf("INFO: Wrote lcov coverage of %d source files to '%s'\n", file_count, lcov_file);
+
+  for (int i = 0; i < file_count; i++)
+    free(files[i]);
+  free(files);
+  free(lines);
+  for (int i = 0; i < label_count; i++)
+    free(labels[i].name);
+  free(labels);
+  free(label_total);
+  free(label_hit);
+  return 0;
+}
+
+bool execute_instruction(struct cpu *cpu, struct instruction_log *log)
+{
+  opcode_handler handler = fetch_instruction(cpu, log);
+  if (!handler) {
     fprintf(stderr, "ERROR: Unimplemented opcode $%02X\n", log->bytes[0]);
     log->len = 6;
     return false;
   }
-  return true;
+  return handler(cpu, log);
 }
 
 bool cpu_step(FILE *f)
@@ -4013,24 +7172,38 @@ bool cpu_step(FILE *f)
     return false;
   }
 
-  struct instruction_log *log = malloc(sizeof(instruction_log));
+  // Add instruction to the log (entries come back zeroed)
+  cpu.instruction_count = cpulog_len;
+  struct instruction_log *log = cpulog_append();
   log->regs = cpu.regs;
   log->pc = cpu.regs.pc;
   log->len = 0; // byte count of instruction
   log->count = 1;
-  log->dup = 0;
-
-  // Add instruction to the log
-  cpu.instruction_count = cpulog_len;
-  cpulog[cpulog_len++] = log;
-
-  if (!execute_instruction(&cpu, log)) {
+  instructions_executed++;
+  unsigned int pc28 = (trace || coverage) ? addr_to_28bit(&cpu, cpu.regs.pc, 0) : 0;
+
+  bool executed = execute_instruction(&cpu, log);
+  if (trace)
+    trace_instruction(log, pc28);
+  if (coverage && executed)
+    coverage_instruction(&cpu, log, pc28);
+  int hypervisor_request = cpu.hypervisor_request;
+  if (hypervisor_request)
+    hypervisor_transition(&cpu);
+  if (!executed) {
     cpu.term.error = true;
     fprintf(f, "ERROR: Exception occurred executing instruction at %s\n       Aborted.\n", describe_address(cpu.regs.pc));
     show_recent_instructions(f, "Instructions leading up to the exception", &cpu, cpulog_len - 16, 16, cpu.regs.pc);
     return false;
   }
 
+  const cpu_speed *speed = log->regs.in_hyper ? &cpu_speeds[CPU_SPEED_FULL] : user_cpu_speed;
+  unsigned int cycles = instruction_cycles(&cpu, log, speed);
+  cpu.cycles += cycles;
+  emulated_seconds += cycles / speed->hz;
+  if (profiling)
+    profile_instruction(log, cycles, hypervisor_request);
+
   // Ignore stack underflows/overflows if execution is complete, so that
   // terminal RTS doesn't cause a stack underflow error
   if (cpu.term.done)
@@ -4061,13 +7234,22 @@ bool cpu_step(FILE *f)
 
   // And to most recent instruction at this address, but only if the last instruction
   // there was not identical on all registers and instruction to this one
-  if (lastataddr[cpu.regs.pc] && identical_cpustates(lastataddr[cpu.regs.pc], log)) {
+  loop_state *last = &lastataddr[cpu.regs.pc];
+  unsigned int hash = cpustate_hash(log);
+  if (last->epoch == lastataddr_epoch && last->hash == hash && identical_cpustates(&last->log, log)) {
     // If identical, increase the count, so that we can keep track of infinite loops
-    lastataddr[cpu.regs.pc]->count++;
+    last->log.count++;
+    instruction_log *shown = cpulog_entry(last->instruction);
+    if (shown)
+      shown->count = last->log.count;
     log->dup = 1;
   }
   else {
-    lastataddr[cpu.regs.pc] = log;
+    last->epoch = lastataddr_epoch;
+    last->hash = hash;
+    last->instruction = cpulog_len - 1;
+    // memcpy() rather than assignment, so padding compares equal in identical_cpustates()
+    memcpy(&last->log, log, sizeof(instruction_log));
   }
   return true;
 }
@@ -4089,13 +7271,13 @@ bool cpu_run(FILE *f)
     if (!cpu_step(f))
       return false;
     // Detect infinite loops
-    if (lastataddr[cpu.regs.pc]->count > INFINITE_LOOP_THRESHOLD) {
+    if (lastataddr[cpu.regs.pc].log.count > infinite_loop_threshold) {
       cpu.term.error = true;
       fprintf(stderr, "ERROR: Infinite loop detected at %s.\n       Aborted after %d iterations.\n",
-          describe_address(cpu.regs.pc), lastataddr[cpu.regs.pc]->count);
+          describe_address(cpu.regs.pc), lastataddr[cpu.regs.pc].log.count);
       // Show upto 32 instructions prior to the infinite loop
       show_recent_instructions(stderr, "Instructions leading into the infinite loop for the first time", &cpu,
-          cpulog_len - lastataddr[cpu.regs.pc]->count - 30, 32, start_addr);
+          cpulog_len - lastataddr[cpu.regs.pc].log.count - 30, 32, start_addr);
       return false;
     }
   }
@@ -4126,6 +7308,8 @@ bool cpu_call_routine(FILE *f, unsigned int addr)
 
   // Reset the CPU instruction log
   cpu_log_reset();
+  if (profiling)
+    profile_routine_start(addr);
 
   cpu.regs.pc = addr;
   if (!cpu_run(f))
@@ -4197,41 +7381,52 @@ bool compare_register_contents(FILE *f, struct cpu *cpu)
 
 int ignore_ram_changes(unsigned int low, unsigned int high)
 {
-  for (int i = low; i <= high; i++) {
-    if (i < CHIPRAM_SIZE) {
-      //      if (chipram_expected[i]!=chipram[i]) fprintf(logfile,"NOTE: Ignoring mutated value at $%x\n",i);
-      chipram_expected[i] = chipram[i];
-    }
-    if (i >= 0xfff8000 && i < 0xfffc000)
-      hypporam_expected[i - 0xfff8000] = hypporam[i - 0xfff8000];
+  // (Only chip RAM and hypervisor RAM are affected, so don't walk the rest of the range)
+  for (unsigned int i = low; i <= high && i < CHIPRAM_SIZE; i++) {
+    //      if (chipram_expected[i]!=chipram[i]) fprintf(logfile,"NOTE: Ignoring mutated value at $%x\n",i);
+    chipram_expected[i] = chipram[i];
+    chipram_touched[i >> PAGE_SHIFT] = 1;
+  }
+  for (unsigned int i = low < 0xfff8000 ? 0xfff8000 : low; i <= high && i < 0xfffc000; i++) {
+    hypporam_expected[i - 0xfff8000] = hypporam[i - 0xfff8000];
+    hypporam_touched[(i - 0xfff8000) >> PAGE_SHIFT] = 1;
   }
   return 0;
 }
 
-int compare_ram_contents(FILE *f, struct cpu *cpu)
+// Count the differences between a memory region and its expected contents, marking the
+// dirty pages that turn out to match as clean (and, if there is one, as touched).
+int compare_dirty_pages(unsigned char *actual, unsigned char *expected, unsigned char *dirty, unsigned char *touched,
+    int size)
 {
   int errors = 0;
 
-  for (int i = 0; i < CHIPRAM_SIZE; i++) {
-    if (chipram[i] != chipram_expected[i]) {
-      errors++;
-    }
-  }
-  for (int i = 0; i < HYPPORAM_SIZE; i++) {
-    if (hypporam[i] != hypporam_expected[i]) {
-      errors++;
-    }
-  }
-  for (int i = 0; i < COLOURRAM_SIZE; i++) {
-    if (colourram[i] != colourram_expected[i]) {
-      errors++;
+  for (int page = 0; page < (size >> PAGE_SHIFT); page++) {
+    if (!dirty[page])
+      continue;
+    int base = page << PAGE_SHIFT;
+    if (!memcmp(&actual[base], &expected[base], PAGE_SIZE)) {
+      if (touched)
+        touched[page] = 1;
+      dirty[page] = 0;
+      continue;
     }
-  }
-  for (int i = 0; i < 65536; i++) {
-    if (ffdram[i] != ffdram_expected[i]) {
-      errors++;
+    for (int i = base; i < base + PAGE_SIZE; i++) {
+      if (actual[i] != expected[i])
+        errors++;
     }
   }
+  return errors;
+}
+
+int compare_ram_contents(FILE *f, struct cpu *cpu)
+{
+  int errors = 0;
+
+  errors += compare_dirty_pages(chipram, chipram_expected, chipram_dirty, chipram_touched, CHIPRAM_SIZE);
+  errors += compare_dirty_pages(hypporam, hypporam_expected, hypporam_dirty, hypporam_touched, HYPPORAM_SIZE);
+  errors += compare_dirty_pages(colourram, colourram_expected, colourram_dirty, colourram_touched, COLOURRAM_SIZE);
+  errors += compare_dirty_pages(ffdram, ffdram_expected, ffdram_dirty, NULL, 65536);
 
   if (errors) {
     fprintf(f, "ERROR: %d memory locations contained unexpected values.\n", errors);
@@ -4240,6 +7435,10 @@ int compare_ram_contents(FILE *f, struct cpu *cpu)
     int displayed = 0;
 
     for (int i = 0; i < CHIPRAM_SIZE; i++) {
+      if (!chipram_dirty[i >> PAGE_SHIFT]) {
+        i |= PAGE_SIZE - 1;
+        continue;
+      }
       if (chipram[i] != chipram_expected[i]) {
         fprintf(f, "ERROR: Saw $%02X at $%07x (%s), but expected to see $%02X\n", chipram[i], i,
             describe_address_label28(cpu, i), chipram_expected[i]);
@@ -4253,6 +7452,10 @@ int compare_ram_contents(FILE *f, struct cpu *cpu)
         break;
     }
     for (int i = 0; i < HYPPORAM_SIZE; i++) {
+      if (!hypporam_dirty[i >> PAGE_SHIFT]) {
+        i |= PAGE_SIZE - 1;
+        continue;
+      }
       if (hypporam[i] != hypporam_expected[i]) {
         fprintf(f, "ERROR: Saw $%02X at $%07x (%s), but expected to see $%02x\n", hypporam[i], i + 0xfff8000,
             describe_address_label28(cpu, i + 0xfff8000), hypporam_expected[i]);
@@ -4265,6 +7468,10 @@ int compare_ram_contents(FILE *f, struct cpu *cpu)
         break;
     }
     for (int i = 0; i < COLOURRAM_SIZE; i++) {
+      if (!colourram_dirty[i >> PAGE_SHIFT]) {
+        i |= PAGE_SIZE - 1;
+        continue;
+      }
       if (colourram[i] != colourram_expected[i]) {
         fprintf(f, "ERROR: Saw $%02X at $%07x (%s), but expected to see $%02X\n", colourram[i], i + 0xff80000,
             describe_address_label28(cpu, i + 0xff80000), colourram_expected[i]);
@@ -4278,6 +7485,10 @@ int compare_ram_contents(FILE *f, struct cpu *cpu)
         break;
     }
     for (int i = 0; i < 65536; i++) {
+      if (!ffdram_dirty[i >> PAGE_SHIFT]) {
+        i |= PAGE_SIZE - 1;
+        continue;
+      }
       if (ffdram[i] != ffdram_expected[i]) {
         fprintf(f, "ERROR: Saw $%02X at $%07x (%s), but expected to see $%02X\n", ffdram[i], i + 0xffd0000,
             describe_address_label28(cpu, i + 0xffd0000), ffdram_expected[i]);
@@ -4307,6 +7518,9 @@ unsigned char viciv_regs[0x80] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0
 
 void machine_init(struct cpu *cpu)
 {
+  io_handlers_init();
+  io_reset();
+
   // Initialise CPU staet
   bzero(cpu, sizeof(struct cpu));
   cpu->regs.flags = FLAG_E | FLAG_I;
@@ -4323,6 +7537,9 @@ void machine_init(struct cpu *cpu)
   bzero(&cpu_expected, sizeof(struct cpu));
   cpu_expected.regs.flags = FLAG_E | FLAG_I;
 
+  // Nothing is known to match any more
+  mark_all_pages_dirty();
+
   // Clear chip RAM
   bzero(chipram_expected, CHIPRAM_SIZE);
   // Clear Hypervisor RAM
@@ -4330,6 +7547,11 @@ void machine_init(struct cpu *cpu)
   bzero(colourram_expected, COLOURRAM_SIZE);
   bzero(ffdram_expected, 65536);
 
+  // Reset the IO registers, so that one test's IO (eg DMA jobs, SD card sectors) doesn't show up as
+  // changes in the next, just as when each test runs in its own -j worker
+  bzero(ffdram, sizeof(ffdram));
+  bzero(ffdram_blame, sizeof(ffdram_blame));
+
   // Setup default VIC-IV register values
   for (int i = 0; i < 0x80; i++) {
     ffdram[0x3000 + i] = viciv_regs[i];
@@ -4341,6 +7563,7 @@ void machine_init(struct cpu *cpu)
   chipram_expected[1] = 0x27;
   chipram[0] = 0x3f;
   chipram[1] = 0x27;
+  memory_map_generation++;
 
   // Reset blame for contents of memory
   bzero(chipram_blame, sizeof(chipram_blame));
@@ -4351,23 +7574,32 @@ void machine_init(struct cpu *cpu)
     free(hyppo_symbols[i].name);
   }
   hyppo_symbol_count = 0;
+  symbol_tables_reset();
 
   // Reset instruction logs
-  for (int i = 0; i < cpulog_len; i++) {
-    free(cpulog[i]);
-  }
-  cpulog_len = 0;
-  bzero(lastataddr, sizeof(lastataddr));
+  cpulog_clear(0);
+  decode_cache_flush();
 }
 
 void test_init(struct cpu *cpu)
 {
 
+  // Each test starts with the default ring buffer instruction log
+  cpulog_set_capacity(CPULOG_RING_LENGTH);
   machine_init(cpu);
 
   fail_on_stack_overflow = true;
   fail_on_stack_underflow = true;
   log_on_failure = false;
+  expect_test_failure = false;
+  infinite_loop_threshold = INFINITE_LOOP_THRESHOLD;
+  user_cpu_speed = &cpu_speeds[CPU_SPEED_FULL];
+  emulated_seconds = 0;
+  run_start_cycles = 0;
+  profiling = false;
+  bzero(&dma_copy_stats, sizeof(dma_copy_stats));
+  bzero(&dma_fill_stats, sizeof(dma_fill_stats));
+  sdcard_detach();
 
   for (int i = 0; i < hyppo_symbol_count; i++)
     free(hyppo_symbols[i].name);
@@ -4378,15 +7610,17 @@ void test_init(struct cpu *cpu)
     free(symbols[i].name);
   bzero(symbols, sizeof(symbols));
   symbol_count = 0;
+  symbol_tables_reset();
 
   bzero(breakpoints, sizeof(breakpoints));
 
   // Log to temporary file, so that we can rename it to PASS.* or FAIL.*
   // after.
-  unlink(TESTLOGFILE);
-  logfile = fopen(TESTLOGFILE, "w");
+  snprintf(testlogfile, sizeof(testlogfile), "/tmp/hyppotest.%d.tmp", (int)getpid());
+  unlink(testlogfile);
+  logfile = fopen(testlogfile, "w");
   if (!logfile) {
-    fprintf(stderr, "ERROR: Could not write to '%s'\n", TESTLOGFILE);
+    fprintf(stderr, "ERROR: Could not write to '%s'\n", testlogfile);
     exit(-2);
   }
 
@@ -4401,10 +7635,27 @@ void test_init(struct cpu *cpu)
     safe_name[strlen(test_name)] = 0;
   }
 
+  test_instructions_start = instructions_executed;
+  clock_gettime(CLOCK_MONOTONIC, &test_time_start);
+
   // Show starting of test
   printf("[    ] %s", test_name);
 }
 
+// Report how quickly the instructions of the current test were emulated
+void report_test_speed(FILE *f)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double secs = (now.tv_sec - test_time_start.tv_sec) + (now.tv_nsec - test_time_start.tv_nsec) / 1e9;
+  unsigned long long n = instructions_executed - test_instructions_start;
+  total_execution_seconds += secs;
+  fprintf(f, "INFO: Executed %llu instructions in %.3f seconds (%.0f instructions/second)\n", n, secs,
+      secs > 0 ? n / secs : 0);
+  if (profiling)
+    fprintf(f, "INFO: Emulated %llu CPU cycles (%.6f seconds)\n", cpu.cycles, emulated_seconds);
+}
+
 void test_conclude(struct cpu *cpu)
 {
   char cmd[8192];
@@ -4415,8 +7666,28 @@ void test_conclude(struct cpu *cpu)
   snprintf(cmd, 8192, "PASS.%s", safe_name);
   unlink(cmd);
 
+  report_test_speed(logfile);
+  if (trace)
+    trace_close();
+  if (cpu->term.log_dma)
+    report_dma_speed(logfile);
+  if (sdcard.image)
+    report_sdcard(logfile);
+  if (profiling) {
+    profile_report(logfile);
+    profiling = false;
+  }
+
+  if (expect_test_failure) {
+    if (cpu->term.error)
+      fprintf(logfile, "NOTE: The test failed, as expected\n");
+    else
+      fprintf(logfile, "ERROR: The test was expected to fail, but nothing in it failed\n");
+    cpu->term.error = !cpu->term.error;
+  }
+
   if (cpu->term.error) {
-    snprintf(cmd, 8192, "mv %s FAIL.%s", TESTLOGFILE, safe_name);
+    snprintf(cmd, 8192, "mv %s FAIL.%s", testlogfile, safe_name);
     test_fails++;
     if (log_on_failure) {
       if (cpulog_len < 500000)
@@ -4431,7 +7702,7 @@ void test_conclude(struct cpu *cpu)
     printf("\r[FAIL] %s\n", test_name);
   }
   else {
-    snprintf(cmd, 8192, "mv %s PASS.%s", TESTLOGFILE, safe_name);
+    snprintf(cmd, 8192, "mv %s PASS.%s", testlogfile, safe_name);
     test_passes++;
 
     //    show_recent_instructions(logfile,"Complete instruction log follows",cpu,1,cpulog_len,-1);
@@ -4454,6 +7725,8 @@ int load_hyppo(char *filename)
     fprintf(logfile, "ERROR: Could not read HICKUP file from '%s'\n", filename);
     return -1;
   }
+  decode_cache_flush();
+  memset(hypporam_dirty, 1, sizeof(hypporam_dirty));
   int b = fread(hypporam, 1, HYPPORAM_SIZE, f);
   if (b != HYPPORAM_SIZE) {
     fprintf(logfile, "ERROR: Read only %d of %d bytes from HICKUP file.\n", b, HYPPORAM_SIZE);
@@ -4507,55 +7780,521 @@ int load_hyppo_symbols(char *filename)
     line[0] = 0;
     fgets(line, 1024, f);
   }
-  fclose(f);
-  fprintf(logfile, "INFO: Read %d HYPPO symbols.\n", hyppo_symbol_count);
+  fclose(f);
+  fprintf(logfile, "INFO: Read %d HYPPO symbols.\n", hyppo_symbol_count);
+  return 0;
+}
+
+int load_symbols(char *filename, unsigned int offset)
+{
+  FILE *f = fopen(filename, "r");
+  if (!f) {
+    fprintf(logfile, "ERROR: Could not read symbol list from '%s'\n", filename);
+    return -1;
+  }
+  char line[1024];
+  line[0] = 0;
+  fgets(line, 1024, f);
+  while (line[0]) {
+    char sym[1024];
+    int addr;
+    if (sscanf(line, " %s = $%x", sym, &addr) == 2) {
+      if (symbol_count >= MAX_SYMBOLS) {
+        fprintf(logfile, "ERROR: Too many symbols. Increase MAX_SYMBOLS.\n");
+        return -1;
+      }
+      symbols[symbol_count].name = strdup(sym);
+      symbols[symbol_count].addr = addr + offset;
+      if (addr + offset < CHIPRAM_SIZE) {
+        sym_by_addr[addr + offset] = &symbols[symbol_count];
+      }
+      symbol_count++;
+    }
+    else if (sscanf(line, "al %x %s", &addr, sym) == 2) {
+      // VICE symbol list format (eg from CC65)
+      if (symbol_count >= MAX_SYMBOLS) {
+        fprintf(logfile, "ERROR: Too many symbols. Increase MAX_SYMBOLS.\n");
+        return -1;
+      }
+      symbols[symbol_count].name = strdup(sym);
+      symbols[symbol_count].addr = addr + offset;
+      if (addr + offset < CHIPRAM_SIZE) {
+        sym_by_addr[addr + offset] = &symbols[symbol_count];
+      }
+      symbol_count++;
+    }
+    line[0] = 0;
+    fgets(line, 1024, f);
+  }
+  fclose(f);
+  fprintf(logfile, "INFO: Read %d symbols.\n", symbol_count);
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Machine snapshots
+
+   "snapshot save <name>" captures the CPU, all memory regions with their expected contents and
+   blame, breakpoints and symbols, so that many tests can share one expensive setup via
+   "snapshot restore <name>".  Snapshots survive from one test to the next.
+
+   A snapshot is a single flat image, which is also its on-disk form: "snapshot write <name> <file>"
+   saves it, and "snapshot read <name> <file>" maps the file back in copy-on-write (MAP_PRIVATE),
+   so a fixture can be reused across runs without being parsed or copied until it is restored.
+
+   Restoring the snapshot that the machine was last saved to or restored from (snapshot_base), or
+   saving over it, only copies the chip, hypervisor and colour RAM pages that are dirty or touched
+   since then, with their expected contents and blame.  Anything else is copied in full, as are
+   the IO registers, which change in too many places to be tracked.
+   As the image is the in-memory layout, a file is only accepted by a hyppotest with the same
+   SNAPSHOT_VERSION and structure sizes, and everything in it that is used as an index is checked.
+
+   The CIA timers and the SD card controller's registers and busy time are saved too, relative to
+   the emulated time, which itself is not: it belongs to the test, as do the instruction trace, the
+   cycle profile and which SD card image is attached, which all carry on as they were.
+   ----------------------------------------------------------------------------------------------------------
+*/
+
+#define SNAPSHOT_MAGIC "HYPSNAP1"
+// Bump this whenever the layout of snapshot_image, or of anything in it, changes
+#define SNAPSHOT_VERSION 2
+
+typedef struct snapshot_image {
+  char magic[8];
+  unsigned int version;     // SNAPSHOT_VERSION
+  unsigned int header_size; // sizeof(snapshot_image)
+  unsigned int cpu_size;    // sizeof(struct cpu)
+  unsigned int image_size;  // including the symbol records that follow
+  unsigned int hyppo_symbol_count;
+  unsigned int symbol_count;
+  int cpulog_len;
+  struct cpu cpu;
+  struct cpu cpu_expected;
+  cia_state cias[2];       // with each timer's start_tick made relative to when the snapshot was saved
+  sdcard_state sdcard;     // only the controller's registers are used, and busy_until is relative too
+  unsigned char chipram[CHIPRAM_SIZE];
+  unsigned char hypporam[HYPPORAM_SIZE];
+  unsigned char colourram[COLOURRAM_SIZE];
+  unsigned char ffdram[65536];
+  unsigned char chipram_expected[CHIPRAM_SIZE];
+  unsigned char hypporam_expected[HYPPORAM_SIZE];
+  unsigned char colourram_expected[COLOURRAM_SIZE];
+  unsigned char ffdram_expected[65536];
+  unsigned int chipram_blame[CHIPRAM_SIZE];
+  unsigned int hypporam_blame[HYPPORAM_SIZE];
+  unsigned int colourram_blame[COLOURRAM_SIZE];
+  unsigned int ffdram_blame[65536];
+  unsigned char breakpoints[65536];
+  // Index into hyppo_symbols[] (with bit 31 set) or symbols[], or -1
+  int sym_by_addr[CHIPRAM_SIZE];
+  // Followed by a record for each HYPPO symbol and then each symbol:
+  // 32-bit address, followed by the NUL terminated name
+} snapshot_image;
+
+typedef struct snapshot {
+  char *name;
+  snapshot_image *image;
+  bool mapped; // image is an mmap() of a snapshot file
+  struct snapshot *next;
+} snapshot;
+
+snapshot *snapshots = NULL;
+// The snapshot that the machine was last saved to or restored from, if it is still as it was then
+snapshot *snapshot_base = NULL;
+
+snapshot *find_snapshot(char *name)
+{
+  for (snapshot *s = snapshots; s; s = s->next)
+    if (!strcmp(s->name, name))
+      return s;
+  return NULL;
+}
+
+// Add a snapshot, replacing any existing one of the same name
+void add_snapshot(char *name, snapshot_image *image, bool mapped)
+{
+  snapshot *s = find_snapshot(name);
+  if (!s) {
+    s = calloc(1, sizeof(snapshot));
+    s->name = strdup(name);
+    s->next = snapshots;
+    snapshots = s;
+  }
+  else if (s->mapped)
+    munmap(s->image, s->image->image_size);
+  else
+    free(s->image);
+  // The machine no longer matches what is in this snapshot
+  if (s == snapshot_base)
+    snapshot_base = NULL;
+  s->image = image;
+  s->mapped = mapped;
+}
+
+int sym_index(hyppo_symbol *sym)
+{
+  if (!sym)
+    return -1;
+  if (sym >= hyppo_symbols && sym < hyppo_symbols + MAX_HYPPO_SYMBOLS)
+    return 0x80000000 | (sym - hyppo_symbols);
+  return sym - symbols;
+}
+
+// Copy the pages of a memory region, with their expected contents and blame, to a snapshot image
+// (or from it, when restoring).  Unless all of them are wanted, only pages that are dirty or touched
+// since snapshot_base are copied: the rest already match.  Either way, the machine now matches the
+// image, and restored pages have to be compared again.
+void snapshot_pages(bool restore, bool all, unsigned char *ram, unsigned char *expected, unsigned int *blame,
+    unsigned char *ram_image, unsigned char *expected_image, unsigned int *blame_image, unsigned char *dirty,
+    unsigned char *touched, int size)
+{
+  for (int page = 0; page < (size >> PAGE_SHIFT); page++) {
+    if (!all && !dirty[page] && !touched[page])
+      continue;
+    int base = page << PAGE_SHIFT;
+    if (restore) {
+      memcpy(&ram[base], &ram_image[base], PAGE_SIZE);
+      memcpy(&expected[base], &expected_image[base], PAGE_SIZE);
+      memcpy(&blame[base], &blame_image[base], PAGE_SIZE * sizeof(unsigned int));
+      dirty[page] = 1;
+    }
+    else {
+      memcpy(&ram_image[base], &ram[base], PAGE_SIZE);
+      memcpy(&expected_image[base], &expected[base], PAGE_SIZE);
+      memcpy(&blame_image[base], &blame[base], PAGE_SIZE * sizeof(unsigned int));
+    }
+  }
+  memset(touched, 0, size >> PAGE_SHIFT);
+}
+
+#define SNAPSHOT_PAGES(restore, all, img, region, size)                                                              \
+  snapshot_pages(restore, all, region, region##_expected, region##_blame, img->region, img->region##_expected,      \
+      img->region##_blame, region##_dirty, region##_touched, size)
+
+int snapshot_save(char *name)
+{
+  unsigned int size = sizeof(snapshot_image);
+  for (int i = 0; i < hyppo_symbol_count; i++)
+    size += 4 + strlen(hyppo_symbols[i].name) + 1;
+  for (int i = 0; i < symbol_count; i++)
+    size += 4 + strlen(symbols[i].name) + 1;
+
+  // Saving over the snapshot base again only has to update the pages changed since
+  snapshot *s = find_snapshot(name);
+  bool update = s && s == snapshot_base && s->image->image_size == size;
+  snapshot_image *img = update ? s->image : malloc(size);
+  if (!img) {
+    fprintf(logfile, "ERROR: Could not allocate %u bytes for snapshot '%s'\n", size, name);
+    return -1;
+  }
+  if (!update)
+    bzero(img, sizeof(snapshot_image));
+  memcpy(img->magic, SNAPSHOT_MAGIC, 8);
+  img->version = SNAPSHOT_VERSION;
+  img->header_size = sizeof(snapshot_image);
+  img->cpu_size = sizeof(struct cpu);
+  img->image_size = size;
+  img->hyppo_symbol_count = hyppo_symbol_count;
+  img->symbol_count = symbol_count;
+  img->cpulog_len = cpulog_len;
+  img->cpu = cpu;
+  img->cpu_expected = cpu_expected;
+  unsigned long long now = cia_tick();
+  for (int c = 0; c < 2; c++) {
+    for (int t = 0; t < 2; t++)
+      cia_timer_update(&cias[c], t);
+    img->cias[c] = cias[c];
+    for (int t = 0; t < 2; t++)
+      img->cias[c].timer[t].start_tick -= now;
+  }
+  img->sdcard = sdcard;
+  img->sdcard.image = NULL;
+  img->sdcard.filename = NULL;
+  img->sdcard.busy_until = sdcard.busy_until > emulated_seconds ? sdcard.busy_until - emulated_seconds : 0;
+  SNAPSHOT_PAGES(false, !update, img, chipram, CHIPRAM_SIZE);
+  SNAPSHOT_PAGES(false, !update, img, hypporam, HYPPORAM_SIZE);
+  SNAPSHOT_PAGES(false, !update, img, colourram, COLOURRAM_SIZE);
+  memcpy(img->ffdram, ffdram, sizeof(ffdram));
+  memcpy(img->ffdram_expected, ffdram_expected, sizeof(ffdram_expected));
+  memcpy(img->ffdram_blame, ffdram_blame, sizeof(ffdram_blame));
+  memcpy(img->breakpoints, breakpoints, sizeof(breakpoints));
+  for (int i = 0; i < CHIPRAM_SIZE; i++)
+    img->sym_by_addr[i] = sym_index(sym_by_addr[i]);
+
+  unsigned char *p = (unsigned char *)(img + 1);
+  for (int i = 0; i < hyppo_symbol_count + symbol_count; i++) {
+    hyppo_symbol *sym = i < hyppo_symbol_count ? &hyppo_symbols[i] : &symbols[i - hyppo_symbol_count];
+    memcpy(p, &sym->addr, 4);
+    strcpy((char *)p + 4, sym->name);
+    p += 4 + strlen(sym->name) + 1;
+  }
+
+  if (!update)
+    add_snapshot(name, img, false);
+  snapshot_base = find_snapshot(name);
+  fprintf(logfile, "INFO: Saved snapshot '%s'\n", name);
+  return 0;
+}
+
+int snapshot_restore(char *name)
+{
+  snapshot *s = find_snapshot(name);
+  if (!s) {
+    fprintf(logfile, "ERROR: No snapshot named '%s'\n", name);
+    return -1;
+  }
+  snapshot_image *img = s->image;
+
+  bool prior_error = cpu.term.error;
+  cpu = img->cpu;
+  cpu.term.error |= prior_error;
+  cpu_expected = img->cpu_expected;
+  bool all = s != snapshot_base;
+  SNAPSHOT_PAGES(true, all, img, chipram, CHIPRAM_SIZE);
+  SNAPSHOT_PAGES(true, all, img, hypporam, HYPPORAM_SIZE);
+  SNAPSHOT_PAGES(true, all, img, colourram, COLOURRAM_SIZE);
+  memcpy(ffdram, img->ffdram, sizeof(ffdram));
+  memcpy(ffdram_expected, img->ffdram_expected, sizeof(ffdram_expected));
+  memcpy(ffdram_blame, img->ffdram_blame, sizeof(ffdram_blame));
+  memset(ffdram_dirty, 1, sizeof(ffdram_dirty));
+  snapshot_base = s;
+  memcpy(breakpoints, img->breakpoints, sizeof(breakpoints));
+
+  unsigned long long now = cia_tick();
+  for (int c = 0; c < 2; c++) {
+    cias[c] = img->cias[c];
+    for (int t = 0; t < 2; t++)
+      cias[c].timer[t].start_tick += now;
+  }
+  const sdcard_state *saved = &img->sdcard;
+  sdcard.mapped = saved->mapped;
+  sdcard.reset = saved->reset;
+  sdcard.sdhc = saved->sdhc;
+  sdcard.error = saved->error;
+  sdcard.fsm_error = saved->fsm_error;
+  sdcard.card1 = saved->card1;
+  sdcard.write_gate = saved->write_gate;
+  sdcard.write_sector0_gate = saved->write_sector0_gate;
+  sdcard.fill_mode = saved->fill_mode;
+  sdcard.busy_until = emulated_seconds + saved->busy_until;
+  sdcard.last_sector = saved->last_sector;
+
+  for (int i = 0; i < hyppo_symbol_count; i++)
+    free(hyppo_symbols[i].name);
+  for (int i = 0; i < symbol_count; i++)
+    free(symbols[i].name);
+  hyppo_symbol_count = img->hyppo_symbol_count;
+  symbol_count = img->symbol_count;
+  unsigned char *p = (unsigned char *)(img + 1);
+  for (int i = 0; i < hyppo_symbol_count + symbol_count; i++) {
+    hyppo_symbol *sym = i < hyppo_symbol_count ? &hyppo_symbols[i] : &symbols[i - hyppo_symbol_count];
+    memcpy(&sym->addr, p, 4);
+    sym->name = strdup((char *)p + 4);
+    p += 4 + strlen(sym->name) + 1;
+  }
+  for (int i = 0; i < CHIPRAM_SIZE; i++) {
+    int index = img->sym_by_addr[i];
+    if (index == -1)
+      sym_by_addr[i] = NULL;
+    else if (index & 0x80000000)
+      sym_by_addr[i] = &hyppo_symbols[index & 0x7fffffff];
+    else
+      sym_by_addr[i] = &symbols[index];
+  }
+  symbol_tables_reset();
+
+  // The instructions that blame refers to are not part of the snapshot, but keep
+  // numbering after them, so that they are reported as no longer in the log.
+  cpulog_clear(img->cpulog_len);
+  decode_cache_flush();
+  memory_map_generation++;
+
+  fprintf(logfile, "INFO: Restored snapshot '%s'\n", name);
+  return 0;
+}
+
+int snapshot_write(char *name, char *filename)
+{
+  snapshot *s = find_snapshot(name);
+  if (!s) {
+    fprintf(logfile, "ERROR: No snapshot named '%s'\n", name);
+    return -1;
+  }
+  FILE *f = fopen(filename, "wb");
+  if (!f || fwrite(s->image, s->image->image_size, 1, f) != 1) {
+    fprintf(logfile, "ERROR: Could not write snapshot '%s' to '%s'\n", name, filename);
+    if (f)
+      fclose(f);
+    return -1;
+  }
+  fclose(f);
+  fprintf(logfile, "INFO: Wrote snapshot '%s' to '%s'\n", name, filename);
+  return 0;
+}
+
+// Check that a snapshot file was written by this build of hyppotest, and that nothing in it that is
+// used as an index or a length is out of range
+bool snapshot_valid(snapshot_image *img, size_t size, char *filename)
+{
+  if (memcmp(img->magic, SNAPSHOT_MAGIC, 8)) {
+    fprintf(logfile, "ERROR: '%s' is not a hyppotest snapshot\n", filename);
+    return false;
+  }
+  if (img->version != SNAPSHOT_VERSION || img->header_size != sizeof(snapshot_image)
+      || img->cpu_size != sizeof(struct cpu)) {
+    fprintf(logfile,
+        "ERROR: Snapshot '%s' is version %u, with a %u byte header and %u byte CPU state, but this hyppotest "
+        "needs version %u, %zu and %zu\n",
+        filename, img->version, img->header_size, img->cpu_size, SNAPSHOT_VERSION, sizeof(snapshot_image),
+        sizeof(struct cpu));
+    return false;
+  }
+
+  const char *problem = NULL;
+  if (img->image_size != size)
+    problem = "its size does not match the file's";
+  else if (img->hyppo_symbol_count > MAX_HYPPO_SYMBOLS || img->symbol_count > MAX_SYMBOLS)
+    problem = "it has too many symbols";
+  else if (img->cpulog_len < 0)
+    problem = "its instruction number is negative";
+  else if (img->cpu.regs.pc > 0xffff || img->cpu_expected.regs.pc > 0xffff)
+    problem = "a PC is more than 16 bits";
+  else if (img->cpu.hypervisor_request < HYPERVISOR_RETURN || img->cpu.hypervisor_request > 0x40)
+    problem = "its pending hypervisor trap is out of range";
+  else if (img->sdcard.busy_until < 0 || img->sdcard.busy_until > 3600)
+    problem = "its SD card busy time is out of range";
+
+  // Each symbol record is a 32-bit address and a name that must end within the file
+  const unsigned char *p = (const unsigned char *)(img + 1), *end = (const unsigned char *)img + size;
+  for (unsigned int i = 0; !problem && i < img->hyppo_symbol_count + img->symbol_count; i++) {
+    const unsigned char *nul = end - p > 4 ? memchr(p + 4, 0, end - p - 4) : NULL;
+    if (!nul)
+      problem = "its symbols run past the end of the file";
+    else
+      p = nul + 1;
+  }
+  for (int i = 0; !problem && i < CHIPRAM_SIZE; i++) {
+    int index = img->sym_by_addr[i];
+    if (index == -1)
+      continue;
+    if (index & 0x80000000 ? (index & 0x7fffffff) >= img->hyppo_symbol_count : index >= img->symbol_count)
+      problem = "it refers to symbols that it does not have";
+  }
+
+  if (problem) {
+    fprintf(logfile, "ERROR: Snapshot '%s' is damaged: %s\n", filename, problem);
+    return false;
+  }
+  return true;
+}
+
+int snapshot_read(char *name, char *filename)
+{
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) || st.st_size < sizeof(snapshot_image)) {
+    fprintf(logfile, "ERROR: Could not read snapshot from '%s'\n", filename);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  snapshot_image *img = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (img == MAP_FAILED) {
+    fprintf(logfile, "ERROR: Could not map snapshot file '%s'\n", filename);
+    return -1;
+  }
+  if (!snapshot_valid(img, st.st_size, filename)) {
+    munmap(img, st.st_size);
+    return -1;
+  }
+  add_snapshot(name, img, true);
+  fprintf(logfile, "INFO: Read snapshot '%s' from '%s'\n", name, filename);
   return 0;
 }
 
-int load_symbols(char *filename, unsigned int offset)
+/* ----------------------------------------------------------------------------------------------------------
+   Symbol lookup by name
+
+   Each symbol list has an open addressing hash table over its names.  Symbols are only ever appended
+   to the lists, except when a test starts, a snapshot is restored or a DMA fill erases some, so the
+   tables index newly appended symbols when they are next searched, and are rebuilt after any of
+   those.  As with a search of the list, the first symbol with a given name wins.
+   ----------------------------------------------------------------------------------------------------------
+*/
+
+typedef struct symbol_hash_slot {
+  unsigned int generation; // slot is empty unless this matches the table's generation
+  int index;
+} symbol_hash_slot;
+
+typedef struct symbol_table {
+  hyppo_symbol *symbols;
+  int *count;
+  unsigned int mask;
+  symbol_hash_slot *slots;
+  unsigned int generation;
+  int indexed; // symbols[0 .. indexed-1] are in the table
+} symbol_table;
+
+// At most half full
+symbol_table hyppo_symbols_by_name = { hyppo_symbols, &hyppo_symbol_count, (2 * MAX_HYPPO_SYMBOLS) - 1 };
+symbol_table symbols_by_name = { symbols, &symbol_count, (1 << 20) - 1 };
+
+unsigned int symbol_name_hash(const char *name)
 {
-  FILE *f = fopen(filename, "r");
-  if (!f) {
-    fprintf(logfile, "ERROR: Could not read symbol list from '%s'\n", filename);
-    return -1;
+  // FNV-1a
+  unsigned int h = 2166136261u;
+  while (*name) {
+    h ^= (unsigned char)*name++;
+    h *= 16777619u;
   }
-  char line[1024];
-  line[0] = 0;
-  fgets(line, 1024, f);
-  while (line[0]) {
-    char sym[1024];
-    int addr;
-    if (sscanf(line, " %s = $%x", sym, &addr) == 2) {
-      if (symbol_count >= MAX_SYMBOLS) {
-        fprintf(logfile, "ERROR: Too many symbols. Increase MAX_SYMBOLS.\n");
-        return -1;
-      }
-      symbols[symbol_count].name = strdup(sym);
-      symbols[symbol_count].addr = addr + offset;
-      if (addr + offset < CHIPRAM_SIZE) {
-        sym_by_addr[addr + offset] = &symbols[symbol_count];
-      }
-      symbol_count++;
-    }
-    else if (sscanf(line, "al %x %s", &addr, sym) == 2) {
-      // VICE symbol list format (eg from CC65)
-      if (symbol_count >= MAX_SYMBOLS) {
-        fprintf(logfile, "ERROR: Too many symbols. Increase MAX_SYMBOLS.\n");
-        return -1;
-      }
-      symbols[symbol_count].name = strdup(sym);
-      symbols[symbol_count].addr = addr + offset;
-      if (addr + offset < CHIPRAM_SIZE) {
-        sym_by_addr[addr + offset] = &symbols[symbol_count];
-      }
-      symbol_count++;
-    }
-    line[0] = 0;
-    fgets(line, 1024, f);
+  return h;
+}
+
+// Forget the contents of the symbol tables, after symbols have been removed or replaced
+void symbol_tables_reset(void)
+{
+  hyppo_symbols_by_name.generation++;
+  hyppo_symbols_by_name.indexed = 0;
+  symbols_by_name.generation++;
+  symbols_by_name.indexed = 0;
+}
+
+void symbol_table_add(symbol_table *t, int index)
+{
+  char *name = t->symbols[index].name;
+  unsigned int slot = symbol_name_hash(name) & t->mask;
+  while (t->slots[slot].generation == t->generation) {
+    if (!strcmp(t->symbols[t->slots[slot].index].name, name))
+      return; // First definition wins
+    slot = (slot + 1) & t->mask;
   }
-  fclose(f);
-  fprintf(logfile, "INFO: Read %d symbols.\n", symbol_count);
-  return 0;
+  t->slots[slot].generation = t->generation;
+  t->slots[slot].index = index;
+}
+
+hyppo_symbol *find_symbol(symbol_table *t, const char *name)
+{
+  if (!t->slots) {
+    t->slots = calloc(t->mask + 1, sizeof(symbol_hash_slot));
+    t->generation++;
+  }
+  if (*t->count < t->indexed) {
+    t->generation++;
+    t->indexed = 0;
+  }
+  while (t->indexed < *t->count)
+    symbol_table_add(t, t->indexed++);
+
+  unsigned int slot = symbol_name_hash(name) & t->mask;
+  while (t->slots[slot].generation == t->generation) {
+    hyppo_symbol *sym = &t->symbols[t->slots[slot].index];
+    if (!strcmp(sym->name, name))
+      return sym;
+    slot = (slot + 1) & t->mask;
+  }
+  return NULL;
 }
 
 int resolve_value32(char *in)
@@ -4592,66 +8331,801 @@ int resolve_value32(char *in)
   if (label[v] == ',')
     label[v] = 0;
 
-  int i;
-  for (i = 0; i < hyppo_symbol_count; i++) {
-    if (!strcmp(label, hyppo_symbols[i].name))
+  hyppo_symbol *sym = find_symbol(&hyppo_symbols_by_name, label);
+  if (sym) {
+    // Add HYPPO base address to HYPPO symbols
+    v = 0xfff0000 + sym->addr + delta;
+    return v;
+  }
+
+  // Now look for non-hyppo symbols
+  sym = find_symbol(&symbols_by_name, label);
+  if (!sym) {
+    fprintf(logfile, "ERROR: Cannot call find non-existent symbol '%s'\n", label);
+    cpu.term.error = true;
+    return 0;
+  }
+  // Return symbol address
+  v = sym->addr + delta;
+  return v;
+}
+
+unsigned char resolve_value8(char *in)
+{
+  return (unsigned char)(resolve_value32(in) & 0xff);
+}
+
+unsigned short resolve_value16(char *in)
+{
+  return (unsigned short)(resolve_value32(in) & 0xffff);
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Inline assembly with ACME
+
+   Assembled blocks are cached on disk, keyed by a hash of their source and load address, the path, size
+   and modification time of the acme that is run, and the contents of every file that the source, or any
+   source file it includes, includes with !src, !bin or !convtab, so that a block is only assembled again
+   when it, or anything it is built from, changes.  The cache lives in $HYPPOTEST_ACME_CACHE, or else in
+   ~/.cache/hyppotest/acme, and setting HYPPOTEST_ACME_CACHE to an empty string disables it.
+
+   ACME has no way to assemble many independent blocks, each with its own labels and symbol list, in
+   one run, so instead the blocks at constant addresses that are not in the cache are all assembled
+   up front, running up to -j copies of ACME at once.
+   ----------------------------------------------------------------------------------------------------------
+*/
+
+// Part of every cache key, so change it whenever the way that ACME is run changes
+#define ACME_OPTIONS "--cpu m65 --format plain"
+
+char *acme_cache_dir = NULL;
+// Which acme is run: its path, size and modification time, or "not found"
+char acme_identity[PATH_MAX + 64] = "not found";
+
+// Find the acme that execlp() will run
+void acme_identify(void)
+{
+  char *path = getenv("PATH");
+  if (!path)
+    return;
+  path = strdup(path);
+  for (char *dir = strtok(path, ":"); dir; dir = strtok(NULL, ":")) {
+    char file[PATH_MAX];
+    struct stat st;
+    snprintf(file, sizeof(file), "%s/acme", *dir ? dir : ".");
+    if (!stat(file, &st) && S_ISREG(st.st_mode) && !access(file, X_OK)) {
+      snprintf(acme_identity, sizeof(acme_identity), "%s %lld %lld.%09ld", file, (long long)st.st_size,
+          (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
       break;
+    }
+  }
+  free(path);
+}
+
+void acme_cache_init(void)
+{
+  char dir[1024];
+  char *env = getenv("HYPPOTEST_ACME_CACHE");
+
+  if (env)
+    snprintf(dir, sizeof(dir), "%s", env);
+  else if (getenv("HOME"))
+    snprintf(dir, sizeof(dir), "%s/.cache/hyppotest/acme", getenv("HOME"));
+  else
+    return;
+  if (!dir[0])
+    return;
+
+  // Create the directory and any missing parents
+  for (char *p = dir + 1; *p; p++) {
+    if (*p == '/') {
+      *p = 0;
+      mkdir(dir, 0777);
+      *p = '/';
+    }
+  }
+  mkdir(dir, 0777);
+  if (access(dir, W_OK)) {
+    fprintf(stderr, "WARNING: Cannot use '%s' to cache assembled code\n", dir);
+    return;
   }
-  if (i == hyppo_symbol_count) {
+  acme_cache_dir = strdup(dir);
+  acme_identify();
+}
+
+// FNV-1a
+unsigned long long acme_hash(unsigned long long h, const void *data, size_t len)
+{
+  for (const unsigned char *c = data; len--; c++) {
+    h ^= *c;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// Add the name and contents of each file that the source includes to the hash, and for source files,
+// those of the files that they include in turn.  Like acme, this looks for relative names in the current
+// directory, and for <library> names in $ACME_LIB.
+unsigned long long acme_hash_includes(unsigned long long h, const char *source, size_t len, int depth)
+{
+  static const char *const pseudo_ops[] = { "src", "source", "bin", "binary", "convtab", "ct", NULL };
+  const char *end = source + len;
+
+  for (const char *p = source; p < end; p++) {
+    // Skip comments and strings, which could contain '!'
+    if (*p == ';') {
+      while (p < end && *p != '\n')
+        p++;
+      continue;
+    }
+    if (*p == '"' || *p == '\'') {
+      char quote = *p++;
+      while (p < end && *p != quote && *p != '\n')
+        p++;
+      continue;
+    }
+    if (*p != '!')
+      continue;
 
-    // Now look for non-hyppo symbols
-    for (i = 0; i < symbol_count; i++) {
-      if (!strcmp(label, symbols[i].name))
+    const char *word = p + 1, *q = word;
+    while (q < end && isalpha(*q))
+      q++;
+    int i;
+    for (i = 0; pseudo_ops[i]; i++)
+      if ((size_t)(q - word) == strlen(pseudo_ops[i]) && !strncasecmp(word, pseudo_ops[i], q - word))
         break;
+    if (!pseudo_ops[i])
+      continue;
+    while (q < end && (*q == ' ' || *q == '\t'))
+      q++;
+    if (q == end || (*q != '"' && *q != '<'))
+      continue;
+    char closing = *q == '"' ? '"' : '>';
+    const char *name = ++q;
+    while (q < end && *q != closing && *q != '\n')
+      q++;
+
+    char file[PATH_MAX];
+    if (closing == '>')
+      snprintf(file, sizeof(file), "%s/%.*s", getenv("ACME_LIB") ? getenv("ACME_LIB") : "", (int)(q - name), name);
+    else
+      snprintf(file, sizeof(file), "%.*s", (int)(q - name), name);
+    h = acme_hash(h, file, strlen(file) + 1);
+
+    // A file that cannot be read makes acme fail, so there is nothing to cache
+    int fd = open(file, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+      if (fd >= 0)
+        close(fd);
+      continue;
     }
-    if (i == symbol_count) {
-      fprintf(logfile, "ERROR: Cannot call find non-existent symbol '%s'\n", label);
-      cpu.term.error = true;
-      return 0;
+    char *contents = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (contents == MAP_FAILED)
+      continue;
+    h = acme_hash(h, contents, st.st_size);
+    // Only source files include others, and a file that includes itself would never end
+    if (i < 2 && depth < 16)
+      h = acme_hash_includes(h, contents, st.st_size, depth + 1);
+    if (contents)
+      munmap(contents, st.st_size);
+    p = q;
+  }
+  return h;
+}
+
+void acme_cache_paths(const char *source, unsigned short pc, char *bin_file_name, char *sym_file_name, size_t size)
+{
+  // Over the ACME options and the acme itself, the load address, the source, and what it includes
+  unsigned long long h = 14695981039346656037ull;
+  char pc_text[16];
+  snprintf(pc_text, sizeof(pc_text), "$%04x\n", pc);
+  const char *parts[4] = { ACME_OPTIONS "\n", acme_identity, pc_text, source };
+  for (int i = 0; i < 4; i++)
+    h = acme_hash(h, parts[i], strlen(parts[i]) + 1);
+  h = acme_hash_includes(h, source, strlen(source), 0);
+
+  snprintf(bin_file_name, size, "%s/%016llx.bin", acme_cache_dir, h);
+  snprintf(sym_file_name, size, "%s/%016llx.sym", acme_cache_dir, h);
+}
+
+// Run ACME on the source, and return its exit status
+int run_acme(const char *source, unsigned short pc, const char *bin_file_name, const char *sym_file_name)
+{
+  char src_file_name[] = P_tmpdir "/acme.src.XXXXXX";
+  int fd = mkstemp(src_file_name);
+  if (fd < 0)
+    return -1;
+  FILE *src_file = fdopen(fd, "w");
+  fputs(source, src_file);
+  fclose(src_file);
+
+  char pc_text[16];
+  snprintf(pc_text, sizeof(pc_text), "$%x", pc);
+  int status = -1;
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (!pid) {
+    execlp("acme", "acme", "--setpc", pc_text, "--cpu", "m65", "--format", "plain", "--outfile", bin_file_name,
+        "--symbollist", sym_file_name, src_file_name, (char *)NULL);
+    _exit(127);
+  }
+  if (pid > 0)
+    waitpid(pid, &status, 0);
+  remove(src_file_name);
+  return status;
+}
+
+// Assemble the source into the cache, via temporary files so that other runs never see partial output
+int acme_cache_build(const char *source, unsigned short pc, const char *bin_file_name, const char *sym_file_name)
+{
+  char bin_tmp[1024], sym_tmp[1024];
+  snprintf(bin_tmp, sizeof(bin_tmp), "%s.%d", bin_file_name, (int)getpid());
+  snprintf(sym_tmp, sizeof(sym_tmp), "%s.%d", sym_file_name, (int)getpid());
+  int status = run_acme(source, pc, bin_tmp, sym_tmp);
+  if (!status)
+    status = rename(sym_tmp, sym_file_name) || rename(bin_tmp, bin_file_name);
+  remove(bin_tmp);
+  remove(sym_tmp);
+  return status;
+}
+
+bool acme_cache_has(const char *bin_file_name, const char *sym_file_name)
+{
+  return !access(bin_file_name, R_OK) && !access(sym_file_name, R_OK);
+}
+
+void assemble_with_acme(const char *source, struct cpu *cpu, unsigned short pc)
+{
+  char bin_file_name[1024], sym_file_name[1024];
+  int status = 0;
+
+  if (acme_cache_dir) {
+    acme_cache_paths(source, pc, bin_file_name, sym_file_name, sizeof(bin_file_name));
+    if (!acme_cache_has(bin_file_name, sym_file_name))
+      status = acme_cache_build(source, pc, bin_file_name, sym_file_name);
+  }
+  else {
+    snprintf(bin_file_name, sizeof(bin_file_name), P_tmpdir "/acme.bin.%d", (int)getpid());
+    snprintf(sym_file_name, sizeof(sym_file_name), P_tmpdir "/acme.sym.%d", (int)getpid());
+    status = run_acme(source, pc, bin_file_name, sym_file_name);
+  }
+
+  if (status) {
+    fprintf(stderr, "ERROR: acme failed to assemble the source\n");
+    if (logfile != stderr)
+      fprintf(logfile, "ERROR: acme failed to assemble the source\n");
+    cpu->term.error = true;
+  }
+  else {
+    //
+    // Load the ACME output files
+    load_file(bin_file_name, pc);
+    load_symbols(sym_file_name, 0);
+  }
+
+  if (!acme_cache_dir) {
+    remove(bin_file_name);
+    remove(sym_file_name);
+  }
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Parallel test execution (-j N)
+
+   Each test block runs in a forked worker, which inherits the machine state the script has set up
+   outside of test blocks, and is isolated from every other test.  A worker's stdout and stderr go to
+   a temporary file, which is copied to our stdout in script order once the worker (and every worker
+   launched before it) has finished.
+   ----------------------------------------------------------------------------------------------------------
+*/
+
+typedef struct test_worker {
+  pid_t pid;
+  char *name;
+  FILE *output;
+  bool done;
+  int status;
+} test_worker;
+
+int max_workers = 1;
+bool in_test_worker = false;
+test_worker *workers = NULL;
+int worker_count = 0;
+int workers_reported = 0;
+int workers_running = 0;
+
+// Workers add the instructions they executed, and how long that took, to these totals, which are shared
+// with the parent, so that its summary covers every test
+typedef struct worker_totals {
+  unsigned long long instructions;
+  unsigned long long nanoseconds;
+} worker_totals;
+worker_totals *shared_worker_totals = NULL;
+unsigned long long worker_instructions_start = 0;
+double worker_seconds_start = 0;
+
+void wait_for_test_worker(void)
+{
+  int status;
+  pid_t pid = wait(&status);
+  if (pid < 0) {
+    perror("wait");
+    exit(-2);
+  }
+  for (int i = workers_reported; i < worker_count; i++) {
+    if (workers[i].pid == pid) {
+      workers[i].done = true;
+      workers[i].status = status;
+      workers_running--;
+      break;
     }
+  }
+}
+
+// Copy the output of finished workers to stdout, in the order they were launched
+void report_test_workers(void)
+{
+  char buffer[8192];
+
+  while (workers_reported < worker_count && workers[workers_reported].done) {
+    test_worker *w = &workers[workers_reported++];
+    size_t n;
+
+    fflush(stdout);
+    rewind(w->output);
+    while ((n = fread(buffer, 1, sizeof(buffer), w->output)) > 0)
+      fwrite(buffer, 1, n, stdout);
+    fclose(w->output);
+
+    if (WIFEXITED(w->status) && WEXITSTATUS(w->status) == 0)
+      test_passes++;
     else {
-      // Return symbol address
-      v = symbols[i].addr + delta;
-      return v;
+      test_fails++;
+      if (!WIFEXITED(w->status))
+        printf("\r[FAIL] %s (test worker died)\n", w->name);
     }
+    free(w->name);
+    fflush(stdout);
   }
-  else {
-    // Add HYPPO base address to HYPPO symbols
-    v = 0xfff0000 + hyppo_symbols[i].addr + delta;
-    return v;
+}
+
+// Start a worker for the test that is about to run.
+// Returns true in the worker, and false in the parent.
+bool launch_test_worker(void)
+{
+  while (workers_running >= max_workers) {
+    wait_for_test_worker();
+    report_test_workers();
+  }
+
+  if (!shared_worker_totals) {
+    shared_worker_totals
+        = mmap(NULL, sizeof(worker_totals), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared_worker_totals == MAP_FAILED) {
+      perror("mmap");
+      exit(-2);
+    }
+  }
+
+  workers = realloc(workers, (worker_count + 1) * sizeof(test_worker));
+  test_worker *w = &workers[worker_count];
+  bzero(w, sizeof(test_worker));
+  w->name = strdup(test_name);
+  w->output = tmpfile();
+  if (!w->output) {
+    perror("tmpfile");
+    exit(-2);
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+  w->pid = fork();
+  if (w->pid < 0) {
+    perror("fork");
+    exit(-2);
+  }
+  if (!w->pid) {
+    // Worker: send all output to our capture file, and go on to run the test
+    in_test_worker = true;
+    // Our exit status reports only this test, not those the parent already collected
+    test_passes = 0;
+    test_fails = 0;
+    worker_instructions_start = instructions_executed;
+    worker_seconds_start = total_execution_seconds;
+    dup2(fileno(w->output), 1);
+    dup2(fileno(w->output), 2);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    return true;
+  }
+  worker_count++;
+  workers_running++;
+  return false;
+}
+
+// A worker exits as soon as its test has been concluded
+void test_worker_done(void)
+{
+  if (in_test_worker) {
+    coverage_save();
+    __atomic_add_fetch(&shared_worker_totals->instructions, instructions_executed - worker_instructions_start,
+        __ATOMIC_RELAXED);
+    __atomic_add_fetch(&shared_worker_totals->nanoseconds,
+        (unsigned long long)((total_execution_seconds - worker_seconds_start) * 1e9), __ATOMIC_RELAXED);
+    fflush(stdout);
+    exit(test_fails ? 1 : 0);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cycle_counter() __rdtsc()
+#else
+#define cycle_counter() 0ULL
+#endif
+
+#define BENCHMARK_ACCESSES (32 * 1024 * 1024)
+
+void report_benchmark(char *what, struct timespec *t0, struct timespec *t1, unsigned long long cycles)
+{
+  double ns = (t1->tv_sec - t0->tv_sec) * 1e9 + (t1->tv_nsec - t0->tv_nsec);
+  printf("%-40s : %6.2f ns", what, ns / BENCHMARK_ACCESSES);
+  if (cycles)
+    printf(", %6.2f cycles", (double)cycles / BENCHMARK_ACCESSES);
+  printf(" per access\n");
+}
+
+// Micro-benchmark of the memory access path (hyppotest -M)
+void memory_benchmark(void)
+{
+  struct timespec t0, t1;
+  unsigned long long c0;
+  unsigned int sum = 0;
+
+  machine_init(&cpu);
+  logfile = stderr;
+
+  // Scatter accesses over the whole 16-bit address space
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  c0 = cycle_counter();
+  for (unsigned int i = 0; i < BENCHMARK_ACCESSES; i++)
+    sum += read_memory28(&cpu, addr_to_28bit_uncached(&cpu, (i * 0x9e37) & 0xffff, 0));
+  c0 = cycle_counter() - c0;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  report_benchmark("read, uncached address translation", &t0, &t1, c0);
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  c0 = cycle_counter();
+  for (unsigned int i = 0; i < BENCHMARK_ACCESSES; i++)
+    sum += read_memory(&cpu, (i * 0x9e37) & 0xffff);
+  c0 = cycle_counter() - c0;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  report_benchmark("read_memory()", &t0, &t1, c0);
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  c0 = cycle_counter();
+  for (unsigned int i = 0; i < BENCHMARK_ACCESSES; i++)
+    sum += memory_blame(&cpu, (i * 0x9e37) & 0xffff);
+  c0 = cycle_counter() - c0;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  report_benchmark("memory_blame()", &t0, &t1, c0);
+
+  // Keep the compiler from discarding the loops
+  if (sum == 0x12345678)
+    printf("\n");
+}
+
+/* ----------------------------------------------------------------------------------------------------------
+   Test script compiler
+
+   The whole script is read and split into directives before anything runs, so that mistakes in it are
+   reported up front with their line numbers, and running a directive does not involve trying each
+   possible form of directive against its text in turn.  Operands that name symbols are kept as text,
+   because symbols are only loaded or defined as the script runs.
+   ----------------------------------------------------------------------------------------------------------
+*/
+
+typedef enum directive_op {
+  DIR_ERROR, // malformed directive, reported when reached
+  DIR_JSR,
+  DIR_JMP,
+  DIR_DUMP_INSTRUCTIONS,
+  DIR_LOG_DMA,
+  DIR_LOG_DMA_OFF,
+  DIR_LOG_ON_FAILURE,
+  DIR_LOG_HISTORY_FULL,
+  DIR_LOG_HISTORY,
+  DIR_CHECK_REGS,
+  DIR_CHECK_MEM,
+  DIR_IGNORE_FROM,
+  DIR_IGNORE_ALL_REGS,
+  DIR_IGNORE_REG,
+  DIR_IGNORE,
+  DIR_TEST,
+  DIR_END_TEST,
+  DIR_LOAD_HYPPO_SYMBOLS,
+  DIR_LOAD_HYPPO,
+  DIR_LOAD_SYMBOLS,
+  DIR_LOAD,
+  DIR_CLEAR_ALL_BREAKPOINTS,
+  DIR_CLEAR_BREAKPOINT,
+  DIR_BREAKPOINT,
+  DIR_CLEAR_FLAG,
+  DIR_SET_FLAG,
+  DIR_EXPECT_FLAG,
+  DIR_EXPECT_REG,
+  DIR_EXPECT_MEM,
+  DIR_SNAPSHOT_SAVE,
+  DIR_SNAPSHOT_RESTORE,
+  DIR_SNAPSHOT_WRITE,
+  DIR_SNAPSHOT_READ,
+  DIR_DEFINE,
+  DIR_POKE,
+  DIR_STEP,
+  DIR_STEP_ONE,
+  DIR_RUN_UNTIL,
+  DIR_LET,
+  DIR_STACK_OVERFLOW,
+  DIR_STACK_UNDERFLOW,
+  DIR_ASSEMBLE,
+  DIR_CPU_SPEED,
+  DIR_PROFILE_CYCLES,
+  DIR_EXPECT_CYCLES,
+  DIR_INFINITE_LOOP_THRESHOLD,
+  DIR_TRACE_TO,
+  DIR_TRACE_OFF,
+  DIR_SDCARD,
+  DIR_SDCARD_LATENCY,
+  DIR_SCREENSHOT,
+  DIR_EXPECT_SCREEN_MATCHES,
+  DIR_EXPECT_SCREEN_TEXT,
+  DIR_EXPECT_FAILURE
+} directive_op;
+
+// An address or value, which is resolved when the directive runs unless it is a plain $hex constant
+typedef struct operand {
+  char *text;
+  bool constant;
+  int value;
+} operand;
+
+typedef struct directive {
+  directive_op op;
+  int line;
+  char *text;  // the directive as written
+  char *error; // why a DIR_ERROR directive is malformed
+
+  int operand_count;
+  operand *operands;
+  char *name;       // test, file, snapshot or symbol name
+  char *file;       // file for snapshot read/write
+  int number;       // counts, load addresses and register numbers
+  int number2;      //
+  unsigned char flag_mask;
+  bool enable;      // flag set/clear, stack overflow allowed, run until brk
+  char *source;     // assembly source, without its common indentation
+  int end;          // for a test, the index of its "end test" directive
+} directive;
+
+typedef struct script {
+  char *filename;
+  directive *directives;
+  int count;
+  int errors;
+} script;
+
+enum { REG_A, REG_X, REG_Y, REG_Z, REG_B, REG_F, REG_SPL, REG_SPH, REG_SP, REG_PC, REG_COUNT };
+const char *register_names[REG_COUNT] = { "a", "x", "y", "z", "b", "f", "spl", "sph", "sp", "pc" };
+
+// Bit order of the flags in regs.flags
+const char flag_names[] = "czidbevn";
+
+int parse_register(const char *name)
+{
+  for (int i = 0; i < REG_COUNT; i++)
+    if (!strcasecmp(name, register_names[i]))
+      return i;
+  return -1;
+}
+
+int parse_flag(const char *name)
+{
+  if (strlen(name) == 1) {
+    const char *f = strchr(flag_names, tolower(*name));
+    if (f)
+      return 1 << (f - flag_names);
+  }
+  return 0;
+}
+
+unsigned int get_register(struct regs *regs, int reg)
+{
+  switch (reg) {
+  case REG_A:
+    return regs->a;
+  case REG_X:
+    return regs->x;
+  case REG_Y:
+    return regs->y;
+  case REG_Z:
+    return regs->z;
+  case REG_B:
+    return regs->b;
+  case REG_F:
+    return regs->flags;
+  case REG_SPL:
+    return regs->spl;
+  case REG_SPH:
+    return regs->sph;
+  case REG_SP:
+    return regs->sp;
+  default:
+    return regs->pc;
+  }
+}
+
+void set_register(struct regs *regs, int reg, unsigned int v)
+{
+  switch (reg) {
+  case REG_A:
+    regs->a = v;
+    break;
+  case REG_X:
+    regs->x = v;
+    break;
+  case REG_Y:
+    regs->y = v;
+    break;
+  case REG_Z:
+    regs->z = v;
+    break;
+  case REG_B:
+    regs->b = v;
+    break;
+  case REG_F:
+    regs->flags = v;
+    break;
+  case REG_SPL:
+    regs->spl = v;
+    break;
+  case REG_SPH:
+    regs->sph = v;
+    break;
+  case REG_SP:
+    regs->sp = v;
+    break;
+  default:
+    regs->pc = v & 0xffff;
+    break;
+  }
+}
+
+int operand_value(operand *o)
+{
+  if (o->constant)
+    return o->value;
+  return resolve_value32(o->text);
+}
+
+void set_operand(operand *o, char *text)
+{
+  o->text = strdup(text);
+  o->constant = false;
+  // A constant is "$hex", optionally followed by a comma, as in the lists of values to poke
+  int n = 0;
+  if (sscanf(text, "$%x%n", &o->value, &n) == 1 && (!text[n] || (text[n] == ',' && !text[n + 1])))
+    o->constant = true;
+}
+
+void add_operand(directive *d, char *text)
+{
+  d->operands = realloc(d->operands, (d->operand_count + 1) * sizeof(operand));
+  set_operand(&d->operands[d->operand_count++], text);
+}
+
+// Split a directive into whitespace separated words, returning how many there are, and a NULL terminated
+// array of them, which is big enough for however many words the line has
+int split_words(char *line, char ***words_out)
+{
+  char **words = malloc((strlen(line) / 2 + 2) * sizeof(char *));
+  int count = 0;
+  char *p = line;
+  while (1) {
+    while (isspace(*p))
+      p++;
+    if (!*p)
+      break;
+    words[count++] = p;
+    while (*p && !isspace(*p))
+      p++;
+    if (*p)
+      *p++ = 0;
   }
+  words[count] = NULL;
+  *words_out = words;
+  return count;
 }
 
-unsigned char resolve_value8(char *in)
+bool word_is(char *word, const char *keyword)
 {
-  return (unsigned char)(resolve_value32(in) & 0xff);
+  return word && !strcasecmp(word, keyword);
 }
 
-unsigned short resolve_value16(char *in)
+void script_error(script *s, directive *d, const char *fmt, ...)
 {
-  return (unsigned short)(resolve_value32(in) & 0xffff);
+  va_list ap;
+  char error[1024];
+
+  va_start(ap, fmt);
+  vsnprintf(error, sizeof(error), fmt, ap);
+  va_end(ap);
+
+  d->op = DIR_ERROR;
+  d->error = strdup(error);
+  fprintf(stderr, "ERROR: %s:%d: %s:\n       %s\n", s->filename, d->line, error, d->text);
+  s->errors++;
 }
 
-void assemble_with_acme(FILE *f, struct cpu *cpu, unsigned short pc)
-{
-  FILE *src_file = NULL;
-  char *bin_file_name = mktemp(strdup(P_tmpdir "/acme.bin.XXXXXX"));
-  assert(bin_file_name != NULL);
-  char *src_file_name = mktemp(strdup(P_tmpdir "/acme.src.XXXXXX"));
-  assert(src_file_name != NULL);
-  char *sym_file_name = mktemp(strdup(P_tmpdir "/acme.sym.XXXXXX"));
-  assert(sym_file_name != NULL);
-  //
-  // Read the lines between the assemble and end assemble directives into a memory buffer file
-  //
-  const size_t max_src_size = 1024 * 1024;
-  FILE *buffer_file = fmemopen(NULL, max_src_size, "w+");
-  assert(buffer_file != NULL);
-  char line[1024];
-  unsigned min_c = 9999;
-  while (!feof(f)) {
-    *line = 0;
-    fgets(line, sizeof(line) / sizeof(char), f);
+// A file named "tmp:<name>" is in a directory of its own for this run of hyppotest, which is removed when it
+// exits.  Tests use these for the files they write and read back, so that neither other runs of hyppotest,
+// nor tests running in parallel with -j, see them, as long as each test uses names of its own.
+char *run_directory = NULL;
+
+void remove_run_directory(void)
+{
+  if (in_test_worker || !run_directory)
+    return;
+  DIR *dir = opendir(run_directory);
+  if (dir) {
+    struct dirent *e;
+    char path[PATH_MAX];
+    while ((e = readdir(dir)))
+      if (strcmp(e->d_name, ".") && strcmp(e->d_name, "..")) {
+        snprintf(path, sizeof(path), "%s/%s", run_directory, e->d_name);
+        unlink(path);
+      }
+    closedir(dir);
+  }
+  rmdir(run_directory);
+}
+
+char *script_file_name(script *s, directive *d, char *word)
+{
+  if (strncmp(word, "tmp:", 4))
+    return strdup(word);
+  if (!word[4] || strchr(word + 4, '/')) {
+    script_error(s, d, "Temporary file names must be tmp:<name>, without any directories");
+    return strdup(word);
+  }
+  if (!run_directory) {
+    const char *tmpdir = getenv("TMPDIR");
+    char template[PATH_MAX];
+    snprintf(template, sizeof(template), "%s/hyppotest-XXXXXX", tmpdir && *tmpdir ? tmpdir : P_tmpdir);
+    if (!mkdtemp(template)) {
+      script_error(s, d, "Could not create a directory for temporary files: %s", strerror(errno));
+      return strdup(word);
+    }
+    run_directory = strdup(template);
+    atexit(remove_run_directory);
+  }
+  char *path = malloc(strlen(run_directory) + strlen(word));
+  sprintf(path, "%s/%s", run_directory, word + 4);
+  return path;
+}
+
+// Read the lines up to "end assemble", removing the indentation they have in common
+char *read_assembly_source(FILE *f, int *line_number)
+{
+  char *line = NULL;
+  size_t line_size = 0;
+  char **lines = NULL;
+  int count = 0;
+  size_t min_c = SIZE_MAX, length = 0;
+
+  while (getline(&line, &line_size, f) >= 0) {
+    (*line_number)++;
     char *line_ptr = line;
     while (isspace(*line_ptr))
       ++line_ptr;
@@ -4661,99 +9135,277 @@ void assemble_with_acme(FILE *f, struct cpu *cpu, unsigned short pc)
       break;
     if (line_ptr - line < min_c)
       min_c = line_ptr - line;
-    if (fputs(line, buffer_file) == EOF) {
-      fprintf(stderr, "ERROR: Assembly source is larger than %zu bytes.\n", max_src_size);
-      if (logfile != stderr)
-        fprintf(logfile, "ERROR: Assembly source is larger than %zu bytes.\n", max_src_size);
-      cpu->term.error = true;
-      goto cleanup;
-    }
-  }
-  rewind(buffer_file);
-  //
-  // Save the assembly source into a temporary file.
-  // Trim common whitespace from each line, in case the asembler is sensitive to things beginning in the first column.
-  //
-  src_file = fopen(src_file_name, "wx");
-  if (src_file == NULL) {
-    snprintf(line, sizeof(line) / sizeof(char), "ERROR: Failed to open file %s for writing the assembly source: %s\n",
-        src_file_name, strerror(errno));
-    fprintf(stderr, line);
-    if (logfile != stderr)
-      fprintf(logfile, line);
-    cpu->term.error = true;
-    goto cleanup;
+    lines = realloc(lines, (count + 1) * sizeof(char *));
+    lines[count++] = strdup(line);
+    length += strlen(line);
   }
-  while (!feof(buffer_file)) {
-    if (fgets(line, sizeof(line) / sizeof(char), buffer_file))
-      fputs(line + min_c, src_file);
+  free(line);
+
+  char *source = malloc(length + 1);
+  char *p = source;
+  for (int i = 0; i < count; i++) {
+    p = stpcpy(p, lines[i] + min_c);
+    free(lines[i]);
   }
-  fclose(src_file);
-  src_file = NULL;
-  fclose(buffer_file);
-  buffer_file = NULL;
-  //
-  // Execute ACME on the temporary source file
-  //
-  snprintf(line, sizeof(line) / sizeof(char),
-      "acme --setpc '$%x' --cpu m65 --format plain --outfile '%s' --symbollist '%s' '%s'", pc, bin_file_name, sym_file_name,
-      src_file_name);
-  if (system(line) != 0) {
-    fprintf(stderr, "ERROR: acme failed to assemble the source\n");
-    if (logfile != stderr)
-      fprintf(logfile, "ERROR: acme failed to assemble the source\n");
-    cpu->term.error = true;
-    goto cleanup;
-  }
-  //
-  // Load the ACME output files
-  load_file(bin_file_name, pc);
-  load_symbols(sym_file_name, 0);
-cleanup:
-  if (buffer_file != NULL)
-    fclose(buffer_file);
-  if (src_file != NULL)
-    fclose(src_file);
-  remove(bin_file_name);
-  free(bin_file_name);
-  remove(src_file_name);
-  free(src_file_name);
-  remove(sym_file_name);
-  free(sym_file_name);
+  *p = 0;
+  free(lines);
+  return source;
 }
 
-int main(int argc, char **argv)
+void compile_directive(script *s, directive *d, FILE *f, int *line_number)
 {
-  if (argc < 2 || argc > 3) {
-    fprintf(stderr, "usage: hyppotest <test script> [<test>]\n");
-    exit(-2);
+  char buffer[1024];
+  char **words;
+  char *line = strdup(d->text);
+  int n = split_words(line, &words);
+  char *w0 = words[0], *w1 = n > 1 ? words[1] : NULL, *w2 = n > 2 ? words[2] : NULL;
+  char *w3 = n > 3 ? words[3] : NULL, *w4 = n > 4 ? words[4] : NULL;
+
+  d->op = DIR_ERROR;
+
+  if (word_is(w0, "jsr") && n == 2) {
+    d->op = DIR_JSR;
+    add_operand(d, w1);
   }
-
-  // Setup for anonymous tests, if user doesn't supply any test directives
-  machine_init(&cpu);
-  logfile = stderr;
-
-  // Open test script, and start interpreting it
-  FILE *f = fopen(argv[1], "r");
-  if (!f) {
-    fprintf(stderr, "ERROR: Could not read test procedure from '%s'\n", argv[1]);
-    exit(-2);
+  else if (word_is(w0, "jmp") && n == 2) {
+    d->op = DIR_JMP;
+    add_operand(d, w1);
   }
-  const char *test_target = (argc == 3 ? argv[2] : NULL);
-  if (test_target) {
-    printf("INFO: Only running test \"%s\"\n", test_target);
+  else if (word_is(w0, "dump") && word_is(w1, "instructions") && word_is(w3, "to") && n == 5
+           && sscanf(w2, "%d", &d->number) == 1 && sscanf(w4, "%d", &d->number2) == 1) {
+    d->op = DIR_DUMP_INSTRUCTIONS;
   }
-  char line[1024];
-  bool skipping_test = false;
-  while (!feof(f)) {
-    line[0] = 0;
-    fgets(line, 1024, f);
-    char routine[1024];
-    char value[1024];
-    char location[1024];
-    char start[1024];
-    char end[1024];
-    unsigned int addr, addr2, first, last;
+  else if (word_is(w0, "log")) {
+    if (word_is(w1, "dma") && n == 2)
+      d->op = DIR_LOG_DMA;
+    else if (word_is(w1, "dma") && word_is(w2, "off") && n == 3)
+      d->op = DIR_LOG_DMA_OFF;
+    else if (word_is(w1, "on") && word_is(w2, "failure") && n == 3)
+      d->op = DIR_LOG_ON_FAILURE;
+    else if (word_is(w1, "history") && word_is(w2, "full") && n == 3)
+      d->op = DIR_LOG_HISTORY_FULL;
+    else if (word_is(w1, "history") && n == 3 && sscanf(w2, "%d", &d->number) == 1)
+      d->op = DIR_LOG_HISTORY;
+  }
+  else if (word_is(w0, "check") && n == 2) {
+    if (word_is(w1, "registers") || word_is(w1, "regs"))
+      d->op = DIR_CHECK_REGS;
+    else if (word_is(w1, "ram") || word_is(w1, "mem") || word_is(w1, "memory"))
+      d->op = DIR_CHECK_MEM;
+  }
+  else if (word_is(w0, "ignore")) {
+    if (word_is(w1, "from") && word_is(w3, "to") && n == 5) {
+      d->op = DIR_IGNORE_FROM;
+      add_operand(d, w2);
+      add_operand(d, w4);
+    }
+    else if (word_is(w1, "all") && word_is(w2, "regs") && n == 3)
+      d->op = DIR_IGNORE_ALL_REGS;
+    else if (word_is(w1, "reg") && n == 3) {
+      d->op = DIR_IGNORE_REG;
+      if ((d->number = parse_register(w2)) < 0)
+        script_error(s, d, "Unknown register '%s'", w2);
+    }
+    else if (n == 2) {
+      d->op = DIR_IGNORE;
+      add_operand(d, w1);
+    }
+  }
+  else if ((word_is(w0, "test") && word_is(w1, "end")) || (word_is(w0, "end") && word_is(w1, "test"))) {
+    d->op = DIR_END_TEST;
+  }
+  else if (sscanf(d->text, "test \"%1023[^\"]\"", buffer) == 1) {
+    d->op = DIR_TEST;
+    d->name = strdup(buffer);
+  }
+  else if (word_is(w0, "loadhypposymbols") && n == 2) {
+    d->op = DIR_LOAD_HYPPO_SYMBOLS;
+    d->name = strdup(w1);
+  }
+  else if (word_is(w0, "loadhyppo") && n == 2) {
+    d->op = DIR_LOAD_HYPPO;
+    d->name = strdup(w1);
+  }
+  else if (word_is(w0, "loadsymbols") && word_is(w2, "at") && n == 4) {
+    // Symbols are at $addr, $addr+$delta or $addr-$delta
+    unsigned int addr, delta;
+    d->op = DIR_LOAD_SYMBOLS;
+    d->name = strdup(w1);
+    if (sscanf(w3, "$%x-$%x", &addr, &delta) == 2)
+      d->number = addr - delta;
+    else if (sscanf(w3, "$%x+$%x", &addr, &delta) == 2)
+      d->number = addr + delta;
+    else if (sscanf(w3, "$%x", &addr) == 1)
+      d->number = addr;
+    else
+      script_error(s, d, "Symbol offset must be $address, $address+$delta or $address-$delta");
+  }
+  else if (word_is(w0, "load") && word_is(w2, "at") && n == 4) {
+    d->op = DIR_LOAD;
+    d->name = strdup(w1);
+    if (sscanf(w3, "$%x", &d->number) != 1)
+      script_error(s, d, "Load address must be $address");
+  }
+  else if (word_is(w0, "clear") && word_is(w1, "all") && word_is(w2, "breakpoints") && n == 3) {
+    d->op = DIR_CLEAR_ALL_BREAKPOINTS;
+  }
+  else if (word_is(w0, "clear") && word_is(w1, "breakpoint") && n == 3) {
+    d->op = DIR_CLEAR_BREAKPOINT;
+    add_operand(d, w2);
+  }
+  else if (word_is(w0, "breakpoint") && n == 2) {
+    d->op = DIR_BREAKPOINT;
+    add_operand(d, w1);
+  }
+  else if ((word_is(w0, "clear") || word_is(w0, "set")) && word_is(w1, "flag") && n == 3) {
+    d->op = word_is(w0, "set") ? DIR_SET_FLAG : DIR_CLEAR_FLAG;
+    if (!(d->flag_mask = parse_flag(w2)))
+      script_error(s, d, "Unknown flag '%s'", w2);
+  }
+  else if (word_is(w0, "expect") && word_is(w1, "flag") && word_is(w3, "is") && n == 5
+           && (word_is(w4, "set") || word_is(w4, "clear"))) {
+    d->op = DIR_EXPECT_FLAG;
+    d->enable = word_is(w4, "set");
+    if (!(d->flag_mask = parse_flag(w2)))
+      script_error(s, d, "Unknown flag '%s'", w2);
+  }
+  else if ((word_is(w0, "expect") || word_is(w0, "let")) && word_is(w2, "=") && n == 4) {
+    d->op = word_is(w0, "let") ? DIR_LET : DIR_EXPECT_REG;
+    add_operand(d, w3);
+    if ((d->number = parse_register(w1)) < 0)
+      script_error(s, d, "Unknown register '%s'", w1);
+  }
+  else if (word_is(w0, "expect") && word_is(w1, "cycles") && word_is(w2, "<=") && n == 4) {
+    d->op = DIR_EXPECT_CYCLES;
+    if (sscanf(w3, "%u", &d->number) != 1)
+      script_error(s, d, "Expected number of cycles must be a decimal number");
+  }
+  else if (word_is(w0, "cpu") && word_is(w1, "speed") && n == 3) {
+    d->op = DIR_CPU_SPEED;
+    for (d->number = 0; d->number < CPU_SPEED_COUNT && !word_is(w2, cpu_speeds[d->number].name); d->number++)
+      ;
+    if (d->number == CPU_SPEED_COUNT)
+      script_error(s, d, "CPU speed must be 1mhz, 2mhz, 3.5mhz or 40mhz");
+  }
+  else if (word_is(w0, "profile") && word_is(w1, "cycles") && n == 2) {
+    d->op = DIR_PROFILE_CYCLES;
+  }
+  else if (word_is(w0, "trace") && word_is(w1, "to") && n == 3) {
+    d->op = DIR_TRACE_TO;
+    d->file = script_file_name(s, d, w2);
+  }
+  else if (word_is(w0, "trace") && word_is(w1, "off") && n == 2) {
+    d->op = DIR_TRACE_OFF;
+  }
+  else if (word_is(w0, "sdcard") && word_is(w1, "latency") && n == 4) {
+    // sdcard latency read|write|seek <microseconds>
+    d->op = DIR_SDCARD_LATENCY;
+    d->number = word_is(w2, "read") ? 0 : word_is(w2, "write") ? 1 : word_is(w2, "seek") ? 2 : -1;
+    if (d->number < 0)
+      script_error(s, d, "SD card latency must be for read, write or seek");
+    if (sscanf(w3, "%d", &d->number2) != 1 || d->number2 < 0)
+      script_error(s, d, "SD card latency must be a decimal number of microseconds");
+  }
+  else if (word_is(w0, "sdcard") && (n == 2 || (n == 3 && word_is(w2, "writable")))) {
+    d->op = DIR_SDCARD;
+    d->file = script_file_name(s, d, w1);
+    d->enable = n == 3;
+  }
+  else if (word_is(w0, "expect") && word_is(w1, "screen") && word_is(w2, "matches") && n == 4) {
+    d->op = DIR_EXPECT_SCREEN_MATCHES;
+    d->file = script_file_name(s, d, w3);
+  }
+  else if (word_is(w0, "expect") && word_is(w1, "screen") && word_is(w2, "text")) {
+    // expect screen text "<text>" at <row>,<column>
+    d->op = DIR_EXPECT_SCREEN_TEXT;
+    if (sscanf(d->text, "expect screen text \"%1023[^\"]\" at %d , %d", buffer, &d->number, &d->number2) != 3
+        || d->number < 0 || d->number2 < 0)
+      script_error(s, d, "Expected screen text must be \"<text>\" at <row>,<column>");
+    else
+      d->name = strdup(buffer);
+  }
+  else if (word_is(w0, "expect") && word_is(w1, "failure") && n == 2) {
+    d->op = DIR_EXPECT_FAILURE;
+  }
+  else if (word_is(w0, "screenshot") && n == 2) {
+    d->op = DIR_SCREENSHOT;
+    d->file = script_file_name(s, d, w1);
+  }
+  else if (word_is(w0, "infinite") && word_is(w1, "loop") && word_is(w2, "threshold") && n == 4) {
+    d->op = DIR_INFINITE_LOOP_THRESHOLD;
+    if (sscanf(w3, "%u", &d->number) != 1 || !d->number)
+      script_error(s, d, "Infinite loop threshold must be a decimal number of repeats");
+  }
+  else if (word_is(w0, "expect") && word_is(w2, "at") && n == 4) {
+    d->op = DIR_EXPECT_MEM;
+    add_operand(d, w1);
+    add_operand(d, w3);
+  }
+  else if (word_is(w0, "snapshot") && (word_is(w1, "save") || word_is(w1, "restore")) && n == 3) {
+    d->op = word_is(w1, "save") ? DIR_SNAPSHOT_SAVE : DIR_SNAPSHOT_RESTORE;
+    d->name = strdup(w2);
+  }
+  else if (word_is(w0, "snapshot") && (word_is(w1, "write") || word_is(w1, "read")) && n == 4) {
+    d->op = word_is(w1, "write") ? DIR_SNAPSHOT_WRITE : DIR_SNAPSHOT_READ;
+    d->name = strdup(w2);
+    d->file = script_file_name(s, d, w3);
+  }
+  else if (word_is(w0, "define") && word_is(w2, "as") && n == 4) {
+    d->op = DIR_DEFINE;
+    d->name = strdup(w1);
+    add_operand(d, w3);
+  }
+  else if (word_is(w0, "poke") && n >= 2) {
+    // Address, followed by the values to write from there
+    d->op = DIR_POKE;
+    for (int i = 1; i < n; i++)
+      add_operand(d, words[i]);
+  }
+  else if (word_is(w0, "step") && n == 2 && sscanf(w1, "%u", &d->number) == 1) {
+    d->op = DIR_STEP;
+  }
+  else if (word_is(w0, "step") && n == 1) {
+    d->op = DIR_STEP_ONE;
+  }
+  else if (word_is(w0, "run") && word_is(w1, "until") && n == 3) {
+    d->op = DIR_RUN_UNTIL;
+    d->enable = word_is(w2, "brk");
+  }
+  else if ((word_is(w0, "allow") || word_is(w0, "forbid")) && word_is(w1, "stack") && n == 3
+           && (word_is(w2, "overflow") || word_is(w2, "underflow"))) {
+    d->op = word_is(w2, "overflow") ? DIR_STACK_OVERFLOW : DIR_STACK_UNDERFLOW;
+    d->enable = word_is(w0, "allow");
+  }
+  else if (word_is(w0, "assemble")
+           && ((word_is(w1, "with") && word_is(w2, "acme") && n == 3)
+               || (word_is(w1, "at") && word_is(w3, "with") && word_is(w4, "acme") && n == 5))) {
+    d->op = DIR_ASSEMBLE;
+    d->enable = n == 5; // explicit address, which must resolve
+    add_operand(d, n == 5 ? w2 : "$2000");
+    d->source = read_assembly_source(f, line_number);
+  }
+
+  if (d->op == DIR_ERROR && !d->error)
+    script_error(s, d, "Unrecognised test directive");
+  free(words);
+  free(line);
+}
+
+script *compile_script(char *filename)
+{
+  FILE *f = fopen(filename, "r");
+  if (!f)
+    return NULL;
+
+  script *s = calloc(1, sizeof(script));
+  s->filename = strdup(filename);
+
+  char *line = NULL;
+  size_t line_size = 0;
+  int line_number = 0;
+  int current_test = -1;
+  while (getline(&line, &line_size, f) >= 0) {
+    line_number++;
     char *line_ptr = line;
     // Skip any leading whitespace
     while (isspace(*line_ptr))
@@ -4762,395 +9414,522 @@ int main(int argc, char **argv)
       continue;
     if (line_ptr[0] == '#')
       continue;
-    if (skipping_test) {
-      if (strncasecmp(line_ptr, "test end", strlen("test end")) == 0
-          || strncasecmp(line_ptr, "end test", strlen("end test")) == 0) {
-        skipping_test = false;
-      }
-      continue;
-    }
-    if (sscanf(line_ptr, "jsr %s", routine) == 1) {
-      int addr32 = resolve_value32(routine);
-      if (addr32 > 0) {
-        int addr16 = addr32;
-        if (addr32 & 0xffff0000) {
-          addr16 = addr32 & 0xffff;
-        }
-        bool prior_error = cpu.term.error;
-        bool log_dma = cpu.term.log_dma;
-        bzero(&cpu.term, sizeof(cpu.term));
-        cpu.term.log_dma = log_dma;
-        cpu.term.rts = 1; // Terminate on net RTS from routine
-        cpu_call_routine(logfile, addr16);
-        cpu.term.error |= prior_error;
-      }
-    }
-    else if (sscanf(line_ptr, "dump instructions %d to %d", &first, &last) == 2) {
-      show_recent_instructions(logfile, line_ptr, &cpu, first, last - first + 1, -1);
-    }
-    else if (!strncasecmp(line_ptr, "log dma off", strlen("log dma off"))) {
-      cpu.term.log_dma = false;
-      fprintf(logfile, "NOTE: DMA jobs will not be reported\n");
-    }
-    else if (!strncasecmp(line_ptr, "log dma", strlen("log dma"))) {
-      cpu.term.log_dma = true;
-      fprintf(logfile, "NOTE: DMA jobs will be reported\n");
-    }
-    else if (!strncasecmp(line_ptr, "log on failure", strlen("log on failure"))) {
-      // Dump all instructions on test failure
-      log_on_failure = true;
-    }
-    else if (sscanf(line_ptr, "jmp %s", routine) == 1) {
-      int addr32 = resolve_value32(routine);
-      if (addr32 > 0) {
-        int addr16 = addr32;
-        if (addr32 & 0xffff0000) {
-          addr16 = addr32 & 0xffff;
-        }
-        bool prior_error = cpu.term.error;
-        bool log_dma = cpu.term.log_dma;
-        bzero(&cpu.term, sizeof(cpu.term));
-        cpu.term.log_dma = log_dma;
-        cpu_call_routine(logfile, addr16);
-        cpu.term.error |= prior_error;
-      }
-    }
-    else if (strncasecmp(line_ptr, "check registers", strlen("check registers")) == 0
-             || strncasecmp(line_ptr, "check regs", strlen("check regs")) == 0) {
-      // Check registers for changes
-      compare_register_contents(logfile, &cpu);
-    }
-    else if (sscanf(line_ptr, "ignore from %s to %s", start, end) == 2) {
-      int low = resolve_value32(start);
-      int high = resolve_value32(end);
-      ignore_ram_changes(low, high);
-    }
-    else if (!strncasecmp(line_ptr, "ignore all regs", strlen("ignore all regs"))) {
-      cpu_expected.regs = cpu.regs;
-    }
-    else if (sscanf(line_ptr, "ignore reg %s", location) == 1) {
-      // Set expected register value
-      if (!strcasecmp(location, "a"))
-        cpu_expected.regs.a = cpu.regs.a;
-      else if (!strcasecmp(location, "x"))
-        cpu_expected.regs.x = cpu.regs.x;
-      else if (!strcasecmp(location, "y"))
-        cpu_expected.regs.y = cpu.regs.y;
-      else if (!strcasecmp(location, "z"))
-        cpu_expected.regs.z = cpu.regs.z;
-      else if (!strcasecmp(location, "b"))
-        cpu_expected.regs.b = cpu.regs.b;
-      else if (!strcasecmp(location, "f"))
-        cpu_expected.regs.flags = cpu.regs.flags;
-      else if (!strcasecmp(location, "spl"))
-        cpu_expected.regs.spl = cpu.regs.spl;
-      else if (!strcasecmp(location, "sph"))
-        cpu_expected.regs.sph = cpu.regs.sph;
-      else if (!strcasecmp(location, "sp"))
-        cpu_expected.regs.sp = cpu.regs.sp;
-      else if (!strcasecmp(location, "pc"))
-        cpu_expected.regs.pc = cpu.regs.pc;
-      else {
-        fprintf(logfile, "ERROR: Unknown register '%s'\n", location);
-        cpu.term.error = true;
-      }
-    }
-    else if (sscanf(line_ptr, "ignore %s", start) == 1) {
-      int low = resolve_value32(start);
-      ignore_ram_changes(low, low);
-    }
-    else if (strncasecmp(line_ptr, "check ram", strlen("check ram")) == 0
-             || strncasecmp(line_ptr, "check mem", strlen("check mem")) == 0
-             || strncasecmp(line_ptr, "check memory", strlen("check memory")) == 0) {
-      // Check RAM for changes
-      compare_ram_contents(logfile, &cpu);
-    }
-    else if (strncasecmp(line_ptr, "test end", strlen("test end")) == 0
-             || strncasecmp(line_ptr, "end test", strlen("end test")) == 0) {
-      test_conclude(&cpu);
-    }
-    else if (sscanf(line_ptr, "test \"%[^\"]\"", test_name) == 1) {
-      if (!test_target || strcmp(test_target, test_name) == 0) {
-        // Set test name
-        test_init(&cpu);
-        fflush(stdout);
-      }
-      else
-        skipping_test = true;
-    }
-    else if (sscanf(line_ptr, "loadhypposymbols %s", routine) == 1) {
-      if (load_hyppo_symbols(routine))
-        cpu.term.error = true;
-    }
-    else if (sscanf(line_ptr, "loadhyppo %s", routine) == 1) {
-      if (load_hyppo(routine))
-        cpu.term.error = true;
-    }
-    else if (sscanf(line_ptr, "loadsymbols %s at $%x-$%x", routine, &addr, &addr2) == 3) {
-      if (load_symbols(routine, addr - addr2))
-        cpu.term.error = true;
+    // Drop the line ending
+    char *line_end = line_ptr + strlen(line_ptr);
+    while (line_end > line_ptr && isspace(line_end[-1]))
+      *--line_end = 0;
+
+    s->directives = realloc(s->directives, (s->count + 1) * sizeof(directive));
+    directive *d = &s->directives[s->count];
+    bzero(d, sizeof(directive));
+    d->line = line_number;
+    d->text = strdup(line_ptr);
+    compile_directive(s, d, f, &line_number);
+
+    if (d->op == DIR_TEST) {
+      current_test = s->count;
+      d->end = -1;
     }
-    else if (sscanf(line_ptr, "loadsymbols %s at $%x+$%x", routine, &addr, &addr2) == 3) {
-      if (load_symbols(routine, addr + addr2))
-        cpu.term.error = true;
+    else if (d->op == DIR_END_TEST && current_test >= 0) {
+      s->directives[current_test].end = s->count;
+      current_test = -1;
     }
-    else if (sscanf(line_ptr, "loadsymbols %s at $%x", routine, &addr) == 2) {
-      if (load_symbols(routine, addr))
-        cpu.term.error = true;
-    }
-    else if (sscanf(line_ptr, "load %s at $%x", routine, &addr) == 2) {
-      if (load_file(routine, addr))
-        cpu.term.error = true;
-    }
-    else if (!strncasecmp(line_ptr, "clear all breakpoints", strlen("clear all breakpoints"))) {
-      fprintf(logfile, "INFO: Cleared all breakpoints\n");
-      bzero(breakpoints, sizeof(breakpoints));
-    }
-    else if (sscanf(line_ptr, "clear breakpoint %s", routine) == 1) {
-      int addr32 = resolve_value32(routine);
-      int addr16 = addr32;
-      if (addr32 & 0xffff0000) {
-        addr16 = addr32 & 0xffff;
-      }
-      fprintf(logfile, "INFO: Breakpoint cleared at %s ($%04x)\n", routine, addr16);
-      breakpoints[addr16] = 0;
-    }
-    else if (sscanf(line_ptr, "breakpoint %s", routine) == 1) {
-      int addr32 = resolve_value32(routine);
-      int addr16 = addr32;
-      if (addr32 & 0xffff0000) {
-        addr16 = addr32 & 0xffff;
-      }
-      fprintf(logfile, "INFO: Breakpoint set at %s ($%04x)\n", routine, addr16);
-      breakpoints[addr16] = 1;
-    }
-    else if (sscanf(line_ptr, "clear flag %s", location) == 1) {
-      if (!strcasecmp(location, "c"))
-        cpu.regs.flag_c = false;
-      else if (!strcasecmp(location, "z"))
-        cpu.regs.flag_z = false;
-      else if (!strcasecmp(location, "i"))
-        cpu.regs.flag_i = false;
-      else if (!strcasecmp(location, "d"))
-        cpu.regs.flag_d = false;
-      else if (!strcasecmp(location, "b"))
-        cpu.regs.flag_b = false;
-      else if (!strcasecmp(location, "e"))
-        cpu.regs.flag_e = false;
-      else if (!strcasecmp(location, "v"))
-        cpu.regs.flag_v = false;
-      else if (!strcasecmp(location, "n"))
-        cpu.regs.flag_n = false;
-      else {
-        fprintf(logfile, "ERROR: Unknown flag '%s'\n", location);
-        cpu.term.error = true;
-      }
-    }
-    else if (sscanf(line_ptr, "set flag %s", location) == 1) {
-      if (!strcasecmp(location, "c"))
-        cpu.regs.flag_c = true;
-      else if (!strcasecmp(location, "z"))
-        cpu.regs.flag_z = true;
-      else if (!strcasecmp(location, "i"))
-        cpu.regs.flag_i = true;
-      else if (!strcasecmp(location, "d"))
-        cpu.regs.flag_d = true;
-      else if (!strcasecmp(location, "b"))
-        cpu.regs.flag_b = true;
-      else if (!strcasecmp(location, "e"))
-        cpu.regs.flag_e = true;
-      else if (!strcasecmp(location, "v"))
-        cpu.regs.flag_v = true;
-      else if (!strcasecmp(location, "n"))
-        cpu.regs.flag_n = true;
-      else {
-        fprintf(logfile, "ERROR: Unknown flag '%s'\n", location);
-        cpu.term.error = true;
-      }
-    }
-    else if (sscanf(line_ptr, "expect flag %s is %s", location, value) == 2) {
-      bool v;
-      if (strcasecmp(value, "set") == 0) {
-        v = true;
-      }
-      else if (strcasecmp(value, "clear") == 0) {
-        v = false;
-      }
-      else {
-        goto directive_error;
-      }
-      if (!strcasecmp(location, "c"))
-        cpu_expected.regs.flag_c = v;
-      else if (!strcasecmp(location, "z"))
-        cpu_expected.regs.flag_z = v;
-      else if (!strcasecmp(location, "i"))
-        cpu_expected.regs.flag_i = v;
-      else if (!strcasecmp(location, "d"))
-        cpu_expected.regs.flag_d = v;
-      else if (!strcasecmp(location, "b"))
-        cpu_expected.regs.flag_b = v;
-      else if (!strcasecmp(location, "e"))
-        cpu_expected.regs.flag_e = v;
-      else if (!strcasecmp(location, "v"))
-        cpu_expected.regs.flag_v = v;
-      else if (!strcasecmp(location, "n"))
-        cpu_expected.regs.flag_n = v;
-      else {
-        fprintf(logfile, "ERROR: Unknown flag '%s'\n", location);
-        cpu.term.error = true;
-      }
-    }
-    else if (sscanf(line_ptr, "expect %s = %s", location, value) == 2) {
-      // Set expected register value
-      if (!strcasecmp(location, "a"))
-        cpu_expected.regs.a = resolve_value8(value);
-      else if (!strcasecmp(location, "x"))
-        cpu_expected.regs.x = resolve_value8(value);
-      else if (!strcasecmp(location, "y"))
-        cpu_expected.regs.y = resolve_value8(value);
-      else if (!strcasecmp(location, "z"))
-        cpu_expected.regs.z = resolve_value8(value);
-      else if (!strcasecmp(location, "b"))
-        cpu_expected.regs.b = resolve_value8(value);
-      else if (!strcasecmp(location, "f"))
-        cpu_expected.regs.flags = resolve_value8(value);
-      else if (!strcasecmp(location, "spl"))
-        cpu_expected.regs.spl = resolve_value8(value);
-      else if (!strcasecmp(location, "sph"))
-        cpu_expected.regs.sph = resolve_value8(value);
-      else if (!strcasecmp(location, "sp"))
-        cpu_expected.regs.sp = resolve_value16(value);
-      else if (!strcasecmp(location, "pc"))
-        cpu_expected.regs.pc = resolve_value16(value);
-      else {
-        fprintf(logfile, "ERROR: Unknown register '%s'\n", location);
-        cpu.term.error = true;
-      }
-    }
-    else if (sscanf(line_ptr, "expect %s at %s", value, location) == 2) {
-      // Update *_expected[] memories to indicate the value we expect where.
-      // Resolve labels and label+offset and $nn in each of the fields.
-      int v = resolve_value8(value);
-      int l = resolve_value32(location);
-      write_mem_expected28(l, v);
-    }
-    else if (sscanf(line_ptr, "define %s as %s", routine, location) == 2) {
-      addr = resolve_value32(location);
-      if (symbol_count >= MAX_SYMBOLS) {
-        fprintf(logfile, "ERROR: Too many symbols. Increase MAX_SYMBOLS.\n");
-        cpu.term.error = true;
-      }
-      symbols[symbol_count].name = strdup(routine);
-      symbols[symbol_count].addr = addr;
-      if (addr < CHIPRAM_SIZE) {
-        sym_by_addr[addr] = &symbols[symbol_count];
-      }
-      symbol_count++;
-    }
-    else if (sscanf(line_ptr, "poke%s%n", location, &last) == 1) {
-      line_ptr += last;
-      unsigned char b;
-      for (addr = resolve_value32(location); (sscanf(line_ptr, "%s%n", value, &last)) == 1; ++addr, line_ptr += last) {
-        b = resolve_value8(value);
-        write_mem28(&cpu, addr, b);
-      }
-    }
-    else if (sscanf(line_ptr, "step %u", &first) == 1) {
-      fprintf(logfile, ">>> Stepping %u instructions starting at %s @ $%04x\n", first,
-          describe_address_label(&cpu, cpu.regs.pc), cpu.regs.pc);
-      bool prior_error = cpu.term.error, prior_log_dma = cpu.term.log_dma;
-      bzero(&cpu.term, sizeof(cpu.term));
-      cpu.term.log_dma = prior_log_dma;
-      for (unsigned i = 0; i < first; ++i) {
-        if (!cpu_step(logfile))
-          break;
-      }
-      cpu.term.error |= prior_error;
+    s->count++;
+  }
+  free(line);
+  fclose(f);
+
+  // A test that is never ended runs to the end of the script
+  for (int i = 0; i < s->count; i++)
+    if (s->directives[i].op == DIR_TEST && s->directives[i].end < 0)
+      s->directives[i].end = s->count;
+
+  return s;
+}
+
+// Assemble the blocks that are not in the ACME cache, before any tests run
+void preassemble_script(script *s)
+{
+  char bin_file_name[1024], sym_file_name[1024];
+  char **started = NULL;
+  int count = 0, running = 0;
+
+  if (!acme_cache_dir)
+    return;
+
+  for (int i = 0; i < s->count; i++) {
+    directive *d = &s->directives[i];
+    // The address of the block is not known yet if it is given by a symbol
+    if (d->op != DIR_ASSEMBLE || !d->operands[0].constant)
+      continue;
+    unsigned short pc = d->operands[0].value;
+    acme_cache_paths(d->source, pc, bin_file_name, sym_file_name, sizeof(bin_file_name));
+    if (acme_cache_has(bin_file_name, sym_file_name))
+      continue;
+    int j;
+    for (j = 0; j < count && strcmp(started[j], bin_file_name); j++)
+      ;
+    if (j < count)
+      continue;
+    started = realloc(started, (count + 1) * sizeof(char *));
+    started[count++] = strdup(bin_file_name);
+
+    while (running >= max_workers) {
+      wait(NULL);
+      running--;
     }
-    else if (strncasecmp(line_ptr, "step", strlen("step")) == 0) {
-      fprintf(logfile, ">>> Stepping instruction at %s @ $%04x\n", describe_address_label(&cpu, cpu.regs.pc), cpu.regs.pc);
-      bool prior_error = cpu.term.error, prior_log_dma = cpu.term.log_dma;
-      bzero(&cpu.term, sizeof(cpu.term));
-      cpu.term.log_dma = prior_log_dma;
-      cpu_step(logfile);
-      cpu.term.error |= prior_error;
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (!pid) {
+      // Errors are reported when the block is assembled again as part of its test
+      int null_fd = open("/dev/null", O_WRONLY);
+      dup2(null_fd, 1);
+      dup2(null_fd, 2);
+      _exit(acme_cache_build(d->source, pc, bin_file_name, sym_file_name) ? 1 : 0);
     }
-    else if (sscanf(line_ptr, "run until %s", location) == 1) {
-      bool run_until_brk = strcasecmp("brk", location) == 0;
-      fprintf(logfile, ">>> Running from %s @ $%04x until %s\n", describe_address_label(&cpu, cpu.regs.pc), cpu.regs.pc,
-          run_until_brk ? "brk" : "rts");
-      bool prior_error = cpu.term.error, prior_log_dma = cpu.term.log_dma;
-      bzero(&cpu.term, sizeof(cpu.term));
-      cpu.term.log_dma = prior_log_dma;
-      if (!run_until_brk)
+    if (pid > 0)
+      running++;
+  }
+  while (running) {
+    wait(NULL);
+    running--;
+  }
+
+  for (int i = 0; i < count; i++)
+    free(started[i]);
+  free(started);
+}
+
+// Prepare to run a JSR, JMP, step or run directive, keeping only the error and DMA logging state
+bool begin_run(void)
+{
+  bool prior_error = cpu.term.error;
+  bool log_dma = cpu.term.log_dma;
+  bzero(&cpu.term, sizeof(cpu.term));
+  cpu.term.log_dma = log_dma;
+  run_start_cycles = cpu.cycles;
+  return prior_error;
+}
+
+// Run a directive.  Returns the index of the next directive to run.
+int run_directive(script *s, int index, const char *test_target)
+{
+  directive *d = &s->directives[index];
+  int addr32, addr16;
+  bool prior_error;
+
+  switch (d->op) {
+  case DIR_JSR:
+  case DIR_JMP:
+    addr32 = operand_value(&d->operands[0]);
+    if (addr32 > 0) {
+      addr16 = addr32 & 0xffff;
+      prior_error = begin_run();
+      if (d->op == DIR_JSR)
         cpu.term.rts = 1; // Terminate on net RTS from routine
-      cpu_run(logfile);
-      if (run_until_brk && cpu.term.brk) {
-        cpu.term.error = false;
-        fprintf(
-            logfile, "INFO: Terminating via BRK at %s @ $%04x\n", describe_address_label(&cpu, cpu.regs.pc), cpu.regs.pc);
-      }
+      cpu_call_routine(logfile, addr16);
       cpu.term.error |= prior_error;
+      if (profiling)
+        fprintf(logfile, "INFO: Routine took %llu cycles\n", cpu.cycles - run_start_cycles);
     }
-    else if (sscanf(line_ptr, "let %s = %s", location, value) == 2) {
-      if (!strcasecmp(location, "a"))
-        cpu.regs.a = resolve_value8(value);
-      else if (!strcasecmp(location, "x"))
-        cpu.regs.x = resolve_value8(value);
-      else if (!strcasecmp(location, "y"))
-        cpu.regs.y = resolve_value8(value);
-      else if (!strcasecmp(location, "z"))
-        cpu.regs.z = resolve_value8(value);
-      else if (!strcasecmp(location, "b"))
-        cpu.regs.b = resolve_value8(value);
-      else if (!strcasecmp(location, "f"))
-        cpu.regs.flags = resolve_value8(value);
-      else if (!strcasecmp(location, "spl"))
-        cpu.regs.spl = resolve_value8(value);
-      else if (!strcasecmp(location, "sph"))
-        cpu.regs.sph = resolve_value8(value);
-      else if (!strcasecmp(location, "sp"))
-        cpu.regs.sp = resolve_value16(value);
-      else if (!strcasecmp(location, "pc"))
-        cpu.regs.pc = resolve_value16(value);
-      else {
-        fprintf(logfile, "ERROR: Unknown register '%s'\n", location);
-        cpu.term.error = true;
-      }
+    break;
+  case DIR_DUMP_INSTRUCTIONS:
+    show_recent_instructions(logfile, d->text, &cpu, d->number, d->number2 - d->number + 1, -1);
+    break;
+  case DIR_LOG_DMA_OFF:
+    cpu.term.log_dma = false;
+    fprintf(logfile, "NOTE: DMA jobs will not be reported\n");
+    break;
+  case DIR_LOG_DMA:
+    cpu.term.log_dma = true;
+    fprintf(logfile, "NOTE: DMA jobs will be reported\n");
+    break;
+  case DIR_LOG_ON_FAILURE:
+    // Dump all instructions on test failure
+    log_on_failure = true;
+    break;
+  case DIR_LOG_HISTORY_FULL:
+    // Keep every instruction, not just the most recent, e.g., for complete blame information
+    cpulog_set_capacity(MAX_LOG_LENGTH);
+    fprintf(logfile, "NOTE: Keeping complete instruction history\n");
+    break;
+  case DIR_LOG_HISTORY: {
+    // Keep (at least) the most recent n instructions
+    unsigned int capacity = 1024;
+    while (capacity < (unsigned int)d->number && capacity < MAX_LOG_LENGTH)
+      capacity *= 2;
+    cpulog_set_capacity(capacity);
+    fprintf(logfile, "NOTE: Keeping the most recent %u instructions\n", capacity);
+  } break;
+  case DIR_CHECK_REGS:
+    // Check registers for changes
+    compare_register_contents(logfile, &cpu);
+    break;
+  case DIR_CHECK_MEM:
+    // Check RAM for changes
+    compare_ram_contents(logfile, &cpu);
+    break;
+  case DIR_IGNORE_FROM:
+    ignore_ram_changes(operand_value(&d->operands[0]), operand_value(&d->operands[1]));
+    break;
+  case DIR_IGNORE_ALL_REGS:
+    cpu_expected.regs = cpu.regs;
+    break;
+  case DIR_IGNORE_REG:
+    set_register(&cpu_expected.regs, d->number, get_register(&cpu.regs, d->number));
+    break;
+  case DIR_IGNORE: {
+    int low = operand_value(&d->operands[0]);
+    ignore_ram_changes(low, low);
+  } break;
+  case DIR_END_TEST:
+    test_conclude(&cpu);
+    test_worker_done();
+    break;
+  case DIR_TEST:
+    snprintf(test_name, sizeof(test_name), "%s", d->name);
+    if (test_target && strcmp(test_target, test_name))
+      return d->end + 1;
+    if (max_workers > 1 && !launch_test_worker()) {
+      // The worker runs the test
+      return d->end + 1;
     }
-    else if (strncasecmp(line_ptr, "allow stack overflow", strlen("allow stack overflow")) == 0) {
-      fprintf(logfile, "INFO: Allowing the stack to overflow\n");
-      fail_on_stack_overflow = false;
+    // Set test name
+    test_init(&cpu);
+    fflush(stdout);
+    break;
+  case DIR_LOAD_HYPPO_SYMBOLS:
+    if (load_hyppo_symbols(d->name))
+      cpu.term.error = true;
+    break;
+  case DIR_LOAD_HYPPO:
+    if (load_hyppo(d->name))
+      cpu.term.error = true;
+    break;
+  case DIR_LOAD_SYMBOLS:
+    if (load_symbols(d->name, d->number))
+      cpu.term.error = true;
+    break;
+  case DIR_LOAD:
+    if (load_file(d->name, d->number))
+      cpu.term.error = true;
+    break;
+  case DIR_CLEAR_ALL_BREAKPOINTS:
+    fprintf(logfile, "INFO: Cleared all breakpoints\n");
+    bzero(breakpoints, sizeof(breakpoints));
+    break;
+  case DIR_CLEAR_BREAKPOINT:
+  case DIR_BREAKPOINT:
+    addr16 = operand_value(&d->operands[0]) & 0xffff;
+    fprintf(logfile, "INFO: Breakpoint %s at %s ($%04x)\n", d->op == DIR_BREAKPOINT ? "set" : "cleared",
+        d->operands[0].text, addr16);
+    breakpoints[addr16] = d->op == DIR_BREAKPOINT;
+    break;
+  case DIR_CLEAR_FLAG:
+    cpu.regs.flags &= ~d->flag_mask;
+    break;
+  case DIR_SET_FLAG:
+    cpu.regs.flags |= d->flag_mask;
+    break;
+  case DIR_EXPECT_FLAG:
+    if (d->enable)
+      cpu_expected.regs.flags |= d->flag_mask;
+    else
+      cpu_expected.regs.flags &= ~d->flag_mask;
+    break;
+  case DIR_EXPECT_REG:
+    // Set expected register value
+    set_register(&cpu_expected.regs, d->number, operand_value(&d->operands[0]));
+    break;
+  case DIR_LET:
+    set_register(&cpu.regs, d->number, operand_value(&d->operands[0]));
+    break;
+  case DIR_EXPECT_MEM: {
+    // Update *_expected[] memories to indicate the value we expect where.
+    // Resolve labels and label+offset and $nn in each of the fields.
+    int v = operand_value(&d->operands[0]) & 0xff;
+    int l = operand_value(&d->operands[1]);
+    write_mem_expected28(l, v);
+  } break;
+  case DIR_SNAPSHOT_SAVE:
+    if (snapshot_save(d->name))
+      cpu.term.error = true;
+    break;
+  case DIR_SNAPSHOT_RESTORE:
+    if (snapshot_restore(d->name))
+      cpu.term.error = true;
+    break;
+  case DIR_SNAPSHOT_WRITE:
+    if (snapshot_write(d->name, d->file))
+      cpu.term.error = true;
+    break;
+  case DIR_SNAPSHOT_READ:
+    if (snapshot_read(d->name, d->file))
+      cpu.term.error = true;
+    break;
+  case DIR_DEFINE: {
+    unsigned int addr = operand_value(&d->operands[0]);
+    if (symbol_count >= MAX_SYMBOLS) {
+      fprintf(logfile, "ERROR: Too many symbols. Increase MAX_SYMBOLS.\n");
+      cpu.term.error = true;
+      break;
     }
-    else if (strncasecmp(line_ptr, "allow stack underflow", strlen("allow stack underflow")) == 0) {
-      fprintf(logfile, "INFO: Allowing the stack to underflow\n");
-      fail_on_stack_underflow = false;
+    symbols[symbol_count].name = strdup(d->name);
+    symbols[symbol_count].addr = addr;
+    if (addr < CHIPRAM_SIZE) {
+      sym_by_addr[addr] = &symbols[symbol_count];
     }
-    else if (strncasecmp(line_ptr, "forbid stack overflow", strlen("forbid stack overflow")) == 0) {
-      fprintf(logfile, "INFO: Forbidding the stack to overflow\n");
-      fail_on_stack_overflow = true;
+    symbol_count++;
+  } break;
+  case DIR_POKE: {
+    unsigned int addr = operand_value(&d->operands[0]);
+    for (int i = 1; i < d->operand_count; i++)
+      write_mem28(&cpu, addr++, operand_value(&d->operands[i]) & 0xff);
+  } break;
+  case DIR_STEP:
+    fprintf(logfile, ">>> Stepping %u instructions starting at %s @ $%04x\n", d->number,
+        describe_address_label(&cpu, cpu.regs.pc), cpu.regs.pc);
+    prior_error = begin_run();
+    for (unsigned i = 0; i < d->number; ++i) {
+      if (!cpu_step(logfile))
+        break;
     }
-    else if (strncasecmp(line_ptr, "forbid stack underflow", strlen("forbid stack underflow")) == 0) {
-      fprintf(logfile, "INFO: Forbidding the stack to underflow\n");
-      fail_on_stack_underflow = true;
+    cpu.term.error |= prior_error;
+    break;
+  case DIR_STEP_ONE:
+    fprintf(logfile, ">>> Stepping instruction at %s @ $%04x\n", describe_address_label(&cpu, cpu.regs.pc), cpu.regs.pc);
+    prior_error = begin_run();
+    cpu_step(logfile);
+    cpu.term.error |= prior_error;
+    break;
+  case DIR_RUN_UNTIL:
+    fprintf(logfile, ">>> Running from %s @ $%04x until %s\n", describe_address_label(&cpu, cpu.regs.pc), cpu.regs.pc,
+        d->enable ? "brk" : "rts");
+    prior_error = begin_run();
+    if (!d->enable)
+      cpu.term.rts = 1; // Terminate on net RTS from routine
+    cpu_run(logfile);
+    if (d->enable && cpu.term.brk) {
+      cpu.term.error = false;
+      fprintf(
+          logfile, "INFO: Terminating via BRK at %s @ $%04x\n", describe_address_label(&cpu, cpu.regs.pc), cpu.regs.pc);
     }
-    else if (strncasecmp(line_ptr, "assemble with acme", strlen("assemble with acme")) == 0) {
-      assemble_with_acme(f, &cpu, 0x2000);
+    cpu.term.error |= prior_error;
+    break;
+  case DIR_STACK_OVERFLOW:
+    fprintf(logfile, "INFO: %s the stack to overflow\n", d->enable ? "Allowing" : "Forbidding");
+    fail_on_stack_overflow = !d->enable;
+    break;
+  case DIR_STACK_UNDERFLOW:
+    fprintf(logfile, "INFO: %s the stack to underflow\n", d->enable ? "Allowing" : "Forbidding");
+    fail_on_stack_underflow = !d->enable;
+    break;
+  case DIR_ASSEMBLE:
+    addr16 = operand_value(&d->operands[0]) & 0xffff;
+    if (!d->enable || !cpu.term.error)
+      assemble_with_acme(d->source, &cpu, addr16);
+    break;
+  case DIR_CPU_SPEED:
+    user_cpu_speed = &cpu_speeds[d->number];
+    fprintf(logfile, "INFO: CPU runs at %s outside the hypervisor\n", user_cpu_speed->name);
+    break;
+  case DIR_PROFILE_CYCLES:
+    fprintf(logfile, "INFO: Profiling cycles\n");
+    profile_start();
+    break;
+  case DIR_EXPECT_CYCLES:
+    if (cpu.cycles - run_start_cycles > (unsigned int)d->number) {
+      fprintf(logfile, "ERROR: Took %llu cycles, but expected at most %u\n", cpu.cycles - run_start_cycles,
+          (unsigned int)d->number);
+      cpu.term.error = true;
     }
-    else if (sscanf(line_ptr, "assemble at %s with acme", location) == 1) {
-      addr = resolve_value16(location);
-      if (!cpu.term.error)
-        assemble_with_acme(f, &cpu, addr);
+    break;
+  case DIR_INFINITE_LOOP_THRESHOLD:
+    infinite_loop_threshold = d->number;
+    break;
+  case DIR_TRACE_TO:
+    if (trace_open(d->file))
+      fprintf(logfile, "INFO: Tracing instructions to '%s'\n", d->file);
+    else
+      cpu.term.error = true;
+    break;
+  case DIR_TRACE_OFF:
+    if (trace)
+      trace_close();
+    break;
+  case DIR_SDCARD:
+    if (sdcard_attach(d->file, d->enable))
+      fprintf(logfile, "INFO: SD card image '%s' has %zu sectors%s\n", d->file, sdcard.sectors,
+          d->enable ? ", and will be written to" : "");
+    else
+      cpu.term.error = true;
+    break;
+  case DIR_SDCARD_LATENCY:
+    *(d->number == 0 ? &sdcard.read_latency : d->number == 1 ? &sdcard.write_latency : &sdcard.seek_latency) =
+        d->number2 / 1e6;
+    break;
+  case DIR_SCREENSHOT:
+    if (do_screen_shot(d->file))
+      cpu.term.error = true;
+    else
+      fprintf(logfile, "INFO: Wrote screen capture to '%s', drawing %d of %d character cells\n", d->file,
+          frame_cells_drawn, frame_cells);
+    break;
+  case DIR_EXPECT_SCREEN_MATCHES:
+    if (!expect_screen_matches(d->file))
+      cpu.term.error = true;
+    break;
+  case DIR_EXPECT_SCREEN_TEXT:
+    if (!expect_screen_text(d->name, d->number, d->number2))
+      cpu.term.error = true;
+    break;
+  case DIR_EXPECT_FAILURE:
+    // For testing the checks themselves
+    expect_test_failure = true;
+    break;
+  case DIR_ERROR:
+    fprintf(logfile, "ERROR: %s:%d: %s:\n       %s\n", s->filename, d->line, d->error, d->text);
+    cpu.term.error = true;
+    break;
+  }
+  return index + 1;
+}
+
+// Find the ACME reports to export coverage for, and somewhere for -j workers to leave their coverage
+bool coverage_setup(script *s)
+{
+  for (int i = 0; i < s->count && !coverage_report_count; i++) {
+    directive *d = &s->directives[i];
+    if (d->op != DIR_LOAD_HYPPO_SYMBOLS)
+      continue;
+    char *report = malloc(strlen(d->name) + 5);
+    strcpy(report, d->name);
+    char *dot = strrchr(report, '.');
+    if (dot && !strcmp(dot, ".sym"))
+      *dot = 0;
+    strcat(report, ".rep");
+    coverage_reports[coverage_report_count++] = report;
+  }
+  if (!coverage_report_count) {
+    fprintf(stderr, "ERROR: No ACME report to write lcov coverage for. Use -r <acme report>\n");
+    return false;
+  }
+
+  if (!coverage_file && max_workers > 1) {
+    static char temporary[] = "/tmp/hyppotest-coverage-XXXXXX";
+    int fd = mkstemp(temporary);
+    if (fd < 0) {
+      perror("mkstemp");
+      return false;
     }
-    else {
-    directive_error:
-      fprintf(logfile, "ERROR: Unrecognised test directive:\n       %s\n", line_ptr);
-      cpu.term.error = true;
+    close(fd);
+    coverage_file = temporary;
+    coverage_file_is_temporary = true;
+  }
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  struct timespec run_start, run_end;
+
+  while ((opt = getopt(argc, argv, "Mj:c:l:r:")) != -1) {
+    switch (opt) {
+    case 'M':
+      memory_benchmark();
+      exit(0);
+    case 'j':
+      max_workers = atoi(optarg);
+      if (max_workers < 1)
+        max_workers = 1;
+      break;
+    case 'c':
+      coverage_file = optarg;
+      coverage = true;
+      break;
+    case 'l':
+      lcov_file = optarg;
+      coverage = true;
+      break;
+    case 'r':
+      if (coverage_report_count < MAX_COVERAGE_REPORTS)
+        coverage_reports[coverage_report_count++] = optarg;
+      break;
+    default:
+      argc = 0;
+      break;
     }
   }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: hyppotest [-M] [-j <jobs>] [-c <coverage file>] [-l <lcov file> [-r <acme report>]] <test script> [<test>]\n");
+    fprintf(stderr, "       -M  Report the cost of emulated memory accesses, and exit\n");
+    fprintf(stderr, "       -j  Run up to <jobs> tests in parallel\n");
+    fprintf(stderr, "       -c  Merge the code coverage of this run into <coverage file>\n");
+    fprintf(stderr, "       -l  Write the (merged) code coverage of the instructions in the ACME report as lcov\n");
+    fprintf(stderr, "       -r  ACME report to use (default: the .rep next to the HYPPO symbols the script loads)\n");
+    exit(-2);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &run_start);
+
+  // Setup for anonymous tests, if user doesn't supply any test directives
+  machine_init(&cpu);
+  logfile = stderr;
+
+  // Compile the test script, and then run it
+  script *s = compile_script(argv[1]);
+  if (!s) {
+    fprintf(stderr, "ERROR: Could not read test procedure from '%s'\n", argv[1]);
+    exit(-2);
+  }
+  acme_cache_init();
+  preassemble_script(s);
+  if (lcov_file && !coverage_setup(s))
+    exit(-2);
+  const char *test_target = (argc == 3 ? argv[2] : NULL);
+  if (test_target) {
+    printf("INFO: Only running test \"%s\"\n", test_target);
+  }
+  for (int i = 0; i < s->count;)
+    i = run_directive(s, i, test_target);
   if (logfile != stderr)
     test_conclude(&cpu);
-  fclose(f);
+  else if (profiling)
+    profile_report(logfile);
+  test_worker_done();
+
+  if (max_workers > 1) {
+    while (workers_running)
+      wait_for_test_worker();
+    report_test_workers();
+    clock_gettime(CLOCK_MONOTONIC, &run_end);
+    printf("INFO: %d tests passed, %d tests failed (%.3f seconds, up to %d tests in parallel)\n", test_passes, test_fails,
+        (run_end.tv_sec - run_start.tv_sec) + (run_end.tv_nsec - run_start.tv_nsec) / 1e9, max_workers);
+  }
+
+  if (coverage) {
+    coverage_save();
+    if (lcov_file)
+      coverage_report();
+    if (coverage_file_is_temporary)
+      unlink(coverage_file);
+  }
+
+  fflush(stdout);
+  if (shared_worker_totals) {
+    // The time is the sum of the time each worker spent executing, so the rate is that of one process
+    instructions_executed += shared_worker_totals->instructions;
+    total_execution_seconds += shared_worker_totals->nanoseconds / 1e9;
+    if (instructions_executed && total_execution_seconds > 0)
+      fprintf(stderr, "INFO: Executed %llu instructions in %.3f seconds (%.0f instructions/second per process)\n",
+          instructions_executed, total_execution_seconds, instructions_executed / total_execution_seconds);
+  }
+  else if (instructions_executed && total_execution_seconds > 0)
+    fprintf(stderr, "INFO: Executed %llu instructions in %.3f seconds (%.0f instructions/second)\n", instructions_executed,
+        total_execution_seconds, instructions_executed / total_execution_seconds);
 }
 
 /* ----------------------------------------------------------------------------------------------------------
@@ -5244,10 +10023,32 @@ unsigned char mega65_rgb(int colour, int rgb)
        + ((vic_regs[0x0100 + (0x100 * rgb) + colour] & 0xf0) >> 4);
 }
 
-png_structp png_ptr = NULL;
-png_bytep png_rows[576];
+// The screen is drawn into a frame that is kept from one screen shot to the next, along with the VIC-IV
+// registers, screen, colour and character data it was drawn from.  When only some character cells have
+// changed since, only those are drawn again.
+#define FRAME_WIDTH 720
+#define FRAME_HEIGHT 576
+unsigned char frame[FRAME_HEIGHT][FRAME_WIDTH * 3];
 int is_pal_mode = 0;
 
+bool frame_valid = false;
+bool frame_cells_independent = false; // every cell was drawn where the incremental drawing would draw it
+unsigned char frame_vic_regs[0x400];
+unsigned char frame_screen_data[MAX_SCREEN_SIZE];
+unsigned char frame_colour_data[MAX_SCREEN_SIZE];
+unsigned char frame_char_data[8192 * 8];
+int frame_cells = 0;       // character cells on the screen
+int frame_cells_drawn = 0; // and how many of them the last screen shot had to draw
+
+// The palette, unpacked from the VIC-IV registers by get_video_state()
+unsigned char palette_rgb[256][3];
+
+// Which pixel of a glyph each pixel drawn for it shows, for each glyph width, at the current horizontal
+// scale, so that drawing a glyph doesn't have to step through it in fractions of a pixel
+float glyph_columns_x_step = -1;
+int glyph_column_count[17];
+unsigned char glyph_columns[17][FRAME_WIDTH];
+
 int min_y = 0;
 int max_y = 999;
 
@@ -5266,9 +10067,9 @@ int set_pixel(int x, int y, int r, int g, int b)
   }
 
   //  printf("Setting pixel at %d,%d to #%02x%02x%02x\n",x,y,b,g,r);
-  ((unsigned char *)png_rows[y])[x * 3 + 0] = r;
-  ((unsigned char *)png_rows[y])[x * 3 + 1] = g;
-  ((unsigned char *)png_rows[y])[x * 3 + 2] = b;
+  frame[y][x * 3 + 0] = r;
+  frame[y][x * 3 + 1] = g;
+  frame[y][x * 3 + 2] = b;
 
   return 0;
 }
@@ -5589,6 +10390,9 @@ void get_video_state(void)
   //  printf("Calling fetch_ram\n");
   fetch_ram(0xffd3000, 0x0400, vic_regs);
   // printf("Got video regs\n");
+  for (int c = 0; c < 256; c++)
+    for (int rgb = 0; rgb < 3; rgb++)
+      palette_rgb[c][rgb] = mega65_rgb(c, rgb);
 
   screen_address = vic_regs[0x60] + (vic_regs[0x61] << 8) + (vic_regs[0x62] << 16);
   charset_address = vic_regs[0x68] + (vic_regs[0x69] << 8) + (vic_regs[0x6A] << 16);
@@ -5689,288 +10493,308 @@ void get_video_state(void)
   return;
 }
 
-void paint_screen_shot(void)
+void glyph_columns_setup(void)
 {
-  printf("Painting rasters %d -- %d\n", min_y, max_y);
-
-  // Now render the text display
-  int y_position = chargen_y;
-  for (int cy = 0; cy < screen_rows; cy++) {
-    if (y_position >= (is_pal_mode ? 576 : 480))
-      break;
-
-    int x_position = chargen_x;
-
-    int xc = 0;
-
-    int is_foreground = 0;
-    int transparent_background = 0;
+  if (x_step == glyph_columns_x_step)
+    return;
+  glyph_columns_x_step = x_step;
+  for (int width = 0; width <= 16; width++) {
+    int count = 0;
+    for (float xx = 0; xx < width && count < FRAME_WIDTH; xx += x_step)
+      glyph_columns[width][count++] = (int)xx;
+    glyph_column_count[width] = count;
+  }
+}
 
-    for (int cx = 0; cx < screen_width; cx++) {
+// Draw character cell (cx,cy) at x_position,y_position, and return how many pixels wide it was.
+// A GOTO character moves x_position instead.
+int paint_char(int cx, int cy, int *x_position, int y_position, int *transparent_background)
+{
+  int xc = 0;
+  int is_foreground = 0;
+
+  // printf("Rendering char (%d,%d) at (%d,%d)\n",cx,cy,*x_position,y_position);
+  //      int char_background_colour;
+  int char_id = 0;
+  int char_value = screen_data[cy * screen_line_step + cx * (1 + sixteenbit_mode)];
+  if (sixteenbit_mode)
+    char_value |= (screen_data[cy * screen_line_step + cx * (1 + sixteenbit_mode) + 1] << 8);
+  int colour_value = colour_data[cy * screen_line_step + cx * (1 + sixteenbit_mode)];
+  if (sixteenbit_mode) {
+    colour_value = colour_value << 8;
+    colour_value |= (colour_data[cy * screen_line_step + cx * (1 + sixteenbit_mode) + 1]);
+  }
+  if (extended_background_mode) {
+    char_id = char_value &= 0x3f;
+    //      char_background_colour=vic_regs[0x21+((char_value>>6)&3)];
+  }
+  else {
+    char_id = char_value & 0x1fff;
+    //      char_background_colour=background_colour;
+  }
+  int glyph_width_deduct = char_value >> 13;
+
+  // Set foreground and background colours
+  int foreground_colour = colour_value & 0x0f;
+  int glyph_flip_vertical = colour_value & 0x8000;
+  int glyph_flip_horizontal = colour_value & 0x4000;
+  int glyph_with_alpha = colour_value & 0x2000;
+  int glyph_goto = colour_value & 0x1000;
+  int glyph_full_colour = 0;
+  // int glyph_blink=0;
+  int glyph_underline = 0;
+  int glyph_bold = 0;
+  int glyph_reverse = 0;
+  if (viciii_attribs && (!multicolour_mode)) {
+    // glyph_blink=colour_value&0x0010;
+    glyph_reverse = colour_value & 0x0020;
+    glyph_bold = colour_value & 0x0040;
+    glyph_underline = colour_value & 0x0080;
+    if (glyph_bold)
+      foreground_colour |= 0x10;
+  }
+  if (multicolour_mode)
+    foreground_colour = colour_value & 0xff;
+
+  if (bitmap_mode) {
+    char_value = screen_data[cy * screen_line_step + cx * (1 + sixteenbit_mode)];
+    foreground_colour = char_value & 0xf;
+    background_colour = char_value >> 4;
+    bitmap_multi_colour = colour_data[cy * screen_line_step + cx * (1 + sixteenbit_mode)];
+    if (0)
+      printf("Bitmap fore/background colours are $%x / $%x\n", foreground_colour, background_colour);
+  }
 
-      // printf("Rendering char (%d,%d) at (%d,%d)\n",cx,cy,x_position,y_position);
-      //      int char_background_colour;
-      int char_id = 0;
-      int char_value = screen_data[cy * screen_line_step + cx * (1 + sixteenbit_mode)];
-      if (sixteenbit_mode)
-        char_value |= (screen_data[cy * screen_line_step + cx * (1 + sixteenbit_mode) + 1] << 8);
-      int colour_value = colour_data[cy * screen_line_step + cx * (1 + sixteenbit_mode)];
-      if (sixteenbit_mode) {
-        colour_value = colour_value << 8;
-        colour_value |= (colour_data[cy * screen_line_step + cx * (1 + sixteenbit_mode) + 1]);
-      }
-      if (extended_background_mode) {
-        char_id = char_value &= 0x3f;
-        //      char_background_colour=vic_regs[0x21+((char_value>>6)&3)];
+  if (vic_regs[0x54] & 2)
+    if (char_id < 0x100)
+      glyph_full_colour = 1;
+  if (vic_regs[0x54] & 4)
+    if (char_id > 0x0FF)
+      glyph_full_colour = 1;
+  int glyph_4bit = colour_value & 0x0800;
+  if (colour_value & 0x0400)
+    glyph_width_deduct += 8;
+
+  // Lookup the char data, and work out how many pixels we need to paint
+  int glyph_width = 8;
+  if (glyph_4bit)
+    glyph_width = 16;
+  glyph_width -= glyph_width_deduct;
+  if (glyph_width < 0)
+    glyph_width = 0;
+
+  unsigned char *fg_rgb = palette_rgb[foreground_colour & 0xff];
+
+  // For each row of the glyph
+  for (int yy = 0; yy < 8; yy++) {
+    int glyph_row = yy;
+    if (glyph_flip_vertical)
+      glyph_row = 7 - glyph_row;
+
+    unsigned char glyph_data[8];
+
+    if (glyph_full_colour) {
+      // Get 8 bytes of data
+      fetch_ram(char_id * 64 + glyph_row * 8, 8, glyph_data);
+    }
+    else {
+      // Use existing char data we have already fetched
+      // printf("Chardata for char $%03x = $%02x\n",char_id,char_data[char_id*8+glyph_row]);
+      if (!bitmap_mode) {
+        for (int i = 0; i < 8; i++)
+          if ((char_data[char_id * 8 + glyph_row] >> i) & 1)
+            glyph_data[i] = 0xff;
+          else
+            glyph_data[i] = 0;
       }
       else {
-        char_id = char_value & 0x1fff;
-        //      char_background_colour=background_colour;
-      }
-      int glyph_width_deduct = char_value >> 13;
-
-      // Set foreground and background colours
-      int foreground_colour = colour_value & 0x0f;
-      int glyph_flip_vertical = colour_value & 0x8000;
-      int glyph_flip_horizontal = colour_value & 0x4000;
-      int glyph_with_alpha = colour_value & 0x2000;
-      int glyph_goto = colour_value & 0x1000;
-      int glyph_full_colour = 0;
-      // int glyph_blink=0;
-      int glyph_underline = 0;
-      int glyph_bold = 0;
-      int glyph_reverse = 0;
-      if (viciii_attribs && (!multicolour_mode)) {
-        // glyph_blink=colour_value&0x0010;
-        glyph_reverse = colour_value & 0x0020;
-        glyph_bold = colour_value & 0x0040;
-        glyph_underline = colour_value & 0x0080;
-        if (glyph_bold)
-          foreground_colour |= 0x10;
-      }
-      if (multicolour_mode)
-        foreground_colour = colour_value & 0xff;
-
-      if (bitmap_mode) {
-        char_value = screen_data[cy * screen_line_step + cx * (1 + sixteenbit_mode)];
-        foreground_colour = char_value & 0xf;
-        background_colour = char_value >> 4;
-        bitmap_multi_colour = colour_data[cy * screen_line_step + cx * (1 + sixteenbit_mode)];
+        int addr = charset_address & 0xfe000;
+        addr += cx * 8 + cy * 320 + glyph_row;
+        if (h640) {
+          addr = charset_address & 0xfc000;
+          addr += cx * 8 + cy * 640 + glyph_row;
+        }
+        unsigned char pixels;
+        fetch_ram(addr, 1, &pixels);
         if (0)
-          printf("Bitmap fore/background colours are $%x / $%x\n", foreground_colour, background_colour);
+          printf("Reading bitmap data from $%x = $%02x, charset_address=$%x\n", addr, pixels, charset_address);
+        for (int i = 0; i < 8; i++)
+          if ((pixels >> i) & 1)
+            glyph_data[i] = 0xff;
+          else
+            glyph_data[i] = 0;
       }
+    }
 
-      if (vic_regs[0x54] & 2)
-        if (char_id < 0x100)
-          glyph_full_colour = 1;
-      if (vic_regs[0x54] & 4)
-        if (char_id > 0x0FF)
-          glyph_full_colour = 1;
-      int glyph_4bit = colour_value & 0x0800;
-      if (colour_value & 0x0400)
-        glyph_width_deduct += 8;
+    if (glyph_flip_horizontal) {
+      unsigned char b[8];
+      for (int i = 0; i < 8; i++)
+        b[i] = glyph_data[i];
+      for (int i = 0; i < 8; i++)
+        glyph_data[i] = b[7 - i];
+    }
 
-      // Lookup the char data, and work out how many pixels we need to paint
-      int glyph_width = 8;
-      if (glyph_4bit)
-        glyph_width = 16;
-      glyph_width -= glyph_width_deduct;
+    if (glyph_reverse) {
+      for (int i = 0; i < 8; i++)
+        glyph_data[i] = 0xff - glyph_data[i];
+    }
 
-      // For each row of the glyph
-      for (int yy = 0; yy < 8; yy++) {
-        int glyph_row = yy;
-        if (glyph_flip_vertical)
-          glyph_row = 7 - glyph_row;
+    // XXX Do blink with PNG animation?
 
-        unsigned char glyph_data[8];
+    if (glyph_underline && (yy == 7)) {
+      for (int i = 0; i < 8; i++)
+        glyph_data[i] = 0xff;
+    }
 
-        if (glyph_full_colour) {
-          // Get 8 bytes of data
-          fetch_ram(char_id * 64 + glyph_row * 8, 8, glyph_data);
+    xc = 0;
+    if (glyph_goto) {
+      *x_position = chargen_x + (char_value & 0x3ff);
+      *transparent_background = colour_value & 0x8000;
+    }
+    else
+      for (; xc < glyph_column_count[glyph_width]; xc++) {
+        int xx = glyph_columns[glyph_width][xc];
+        unsigned char *bg_rgb = palette_rgb[background_colour & 0xff];
+        int r = bg_rgb[0];
+        int g = bg_rgb[1];
+        int b = bg_rgb[2];
+
+        is_foreground = 0;
+
+        if (glyph_4bit) {
+          // 16-colour 4 bits per pixel
+          int c = glyph_data[xx / 2];
+          if (xx & 1)
+            c = c >> 4;
+          else
+            c = c & 0xf;
+          if (glyph_with_alpha) {
+            // Alpha blended pixels:
+            // Here we blend the foreground and background colours we already know
+            // according to the alpha value
+            int a = c;
+            r = (fg_rgb[0] * a + bg_rgb[0] * (15 - a)) >> 8;
+            g = (fg_rgb[1] * a + bg_rgb[1] * (15 - a)) >> 8;
+            b = (fg_rgb[2] * a + bg_rgb[2] * (15 - a)) >> 8;
+          }
+          else {
+            r = palette_rgb[c][0];
+            g = palette_rgb[c][1];
+            b = palette_rgb[c][2];
+          }
+          if (c)
+            is_foreground = 1;
         }
-        else {
-          // Use existing char data we have already fetched
-          // printf("Chardata for char $%03x = $%02x\n",char_id,char_data[char_id*8+glyph_row]);
+        else if (glyph_full_colour) {
+          // 256-colour 8 bits per pixel
+          if (glyph_with_alpha) {
+            // Alpha blended pixels:
+            // Here we blend the foreground and background colours we already know
+            // according to the alpha value
+            int a = glyph_data[xx];
+            r = (fg_rgb[0] * a + bg_rgb[0] * (255 - a)) >> 8;
+            g = (fg_rgb[1] * a + bg_rgb[1] * (255 - a)) >> 8;
+            b = (fg_rgb[2] * a + bg_rgb[2] * (255 - a)) >> 8;
+            if (foreground_colour)
+              is_foreground = 1;
+          }
+          else {
+            r = palette_rgb[glyph_data[xx]][0];
+            g = palette_rgb[glyph_data[xx]][1];
+            b = palette_rgb[glyph_data[xx]][2];
+          }
+        }
+        else if (multicolour_mode && ((foreground_colour & 8) || bitmap_mode)) {
+          // Multi-colour normal char
+          int bits = 0;
+          if (glyph_data[6 - (xx & 0x6)])
+            bits |= 1;
+          if (glyph_data[7 - (xx & 0x6)])
+            bits |= 2;
+          int colour;
           if (!bitmap_mode) {
-            for (int i = 0; i < 8; i++)
-              if ((char_data[char_id * 8 + glyph_row] >> i) & 1)
-                glyph_data[i] = 0xff;
-              else
-                glyph_data[i] = 0;
+            switch (bits) {
+            case 0:
+              colour = vic_regs[0x21];
+              break; // background colour
+            case 1:
+              is_foreground = 1;
+              colour = vic_regs[0x22];
+              break; // multi colour 1
+            case 2:
+              is_foreground = 1;
+              colour = vic_regs[0x23];
+              break; // multi colour 2
+            case 3:
+              is_foreground = 1;
+              colour = foreground_colour & 7;
+              break; // foreground colour
+            }
           }
           else {
-            int addr = charset_address & 0xfe000;
-            addr += cx * 8 + cy * 320 + glyph_row;
-            if (h640) {
-              addr = charset_address & 0xfc000;
-              addr += cx * 8 + cy * 640 + glyph_row;
+            switch (bits) {
+            case 0:
+              is_foreground = 1;
+              colour = vic_regs[0x21];
+              break;
+            case 1:
+              colour = background_colour;
+              break;
+            case 2:
+              is_foreground = 1;
+              colour = foreground_colour;
+              break;
+            case 3:
+              is_foreground = 1;
+              colour = bitmap_multi_colour & 0xf;
+              break;
             }
-            unsigned char pixels;
-            fetch_ram(addr, 1, &pixels);
-            if (0)
-              printf("Reading bitmap data from $%x = $%02x, charset_address=$%x\n", addr, pixels, charset_address);
-            for (int i = 0; i < 8; i++)
-              if ((pixels >> i) & 1)
-                glyph_data[i] = 0xff;
-              else
-                glyph_data[i] = 0;
           }
+          r = palette_rgb[colour & 0xff][0];
+          g = palette_rgb[colour & 0xff][1];
+          b = palette_rgb[colour & 0xff][2];
         }
-
-        if (glyph_flip_horizontal) {
-          unsigned char b[8];
-          for (int i = 0; i < 8; i++)
-            b[i] = glyph_data[i];
-          for (int i = 0; i < 8; i++)
-            glyph_data[i] = b[7 - i];
-        }
-
-        if (glyph_reverse) {
-          for (int i = 0; i < 8; i++)
-            glyph_data[i] = 0xff - glyph_data[i];
+        else {
+          // Mono normal char
+          if (glyph_data[7 - xx]) {
+            r = fg_rgb[0];
+            g = fg_rgb[1];
+            b = fg_rgb[2];
+            //            printf("Foreground pixel. colour = $%02x = #%02x%02x%02x\n",
+            //                   foreground_colour,b,g,r);
+            is_foreground = 1;
+          }
         }
 
-        // XXX Do blink with PNG animation?
-
-        if (glyph_underline && (yy == 7)) {
-          for (int i = 0; i < 8; i++)
-            glyph_data[i] = 0xff;
+        // Actually draw the pixels
+        for (int yc = 0; yc <= y_scale; yc++) {
+          if (((y_position + yc) < bottom_border_y) && ((y_position + yc) >= top_border_y)
+              && ((*x_position + xc) < right_border) && ((*x_position + xc) >= left_border))
+            if (is_foreground || (!*transparent_background)) {
+              set_pixel(*x_position + xc, y_position + yc + yy * (1 + y_scale), r, g, b);
+            }
         }
+      }
+  }
 
-        xc = 0;
-        if (glyph_goto) {
-          x_position = chargen_x + (char_value & 0x3ff);
-          transparent_background = colour_value & 0x8000;
-        }
-        else
-          for (float xx = 0; xx < glyph_width; xx += x_step) {
-            int r = mega65_rgb(background_colour, 0);
-            int g = mega65_rgb(background_colour, 1);
-            int b = mega65_rgb(background_colour, 2);
-
-            is_foreground = 0;
-
-            if (glyph_4bit) {
-              // 16-colour 4 bits per pixel
-              int c = glyph_data[((int)xx) / 2];
-              if (((int)xx) & 1)
-                c = c >> 4;
-              else
-                c = c & 0xf;
-              if (glyph_with_alpha) {
-                // Alpha blended pixels:
-                // Here we blend the foreground and background colours we already know
-                // according to the alpha value
-                int a = c;
-                r = (mega65_rgb(foreground_colour, 0) * a + mega65_rgb(background_colour, 0) * (15 - a)) >> 8;
-                g = (mega65_rgb(foreground_colour, 1) * a + mega65_rgb(background_colour, 1) * (15 - a)) >> 8;
-                b = (mega65_rgb(foreground_colour, 2) * a + mega65_rgb(background_colour, 2) * (15 - a)) >> 8;
-              }
-              else {
-                r = mega65_rgb(c, 0);
-                g = mega65_rgb(c, 1);
-                b = mega65_rgb(c, 2);
-              }
-              if (c)
-                is_foreground = 1;
-            }
-            else if (glyph_full_colour) {
-              // 256-colour 8 bits per pixel
-              if (glyph_with_alpha) {
-                // Alpha blended pixels:
-                // Here we blend the foreground and background colours we already know
-                // according to the alpha value
-                int a = glyph_data[(int)xx];
-                r = (mega65_rgb(foreground_colour, 0) * a + mega65_rgb(background_colour, 0) * (255 - a)) >> 8;
-                g = (mega65_rgb(foreground_colour, 1) * a + mega65_rgb(background_colour, 1) * (255 - a)) >> 8;
-                b = (mega65_rgb(foreground_colour, 2) * a + mega65_rgb(background_colour, 2) * (255 - a)) >> 8;
-                if (foreground_colour)
-                  is_foreground = 1;
-              }
-              else {
-                r = mega65_rgb(glyph_data[(int)xx], 0);
-                g = mega65_rgb(glyph_data[(int)xx], 1);
-                b = mega65_rgb(glyph_data[(int)xx], 2);
-              }
-            }
-            else if (multicolour_mode && ((foreground_colour & 8) || bitmap_mode)) {
-              // Multi-colour normal char
-              int bits = 0;
-              if (glyph_data[6 - (((int)xx) & 0x6)])
-                bits |= 1;
-              if (glyph_data[7 - (((int)xx) & 0x6)])
-                bits |= 2;
-              int colour;
-              if (!bitmap_mode) {
-                switch (bits) {
-                case 0:
-                  colour = vic_regs[0x21];
-                  break; // background colour
-                case 1:
-                  is_foreground = 1;
-                  colour = vic_regs[0x22];
-                  break; // multi colour 1
-                case 2:
-                  is_foreground = 1;
-                  colour = vic_regs[0x23];
-                  break; // multi colour 2
-                case 3:
-                  is_foreground = 1;
-                  colour = foreground_colour & 7;
-                  break; // foreground colour
-                }
-              }
-              else {
-                switch (bits) {
-                case 0:
-                  is_foreground = 1;
-                  colour = vic_regs[0x21];
-                  break;
-                case 1:
-                  colour = background_colour;
-                  break;
-                case 2:
-                  is_foreground = 1;
-                  colour = foreground_colour;
-                  break;
-                case 3:
-                  is_foreground = 1;
-                  colour = bitmap_multi_colour & 0xf;
-                  break;
-                }
-              }
-              r = mega65_rgb(colour, 0);
-              g = mega65_rgb(colour, 1);
-              b = mega65_rgb(colour, 2);
-            }
-            else {
-              // Mono normal char
-              if (glyph_data[7 - (int)xx]) {
-                r = mega65_rgb(foreground_colour, 0);
-                g = mega65_rgb(foreground_colour, 1);
-                b = mega65_rgb(foreground_colour, 2);
-                //            printf("Foreground pixel. colour = $%02x = #%02x%02x%02x\n",
-                //                   foreground_colour,b,g,r);
-                is_foreground = 1;
-              }
-            }
+  return xc;
+}
 
-            // Actually draw the pixels
-            for (int yc = 0; yc <= y_scale; yc++) {
-              if (((y_position + yc) < bottom_border_y) && ((y_position + yc) >= top_border_y)
-                  && ((x_position + xc) < right_border) && ((x_position + xc) >= left_border))
-                if (is_foreground || (!transparent_background)) {
-                  set_pixel(x_position + xc, y_position + yc + yy * (1 + y_scale), r, g, b);
-                }
-            }
+void paint_screen_shot(void)
+{
+  // Now render the text display
+  int y_position = chargen_y;
+  for (int cy = 0; cy < screen_rows; cy++) {
+    if (y_position >= (is_pal_mode ? 576 : 480))
+      break;
 
-            xc++;
-          }
-      }
+    int x_position = chargen_x;
+    int transparent_background = 0;
 
+    for (int cx = 0; cx < screen_width; cx++) {
       // Advance for width of the glyph
-      //      printf("Char was %d pixels wide.\n",xc);
-      x_position += xc;
+      int width = paint_char(cx, cy, &x_position, y_position, &transparent_background);
+      x_position += width;
     }
     y_position += 8 * (1 + y_scale);
   }
@@ -5978,89 +10802,434 @@ void paint_screen_shot(void)
   return;
 }
 
-int do_screen_shot(char *filename)
+// Whether each character cell is drawn from only its own screen and colour RAM bytes and its glyph in
+// char_data, at a fixed position.  Otherwise GOTO characters, variable width glyphs, full-colour glyphs
+// and bitmaps mean that a change in one place can move or change other cells.
+int screen_cells_are_independent(void)
+{
+  if (bitmap_mode)
+    return 0;
+  for (int cy = 0; cy < screen_rows; cy++)
+    for (int cx = 0; cx < screen_width; cx++) {
+      int offset = cy * screen_line_step + cx * (1 + sixteenbit_mode);
+      int char_value = screen_data[offset];
+      int colour_value = colour_data[offset];
+      if (sixteenbit_mode) {
+        char_value |= screen_data[offset + 1] << 8;
+        colour_value = (colour_value << 8) | colour_data[offset + 1];
+      }
+      int char_id = extended_background_mode ? char_value & 0x3f : char_value & 0x1fff;
+      if (!extended_background_mode && (char_value >> 13))
+        return 0; // narrower glyph
+      if (colour_value & 0x1c00)
+        return 0; // GOTO, 4-bit or narrower glyph
+      if (((vic_regs[0x54] & 2) && char_id < 0x100) || ((vic_regs[0x54] & 4) && char_id > 0xff))
+        return 0; // full-colour glyph
+    }
+  return 1;
+}
+
+// Whether any VIC-IV register or palette entry that the frame depends on has changed since it was drawn.
+// The raster and interrupt registers don't change how the screen looks.
+int screen_layout_changed(void)
 {
+  for (int i = 0; i < 0x400; i++) {
+    unsigned char mask = 0xff;
+    if (i == 0x12 || i == 0x19 || i == 0x52 || i == 0x53)
+      continue;
+    if (i == 0x11)
+      mask = 0x7f;
+    if ((vic_regs[i] ^ frame_vic_regs[i]) & mask)
+      return 1;
+  }
+  return 0;
+}
 
-  get_video_state();
+// Bring the frame up to date with the screen state read by get_video_state()
+void render_screen(void)
+{
+  int height = is_pal_mode ? 576 : 480;
+
+  glyph_columns_setup();
+  frame_cells = screen_rows * screen_width;
+  frame_cells_drawn = 0;
+
+  bool independent = screen_cells_are_independent();
+  if (frame_valid && frame_cells_independent && independent && !screen_layout_changed()) {
+    // Draw only the cells whose character, colour or glyph has changed
+    int cell_width = glyph_column_count[8];
+    int y_position = chargen_y;
+    for (int cy = 0; cy < screen_rows; cy++) {
+      if (y_position >= height)
+        break;
+      for (int cx = 0; cx < screen_width; cx++) {
+        int offset = cy * screen_line_step + cx * (1 + sixteenbit_mode);
+        int bytes = 1 + sixteenbit_mode;
+        int char_id = screen_data[offset] | (sixteenbit_mode ? screen_data[offset + 1] << 8 : 0);
+        char_id &= extended_background_mode ? 0x3f : 0x1fff;
+        if (!memcmp(&screen_data[offset], &frame_screen_data[offset], bytes)
+            && !memcmp(&colour_data[offset], &frame_colour_data[offset], bytes)
+            && !memcmp(&char_data[char_id * 8], &frame_char_data[char_id * 8], 8))
+          continue;
+        int x_position = chargen_x + cx * cell_width;
+        int transparent_background = 0;
+        paint_char(cx, cy, &x_position, y_position, &transparent_background);
+        frame_cells_drawn++;
+      }
+      y_position += 8 * (1 + y_scale);
+    }
+  }
+  else {
+    // Set all pixels to the border colour, and then draw the non-border area
+    for (int y = 0; y < height; y++)
+      for (int x = 0; x < FRAME_WIDTH; x++)
+        memcpy(&frame[y][x * 3], palette_rgb[border_colour & 0xff], 3);
+    for (int y = top_border_y; y < bottom_border_y && y < height; y++)
+      for (int x = left_border; x < right_border && x < FRAME_WIDTH; x++)
+        memcpy(&frame[y][x * 3], palette_rgb[background_colour & 0xff], 3);
 
-  //  printf("Got video state.\n");
+    min_y = 0;
+    max_y = height;
+    paint_screen_shot();
+    frame_cells_drawn = frame_cells;
+  }
 
-  //  printf("Got ASCII screenshot.\n");
+  // Remember what the frame now shows
+  memcpy(frame_vic_regs, vic_regs, sizeof(frame_vic_regs));
+  memcpy(frame_screen_data, screen_data, screen_size);
+  memcpy(frame_colour_data, colour_data, screen_size);
+  memcpy(frame_char_data, char_data, charset_size);
+  frame_valid = true;
+  frame_cells_independent = independent;
+}
 
-  FILE *f = NULL;
-  f = fopen(filename, "wb");
-  if (!f) {
-    fprintf(stderr, "ERROR: Could not open '%s' for writing.\n", filename);
+int write_screen_shot_ppm(FILE *f, int height)
+{
+  fprintf(f, "P6\n%d %d\n255\n", FRAME_WIDTH, height);
+  if (fwrite(frame, sizeof(frame[0]), height, f) != height)
     return -1;
-  }
-  // printf("Rendering pixel-exact version to %s...\n", filename);
+  return 0;
+}
 
-  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+int write_png(FILE *f, unsigned char *rgb, int width, int height)
+{
+  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
   if (!png_ptr) {
-    fprintf(stderr, "ERROR: Could not creat PNG structure.\n");
+    fprintf(logfile, "ERROR: Could not create PNG structure.\n");
     return -1;
   }
 
   png_infop info_ptr = png_create_info_struct(png_ptr);
   if (!info_ptr) {
-    fprintf(stderr, "ERROR: Could not creat PNG info structure.\n");
+    fprintf(logfile, "ERROR: Could not create PNG info structure.\n");
+    png_destroy_write_struct(&png_ptr, NULL);
     return -1;
   }
 
   png_init_io(png_ptr, f);
 
-  // Set image size based on PAL or NTSC video mode
-  png_set_IHDR(png_ptr, info_ptr, 720, is_pal_mode ? 576 : 480, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-      PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+  // Screens are mostly large areas of flat colour, which compress well enough without trying hard
+  png_set_compression_level(png_ptr, 1);
+  png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+
+  png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
+      PNG_FILTER_TYPE_BASE);
 
   png_write_info(png_ptr, info_ptr);
+  for (int y = 0; y < height; y++)
+    png_write_row(png_ptr, rgb + y * width * 3);
+  png_write_end(png_ptr, NULL);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
 
-  // Allocate frame buffer for image, and set all pixels to the border colour by default
-  // printf("Allocating PNG frame buffer...\n");
-  for (int y = 0; y < (is_pal_mode ? 576 : 480); y++) {
-    png_rows[y] = (png_bytep)malloc(3 * 720 * sizeof(png_byte));
-    if (!png_rows[y]) {
-      perror("malloc()");
-      return -1;
-    }
-    // Set all pixels to border colour
-    for (int x = 0; x < 720; x++) {
-      ((unsigned char *)png_rows[y])[x * 3 + 0] = mega65_rgb(border_colour, 0);
-      ((unsigned char *)png_rows[y])[x * 3 + 1] = mega65_rgb(border_colour, 1);
-      ((unsigned char *)png_rows[y])[x * 3 + 2] = mega65_rgb(border_colour, 2);
+  return 0;
+}
+
+// Write a screen shot as a PNG, or as a PPM if the file name ends in .ppm.  PPMs take no time to write,
+// and are easy to compare.
+int do_screen_shot(char *filename)
+{
+  get_video_state();
+  render_screen();
+
+  FILE *f = fopen(filename, "wb");
+  if (!f) {
+    fprintf(logfile, "ERROR: Could not open '%s' for writing.\n", filename);
+    return -1;
+  }
+
+  int height = is_pal_mode ? 576 : 480;
+  size_t len = strlen(filename);
+  int result;
+  if (len > 4 && !strcasecmp(filename + len - 4, ".ppm"))
+    result = write_screen_shot_ppm(f, height);
+  else
+    result = write_png(f, &frame[0][0], FRAME_WIDTH, height);
+
+  if (fclose(f) || result) {
+    fprintf(logfile, "ERROR: Could not write screen capture to '%s'.\n", filename);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+  Screen assertions: "expect screen matches <image>" compares the rendered screen with a golden PNG or PPM,
+  and "expect screen text "<text>" at <row>,<column>" compares screen RAM directly, without rendering.
+*/
+
+typedef struct golden_image {
+  char *filename;
+  struct timespec mtime; // so that it is read again if the file is rewritten
+  int width, height;
+  unsigned char *rgb;
+} golden_image;
+
+// Golden images are kept once read, as scripts often compare against the same one repeatedly
+#define MAX_GOLDEN_IMAGES 16
+golden_image golden_images[MAX_GOLDEN_IMAGES];
+int golden_image_count = 0;
+int golden_image_next = 0;
+
+unsigned char *read_ppm(FILE *f, int *width, int *height)
+{
+  int maxval;
+  if (fscanf(f, "P6 %d %d %d", width, height, &maxval) != 3 || maxval != 255 || fgetc(f) == EOF)
+    return NULL;
+  if (*width <= 0 || *height <= 0 || *width > 4096 || *height > 4096)
+    return NULL;
+  unsigned char *rgb = malloc(*width * *height * 3);
+  if (rgb && fread(rgb, *width * 3, *height, f) != *height) {
+    free(rgb);
+    return NULL;
+  }
+  return rgb;
+}
+
+unsigned char *read_png(FILE *f, int *width, int *height)
+{
+  png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!png_ptr)
+    return NULL;
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  unsigned char *volatile rgb = NULL;
+  if (!info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    free(rgb);
+    return NULL;
+  }
+  png_init_io(png_ptr, f);
+  png_read_info(png_ptr, info_ptr);
+
+  // Whatever the PNG has, read it as 8-bit RGB
+  png_set_expand(png_ptr);
+  png_set_strip_16(png_ptr);
+  png_set_strip_alpha(png_ptr);
+  png_set_gray_to_rgb(png_ptr);
+  png_read_update_info(png_ptr, info_ptr);
+
+  *width = png_get_image_width(png_ptr, info_ptr);
+  *height = png_get_image_height(png_ptr, info_ptr);
+  rgb = malloc(*width * *height * 3);
+  if (rgb) {
+    png_bytep rows[*height];
+    for (int y = 0; y < *height; y++)
+      rows[y] = rgb + y * *width * 3;
+    png_read_image(png_ptr, rows);
+    png_read_end(png_ptr, NULL);
+  }
+  png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+  return rgb;
+}
+
+golden_image *load_golden_image(char *filename)
+{
+  struct stat st;
+  if (stat(filename, &st)) {
+    fprintf(logfile, "ERROR: Could not read golden image '%s'\n", filename);
+    return NULL;
+  }
+  golden_image *g = NULL;
+  for (int i = 0; i < golden_image_count; i++)
+    if (!strcmp(golden_images[i].filename, filename)) {
+      g = &golden_images[i];
+      if (g->mtime.tv_sec == st.st_mtim.tv_sec && g->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        return g;
     }
+
+  FILE *f = fopen(filename, "rb");
+  if (!f) {
+    fprintf(logfile, "ERROR: Could not read golden image '%s'\n", filename);
+    return NULL;
+  }
+  golden_image image;
+  image.mtime = st.st_mtim;
+  size_t len = strlen(filename);
+  if (len > 4 && !strcasecmp(filename + len - 4, ".ppm"))
+    image.rgb = read_ppm(f, &image.width, &image.height);
+  else
+    image.rgb = read_png(f, &image.width, &image.height);
+  fclose(f);
+  if (!image.rgb) {
+    fprintf(logfile, "ERROR: Could not decode golden image '%s'\n", filename);
+    return NULL;
+  }
+  image.filename = strdup(filename);
+
+  if (g) {
+    free(g->filename);
+    free(g->rgb);
+  }
+  else if (golden_image_count < MAX_GOLDEN_IMAGES)
+    g = &golden_images[golden_image_count++];
+  else {
+    g = &golden_images[golden_image_next];
+    golden_image_next = (golden_image_next + 1) % MAX_GOLDEN_IMAGES;
+    free(g->filename);
+    free(g->rgb);
   }
+  *g = image;
+  return g;
+}
 
-  printf("Rendering screen...\n");
+// The screen is compared a tile at a time, a row of the tile at a time, and only the pixels of tiles that
+// differ are looked at one by one
+#define SCREEN_TILE 16
 
-  // Start by drawing the non-border area
-  for (int y = top_border_y; y < bottom_border_y && (y < (is_pal_mode ? 576 : 480)); y++) {
-    for (int x = left_border; x < right_border; x++) {
-      ((unsigned char *)png_rows[y])[x * 3 + 0] = mega65_rgb(background_colour, 0);
-      ((unsigned char *)png_rows[y])[x * 3 + 1] = mega65_rgb(background_colour, 1);
-      ((unsigned char *)png_rows[y])[x * 3 + 2] = mega65_rgb(background_colour, 2);
+// Write an image of where the screen differs from the golden image: differing pixels are red, and the rest
+// are the screen, dimmed
+void write_screen_diff(golden_image *g, char *filename)
+{
+  unsigned char *rgb = malloc(g->width * g->height * 3);
+  if (!rgb)
+    return;
+  for (int y = 0; y < g->height; y++)
+    for (int x = 0; x < g->width; x++) {
+      unsigned char *actual = &frame[y][x * 3];
+      unsigned char *expected = &g->rgb[(y * g->width + x) * 3];
+      unsigned char *out = &rgb[(y * g->width + x) * 3];
+      if (memcmp(actual, expected, 3)) {
+        out[0] = 0xff;
+        out[1] = 0;
+        out[2] = 0;
+      }
+      else
+        for (int i = 0; i < 3; i++)
+          out[i] = actual[i] >> 2;
     }
+  FILE *f = fopen(filename, "wb");
+  if (f) {
+    write_png(f, rgb, g->width, g->height);
+    fclose(f);
+    fprintf(logfile, "INFO: Wrote the differences to '%s'\n", filename);
   }
+  free(rgb);
+}
 
-  {
-    //     printf("Video mode does not use raster splits. Drawing normally.\n");
-    min_y = 0;
-    max_y = is_pal_mode ? 576 : 480;
-    paint_screen_shot();
+bool expect_screen_matches(char *filename)
+{
+  golden_image *g = load_golden_image(filename);
+  if (!g)
+    return false;
+
+  get_video_state();
+  render_screen();
+  int height = is_pal_mode ? 576 : 480;
+  if (g->width != FRAME_WIDTH || g->height != height) {
+    fprintf(logfile, "ERROR: Golden image '%s' is %dx%d, but the screen is %dx%d\n", filename, g->width, g->height,
+        FRAME_WIDTH, height);
+    return false;
   }
 
-  //  printf("Writing out PNG frame buffer...\n");
-  // Write out each row of the PNG
-  for (int y = 0; y < (is_pal_mode ? 576 : 480); y++)
-    png_write_row(png_ptr, png_rows[y]);
+  int tiles = 0, differing_tiles = 0, differing_pixels = 0;
+  for (int ty = 0; ty < height; ty += SCREEN_TILE)
+    for (int tx = 0; tx < FRAME_WIDTH; tx += SCREEN_TILE) {
+      int tile_height = ty + SCREEN_TILE <= height ? SCREEN_TILE : height - ty;
+      int tile_width = tx + SCREEN_TILE <= FRAME_WIDTH ? SCREEN_TILE : FRAME_WIDTH - tx;
+      tiles++;
+      int y;
+      for (y = ty; y < ty + tile_height; y++)
+        if (memcmp(&frame[y][tx * 3], &g->rgb[(y * FRAME_WIDTH + tx) * 3], tile_width * 3))
+          break;
+      if (y == ty + tile_height)
+        continue;
+      differing_tiles++;
+      for (y = ty; y < ty + tile_height; y++)
+        for (int x = tx; x < tx + tile_width; x++)
+          if (memcmp(&frame[y][x * 3], &g->rgb[(y * FRAME_WIDTH + x) * 3], 3))
+            differing_pixels++;
+    }
+
+  if (!differing_tiles)
+    return true;
 
-  png_write_end(png_ptr, NULL);
+  fprintf(logfile, "ERROR: Screen differs from '%s' in %d pixels, in %d of %d %dx%d tiles\n", filename,
+      differing_pixels, differing_tiles, tiles, SCREEN_TILE, SCREEN_TILE);
+  char diff_name[1100];
+  snprintf(diff_name, sizeof(diff_name), "DIFF.%s.png", safe_name);
+  write_screen_diff(g, diff_name);
+  return false;
+}
 
-  fclose(f);
+// The screen code for an ASCII character, as print_screencode() would show it, or -1
+int ascii_screencode(char c, int upper_case)
+{
+  if (c >= 0x20 && c < 0x40)
+    return c;
+  if (c >= 0x40 && c < 0x60)
+    return upper_case ? c - 0x40 : c;
+  if (c >= 0x60 && c < 0x80)
+    return c - 0x60;
+  return -1;
+}
 
-  printf("Wrote screen capture to %s...\n", filename);
-  // start_cpu();
-  // exit(0);
+char screencode_ascii(int code, int upper_case)
+{
+  if (code >= 0x20 && code < 0x40)
+    return code;
+  if (code < 0x20)
+    return code + (upper_case ? 0x40 : 0x60);
+  if (code >= 0x40 && code < 0x60 && !upper_case)
+    return code;
+  return '?';
+}
 
-  return 0;
+// Reversed characters match, as the cursor may be blinking over them
+bool expect_screen_text(char *text, int row, int column)
+{
+  unsigned char regs[0x80];
+  for (int i = 0; i < 0x80; i++)
+    regs[i] = read_memory28(NULL, 0xffd3000 + i);
+  unsigned int address = regs[0x60] + (regs[0x61] << 8) + (regs[0x62] << 16);
+  unsigned int line_step = regs[0x58] + (regs[0x59] << 8);
+  int sixteen_bit = regs[0x54] & 1;
+  int upper = 2 - (regs[0x18] & 2);
+  int rows = 1 + regs[0x7b];
+  int columns = regs[0x5e];
+  int mask = (regs[0x11] & 0x40) ? 0x3f : sixteen_bit ? 0x1f7f : 0x7f;
+
+  int len = strlen(text);
+  if (row >= rows || column + len > columns) {
+    fprintf(logfile, "ERROR: Screen text \"%s\" at row %d, column %d does not fit on the %dx%d screen\n", text, row,
+        column, columns, rows);
+    return false;
+  }
+
+  char found[len + 1];
+  bool matches = true;
+  for (int i = 0; i < len; i++) {
+    unsigned int addr = address + row * line_step + (column + i) * (1 + sixteen_bit);
+    int code = read_memory28(NULL, addr);
+    if (sixteen_bit)
+      code |= read_memory28(NULL, addr + 1) << 8;
+    code &= mask;
+    found[i] = code & ~0x7f ? '?' : screencode_ascii(code, upper);
+    if (code != ascii_screencode(text[i], upper))
+      matches = false;
+  }
+  found[len] = 0;
+  if (!matches)
+    fprintf(logfile, "ERROR: Expected screen text \"%s\" at row %d, column %d, but found \"%s\"\n", text, row, column,
+        found);
+  return matches;
 }
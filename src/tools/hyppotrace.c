@@ -0,0 +1,683 @@
+/*
+  Answer questions about a binary instruction trace written by hyppotest's
+  "trace to <file>" directive, without running the test again.
+
+  The trace is mapped into memory and decoded sequentially, see hyppotrace.h
+  for the format.
+
+  hyppotest numbers instructions from 1 again for each routine it calls, so
+  instructions are identified here by their position in the whole trace, as
+  T<n>.  I<n> picks the most recent instruction with that hyppotest number.
+*/
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hyppotrace.h"
+
+char *oplist[] = { "00   BRK\n", "01   ORA ($nn,X)\n", "02   CLE\n", "03   SEE\n", "04   TSB $nn\n", "05   ORA $nn\n",
+  "06   ASL $nn\n", "07   RMB0 $nn\n", "08   PHP\n", "09   ORA #$nn\n", "0A   ASL A\n", "0B   TSY\n", "0C   TSB $nnnn\n",
+  "0D   ORA $nnnn\n", "0E   ASL $nnnn\n", "0F   BBR0 $nn,$rr\n", "10   BPL $rr\n", "11   ORA ($nn),Y\n",
+  "12   ORA ($nn),Z\n", "13   BPL $rrrr\n", "14   TRB $nn\n", "15   ORA $nn,X\n", "16   ASL $nn,X\n", "17   RMB1 $nn\n",
+  "18   CLC\n", "19   ORA $nnnn,Y\n", "1A   INC\n", "1B   INZ\n", "1C   TRB $nnnn\n", "1D   ORA $nnnn,X\n",
+  "1E   ASL $nnnn,X\n", "1F   BBR1 $nn,$rr\n", "20   JSR $nnnn\n", "21   AND ($nn,X)\n", "22   JSR ($nnnn)\n",
+  "23   JSR ($nnnn,X)\n", "24   BIT $nn\n", "25   AND $nn\n", "26   ROL $nn\n", "27   RMB2 $nn\n", "28   PLP\n",
+  "29   AND #$nn\n", "2A   ROL A\n", "2B   TYS\n", "2C   BIT $nnnn\n", "2D   AND $nnnn\n", "2E   ROL $nnnn\n",
+  "2F   BBR2 $nn,$rr\n", "30   BMI $rr\n", "31   AND ($nn),Y\n", "32   AND ($nn),Z\n", "33   BMI $rrrr\n",
+  "34   BIT $nn,X\n", "35   AND $nn,X\n", "36   ROL $nn,X\n", "37   RMB3 $nn\n", "38   SEC\n", "39   AND $nnnn,Y\n",
+  "3A   DEC\n", "3b   DEZ\n", "3C   BIT $nnnn,X\n", "3D   AND $nnnn,X\n", "3E   ROL $nnnn,X\n", "3F   BBR3 $nn,$rr\n",
+  "40   RTI\n", "41   EOR ($nn,X)\n", "42   NEG\n", "43   ASR\n", "44   ASR $nn\n", "45   EOR $nn\n", "46   LSR $nn\n",
+  "47   RMB4 $nn\n", "48   PHA\n", "49   EOR #$nn\n", "4A   LSR A\n", "4B   TAZ\n", "4C   JMP $nnnn\n", "4D   EOR $nnnn\n",
+  "4E   LSR $nnnn\n", "4F   BBR4 $nn,$rr\n", "50   BVC $rr\n", "51   EOR ($nn),Y\n", "52   EOR ($nn),Z\n",
+  "53   BVC $rrrr\n", "54   ASR $nn,X\n", "55   EOR $nn,X\n", "56   LSR $nn,X\n", "57   RMB5 $nn\n", "58   CLI\n",
+  "59   EOR $nnnn,Y\n", "5A   PHY\n", "5B   TAB\n", "5C   MAP\n", "5D   EOR $nnnn,X\n", "5E   LSR $nnnn,X\n",
+  "5F   BBR5 $nn,$rr\n", "60   RTS\n", "61   ADC ($nn,X)\n", "62   RTS #$nn\n", "63   BSR $rrrr\n", "64   STZ $nn\n",
+  "65   ADC $nn\n", "66   ROR $nn\n", "67   RMB6 $nn\n", "68   PLA\n", "69   ADC #$nn\n", "6A   ROR A\n", "6B   TZA\n",
+  "6C   JMP ($nnnn)\n", "6D   ADC $nnnn\n", "6E   ROR $nnnn\n", "6F   BBR6 $nn,$rr\n", "70   BVS $rr\n",
+  "71   ADC ($nn),Y\n", "72   ADC ($nn),Z\n", "73   BVS $rrrr\n", "74   STZ $nn,X\n", "75   ADC $nn,X\n", "76   ROR $nn,X\n",
+  "77   RMB7 $nn\n", "78   SEI\n", "79   ADC $nnnn,Y\n", "7A   PLY\n", "7B   TBA\n", "7C   JMP ($nnnn,X)\n",
+  "7D   ADC $nnnn,X\n", "7E   ROR $nnnn,X\n", "7F   BBR7 $nn,$rr\n", "80   BRA $rr\n", "81   STA ($nn,X)\n",
+  "82   STA ($nn,SP),Y\n", "83   BRA $rrrr\n", "84   STY $nn\n", "85   STA $nn\n", "86   STX $nn\n", "87   SMB0 $nn\n",
+  "88   DEY\n", "89   BIT #$nn\n", "8A   TXA\n", "8B   STY $nnnn,X\n", "8C   STY $nnnn\n", "8D   STA $nnnn\n",
+  "8E   STX $nnnn\n", "8F   BBS0 $nn,$rr\n", "90   BCC $rr\n", "91   STA ($nn),Y\n", "92   STA ($nn),Z\n",
+  "93   BCC $rrrr\n", "94   STY $nn,X\n", "95   STA $nn,X\n", "96   STX $nn,Y\n", "97   SMB1 $nn\n", "98   TYA\n",
+  "99   STA $nnnn,Y\n", "9A   TXS\n", "9B   STX $nnnn,Y\n", "9C   STZ $nnnn\n", "9D   STA $nnnn,X\n", "9E   STZ $nnnn,X\n",
+  "9F   BBS1 $nn,$rr\n", "A0   LDY #$nn\n", "A1   LDA ($nn,X)\n", "A2   LDX #$nn\n", "A3   LDZ #$nn\n", "A4   LDY $nn\n",
+  "A5   LDA $nn\n", "A6   LDX $nn\n", "A7   SMB2 $nn\n", "A8   TAY\n", "A9   LDA #$nn\n", "AA   TAX\n", "AB   LDZ $nnnn\n",
+  "AC   LDY $nnnn\n", "AD   LDA $nnnn\n", "AE   LDX $nnnn\n", "AF   BBS2 $nn,$rr\n", "B0   BCS $rr\n", "B1   LDA ($nn),Y\n",
+  "B2   LDA ($nn),Z\n", "B3   BCS $rrrr\n", "B4   LDY $nn,X\n", "B5   LDA $nn,X\n", "B6   LDX $nn,Y\n", "B7   SMB3 $nn\n",
+  "B8   CLV\n", "B9   LDA $nnnn,Y\n", "BA   TSX\n", "BB   LDZ $nnnn,X\n", "BC   LDY $nnnn,X\n", "BD   LDA $nnnn,X\n",
+  "BE   LDX $nnnn,Y\n", "BF   BBS3 $nn,$rr\n", "C0   CPY #$nn\n", "C1   CMP ($nn,X)\n", "C2   CPZ #$nn\n", "C3   DEW $nn\n",
+  "C4   CPY $nn\n", "C5   CMP $nn\n", "C6   DEC $nn\n", "C7   SMB4 $nn\n", "C8   INY\n", "C9   CMP #$nn\n", "CA   DEX\n",
+  "CB   ASW $nnnn\n", "CC   CPY $nnnn\n", "CD   CMP $nnnn\n", "CE   DEC $nnnn\n", "CF   BBS4 $nn,$rr\n", "D0   BNE $rr\n",
+  "D1   CMP ($nn),Y\n", "D2   CMP ($nn),Z\n", "D3   BNE $rrrr\n", "D4   CPZ $nn\n", "D5   CMP $nn,X\n", "D6   DEC $nn,X\n",
+  "D7   SMB5 $nn\n", "D8   CLD\n", "D9   CMP $nnnn,Y\n", "DA   PHX\n", "DB   PHZ\n", "DC   CPZ $nnnn\n",
+  "DD   CMP $nnnn,X\n", "DE   DEC $nnnn,X\n", "DF   BBS5 $nn,$rr\n", "E0   CPX #$nn\n", "E1   SBC ($nn,X)\n",
+  "E2   LDA ($nn,SP),Y\n", "E3   INW $nn\n", "E4   CPX $nn\n", "E5   SBC $nn\n", "E6   INC $nn\n", "E7   SMB6 $nn\n",
+  "E8   INX\n", "E9   SBC #$nn\n", "EA   EOM\n", "EB   ROW $nnnn\n", "EC   CPX $nnnn\n", "ED   SBC $nnnn\n",
+  "EE   INC $nnnn\n", "EF   BBS6 $nn,$rr\n", "F0   BEQ $rr\n", "F1   SBC ($nn),Y\n", "F2   SBC ($nn),Z\n",
+  "F3   BEQ $rrrr\n", "F4   PHW #$nnnn\n", "F5   SBC $nn,X\n", "F6   INC $nn,X\n", "F7   SMB7 $nn\n", "F8   SED\n",
+  "F9   SBC $nnnn,Y\n", "FA   PLX\n", "FB   PLZ\n", "FC   PHW $nnnn\n", "FD   SBC $nnnn,X\n", "FE   INC $nnnn,X\n",
+  "FF   BBS7 $nn,$rr\n", NULL };
+
+char *opnames[256] = { NULL };
+char *modes[256] = { NULL };
+
+// Decoded instruction: the CPU state before it executed
+typedef struct trace_insn {
+  unsigned long long seq;
+  int number;
+  unsigned int pc, pc28;
+  unsigned char a, x, y, z, b, flags;
+  unsigned short sp;
+  unsigned char in_hyper, map_irq_inhibit;
+  unsigned short maplo, maphi;
+  unsigned char maplomb, maphimb;
+  unsigned char len;
+  const unsigned char *bytes;
+} trace_insn;
+
+typedef struct trace_write {
+  unsigned long long seq; // of the blamed instruction
+  int blame;
+  unsigned int addr;
+  unsigned char value;
+} trace_write;
+
+typedef struct symbol {
+  unsigned int addr;
+  char *name;
+} symbol;
+
+symbol *symbols = NULL;
+int symbol_count = 0;
+
+const unsigned char *trace_data;
+size_t trace_size;
+
+void fail(const char *msg)
+{
+  fprintf(stderr, "ERROR: %s\n", msg);
+  exit(-1);
+}
+
+// Read records from a trace
+typedef struct trace_reader {
+  const unsigned char *p, *end;
+} trace_reader;
+
+unsigned char read_byte(trace_reader *r)
+{
+  if (r->p >= r->end)
+    fail("Trace is truncated");
+  return *r->p++;
+}
+
+void skip_bytes(trace_reader *r, size_t n)
+{
+  if (n > (size_t)(r->end - r->p))
+    fail("Trace is truncated");
+  r->p += n;
+}
+
+unsigned int read_varint(trace_reader *r)
+{
+  unsigned int v = 0;
+  for (int shift = 0;; shift += 7) {
+    unsigned char b = read_byte(r);
+    v |= (b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return v;
+  }
+}
+
+int read_svarint(trace_reader *r)
+{
+  unsigned int v = read_varint(r);
+  return (v >> 1) ^ -(v & 1);
+}
+
+// Decode the whole trace, calling back for each instruction and memory write.
+// A callback can stop the scan by returning false.
+typedef bool (*instruction_callback)(const trace_insn *insn, void *context);
+typedef bool (*write_callback)(const trace_write *write, void *context);
+
+void scan_trace(instruction_callback on_instruction, write_callback on_write, void *context)
+{
+  trace_reader r = { trace_data + 8, trace_data + trace_size };
+  trace_insn insn;
+  trace_write write;
+  unsigned int write_addr = 0;
+  int bank = 0;
+  unsigned long long seq = 0;
+  // Instruction last recorded at each PC
+  static struct {
+    unsigned int pc28;
+    unsigned char len;
+    const unsigned char *bytes;
+  } code[65536];
+
+  bzero(&insn, sizeof(insn));
+  bzero(code, sizeof(code));
+  while (r.p < r.end) {
+    unsigned char tag = read_byte(&r);
+    if (tag < 0x80) {
+      // Instruction
+      insn.pc = (insn.pc + insn.len) & 0xffff;
+      if (tag & TRACE_PC) {
+        insn.pc = read_byte(&r);
+        insn.pc |= read_byte(&r) << 8;
+      }
+      if (tag & TRACE_A)
+        insn.a = read_byte(&r);
+      if (tag & TRACE_X)
+        insn.x = read_byte(&r);
+      if (tag & TRACE_Y)
+        insn.y = read_byte(&r);
+      if (tag & TRACE_FLAGS)
+        insn.flags = read_byte(&r);
+      if (tag & TRACE_SP) {
+        insn.sp = read_byte(&r);
+        insn.sp |= read_byte(&r) << 8;
+      }
+      if (tag & TRACE_EXT) {
+        unsigned char ext = read_byte(&r);
+        if (ext & TRACE_EXT_Z)
+          insn.z = read_byte(&r);
+        if (ext & TRACE_EXT_B)
+          insn.b = read_byte(&r);
+        if (ext & TRACE_EXT_MAP) {
+          insn.maplo = read_byte(&r);
+          insn.maplo |= read_byte(&r) << 8;
+          insn.maphi = read_byte(&r);
+          insn.maphi |= read_byte(&r) << 8;
+          insn.maplomb = read_byte(&r);
+          insn.maphimb = read_byte(&r);
+        }
+        if (ext & TRACE_EXT_MODE) {
+          unsigned char mode = read_byte(&r);
+          insn.in_hyper = mode & 1;
+          insn.map_irq_inhibit = (mode >> 1) & 1;
+        }
+        if (ext & TRACE_EXT_BANK)
+          bank = read_svarint(&r);
+      }
+      insn.pc28 = insn.pc + bank;
+      insn.seq = seq++;
+      insn.len = read_byte(&r);
+      if (!insn.len) {
+        // (An instruction that failed to execute has no bytes either)
+        if (code[insn.pc].pc28 == insn.pc28) {
+          insn.len = code[insn.pc].len;
+          insn.bytes = code[insn.pc].bytes;
+        }
+      }
+      else {
+        insn.bytes = r.p;
+        skip_bytes(&r, insn.len);
+        code[insn.pc].pc28 = insn.pc28;
+        code[insn.pc].len = insn.len;
+        code[insn.pc].bytes = insn.bytes;
+      }
+      if (on_instruction && !on_instruction(&insn, context))
+        return;
+      insn.number++;
+      continue;
+    }
+    switch (tag) {
+    case TRACE_WRITE:
+      write.addr = write_addr + read_svarint(&r);
+      write.value = read_byte(&r);
+      {
+        unsigned int delta = read_varint(&r);
+        write.blame = insn.number - delta;
+        write.seq = seq - delta;
+      }
+      write_addr = write.addr;
+      if (on_write && !on_write(&write, context))
+        return;
+      break;
+    case TRACE_RESET:
+      bzero(&insn, sizeof(insn));
+      bzero(code, sizeof(code));
+      insn.number = read_varint(&r);
+      write_addr = 0;
+      bank = 0;
+      break;
+    case TRACE_SYMBOL:
+      read_varint(&r);
+      skip_bytes(&r, read_byte(&r));
+      break;
+    case TRACE_NOTE:
+      skip_bytes(&r, read_varint(&r));
+      break;
+    case TRACE_END:
+      return;
+    default:
+      fprintf(stderr, "ERROR: Unknown record $%02X at offset %ld in trace\n", tag, (long)(r.p - 1 - trace_data));
+      exit(-1);
+    }
+  }
+  fail("Trace is truncated: it has no end record");
+}
+
+int compare_symbols(const void *a, const void *b)
+{
+  const symbol *sa = a, *sb = b;
+  if (sa->addr != sb->addr)
+    return sa->addr < sb->addr ? -1 : 1;
+  return 0;
+}
+
+// Collect the symbol records (and show notes, if asked to)
+void load_symbols(bool show_notes)
+{
+  trace_reader r = { trace_data + 8, trace_data + trace_size };
+  int allocated = 0;
+  bool ended = false;
+
+  while (!ended && r.p < r.end) {
+    unsigned char tag = read_byte(&r);
+    if (tag < 0x80) {
+      unsigned char ext = 0;
+      skip_bytes(&r, ((tag & TRACE_PC) ? 2 : 0) + ((tag & TRACE_A) ? 1 : 0) + ((tag & TRACE_X) ? 1 : 0) + ((tag & TRACE_Y) ? 1 : 0)
+           + ((tag & TRACE_FLAGS) ? 1 : 0) + ((tag & TRACE_SP) ? 2 : 0));
+      if (tag & TRACE_EXT)
+        ext = read_byte(&r);
+      skip_bytes(&r, ((ext & TRACE_EXT_Z) ? 1 : 0) + ((ext & TRACE_EXT_B) ? 1 : 0) + ((ext & TRACE_EXT_MAP) ? 6 : 0)
+           + ((ext & TRACE_EXT_MODE) ? 1 : 0));
+      if (ext & TRACE_EXT_BANK)
+        read_varint(&r);
+      skip_bytes(&r, read_byte(&r));
+      continue;
+    }
+    switch (tag) {
+    case TRACE_WRITE:
+      read_varint(&r);
+      read_byte(&r);
+      read_varint(&r);
+      break;
+    case TRACE_RESET:
+      read_varint(&r);
+      break;
+    case TRACE_SYMBOL: {
+      unsigned int addr = read_varint(&r);
+      unsigned char len = read_byte(&r);
+      const unsigned char *name = r.p;
+      skip_bytes(&r, len);
+      if (symbol_count == allocated) {
+        allocated = allocated ? allocated * 2 : 1024;
+        symbols = realloc(symbols, allocated * sizeof(symbol));
+      }
+      symbols[symbol_count].addr = addr;
+      symbols[symbol_count].name = strndup((const char *)name, len);
+      symbol_count++;
+    } break;
+    case TRACE_NOTE: {
+      unsigned int len = read_varint(&r);
+      const unsigned char *text = r.p;
+      skip_bytes(&r, len);
+      if (show_notes)
+        printf("NOTE: %.*s\n", (int)len, text);
+    } break;
+    case TRACE_END:
+      ended = true;
+      break;
+    default:
+      fprintf(stderr, "ERROR: Unknown record $%02X at offset %ld in trace\n", tag, (long)(r.p - 1 - trace_data));
+      exit(-1);
+    }
+  }
+  // A trace that stops between records was cut short too, e.g. by hyppotest being killed
+  if (!ended)
+    fail("Trace is truncated: it has no end record");
+  if (symbol_count)
+    qsort(symbols, symbol_count, sizeof(symbol), compare_symbols);
+}
+
+symbol *find_symbol_by_name(const char *name)
+{
+  for (int i = 0; i < symbol_count; i++)
+    if (!strcmp(symbols[i].name, name))
+      return &symbols[i];
+  return NULL;
+}
+
+// Describe a 28-bit address as the nearest symbol at or below it
+const char *describe_address(unsigned int addr)
+{
+  static char description[1024];
+  int lo = 0, hi = symbol_count - 1, match = -1;
+
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (symbols[mid].addr <= addr) {
+      match = mid;
+      lo = mid + 1;
+    }
+    else
+      hi = mid - 1;
+  }
+  if (match < 0 || addr - symbols[match].addr > 0xffff)
+    description[0] = 0;
+  else if (addr == symbols[match].addr)
+    snprintf(description, sizeof(description), "%s", symbols[match].name);
+  else {
+    const unsigned int delta = addr - symbols[match].addr;
+    snprintf(description, sizeof(description), delta > 0xff ? "%s+$%x" : "%s+%d", symbols[match].name, delta);
+  }
+  return description;
+}
+
+// Disassemble an instruction, using the same templates as ethermon
+void disassemble(char *out, int size, const trace_insn *insn)
+{
+  const unsigned char *b = insn->bytes;
+  int len = insn->len;
+  int o = 0;
+  bool quad = false, flat = false;
+
+  if (!len) {
+    snprintf(out, size, "???");
+    return;
+  }
+  // 45GS02 prefixes: NEG NEG for 32-bit Q register operations, NOP for 32-bit flat pointers
+  if (len > 2 && b[0] == 0x42 && b[1] == 0x42) {
+    quad = true;
+    b += 2;
+    len -= 2;
+  }
+  if (len > 1 && b[0] == 0xea && strstr(modes[b[1]], "),Z")) {
+    flat = true;
+    b++;
+    len--;
+  }
+
+  const char *mode = modes[b[0]];
+  o += snprintf(&out[o], size - o, "%s%s ", opnames[b[0]], quad ? "Q" : "");
+  for (int i = 1, j = 0; mode[j] && o < size - 8;) {
+    int digits = 0;
+    switch (mode[j]) {
+    case 'n':
+    case 'r': {
+      char kind = mode[j];
+      while (mode[j] == kind) {
+        digits++;
+        j++;
+      }
+      int value = b[i < len ? i : 0];
+      if (digits == 4)
+        value |= b[i + 1 < len ? i + 1 : 0] << 8;
+      if (kind == 'r') {
+        if (digits == 2)
+          value = (value & 0x80) ? value - 0x100 : value;
+        else
+          value = (value & 0x8000) ? value - 0x10000 : value;
+        // Branches are relative to the byte after the first operand byte
+        value = (insn->pc + (b - insn->bytes) + i + 1 + value) & 0xffff;
+        o += snprintf(&out[o], size - o, "%04X", value);
+      }
+      else
+        o += snprintf(&out[o], size - o, digits == 2 ? "%02X" : "%04X", value);
+      i += digits / 2;
+    } break;
+    case '(':
+    case ')':
+      out[o++] = flat ? (mode[j] == '(' ? '[' : ']') : mode[j];
+      out[o] = 0;
+      j++;
+      break;
+    default:
+      out[o++] = mode[j++];
+      out[o] = 0;
+      break;
+    }
+  }
+}
+
+void show_instruction(const trace_insn *insn)
+{
+  char text[1024];
+
+  disassemble(text, sizeof(text), insn);
+  printf("T%-8llu I%-7d $%04X : A:%02X X:%02X Y:%02X Z:%02X SP:%04X B:%02X M:%04x+%02x/%04x+%02x %c%c%c%c%c%c%c%c : %32s : ",
+      insn->seq, insn->number, insn->pc, insn->a, insn->x, insn->y, insn->z, insn->sp, insn->b, insn->maplo, insn->maplomb,
+      insn->maphi, insn->maphimb, insn->flags & 0x80 ? 'N' : '.', insn->flags & 0x40 ? 'V' : '.',
+      insn->flags & 0x20 ? 'E' : '.', insn->flags & 0x10 ? 'B' : '.', insn->flags & 0x08 ? 'D' : '.',
+      insn->flags & 0x04 ? 'I' : '.', insn->flags & 0x02 ? 'Z' : '.', insn->flags & 0x01 ? 'C' : '.',
+      describe_address(insn->pc28));
+  for (int j = 0; j < 3; j++) {
+    if (j < insn->len)
+      printf("%02X ", insn->bytes[j]);
+    else
+      printf("   ");
+  }
+  printf(" : %s\n", text);
+}
+
+// Find the most recent instruction with a given hyppotest number
+typedef struct numbered {
+  int number;
+  unsigned long long seq;
+  bool found;
+} numbered;
+
+bool find_numbered(const trace_insn *insn, void *context)
+{
+  numbered *n = context;
+  if (insn->number == n->number) {
+    n->seq = insn->seq;
+    n->found = true;
+  }
+  return true;
+}
+
+// Parse T<n> (or just <n>) or I<n> into a position in the trace
+unsigned long long parse_instruction(const char *s)
+{
+  numbered n = { 0, 0, false };
+
+  if (s[0] == 'I' && sscanf(s + 1, "%d", &n.number) == 1) {
+    scan_trace(find_numbered, NULL, &n);
+    if (!n.found) {
+      fprintf(stderr, "ERROR: There is no instruction %s in the trace\n", s);
+      exit(-1);
+    }
+    return n.seq;
+  }
+  if (sscanf(s[0] == 'T' ? s + 1 : s, "%llu", &n.seq) == 1)
+    return n.seq;
+  fprintf(stderr, "ERROR: '%s' should be T<n> or I<n>\n", s);
+  exit(-1);
+}
+
+// list <first> [<last>]
+typedef struct range {
+  unsigned long long first, last;
+  int shown;
+} range;
+
+bool list_instruction(const trace_insn *insn, void *context)
+{
+  range *r = context;
+  if (insn->seq >= r->first && insn->seq <= r->last) {
+    show_instruction(insn);
+    r->shown++;
+  }
+  return insn->seq < r->last;
+}
+
+// writer <address> [<instruction>]
+typedef struct last_write {
+  unsigned int addr;
+  unsigned long long before;
+  bool found;
+  trace_write write;
+} last_write;
+
+bool find_last_write(const trace_write *write, void *context)
+{
+  last_write *w = context;
+  if (write->seq >= w->before)
+    return false;
+  if (write->addr == w->addr) {
+    w->write = *write;
+    w->found = true;
+  }
+  return true;
+}
+
+// calls <symbol>
+typedef struct calls {
+  unsigned int addr;
+  trace_insn caller;
+  bool have_caller;
+  const unsigned char *caller_bytes;
+  int count;
+} calls;
+
+bool find_call(const trace_insn *insn, void *context)
+{
+  calls *c = context;
+  if (insn->pc28 == c->addr && c->have_caller) {
+    const char *label = describe_address(c->caller.pc28);
+    printf("T%-8llu I%-7d called from $%04X%s%s%s by:\n", insn->seq, insn->number, c->caller.pc, *label ? " (" : "",
+        label, *label ? ")" : "");
+    show_instruction(&c->caller);
+    c->count++;
+  }
+  // JSR, JSR (abs), JSR (abs,X) and BSR
+  c->have_caller = insn->len && (insn->bytes[0] == 0x20 || insn->bytes[0] == 0x22 || insn->bytes[0] == 0x23
+                                 || insn->bytes[0] == 0x63);
+  if (c->have_caller)
+    c->caller = *insn;
+  return true;
+}
+
+// info
+typedef struct totals {
+  unsigned long long instructions, writes;
+} totals;
+
+bool count_instruction(const trace_insn *insn, void *context)
+{
+  ((totals *)context)->instructions++;
+  return true;
+}
+
+bool count_write(const trace_write *write, void *context)
+{
+  ((totals *)context)->writes++;
+  return true;
+}
+
+unsigned int parse_address(const char *s)
+{
+  unsigned int addr;
+  symbol *sym;
+
+  if (sscanf(s, "$%x", &addr) == 1 || sscanf(s, "0x%x", &addr) == 1)
+    return addr;
+  if ((sym = find_symbol_by_name(s)))
+    return sym->addr;
+  fprintf(stderr, "ERROR: '%s' is neither a $hex address nor a symbol in the trace\n", s);
+  exit(-1);
+}
+
+void usage(void)
+{
+  fprintf(stderr, "usage: hyppotrace <trace file> <command>\n"
+                  "\n"
+                  "Commands:\n"
+                  "  info                       Show the notes and totals in the trace\n"
+                  "  list <first> [<last>]      Disassemble instructions <first> to <last>\n"
+                  "  writer <address> [<n>]     Show which instruction last wrote <address> before instruction <n>\n"
+                  "  calls <symbol>             Show every call to <symbol>\n"
+                  "\n"
+                  "Addresses are 28-bit, as $hex or a symbol name.  Instructions are T<n> for the n-th\n"
+                  "instruction in the trace, or I<n> for the most recent one numbered n in hyppotest's\n"
+                  "instruction log.\n");
+  exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 3)
+    usage();
+
+  int fd = open(argv[1], O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st)) {
+    perror(argv[1]);
+    exit(-1);
+  }
+  trace_size = st.st_size;
+  if (trace_size < 8 || !(trace_data = mmap(NULL, trace_size, PROT_READ, MAP_PRIVATE, fd, 0)) || trace_data == MAP_FAILED
+      || memcmp(trace_data, HYPPOTRACE_MAGIC, 8)) {
+    fprintf(stderr, "ERROR: '%s' is not a hyppotest trace\n", argv[1]);
+    exit(-1);
+  }
+  close(fd);
+
+  for (int i = 0; oplist[i]; i++) {
+    unsigned int n;
+    char opcode[1024];
+    char mode[1024];
+
+    int r = sscanf(oplist[i], "%02x   %s %s", &n, opcode, mode);
+    if (n == (unsigned int)i) {
+      opnames[i] = strdup(opcode);
+      modes[i] = r == 3 ? strdup(mode) : "";
+    }
+  }
+  for (int i = 0; i < 256; i++) {
+    if (!opnames[i]) {
+      opnames[i] = "???";
+      modes[i] = "";
+    }
+  }
+
+  const char *cmd = argv[2];
+  load_symbols(!strcmp(cmd, "info"));
+
+  if (!strcmp(cmd, "info") && argc == 3) {
+    totals t = { 0, 0 };
+    scan_trace(count_instruction, count_write, &t);
+    printf("INFO: %llu instructions, %llu memory writes and %d symbols\n", t.instructions, t.writes, symbol_count);
+  }
+  else if (!strcmp(cmd, "list") && (argc == 4 || argc == 5)) {
+    range r = { parse_instruction(argv[3]), parse_instruction(argv[argc - 1]), 0 };
+    scan_trace(list_instruction, NULL, &r);
+    if (!r.shown)
+      printf("INFO: No instructions T%llu to T%llu in the trace\n", r.first, r.last);
+  }
+  else if (!strcmp(cmd, "writer") && (argc == 4 || argc == 5)) {
+    last_write w = { parse_address(argv[3]), argc == 5 ? parse_instruction(argv[4]) : ~0ULL, false };
+    scan_trace(NULL, find_last_write, &w);
+    if (!w.found)
+      printf("INFO: $%07X was not written to in the trace\n", w.addr);
+    else {
+      printf("INFO: $%07X was last written with $%02X by T%llu (I%d):\n", w.addr, w.write.value, w.write.seq,
+          w.write.blame);
+      range r = { w.write.seq, w.write.seq, 0 };
+      scan_trace(list_instruction, NULL, &r);
+      if (!r.shown)
+        printf("INFO: (by a directive, rather than an instruction)\n");
+    }
+  }
+  else if (!strcmp(cmd, "calls") && argc == 4) {
+    calls c = { parse_address(argv[3]) };
+    scan_trace(find_call, NULL, &c);
+    printf("INFO: %d calls to %s\n", c.count, argv[3]);
+  }
+  else
+    usage();
+  return 0;
+}
@@ -0,0 +1,69 @@
+/*
+  Binary instruction trace format written by hyppotest ("trace to <file>")
+  and read by hyppotrace.
+
+  A trace is the 8 byte magic HYPPOTRACE_MAGIC followed by records.  Each
+  record starts with a tag byte.  Numbers are stored as unsigned LEB128
+  varints, and signed ones are zig-zag encoded first.
+
+  Tags below $80 are instructions.  Their bits say which parts of the CPU
+  state differ from the previous instruction, and only those parts follow,
+  in this order:
+
+    TRACE_PC     PC (2 bytes), when it isn't the previous PC + length
+    TRACE_A      A
+    TRACE_X      X
+    TRACE_Y      Y
+    TRACE_FLAGS  P
+    TRACE_SP     SP (2 bytes)
+    TRACE_EXT    a second mask byte of the TRACE_EXT_* bits below:
+      TRACE_EXT_Z     Z
+      TRACE_EXT_B     B
+      TRACE_EXT_MAP   MAPLO, MAPHI (2 bytes each), MAPLO MB, MAPHI MB
+      TRACE_EXT_MODE  bit 0 = in hypervisor, bit 1 = MAP IRQ inhibit
+      TRACE_EXT_BANK  signed varint: 28-bit address of PC minus PC
+
+  and then the instruction length and bytes.  A length of 0 means that the
+  bytes are the same as those last recorded at this 16-bit PC, with the same
+  28-bit address.  The registers are those before the instruction executes.
+  Instructions are numbered from the last TRACE_RESET, as in the hyppotest
+  instruction log.
+
+  Other records are:
+
+    TRACE_WRITE   signed varint address delta from the previous write, value,
+                  varint of (number of next instruction - blamed instruction)
+    TRACE_RESET   varint number of the next instruction. The CPU state and
+                  write address deltas start again from zero
+    TRACE_SYMBOL  varint 28-bit address, name length, name
+    TRACE_NOTE    varint length, text
+    TRACE_END     end of trace.  A trace without one is truncated, even if
+                  it stops at the end of a record
+*/
+
+#ifndef HYPPOTRACE_H
+#define HYPPOTRACE_H
+
+#define HYPPOTRACE_MAGIC "HYPTRC01"
+
+#define TRACE_PC 0x01
+#define TRACE_A 0x02
+#define TRACE_X 0x04
+#define TRACE_Y 0x08
+#define TRACE_FLAGS 0x10
+#define TRACE_SP 0x20
+#define TRACE_EXT 0x40
+
+#define TRACE_EXT_Z 0x01
+#define TRACE_EXT_B 0x02
+#define TRACE_EXT_MAP 0x04
+#define TRACE_EXT_MODE 0x08
+#define TRACE_EXT_BANK 0x10
+
+#define TRACE_WRITE 0x80
+#define TRACE_RESET 0x81
+#define TRACE_SYMBOL 0x82
+#define TRACE_NOTE 0x83
+#define TRACE_END 0x84
+
+#endif
@@ -1,9 +1,20 @@
 /*
   Use libpcap to fetch raw video packets from C65GS, and then present them
-  via a UDP socket for reading by the C65GS vncserver.  The idea is to
+  via a TCP socket for reading by the C65GS vncserver.  The idea is to
   separate the packet sniffer which needs root, from the part that listens
   to connections from the internet.
 
+  Packets are captured in batches with pcap_dispatch(), which on Linux
+  reads them straight out of libpcap's memory-mapped (TPACKET_V3) ring,
+  and the kernel only passes on packets of the video frame size.  Each
+  client has its own queue of packets, and is written to without
+  blocking, so a slow client never holds up capture or the other clients.
+  When a client's queue is full, its oldest packet is dropped.
+
+  With -r, packets are replayed from a pcap file at the speed they were
+  captured, starting when the first client connects, so that the VNC
+  server can be tested without a MEGA65.
+
   (C) Paul Gardner-Stephen 2014, 2018.
 
   This program is free software; you can redistribute it and/or
@@ -42,9 +53,30 @@
 #include <signal.h>
 #include <netdb.h>
 #include <time.h>
+#include <poll.h>
+#include <getopt.h>
 #include <pcap.h>
 
-int client_sock = -1;
+// Compressed video packets, including the ethernet header, are always this size
+#define VIDEO_PACKET_SIZE 2132
+
+#define MAX_CLIENTS 16
+// Packets queued for each client: a bit over a frame of a busy screen
+#define CLIENT_QUEUE_PACKETS 256
+
+typedef struct client {
+  int sock;
+  unsigned char queue[CLIENT_QUEUE_PACKETS][VIDEO_PACKET_SIZE];
+  int first;       // oldest queued packet
+  int count;       // packets queued
+  int sent;        // bytes of the oldest packet already written
+  long long drops; // packets dropped because the client wasn't keeping up
+} client;
+
+client *clients[MAX_CLIENTS];
+int client_count = 0;
+
+long long packets_captured = 0;
 
 int create_listen_socket(int port)
 {
@@ -92,68 +124,276 @@ int accept_incoming(int sock)
   return -1;
 }
 
+void accept_clients(int listen_sock)
+{
+  int sock;
+  while ((sock = accept_incoming(listen_sock)) != -1) {
+    if (client_count == MAX_CLIENTS) {
+      fprintf(stderr, "Too many clients. Refusing connection.\n");
+      close(sock);
+      continue;
+    }
+    client *c = calloc(1, sizeof(client));
+    if (!c) {
+      perror("calloc");
+      close(sock);
+      continue;
+    }
+    int on = 1;
+    ioctl(sock, FIONBIO, (char *)&on);
+    c->sock = sock;
+    clients[client_count++] = c;
+    printf("New connection. %d total.\n", client_count);
+  }
+}
+
+void close_client(int i)
+{
+  client *c = clients[i];
+  close(c->sock);
+  printf("Closed client connection, after dropping %lld packets. %d remaining.\n", c->drops, client_count - 1);
+  free(c);
+  clients[i] = clients[--client_count];
+}
+
+void queue_packet(client *c, const unsigned char *packet)
+{
+  if (c->count == CLIENT_QUEUE_PACKETS) {
+    // Drop the oldest packet, unless it has been partly written, as the client has to get whole packets
+    int drop = c->sent ? (c->first + 1) % CLIENT_QUEUE_PACKETS : c->first;
+    if (c->sent)
+      memcpy(c->queue[drop], c->queue[c->first], VIDEO_PACKET_SIZE);
+    c->first = (c->first + 1) % CLIENT_QUEUE_PACKETS;
+    c->count--;
+    c->drops++;
+  }
+  memcpy(c->queue[(c->first + c->count) % CLIENT_QUEUE_PACKETS], packet, VIDEO_PACKET_SIZE);
+  c->count++;
+}
+
+// Write as much of the client's queue as it will take now. Returns -1 if the client has gone away.
+int flush_client(client *c)
+{
+  while (c->count) {
+    ssize_t n = send(c->sock, &c->queue[c->first][c->sent], VIDEO_PACKET_SIZE - c->sent, MSG_NOSIGNAL);
+    if (n < 0)
+      return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    c->sent += n;
+    if (c->sent < VIDEO_PACKET_SIZE)
+      return 0;
+    c->sent = 0;
+    c->first = (c->first + 1) % CLIENT_QUEUE_PACKETS;
+    c->count--;
+  }
+  return 0;
+}
+
+void broadcast_packet(const unsigned char *packet, int len)
+{
+  if (len != VIDEO_PACKET_SIZE)
+    return;
+  packets_captured++;
+  for (int i = 0; i < client_count; i++)
+    queue_packet(clients[i], packet);
+}
+
+void captured_packet(u_char *user, const struct pcap_pkthdr *hdr, const u_char *packet)
+{
+  // probably a C65GS compressed video frame.
+  broadcast_packet(packet, hdr->caplen);
+}
+
+long long microseconds(struct timeval *tv)
+{
+  return tv->tv_sec * 1000000LL + tv->tv_usec;
+}
+
+long long now_microseconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int usage(void)
+{
+  fprintf(stderr, "usage: videoproxy <network interface>\n"
+                  "       videoproxy -r <pcap file>\n");
+  fprintf(stderr, "Video packets are served to vncserver (or any other client) on port 6565.\n");
+  fprintf(stderr, "If -r is specified, packets are replayed from the file at the speed they were captured,\n"
+                  "once the first client connects.\n");
+  exit(-3);
+}
+
 int main(int argc, char **argv)
 {
-  char *dev;
+  char *dev = NULL;
+  char *replay_file = NULL;
   char errbuf[PCAP_ERRBUF_SIZE];
   pcap_t *descr;
-  //    struct bpf_program fp;        /* to hold compiled program */
-  bpf_u_int32 pMask; /* subnet mask */
-  bpf_u_int32 pNet;  /* ip address*/
-  pcap_if_t *alldevs;
-
-  // Prepare a list of all the devices
-  if (pcap_findalldevs(&alldevs, errbuf) == -1) {
-    fprintf(stderr, "Error in pcap_findalldevs: %s\n", errbuf);
-    exit(1);
+  struct bpf_program fp; /* to hold compiled program */
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r:")) != -1) {
+    switch (opt) {
+    case 'r':
+      replay_file = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (!replay_file) {
+    if (optind >= argc)
+      usage();
+    dev = argv[optind];
   }
 
-  if (argv[1])
-    dev = argv[1];
+  if (replay_file) {
+    descr = pcap_open_offline(replay_file, errbuf);
+    if (descr == NULL) {
+      printf("pcap_open_offline() failed due to [%s]\n", errbuf);
+      return -1;
+    }
+  }
   else {
-    fprintf(stderr, "You must specify the interface to listen on.\n");
-    exit(-1);
+    // Now, open device for sniffing with big snaplen, promiscuous mode enabled, and a big enough
+    // ring buffer to ride out a few frames of the process not being scheduled.
+    descr = pcap_create(dev, errbuf);
+    if (descr == NULL) {
+      printf("pcap_create() failed due to [%s]\n", errbuf);
+      return -1;
+    }
+    pcap_set_snaplen(descr, 3000);
+    pcap_set_promisc(descr, 1);
+    pcap_set_timeout(descr, 10);
+    pcap_set_buffer_size(descr, 16 * 1024 * 1024);
+    int r = pcap_activate(descr);
+    if (r < 0) {
+      printf("pcap_activate() failed due to [%s]\n", pcap_geterr(descr));
+      return -1;
+    }
+    if (r > 0)
+      fprintf(stderr, "WARNING: pcap_activate(): %s\n", pcap_statustostr(r));
+    if (pcap_setnonblock(descr, 1, errbuf) == -1) {
+      printf("pcap_setnonblock() failed due to [%s]\n", errbuf);
+      return -1;
+    }
   }
 
-  // If something was not provided
-  // return error.
-  if (dev == NULL) {
-    printf("\n[%s]\n", errbuf);
+  // Have the kernel (or libpcap for a file) pass on only packets of the video frame size
+  char filter[64];
+  snprintf(filter, sizeof(filter), "len == %d", VIDEO_PACKET_SIZE);
+  if (pcap_compile(descr, &fp, filter, 1, PCAP_NETMASK_UNKNOWN) == -1 || pcap_setfilter(descr, &fp) == -1) {
+    printf("Could not set packet filter '%s' due to [%s]\n", filter, pcap_geterr(descr));
     return -1;
   }
+  pcap_freecode(&fp);
 
-  // fetch the network address and network mask
-  pcap_lookupnet(dev, &pNet, &pMask, errbuf);
-
-  // Now, open device for sniffing with big snaplen and
-  // promiscuous mode enabled.
-  descr = pcap_open_live(dev, 3000, 1, 10, errbuf);
-  if (descr == NULL) {
-    printf("pcap_open_live() failed due to [%s]\n", errbuf);
+  int listen_sock = create_listen_socket(6565);
+  if (listen_sock == -1) {
+    perror("Couldn't listen to port 6565");
     return -1;
   }
 
   printf("Started.\n");
   fflush(stdout);
 
-  int listen_sock = create_listen_socket(6565);
+  int capture_fd = replay_file ? -1 : pcap_get_selectable_fd(descr);
+
+  // Replay state: the next packet from the file, and when to send it
+  struct pcap_pkthdr *replay_hdr = NULL;
+  const u_char *replay_packet = NULL;
+  long long replay_start = 0, replay_first = 0;
+  int replay_done = 0;
 
   while (1) {
-    if (client_sock == -1) {
-      client_sock = accept_incoming(listen_sock);
+    struct pollfd fds[2 + MAX_CLIENTS];
+    int nfds = 0;
+    fds[nfds].fd = listen_sock;
+    fds[nfds++].events = POLLIN;
+    fds[nfds].fd = capture_fd;
+    fds[nfds++].events = POLLIN;
+    for (int i = 0; i < client_count; i++) {
+      fds[nfds].fd = clients[i]->sock;
+      fds[nfds++].events = clients[i]->count ? POLLOUT : POLLIN;
+    }
+
+    int timeout = 1000;
+    if (replay_file && !replay_done && client_count) {
+      if (!replay_packet) {
+        int r = pcap_next_ex(descr, &replay_hdr, &replay_packet);
+        if (r == -2 || r == -1) {
+          if (r == -1)
+            fprintf(stderr, "Error reading '%s': %s\n", replay_file, pcap_geterr(descr));
+          printf("Replayed %lld packets.\n", packets_captured);
+          replay_done = 1;
+          replay_packet = NULL;
+        }
+        else if (!replay_start) {
+          replay_start = now_microseconds();
+          replay_first = microseconds(&replay_hdr->ts);
+        }
+      }
+      if (replay_packet) {
+        long long due = replay_start + microseconds(&replay_hdr->ts) - replay_first;
+        long long now = now_microseconds();
+        if (due <= now) {
+          broadcast_packet(replay_packet, replay_hdr->caplen);
+          replay_packet = NULL;
+          timeout = 0;
+        }
+        else
+          timeout = (due - now + 999) / 1000;
+      }
+    }
+    if (replay_done) {
+      // Exit once everyone has been sent everything
+      int pending = 0;
+      for (int i = 0; i < client_count; i++)
+        pending += clients[i]->count;
+      if (!pending)
+        break;
     }
 
-    struct pcap_pkthdr hdr;
-    hdr.caplen = 0;
-    const unsigned char *packet = pcap_next(descr, &hdr);
-    if (packet) {
-      if (hdr.caplen == 2132) {
-        // probably a C65GS compressed video frame.
-        if (client_sock != -1)
-          write(client_sock, packet, 2132);
+    if (poll(fds, nfds, timeout) == -1 && errno != EINTR) {
+      perror("poll");
+      return -1;
+    }
+
+    if (fds[0].revents & POLLIN)
+      accept_clients(listen_sock);
+
+    if (fds[1].revents & POLLIN) {
+      // Take everything that has arrived in one batch
+      if (pcap_dispatch(descr, -1, captured_packet, NULL) == -1) {
+        printf("pcap_dispatch() failed due to [%s]\n", pcap_geterr(descr));
+        return -1;
+      }
+    }
+
+    // fds[] was built before any new clients were accepted, so only look at the clients it covers,
+    // and work backwards, as closing a client moves the last one into its place.
+    for (int i = nfds - 3; i >= 0; i--) {
+      if (fds[2 + i].revents & (POLLERR | POLLHUP)) {
+        close_client(i);
+        continue;
+      }
+      if (fds[2 + i].revents & POLLIN) {
+        // Clients have nothing to say, so this is end of file
+        char buffer[256];
+        if (read(clients[i]->sock, buffer, sizeof(buffer)) <= 0) {
+          close_client(i);
+          continue;
+        }
       }
     }
+    for (int i = client_count - 1; i >= 0; i--)
+      if (flush_client(clients[i]))
+        close_client(i);
   }
+  while (client_count)
+    close_client(client_count - 1);
   printf("Exiting.\n");
 
   return 0;
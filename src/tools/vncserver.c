@@ -17,6 +17,7 @@
 #include <time.h>
 #include <poll.h>
 #include <termios.h>
+#include <stdint.h>
 
 int sendScanCode(int scan_code);
 
@@ -41,9 +42,16 @@ int y;
 static const int bpp = 4;
 static int maxx = 800, maxy = 600;
 
+// The leftmost and rightmost pixels of each raster line that have been written with a different value since
+// the clients were last told about changes.  A line is clean when its left is beyond its right.
+int dirty_left[600], dirty_right[600];
+// What the clients were last told the screen looks like, as pixels can change and change back within a frame
+uint32_t *sent_frame = NULL;
+int dirty_pixels = 0; // in the rectangles marked modified since the last report
+
 static void initBuffer(unsigned char *buffer)
 {
-  bzero(buffer, maxx * maxy);
+  bzero(buffer, maxx * maxy * bpp);
 }
 
 /* Here we create a structure so that every client has it's own pointer */
@@ -362,11 +370,52 @@ static void dokey(rfbBool down, rfbKeySym key, rfbClientPtr cl)
   }
 }
 
+static inline void markDirty(int x1, int x2, int y)
+{
+  if (x1 < dirty_left[y])
+    dirty_left[y] = x1;
+  if (x2 > dirty_right[y])
+    dirty_right[y] = x2;
+}
+
+void markAllClean(void)
+{
+  for (int y = 0; y < maxy; y++) {
+    dirty_left[y] = maxx;
+    dirty_right[y] = -1;
+  }
+}
+
 int updateFrameBuffer(rfbScreenInfoPtr screen)
 {
-  // Tell VNC that everything has changed, and let it do the optimisation.
+  // Narrow each written span down to the pixels that differ from what the clients have
+  uint32_t *frame = (uint32_t *)screen->frameBuffer;
+  for (int y = 0; y < maxy; y++) {
+    uint32_t *line = &frame[y * maxx], *sent = &sent_frame[y * maxx];
+    while (dirty_left[y] <= dirty_right[y] && line[dirty_left[y]] == sent[dirty_left[y]])
+      dirty_left[y]++;
+    while (dirty_left[y] <= dirty_right[y] && line[dirty_right[y]] == sent[dirty_right[y]])
+      dirty_right[y]--;
+    if (dirty_left[y] <= dirty_right[y])
+      memcpy(&sent[dirty_left[y]], &line[dirty_left[y]], (dirty_right[y] + 1 - dirty_left[y]) * 4);
+  }
 
-  rfbMarkRectAsModified(screen, 0, 0, maxx - 1, maxy - 1);
+  // Tell VNC about the raster lines that have changed, coalescing runs of consecutive changed lines into
+  // one rectangle each, so that a static screen costs nothing to send.
+  for (int y = 0; y < maxy; y++) {
+    if (dirty_left[y] > dirty_right[y])
+      continue;
+    int top = y, left = dirty_left[y], right = dirty_right[y];
+    for (; y + 1 < maxy && dirty_left[y + 1] <= dirty_right[y + 1]; y++) {
+      if (dirty_left[y + 1] < left)
+        left = dirty_left[y + 1];
+      if (dirty_right[y + 1] > right)
+        right = dirty_right[y + 1];
+    }
+    rfbMarkRectAsModified(screen, left, top, right + 1, y + 1);
+    dirty_pixels += (right + 1 - left) * (y + 1 - top);
+  }
+  markAllClean();
 
   return 0;
 }
@@ -612,31 +661,80 @@ int openSerialPort(char *port)
   return 0;
 }
 
-int setPixel(rfbScreenInfoPtr screen, int x, int y, uint32_t v)
+// A pixel is the three bytes of v from the top down, then 0
+static inline uint32_t pixelValue(uint32_t v)
+{
+  unsigned char p[4] = { (v >> 16) & 0xff, (v >> 8) & 0xff, v & 0xff, 0 };
+  uint32_t pixel;
+  memcpy(&pixel, p, 4);
+  return pixel;
+}
+
+static inline int setPixel(rfbScreenInfoPtr screen, int x, int y, uint32_t v)
 {
   //  printf("(%d,%d) = %08x\n",x,y,v);
   if (y >= 0 && y < maxy && x >= 0 && x < maxx) {
-    ((unsigned char *)screen->frameBuffer)[(y * maxx * 4) + x * 4 + 3] = 0;
-    ((unsigned char *)screen->frameBuffer)[(y * maxx * 4) + x * 4 + 2] = v & 0xff;
-    ((unsigned char *)screen->frameBuffer)[(y * maxx * 4) + x * 4 + 1] = (v >> 8) & 0xff;
-    ((unsigned char *)screen->frameBuffer)[(y * maxx * 4) + x * 4 + 0] = (v >> 16) & 0xff;
+    uint32_t *p = &((uint32_t *)screen->frameBuffer)[y * maxx + x];
+    uint32_t pixel = pixelValue(v);
+    if (*p != pixel) {
+      *p = pixel;
+      markDirty(x, x, y);
+    }
   }
   return 0;
 }
 
+// Set count pixels from (x,y), which must all be on the screen, noting which of them change
+void fillPixels(rfbScreenInfoPtr screen, int x, int y, int count, uint32_t v)
+{
+  uint32_t *p = &((uint32_t *)screen->frameBuffer)[y * maxx + x];
+  uint32_t pixel = pixelValue(v);
+  int first = 0, last = count - 1;
+  while (first < count && p[first] == pixel)
+    first++;
+  if (first == count)
+    return;
+  while (p[last] == pixel)
+    last--;
+  for (int i = first; i <= last; i++)
+    p[i] = pixel;
+  markDirty(x + first, x + last, y);
+}
+
+// Shift the line right by a pixel, behind two pixels of colour v.  (This used to be an overlapping bcopy().)
 int setRaster(rfbScreenInfoPtr screen, int y, uint32_t v)
 {
   if (y >= 0 && y < maxy) {
-    unsigned char *raster = &((unsigned char *)screen->frameBuffer)[y * maxx * 4];
-    raster[3] = 0;
-    raster[2] = v & 0xff;
-    raster[1] = (v >> 8) & 0xff;
-    raster[0] = (v >> 16) & 0xff;
-    bcopy(&raster[0], &raster[4], maxx * 4 - 1);
+    uint32_t *p = &((uint32_t *)screen->frameBuffer)[y * maxx];
+    int left = maxx, right = -1;
+    for (int x = maxx - 1; x >= 2; x--)
+      if (p[x] != p[x - 1]) {
+        p[x] = p[x - 1];
+        if (right < 0)
+          right = x;
+        left = x;
+      }
+    if (right >= 0)
+      markDirty(left, right, y);
+    setPixel(screen, 1, y, v);
+    setPixel(screen, 0, y, v);
   }
   return 0;
 }
 
+// Set a run of up to count pixels from (x,y), stopping at the edge of the screen, and return how many
+// pixels the run covered
+int setRun(rfbScreenInfoPtr screen, int x, int y, int count, uint32_t v)
+{
+  if (x >= maxx)
+    return 0;
+  if (count > maxx - x)
+    count = maxx - x;
+  if (count && y >= 0 && y < maxy && x >= 0)
+    fillPixels(screen, x, y, count, v);
+  return count;
+}
+
 int dump_bytes(char *msg, unsigned char *bytes, int length)
 {
   fprintf(stdout, "%s:\n", msg);
@@ -650,10 +748,267 @@ int dump_bytes(char *msg, unsigned char *bytes, int length)
   return 0;
 }
 
+/*
+  The compressed video stream is a sequence of tokens, each a prefix code possibly followed by a field:
+
+    0                     the current colour again
+    10                    the previous colour
+    1100, 1101, 1110      the 3rd, 4th or 5th most recent colour
+    11110 + 12 bits       an explicit colour
+    111110 + 10 bits      start of raster line
+    11111110 + 8 bits     run of 0 - 255 pixels in the current colour
+    11111100              new frame
+    11111101              reserved
+
+  The next 8 bits of the stream are enough to tell which token comes next, so tokens are looked up in a
+  table indexed by them.  Any other bits (ie 11111111) are skipped a bit at a time.
+*/
+
+enum {
+  TOKEN_NONE,
+  TOKEN_SAME,
+  TOKEN_COLOUR1,
+  TOKEN_COLOUR2,
+  TOKEN_COLOUR3,
+  TOKEN_COLOUR4,
+  TOKEN_EXPLICIT,
+  TOKEN_RASTER,
+  TOKEN_RUN,
+  TOKEN_NEW_FRAME,
+  TOKEN_RESERVED
+};
+
+typedef struct video_token {
+  unsigned char type;
+  unsigned char length;     // bits, including the field
+  unsigned char field_bits; // at the end of the token
+} video_token;
+
+video_token video_tokens[256];
+
+void init_video_tokens(void)
+{
+  for (int i = 0; i < 256; i++) {
+    video_token t = { TOKEN_NONE, 1, 0 };
+    if (!(i & 0x80))
+      t = (video_token) { TOKEN_SAME, 1, 0 };
+    else if ((i & 0xc0) == 0x80)
+      t = (video_token) { TOKEN_COLOUR1, 2, 0 };
+    else if ((i & 0xf0) == 0xc0)
+      t = (video_token) { TOKEN_COLOUR2, 4, 0 };
+    else if ((i & 0xf0) == 0xd0)
+      t = (video_token) { TOKEN_COLOUR3, 4, 0 };
+    else if ((i & 0xf0) == 0xe0)
+      t = (video_token) { TOKEN_COLOUR4, 4, 0 };
+    else if ((i & 0xf8) == 0xf0)
+      t = (video_token) { TOKEN_EXPLICIT, 5 + 12, 12 };
+    else if ((i & 0xfc) == 0xf8)
+      t = (video_token) { TOKEN_RASTER, 6 + 10, 10 };
+    else if (i == 0xfe)
+      t = (video_token) { TOKEN_RUN, 8 + 8, 8 };
+    else if (i == 0xfc)
+      t = (video_token) { TOKEN_NEW_FRAME, 8, 0 };
+    else if (i == 0xfd)
+      t = (video_token) { TOKEN_RESERVED, 8, 0 };
+    video_tokens[i] = t;
+  }
+}
+
+// Reads a packet MSB first, keeping the next 57 - 64 bits in a 64-bit cache
+typedef struct bit_reader {
+  const unsigned char *data;
+  int bytes;
+  int next_byte;
+  uint64_t cache; // the next bits, from the top down
+  int cached;
+  int remaining; // bits in the packet not yet consumed
+} bit_reader;
+
+void bit_reader_init(bit_reader *br, const unsigned char *data, int bytes)
+{
+  br->data = data;
+  br->bytes = bytes;
+  br->next_byte = 0;
+  br->cache = 0;
+  br->cached = 0;
+  br->remaining = bytes * 8;
+}
+
+static inline void bit_reader_refill(bit_reader *br)
+{
+  while (br->cached <= 56) {
+    uint64_t b = br->next_byte < br->bytes ? br->data[br->next_byte] : 0;
+    br->cache |= b << (56 - br->cached);
+    br->next_byte++;
+    br->cached += 8;
+  }
+}
+
+static inline unsigned int bit_reader_peek(bit_reader *br, int n)
+{
+  return br->cache >> (64 - n);
+}
+
+static inline void bit_reader_skip(bit_reader *br, int n)
+{
+  br->cache <<= n;
+  br->cached -= n;
+  br->remaining -= n;
+}
+
+int debug = 0; // x806; //0x21b;
+int x = 0;
+int video_frames = 0;  // new frames seen since the last report
+int video_packets = 0; // and packets decoded
+
+void decode_video_packet(rfbScreenInfoPtr screen, unsigned char *packet, int len)
+{
+  if (!video_tokens[0].type)
+    init_video_tokens();
+
+  // Packet consists solely of bit-packed data, after the header
+  bit_reader br;
+  bit_reader_init(&br, &packet[0x56], len - 0x56);
+
+  // Start outside frame so that we can synchronise without visible artefacts
+  int lasty = -1;
+  y = -1;
+
+  // Tokens were originally recognised as they came out of the end of a 20 bit window that the packet was
+  // shifted through, and so any token in the last 19 bits of the packet was never seen.  Those bits are
+  // still ignored, so that the picture is the same.
+  while (br.remaining >= 20) {
+    bit_reader_refill(&br);
+    video_token t = video_tokens[bit_reader_peek(&br, 8)];
+    int field = t.field_bits ? bit_reader_peek(&br, t.length) & ((1 << t.field_bits) - 1) : 0;
+    bit_reader_skip(&br, t.length);
+
+    int c;
+    switch (t.type) {
+    case TOKEN_EXPLICIT:
+      // Explcit colour (12 bits)
+      colour4 = colour3;
+      colour3 = colour2;
+      colour2 = colour1;
+      colour1 = colour0;
+      colour0 = ((field & 0xf) << 4) | ((field & 0xf0) << 8) | ((field & 0xf00) << 12);
+      if (debug & 0x800)
+        printf("Saw new colour #%06x at (%d,%d)\n", colour0, x, y);
+      setPixel(screen, x++, y, colour0);
+      break;
+    case TOKEN_RASTER:
+      // Indicate raster (10 bits)
+      setRaster(screen, y, colour0);
+      y = field;
+      if (lasty == -1) {
+        lasty = y;
+        y = -1;
+      }
+      else {
+        if ((y != (1 + lasty)) && (y != lasty)) {
+          // Non successive raster lines, block drawing
+          if (debug & 2)
+            printf("lasty was %d, new y = %d\n", lasty, y);
+          lasty = y;
+          y = -1;
+        }
+        else
+          lasty = y;
+      }
+      if (debug & 2)
+        printf("Raster #%d (MAX X value seen was %d)\n", y, x);
+      x = 0;
+      colour0 = 0x000000;
+      colour1 = 0xf0f0f0;
+      colour2 = 0x303030;
+      colour3 = 0x707070;
+      colour4 = 0xb0b0b0;
+      break;
+    case TOKEN_RUN:
+      // RLE run of 0 - 255 pixels
+      if (debug & 8)
+        printf("Run of %d at %d,%d\n", field, x, y);
+      if (x != -1)
+        x += setRun(screen, x, y, field, colour0);
+      if (debug & 8)
+        printf("After run, x=%d\n", x);
+      break;
+    case TOKEN_NEW_FRAME:
+      if (debug & 1)
+        printf("New frame (y got to %d)\n", y);
+      if (y != -1)
+        setRaster(screen, y, colour0);
+      y = -1;
+      x = -1;
+      colour0 = 0x000000;
+      colour1 = 0xf0f0f0;
+      colour2 = 0x303030;
+      colour3 = 0x707070;
+      colour4 = 0xb0b0b0;
+      updateFrameBuffer(screen);
+      video_frames++;
+      break;
+    case TOKEN_RESERVED:
+      // Reserved -- this is an error for now
+      if (debug & 0x100)
+        printf("Reserved token.\n");
+      break;
+    case TOKEN_COLOUR2:
+      c = colour2;
+      colour2 = colour1;
+      colour1 = colour0;
+      colour0 = c;
+      if (debug & 4)
+        printf("Colour 2 @ x=%d (colour=#%06x)\n", x, colour0);
+      if (x != -1)
+        setPixel(screen, x++, y, colour0);
+      break;
+    case TOKEN_COLOUR3:
+      c = colour3;
+      colour3 = colour2;
+      colour2 = colour1;
+      colour1 = colour0;
+      colour0 = c;
+      if (debug & 4)
+        printf("Colour 3\n");
+      if (x != -1)
+        setPixel(screen, x++, y, colour0);
+      break;
+    case TOKEN_COLOUR4:
+      c = colour4;
+      colour4 = colour3;
+      colour3 = colour2;
+      colour2 = colour1;
+      colour1 = colour0;
+      colour0 = c;
+      if (debug & 4)
+        printf("Colour 4 @ %d,%d\n", x, y);
+      if (x != -1)
+        setPixel(screen, x++, y, colour0);
+      break;
+    case TOKEN_COLOUR1:
+      c = colour1;
+      colour1 = colour0;
+      colour0 = c;
+      if (debug & 4)
+        printf("Previous colour @ %d,%d\n", x, y);
+      if (x != -1)
+        setPixel(screen, x++, y, colour0);
+      break;
+    case TOKEN_SAME:
+      // Repeat last colour
+      if (debug & 4)
+        printf("Same colour at %d,%d\n", x, y);
+      if (x != -1)
+        setPixel(screen, x++, y, colour0);
+      break;
+    }
+  }
+}
+
 int main(int argc, char **argv)
 {
   int do_dummy = 0;
-  int debug = 0; // x806; //0x21b;
 
   if (!do_dummy) {
     if (argc > 1)
@@ -672,6 +1027,8 @@ int main(int argc, char **argv)
   rfbScreen->httpEnableProxyConnect = TRUE;
 
   initBuffer((unsigned char *)rfbScreen->frameBuffer);
+  sent_frame = calloc(maxx * maxy, 4);
+  markAllClean();
 
   /* initialize the server */
   rfbInitServer(rfbScreen);
@@ -691,13 +1048,7 @@ int main(int argc, char **argv)
   printf("Started.\n");
   fflush(stdout);
 
-  int y = -1;
-  int x = 0;
-
-  char bit_sequence[21];
-
-  // Put end of string marker in place
-  bit_sequence[20] = 0;
+  time_t report_time = time(0);
 
   while (1) {
     unsigned char packet[8192];
@@ -734,191 +1085,21 @@ int main(int argc, char **argv)
         dump_bytes("packet", packet, len);
       }
 
-      // Packet consists solely of bit-packed data
-
-      // Erase any banked up bits before starting decode of next packet
-      memset(bit_sequence, '.', 20);
-
-      // Start from beginning of data
-      int offset = 0x56;
-      int bn = 0;
-
-      int counter = 0;
-
-      // Process all bits in packet
-
-      // Start outside frame so that we can synchronise without visible artefacts
-      int lasty = -1;
-      y = -1;
+      decode_video_packet(rfbScreen, packet, len);
+      video_packets++;
+    }
 
-      for (; offset < len; offset++) {
-        if (debug & 0x200)
-          printf("> 0x%02x\n", packet[offset]);
-        for (bn = 7; bn >= 0; bn--) {
-          counter++;
-
-          int bit = (packet[offset] >> bn) & 1;
-          // Shuffle bits down
-          bcopy(&bit_sequence[1], &bit_sequence[0], 19);
-          bit_sequence[19] = '0' + bit;
-          if (debug & 0x200) {
-            if (bit_sequence[0] != '.')
-              printf(">> %-8d %s\n", counter, bit_sequence);
-          }
-
-          if (!strncmp("11110", bit_sequence, 5)) {
-            // Explcit colour (12 bits)
-            int s = bit_sequence[17];
-            bit_sequence[17] = 0;
-            int c = strtol(&bit_sequence[5], NULL, 2);
-            colour4 = colour3;
-            colour3 = colour2;
-            colour2 = colour1;
-            colour1 = colour0;
-            colour0 = ((c & 0xf) << 4) | ((c & 0xf0) << 8) | ((c & 0xf00) << 12);
-            if (debug & 0x800)
-              printf("Saw new colour #%06x at (%d,%d)\n", colour0, x, y);
-            bit_sequence[17] = s;
-            memset(bit_sequence, '.', 17);
-            setPixel(rfbScreen, x++, y, colour0);
-          }
-          else if (!strncmp("111110", bit_sequence, 6)) {
-            // Indicate raster (10 bits)
-            int s = bit_sequence[16];
-            bit_sequence[16] = 0;
-            setRaster(rfbScreen, y, colour0);
-            // if (x!=-1) for(;x<maxx;x++) setPixel(rfbScreen,x,y,colour0);
-            y = strtol(&bit_sequence[6], NULL, 2);
-            if (lasty == -1) {
-              lasty = y;
-              y = -1;
-            }
-            else {
-              if ((y != (1 + lasty)) && (y != lasty)) {
-                // Non successive raster lines, block drawing
-                if (debug & 2)
-                  printf("lasty was %d, new y = %d\n", lasty, y);
-                lasty = y;
-                y = -1;
-              }
-              else
-                lasty = y;
-            }
-
-            bit_sequence[16] = s;
-            if (debug & 2)
-              printf("Raster #%d (MAX X value seen was %d)\n", y, x);
-            x = 0;
-            colour0 = 0x000000;
-            colour1 = 0xf0f0f0;
-            colour2 = 0x303030;
-            colour3 = 0x707070;
-            colour4 = 0xb0b0b0;
-            memset(bit_sequence, '.', 16);
-          }
-          else if (!strncmp("11111110", bit_sequence, 8)) {
-            // RLE run of 0 - 255 pixels
-            int s = bit_sequence[16];
-            bit_sequence[16] = 0;
-            int r = strtol(&bit_sequence[8], NULL, 2);
-            bit_sequence[16] = s;
-            if (debug & 8)
-              printf("Run of %d at %d,%d\n", r, x, y);
-            if (x != -1)
-              for (; r && (x < 800); r--) {
-                setPixel(rfbScreen, x++, y, colour0);
-              }
-            memset(bit_sequence, '.', 16);
-            if (debug & 8)
-              printf("After run, x=%d\n", x);
-          }
-          else if (!strncmp("11111100", bit_sequence, 8)) {
-            // New frame
-            if (debug & 1)
-              printf("New frame (y got to %d)\n", y);
-            if (y != -1)
-              setRaster(rfbScreen, y, colour0);
-            // if (x!=-1) for(;x<maxx;x++) setPixel(rfbScreen,x,y,colour0);
-            y = -1;
-            x = -1;
-            memset(bit_sequence, '.', 8);
-            colour0 = 0x000000;
-            colour1 = 0xf0f0f0;
-            colour2 = 0x303030;
-            colour3 = 0x707070;
-            colour4 = 0xb0b0b0;
-            updateFrameBuffer(rfbScreen);
-          }
-          else if (!strncmp("11111101", bit_sequence, 8)) {
-            // Reserved -- this is an error for now
-            if (debug & 0x100)
-              printf("Reserved token.\n");
-            memset(bit_sequence, '.', 8);
-          }
-          else if (!strncmp("1100", bit_sequence, 4)) {
-            // Colour 2
-            int t = colour2;
-            colour2 = colour1;
-            colour1 = colour0;
-            colour0 = t;
-            if (debug & 4)
-              printf("Colour 2 @ x=%d (colour=#%06x)\n", x, colour0);
-            if (x != -1)
-              setPixel(rfbScreen, x++, y, colour0);
-            memset(bit_sequence, '.', 4);
-          }
-          else if (!strncmp("1101", bit_sequence, 4)) {
-            // Colour 3
-            int t = colour3;
-            colour3 = colour2;
-            colour2 = colour1;
-            colour1 = colour0;
-            colour0 = t;
-            if (debug & 4)
-              printf("Colour 3\n");
-            if (x != -1)
-              setPixel(rfbScreen, x++, y, colour0);
-            memset(bit_sequence, '.', 4);
-          }
-          else if (!strncmp("1110", bit_sequence, 4)) {
-            // Colour 4
-            int t = colour4;
-            colour4 = colour3;
-            colour3 = colour2;
-            colour2 = colour1;
-            colour1 = colour0;
-            colour0 = t;
-            if (debug & 4)
-              printf("Colour 4 @ %d,%d\n", x, y);
-            if (x != -1)
-              setPixel(rfbScreen, x++, y, colour0);
-            memset(bit_sequence, '.', 4);
-          }
-          else if (!strncmp("10", bit_sequence, 2)) {
-            // Colour 1
-            int t = colour1;
-            colour1 = colour0;
-            colour0 = t;
-            if (debug & 4)
-              printf("Previous colour @ %d,%d\n", x, y);
-            if (x != -1)
-              setPixel(rfbScreen, x++, y, colour0);
-            //	    if (debug&4)
-            memset(bit_sequence, '.', 2);
-          }
-          else if (!strncmp("0", bit_sequence, 1)) {
-            // Repeat last colour
-            if (debug & 4)
-              printf("Same colour at %d,%d\n", x, y);
-            if (x != -1)
-              setPixel(rfbScreen, x++, y, colour0);
-            memset(bit_sequence, '.', 1);
-          }
-          //	  if (debug&0x800)
-          if (0)
-            printf("Colours = #%06x, #%06x, #%06x, #%06x, #%06x\n", colour0, colour1, colour2, colour3, colour4);
-        }
-      }
+    // Report how well decoding is keeping up, once a second while video is arriving
+    time_t now = time(0);
+    if (now != report_time) {
+      if (video_packets)
+        printf("Decoded %d frames/second, from %d packets/second. %.1f%% of each frame changed.\n",
+            (int)(video_frames / (now - report_time)), (int)(video_packets / (now - report_time)),
+            video_frames ? 100.0 * dirty_pixels / video_frames / (maxx * maxy) : 0.0);
+      video_frames = 0;
+      video_packets = 0;
+      dirty_pixels = 0;
+      report_time = now;
     }
   }
 